@@ -0,0 +1,641 @@
+/*  FLV to MPEG-TS remuxer keeping a sliding window of HLS segments
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with RTMPDump; see the file COPYING.  If not, write to
+ *  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *  http://www.gnu.org/copyleft/gpl.html
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hls.h"
+#include "librtmp/rtmp.h"
+#include "librtmp/log.h"
+
+/* Only H.264 video and AAC audio can be carried, anything else in the
+ * stream is left out. Each segment starts with the PAT and PMT and,
+ * when there is video, with a keyframe, so it plays on its own.
+ */
+
+#define PID_PMT		0x1000
+#define PID_VIDEO	0x100
+#define PID_AUDIO	0x101
+
+enum { CC_PAT, CC_PMT, CC_VIDEO, CC_AUDIO };
+
+#define PES_HEADER	19	/* longest PES header, with PTS and DTS */
+#define TS_DELAY	63000	/* 700 ms at 90 kHz between PCR and DTS */
+
+static uint32_t
+Crc32(const unsigned char *p, int len)
+{
+  uint32_t crc = 0xffffffff;
+  int i;
+
+  while (len--)
+    {
+      crc ^= (uint32_t) *p++ << 24;
+      for (i = 0; i < 8; i++)
+	crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+    }
+  return crc;
+}
+
+static void
+SegRelease(HlsSegment *s)
+{
+  if (--s->refs)
+    return;
+  free(s->data);
+  free(s);
+}
+
+static int
+SegAppend(HlsSegment *s, const unsigned char *data, size_t len)
+{
+  if (s->len + len > s->size)
+    {
+      size_t size = s->size ? s->size * 2 : 256 * 1024;
+      char *buf;
+
+      while (size < s->len + len)
+	size *= 2;
+      buf = realloc(s->data, size);
+      if (!buf)
+	return FALSE;
+      s->data = buf;
+      s->size = size;
+    }
+  memcpy(s->data + s->len, data, len);
+  s->len += len;
+  return TRUE;
+}
+
+/* a PSI section in a packet of its own, sec has room for the CRC */
+static int
+TsSection(Hls *h, int cc, int pid, unsigned char *sec, int n)
+{
+  unsigned char pkt[188];
+  uint32_t crc;
+  int len = n - 3 + 4;
+
+  sec[1] = 0xb0 | (len >> 8);
+  sec[2] = len & 0xff;
+  crc = Crc32(sec, n);
+  sec[n++] = crc >> 24;
+  sec[n++] = crc >> 16;
+  sec[n++] = crc >> 8;
+  sec[n++] = crc;
+
+  pkt[0] = 0x47;
+  pkt[1] = 0x40 | (pid >> 8);
+  pkt[2] = pid & 0xff;
+  pkt[3] = 0x10 | (h->cc[cc]++ & 0x0f);
+  pkt[4] = 0;			/* pointer field */
+  memcpy(pkt + 5, sec, n);
+  memset(pkt + 5 + n, 0xff, sizeof(pkt) - 5 - n);
+  return SegAppend(h->cur, pkt, sizeof(pkt));
+}
+
+static int
+TsTables(Hls *h)
+{
+  unsigned char sec[64];
+  int n = 0, pcr = h->avcConfig ? PID_VIDEO : PID_AUDIO;
+
+  /* PAT, program 1 */
+  sec[n++] = 0x00;
+  n += 2;
+  sec[n++] = 0x00;
+  sec[n++] = 0x01;
+  sec[n++] = 0xc1;
+  sec[n++] = 0x00;
+  sec[n++] = 0x00;
+  sec[n++] = 0x00;
+  sec[n++] = 0x01;
+  sec[n++] = 0xe0 | (PID_PMT >> 8);
+  sec[n++] = PID_PMT & 0xff;
+  if (!TsSection(h, CC_PAT, 0, sec, n))
+    return FALSE;
+
+  /* PMT, the streams we have sequence headers for */
+  n = 0;
+  sec[n++] = 0x02;
+  n += 2;
+  sec[n++] = 0x00;
+  sec[n++] = 0x01;
+  sec[n++] = 0xc1;
+  sec[n++] = 0x00;
+  sec[n++] = 0x00;
+  sec[n++] = 0xe0 | (pcr >> 8);
+  sec[n++] = pcr & 0xff;
+  sec[n++] = 0xf0;
+  sec[n++] = 0x00;
+  if (h->avcConfig)
+    {
+      sec[n++] = 0x1b;
+      sec[n++] = 0xe0 | (PID_VIDEO >> 8);
+      sec[n++] = PID_VIDEO & 0xff;
+      sec[n++] = 0xf0;
+      sec[n++] = 0x00;
+    }
+  if (h->bAac)
+    {
+      sec[n++] = 0x0f;
+      sec[n++] = 0xe0 | (PID_AUDIO >> 8);
+      sec[n++] = PID_AUDIO & 0xff;
+      sec[n++] = 0xf0;
+      sec[n++] = 0x00;
+    }
+  return TsSection(h, CC_PMT, PID_PMT, sec, n);
+}
+
+/* split a PES packet into transport packets */
+static int
+TsWrite(Hls *h, int cc, int pid, const unsigned char *data, size_t len,
+	int bKey, int bPCR, uint64_t pcr)
+{
+  unsigned char pkt[188];
+  int first = TRUE;
+
+  while (len)
+    {
+      int af = 0, flags = 0, n;
+
+      pkt[0] = 0x47;
+      pkt[1] = (first ? 0x40 : 0) | (pid >> 8);
+      pkt[2] = pid & 0xff;
+      pkt[3] = 0x10 | (h->cc[cc]++ & 0x0f);
+      if (first && bPCR)
+	{
+	  flags |= 0x10;
+	  af = 8;
+	}
+      if (first && bKey)
+	{
+	  flags |= 0x40;		/* random access point */
+	  if (!af)
+	    af = 2;
+	}
+      n = len < (size_t) (184 - af) ? (int) len : 184 - af;
+
+      /* the adaptation field also pads the last packet */
+      af = 184 - n;
+      if (af)
+	{
+	  pkt[3] |= 0x20;
+	  pkt[4] = af - 1;
+	  if (af > 1)
+	    {
+	      pkt[5] = flags;
+	      memset(pkt + 6, 0xff, af - 2);
+	      if (flags & 0x10)
+		{
+		  pkt[6] = pcr >> 25;
+		  pkt[7] = pcr >> 17;
+		  pkt[8] = pcr >> 9;
+		  pkt[9] = pcr >> 1;
+		  pkt[10] = ((pcr & 1) << 7) | 0x7e;
+		  pkt[11] = 0;
+		}
+	    }
+	}
+      memcpy(pkt + 4 + af, data, n);
+      if (!SegAppend(h->cur, pkt, sizeof(pkt)))
+	return FALSE;
+      data += n;
+      len -= n;
+      first = FALSE;
+    }
+  return TRUE;
+}
+
+static void
+PutTs(unsigned char *p, int prefix, uint64_t ts)
+{
+  p[0] = (prefix << 4) | ((ts >> 29) & 0x0e) | 1;
+  p[1] = ts >> 22;
+  p[2] = ((ts >> 14) & 0xfe) | 1;
+  p[3] = ts >> 7;
+  p[4] = ((ts << 1) & 0xfe) | 1;
+}
+
+/* append to the payload of the PES packet being built */
+static int
+PesAdd(Hls *h, size_t *off, const void *data, size_t len)
+{
+  if (*off + len > h->pesSize)
+    {
+      size_t size = h->pesSize ? h->pesSize : 64 * 1024;
+      char *buf;
+
+      while (size < *off + len)
+	size *= 2;
+      buf = realloc(h->pes, size);
+      if (!buf)
+	return FALSE;
+      h->pes = buf;
+      h->pesSize = size;
+    }
+  memcpy(h->pes + *off, data, len);
+  *off += len;
+  return TRUE;
+}
+
+/* put the header in front of the payload at h->pes + PES_HEADER and
+ * write the packet out, times in ms
+ */
+static int
+PesSend(Hls *h, int cc, int pid, int sid, size_t len, int64_t pts,
+	int64_t dts, int bKey, int bPCR)
+{
+  unsigned char hdr[PES_HEADER];
+  uint64_t pts90 = (uint64_t) (pts * 90 + TS_DELAY) & 0x1ffffffffULL;
+  uint64_t dts90 = (uint64_t) (dts * 90 + TS_DELAY) & 0x1ffffffffULL;
+  int hlen = pts != dts ? 19 : 14;
+  size_t plen = hlen - 6 + len;
+
+  if (plen > 0xffff)
+    plen = 0;			/* unbounded, only allowed for video */
+  hdr[0] = 0;
+  hdr[1] = 0;
+  hdr[2] = 1;
+  hdr[3] = sid;
+  hdr[4] = plen >> 8;
+  hdr[5] = plen & 0xff;
+  hdr[6] = 0x80;
+  hdr[7] = pts != dts ? 0xc0 : 0x80;
+  hdr[8] = hlen - 9;
+  PutTs(hdr + 9, pts != dts ? 3 : 2, pts90);
+  if (pts != dts)
+    PutTs(hdr + 14, 1, dts90);
+  memcpy(h->pes + PES_HEADER - hlen, hdr, hlen);
+
+  return TsWrite(h, cc, pid, (unsigned char *) h->pes + PES_HEADER - hlen,
+		 hlen + len, bKey, bPCR,
+		 (uint64_t) (dts * 90) & 0x1ffffffffULL);
+}
+
+/* finish the segment being filled and start the next one at ts */
+static void
+HlsCut(Hls *h, uint32_t ts)
+{
+  HlsSegment *s = h->cur;
+
+  if (s)
+    {
+      s->duration = ts - s->start;
+      if (s->duration > h->maxDuration)
+	h->maxDuration = s->duration;
+      if (h->tail)
+	h->tail->next = s;
+      else
+	h->head = s;
+      h->tail = s;
+      h->nSegs++;
+      h->cur = NULL;
+
+      /* clients still sending an old one hold a reference */
+      while (h->nSegs > h->window + HLS_SPARE)
+	{
+	  s = h->head;
+	  h->head = s->next;
+	  h->nSegs--;
+	  SegRelease(s);
+	}
+    }
+  if (h->bEnded)
+    return;
+
+  s = calloc(1, sizeof(HlsSegment));
+  if (!s)
+    return;
+  s->refs = 1;
+  s->seq = h->nextSeq++;
+  s->start = ts;
+  h->cur = s;
+  if (!TsTables(h))
+    {
+      h->cur = NULL;
+      SegRelease(s);
+    }
+}
+
+/* a failed write leaves the segment out, the next one starts afresh */
+static void
+HlsAbort(Hls *h)
+{
+  RTMP_Log(RTMP_LOGWARNING, "%s, out of memory, dropping segment %u",
+	   __FUNCTION__, h->cur->seq);
+  SegRelease(h->cur);
+  h->cur = NULL;
+}
+
+static void
+AvcConfig(Hls *h, const unsigned char *p, unsigned int len)
+{
+  char *cfg;
+  size_t n = 0;
+  unsigned int off = 6;
+  int i, k, cnt;
+
+  if (len < 7)
+    return;
+  /* a 2 byte length turns into a 4 byte start code */
+  cfg = malloc(len * 2);
+  if (!cfg)
+    return;
+  h->nalSize = (p[4] & 3) + 1;
+  cnt = p[5] & 0x1f;
+  for (k = 0; k < 2; k++)
+    {
+      for (i = 0; i < cnt && off + 2 <= len; i++)
+	{
+	  unsigned int l = (p[off] << 8) | p[off + 1];
+
+	  off += 2;
+	  if (off + l > len)
+	    break;
+	  memcpy(cfg + n, "\0\0\0\1", 4);
+	  memcpy(cfg + n + 4, p + off, l);
+	  n += 4 + l;
+	  off += l;
+	}
+      /* then the PPS */
+      if (k || off >= len)
+	break;
+      cnt = p[off++];
+    }
+  free(h->avcConfig);
+  h->avcConfig = cfg;
+  h->avcConfigLen = n;
+}
+
+static void
+AacConfig(Hls *h, const unsigned char *p, unsigned int len)
+{
+  int obj, rate;
+
+  if (len < 2)
+    return;
+  obj = p[0] >> 3;
+  rate = ((p[0] & 7) << 1) | (p[1] >> 7);
+  if (rate > 12)
+    {
+      RTMP_Log(RTMP_LOGWARNING, "%s, unsupported AAC sampling rate index %d",
+	       __FUNCTION__, rate);
+      return;
+    }
+  /* ADTS only knows the first 4 object types, HE-AAC is signalled
+   * implicitly on top of LC
+   */
+  h->aacProfile = obj >= 1 && obj <= 4 ? obj - 1 : 1;
+  h->aacRate = rate;
+  h->aacChannels = (p[1] >> 3) & 0x0f;
+  h->bAac = TRUE;
+}
+
+int
+HlsInit(Hls *h, uint32_t target, int window, unsigned int firstSeq)
+{
+  memset(h, 0, sizeof(Hls));
+  h->target = target;
+  h->window = window;
+  h->nextSeq = firstSeq;
+  MutexInit(&h->lock);
+  return TRUE;
+}
+
+/* nobody may hold a segment any more */
+void
+HlsFree(Hls *h)
+{
+  HlsSegment *s, *next;
+
+  for (s = h->head; s; s = next)
+    {
+      next = s->next;
+      free(s->data);
+      free(s);
+    }
+  if (h->cur)
+    {
+      free(h->cur->data);
+      free(h->cur);
+    }
+  free(h->avcConfig);
+  free(h->pes);
+  MutexDestroy(&h->lock);
+}
+
+/* Remux one FLV tag. A segment is cut at the first video keyframe
+ * after the target duration, or at any audio frame if there is no
+ * video.
+ */
+void
+HlsTag(Hls *h, int type, uint32_t ts, const char *data, unsigned int len)
+{
+  const unsigned char *body = (const unsigned char *) data;
+  size_t n = PES_HEADER;
+
+  MutexLock(&h->lock);
+  if (h->bEnded)
+    goto out;
+
+  if (type == RTMP_PACKET_TYPE_VIDEO)
+    {
+      const unsigned char *p, *end = body + len;
+      int key, cts;
+
+      if (len < 5 || (body[0] & 0x0f) != 7)
+	goto out;
+      if (body[1] == 0)
+	{
+	  AvcConfig(h, body + 5, len - 5);
+	  goto out;
+	}
+      if (body[1] != 1 || !h->avcConfig)
+	goto out;
+
+      key = (body[0] >> 4) == 1;
+      cts = AMF_DecodeInt24(data + 2);
+      if (cts & 0x800000)
+	cts -= 0x1000000;
+      if (key && (!h->cur || (int32_t) (ts - h->cur->start) >= (int32_t) h->target))
+	HlsCut(h, ts);
+      if (!h->cur)
+	goto out;
+      h->lastTs = ts;
+
+      /* an access unit delimiter, the parameter sets ahead of a
+       * keyframe and the NAL units with start codes
+       */
+      if (!PesAdd(h, &n, "\0\0\0\1\x09\xf0", 6)
+	  || (key && !PesAdd(h, &n, h->avcConfig, h->avcConfigLen)))
+	{
+	  HlsAbort(h);
+	  goto out;
+	}
+      for (p = body + 5; end - p >= h->nalSize;)
+	{
+	  uint32_t l = 0;
+	  int i;
+
+	  for (i = 0; i < h->nalSize; i++)
+	    l = (l << 8) | *p++;
+	  if (l > (uint32_t) (end - p))
+	    break;
+	  if (l && (p[0] & 0x1f) != 9
+	      && (!PesAdd(h, &n, "\0\0\0\1", 4) || !PesAdd(h, &n, p, l)))
+	    {
+	      HlsAbort(h);
+	      goto out;
+	    }
+	  p += l;
+	}
+      if (!PesSend(h, CC_VIDEO, PID_VIDEO, 0xe0, n - PES_HEADER,
+		   (int64_t) ts + cts, ts, key, TRUE))
+	HlsAbort(h);
+    }
+  else if (type == RTMP_PACKET_TYPE_AUDIO)
+    {
+      unsigned char adts[7];
+      unsigned int flen = len - 2 + 7;
+
+      if (len < 2 || (body[0] >> 4) != 10)
+	goto out;
+      if (body[1] == 0)
+	{
+	  AacConfig(h, body + 2, len - 2);
+	  goto out;
+	}
+      if (body[1] != 1 || !h->bAac || flen > 0x1fff)
+	goto out;
+
+      if (!h->avcConfig
+	  && (!h->cur || (int32_t) (ts - h->cur->start) >= (int32_t) h->target))
+	HlsCut(h, ts);
+      if (!h->cur)
+	goto out;
+      h->lastTs = ts;
+
+      adts[0] = 0xff;
+      adts[1] = 0xf1;
+      adts[2] = (h->aacProfile << 6) | (h->aacRate << 2) | (h->aacChannels >> 2);
+      adts[3] = ((h->aacChannels & 3) << 6) | (flen >> 11);
+      adts[4] = (flen >> 3) & 0xff;
+      adts[5] = ((flen & 7) << 5) | 0x1f;
+      adts[6] = 0xfc;
+      if (!PesAdd(h, &n, adts, 7) || !PesAdd(h, &n, body + 2, len - 2)
+	  || !PesSend(h, CC_AUDIO, PID_AUDIO, 0xc0, n - PES_HEADER, ts, ts,
+		      !h->avcConfig, !h->avcConfig))
+	HlsAbort(h);
+    }
+
+out:
+  MutexUnlock(&h->lock);
+}
+
+/* The stream is over, the last segment goes into the playlist which
+ * is marked as complete. Returns the number the next segment would
+ * have had.
+ */
+unsigned int
+HlsEnd(Hls *h)
+{
+  unsigned int seq;
+
+  MutexLock(&h->lock);
+  h->bEnded = TRUE;
+  if (h->cur && h->lastTs != h->cur->start)
+    HlsCut(h, h->lastTs);
+  else if (h->cur)
+    {
+      SegRelease(h->cur);
+      h->cur = NULL;
+    }
+  seq = h->nextSeq;
+  MutexUnlock(&h->lock);
+  return seq;
+}
+
+/* The playlist of the current window, with query appended to the
+ * segment URIs. Returns NULL while there are no segments yet.
+ */
+char *
+HlsPlaylist(Hls *h, const char *query, int *len)
+{
+  HlsSegment *s;
+  char *buf;
+  uint32_t target;
+  int n, skip;
+
+  MutexLock(&h->lock);
+  if (!h->nSegs)
+    {
+      MutexUnlock(&h->lock);
+      return NULL;
+    }
+  buf = malloc(128 + h->nSegs * (64 + strlen(query)));
+  if (!buf)
+    {
+      MutexUnlock(&h->lock);
+      return NULL;
+    }
+
+  /* players must not see the target change, so it only grows */
+  target = h->maxDuration > h->target ? h->maxDuration : h->target;
+  s = h->head;
+  for (skip = h->nSegs - h->window; skip > 0; skip--)
+    s = s->next;
+  n = sprintf(buf, "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:%u\n"
+	      "#EXT-X-MEDIA-SEQUENCE:%u\n", (target + 999) / 1000, s->seq);
+  for (; s; s = s->next)
+    n += sprintf(buf + n, "#EXTINF:%.3f,\n%u.ts%s\n", s->duration / 1000.0,
+		 s->seq, query);
+  if (h->bEnded)
+    n += sprintf(buf + n, "#EXT-X-ENDLIST\n");
+  MutexUnlock(&h->lock);
+
+  *len = n;
+  return buf;
+}
+
+/* Take a reference on a finished segment, NULL if it isn't kept */
+HlsSegment *
+HlsGet(Hls *h, unsigned int seq)
+{
+  HlsSegment *s;
+
+  MutexLock(&h->lock);
+  for (s = h->head; s; s = s->next)
+    if (s->seq == seq)
+      {
+	s->refs++;
+	break;
+      }
+  MutexUnlock(&h->lock);
+  return s;
+}
+
+void
+HlsRelease(Hls *h, HlsSegment *seg)
+{
+  MutexLock(&h->lock);
+  SegRelease(seg);
+  MutexUnlock(&h->lock);
+}
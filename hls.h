@@ -0,0 +1,85 @@
+/*  FLV to MPEG-TS remuxer keeping a sliding window of HLS segments
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with RTMPDump; see the file COPYING.  If not, write to
+ *  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *  http://www.gnu.org/copyleft/gpl.html
+ *
+ */
+
+#ifndef __HLS_H__
+#define __HLS_H__ 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include "thread.h"
+
+#define HLS_SPARE	2	/* segments kept after they left the playlist */
+
+/* A finished segment never changes, so it can be sent without holding
+ * the lock once a reference is taken.
+ */
+typedef struct HlsSegment
+{
+  struct HlsSegment *next;
+  int refs;			/* the window and the clients sending it */
+  unsigned int seq;
+  uint32_t start;		/* timestamp of the first tag, ms */
+  uint32_t duration;		/* ms */
+  char *data;
+  size_t len;
+  size_t size;
+} HlsSegment;
+
+typedef struct Hls
+{
+  TMUTEX lock;
+  uint32_t target;		/* ms a segment should last at least */
+  int window;			/* segments listed in the playlist */
+  HlsSegment *head;		/* finished segments, oldest first */
+  HlsSegment *tail;
+  int nSegs;
+  HlsSegment *cur;		/* the one being filled */
+  unsigned int nextSeq;
+  uint32_t maxDuration;		/* of any segment so far, ms */
+  uint32_t lastTs;
+  int bEnded;
+
+  /* from the sequence headers */
+  char *avcConfig;		/* SPS and PPS with start codes */
+  size_t avcConfigLen;
+  int nalSize;			/* bytes of the NAL unit lengths */
+  int aacProfile;
+  int aacRate;
+  int aacChannels;
+  int bAac;
+
+  unsigned char cc[4];		/* continuity counters of the PIDs */
+  char *pes;			/* PES packet being built */
+  size_t pesSize;
+} Hls;
+
+int HlsInit(Hls *h, uint32_t target, int window, unsigned int firstSeq);
+void HlsFree(Hls *h);
+
+/* producer side */
+void HlsTag(Hls *h, int type, uint32_t ts, const char *body, unsigned int len);
+unsigned int HlsEnd(Hls *h);
+
+/* what clients ask for */
+char *HlsPlaylist(Hls *h, const char *query, int *len);
+HlsSegment *HlsGet(Hls *h, unsigned int seq);
+void HlsRelease(Hls *h, HlsSegment *seg);
+
+#endif /* __HLS_H__ */
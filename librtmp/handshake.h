@@ -1078,23 +1078,58 @@ HandShake(RTMP * r, int FP9HandShake)
   return TRUE;
 }
 
+/* what the second half of the server handshake needs from the first */
+typedef struct SHandShakeState
+{
+  uint8_t serverbuf[RTMP_SIG_SIZE + 4];
+  int digestPosServer;
+  uint8_t type;
+  int FP9HandShake;
+  int encrypted;
+  RC4_handle keyIn;
+  RC4_handle keyOut;
+} SHandShakeState;
+
+static void
+SHandShakeFree(RTMP * r)
+{
+  SHandShakeState *hs = r->m_serveHS;
+
+  if (hs)
+    {
+      if (hs->keyIn)
+	RC4_free(hs->keyIn);
+      if (hs->keyOut)
+	RC4_free(hs->keyOut);
+      free(hs);
+      r->m_serveHS = NULL;
+    }
+}
+
+/* read C0 and C1, answer with S0, S1 and S2 */
 static int
-SHandShake(RTMP * r)
+SHandShake0(RTMP * r)
 {
   int i, offalg = 0;
   int dhposServer = 0;
   int digestPosServer = 0;
-  RC4_handle keyIn = 0;
-  RC4_handle keyOut = 0;
   int FP9HandShake = FALSE;
   int encrypted;
   int32_t *ip;
 
   uint8_t clientsig[RTMP_SIG_SIZE];
-  uint8_t serverbuf[RTMP_SIG_SIZE + 4], *serversig = serverbuf+4;
+  uint8_t *serversig;
   uint8_t type;
   uint32_t uptime;
   getoff *getdh = NULL, *getdig = NULL;
+  SHandShakeState *hs;
+
+  SHandShakeFree(r);
+  hs = calloc(1, sizeof(SHandShakeState));
+  if (!hs)
+    return FALSE;
+  r->m_serveHS = hs;
+  serversig = hs->serverbuf + 4;
 
   if (ReadN(r, (char *)&type, 1) != 1)	/* 0x03 or 0x06 */
     return FALSE;
@@ -1284,7 +1319,7 @@ SHandShake(RTMP * r)
 	  InitRC4Encryption(secretKey,
 			    (uint8_t *) &clientsig[dhposClient],
 			    (uint8_t *) &serversig[dhposServer],
-			    &keyIn, &keyOut);
+			    &hs->keyIn, &hs->keyOut);
 	}
 
 
@@ -1338,6 +1373,28 @@ SHandShake(RTMP * r)
   if (!WriteN(r, (char *)clientsig, RTMP_SIG_SIZE))
     return FALSE;
 
+  hs->digestPosServer = digestPosServer;
+  hs->type = type;
+  hs->FP9HandShake = FP9HandShake;
+  hs->encrypted = encrypted;
+  return TRUE;
+}
+
+/* read and check C2 */
+static int
+SHandShake1(RTMP * r)
+{
+  SHandShakeState *hs = r->m_serveHS;
+  uint8_t clientsig[RTMP_SIG_SIZE];
+  uint8_t *serversig;
+#ifdef FP10
+  int i;
+#endif
+
+  if (!hs)
+    return FALSE;
+  serversig = hs->serverbuf + 4;
+
   /* 2nd part of handshake */
   if (ReadN(r, (char *)clientsig, RTMP_SIG_SIZE) != RTMP_SIG_SIZE)
     return FALSE;
@@ -1345,7 +1402,7 @@ SHandShake(RTMP * r)
   RTMP_Log(RTMP_LOGDEBUG2, "%s: 2nd handshake: ", __FUNCTION__);
   RTMP_LogHex(RTMP_LOGDEBUG2, clientsig, RTMP_SIG_SIZE);
 
-  if (FP9HandShake)
+  if (hs->FP9HandShake)
     {
       uint8_t signature[SHA256_DIGEST_LENGTH];
       uint8_t digest[SHA256_DIGEST_LENGTH];
@@ -1355,12 +1412,12 @@ SHandShake(RTMP * r)
 	     SHA256_DIGEST_LENGTH);
 
       /* verify client response */
-      HMACsha256(&serversig[digestPosServer], SHA256_DIGEST_LENGTH,
+      HMACsha256(&serversig[hs->digestPosServer], SHA256_DIGEST_LENGTH,
 		 GenuineFPKey, sizeof(GenuineFPKey), digest);
       HMACsha256(clientsig, RTMP_SIG_SIZE - SHA256_DIGEST_LENGTH, digest,
 		 SHA256_DIGEST_LENGTH, signature);
 #ifdef FP10
-      if (type == 8 )
+      if (hs->type == 8 )
         {
 	  uint8_t *dptr = digest;
 	  uint8_t *sig = signature;
@@ -1368,7 +1425,7 @@ SHandShake(RTMP * r)
           for (i=0; i<SHA256_DIGEST_LENGTH; i+=8)
 	    rtmpe8_sig(sig+i, sig+i, dptr[i] % 15);
         }
-      else if (type == 9)
+      else if (hs->type == 9)
         {
 	  uint8_t *dptr = digest;
 	  uint8_t *sig = signature;
@@ -1396,12 +1453,13 @@ SHandShake(RTMP * r)
 	  RTMP_Log(RTMP_LOGDEBUG, "%s: Genuine Adobe Flash Player", __FUNCTION__);
 	}
 
-      if (encrypted)
+      if (hs->encrypted)
 	{
 	  char buff[RTMP_SIG_SIZE];
 	  /* set keys for encryption from now on */
-	  r->Link.rc4keyIn = keyIn;
-	  r->Link.rc4keyOut = keyOut;
+	  r->Link.rc4keyIn = hs->keyIn;
+	  r->Link.rc4keyOut = hs->keyOut;
+	  hs->keyIn = hs->keyOut = NULL;
 
 	  /* update the keystreams */
 	  if (r->Link.rc4keyIn)
@@ -1424,6 +1482,13 @@ SHandShake(RTMP * r)
 	}
     }
 
+  SHandShakeFree(r);
   RTMP_Log(RTMP_LOGDEBUG, "%s: Handshaking finished....", __FUNCTION__);
   return TRUE;
 }
+
+static int
+SHandShake(RTMP * r)
+{
+  return SHandShake0(r) && SHandShake1(r);
+}
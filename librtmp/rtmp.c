@@ -33,6 +33,14 @@
 #include "rtmp_sys.h"
 #include "log.h"
 
+#ifdef _WIN32
+#define poll	WSAPoll
+#else
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <poll.h>
+#endif
+
 #ifdef CRYPTO
 #ifdef USE_POLARSSL
 #include <polarssl/havege.h>
@@ -68,11 +76,15 @@ TLS_CTX RTMP_TLS_ctx;
 #endif
 
 #define RTMP_SIG_SIZE 1536
+#define RTMP_OUTQ_MAX	(1024*1024)	/* default m_outMax */
 #define RTMP_LARGE_HEADER_SIZE 12
 #define HEX2BIN(a) (((a)&0x40)?((a)&0xf)+9:((a)&0xf))
 
 static const int packetSize[] = { 12, 8, 4, 1 };
 
+/* slot of a packet type in the RTMPStats arrays */
+#define STATS_TYPE(t)	((t) < RTMP_STATS_TYPES ? (t) : 0)
+
 int RTMP_ctrlC;
 
 const char RTMPProtocolStrings[][7] = {
@@ -112,6 +124,7 @@ typedef enum {
 
 static int DumpMetaData(AMFObject *obj);
 static int HandShake(RTMP *r, int FP9HandShake);
+static int ReadPacket(RTMP *r, RTMPPacket *packet);
 static int SocksNegotiate(RTMP *r);
 
 static int SendConnectPacket(RTMP *r, RTMPPacket *cp);
@@ -119,7 +132,7 @@ static int SendCheckBW(RTMP *r);
 static int SendCheckBWResult(RTMP *r, double txn);
 static int SendDeleteStream(RTMP *r, double dStreamId);
 static int SendFCSubscribe(RTMP *r, AVal *subscribepath);
-static int SendPlay(RTMP *r);
+static int SendPlay(RTMP *r, int streamId, AVal *playpath);
 static int SendBytesReceived(RTMP *r);
 static int SendUsherToken(RTMP *r, AVal *usherToken);
 static int ConnectSocket(RTMP *r);
@@ -133,6 +146,10 @@ static int SendBGHasStream(RTMP *r, double dId, AVal *playpath);
 #endif
 
 static int HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize);
+static int CreateStream(RTMP *r, RTMPStream *s);
+static RTMPStream *FindStream(RTMP *r, int id);
+static RTMPStream *FindStreamCall(RTMP *r, int txn);
+static void HandleStreamPacket(RTMP *r, RTMPStream *s, RTMPPacket *packet);
 static int HandleMetadata(RTMP *r, char *body, unsigned int len);
 static void HandleChangeChunkSize(RTMP *r, const RTMPPacket *packet);
 static void HandleAudio(RTMP *r, const RTMPPacket *packet);
@@ -143,13 +160,15 @@ static void HandleClientBW(RTMP *r, const RTMPPacket *packet);
 
 static int ReadN(RTMP *r, char *buffer, int n);
 static int WriteN(RTMP *r, const char *buffer, int n);
+static int SockFill(RTMP *r);
+static int SockSend(RTMP *r, const char *buf, int len);
 
 static void DecodeTEA(AVal *key, AVal *text);
 
 static int HTTP_Post(RTMP *r, RTMPTCmd cmd, const char *buf, int len);
 static int HTTP_read(RTMP *r, int fill);
 
-#ifndef _WIN32
+#if !defined(_WIN32) && !defined(CLOCK_MONOTONIC)
 static int clk_tck;
 #endif
 
@@ -157,13 +176,18 @@ static int clk_tck;
 #include "handshake.h"
 #endif
 
+/* milliseconds on a clock that only moves forward, the origin is
+ * arbitrary so only differences are meaningful
+ */
 uint32_t
 RTMP_GetTime()
 {
-#ifdef _DEBUG
-  return 0;
-#elif defined(_WIN32)
+#if defined(_WIN32)
   return timeGetTime();
+#elif defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 #else
   struct tms t;
   if (!clk_tck) clk_tck = sysconf(_SC_CLK_TCK);
@@ -171,6 +195,25 @@ RTMP_GetTime()
 #endif
 }
 
+/* the same clock in microseconds, for measuring short intervals */
+uint64_t
+RTMP_GetTimeUS()
+{
+#if defined(_WIN32)
+  LARGE_INTEGER freq, count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000 +
+    (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+  return (uint64_t)RTMP_GetTime() * 1000;
+#endif
+}
+
 void
 RTMP_UserInterrupt()
 {
@@ -324,6 +367,15 @@ RTMP_Alloc()
 void
 RTMP_Free(RTMP *r)
 {
+  RTMPStream *s;
+
+  /* RTMP_Close() keeps them for a reconnect */
+  while ((s = r->m_streams))
+    {
+      r->m_streams = s->next;
+      free(s->playpath.av_val);
+      free(s);
+    }
   free(r);
 }
 
@@ -363,6 +415,12 @@ RTMP_GetDuration(RTMP *r)
   return r->m_fDuration;
 }
 
+void
+RTMP_GetStats(RTMP *r, RTMPStats *stats)
+{
+  *stats = r->m_stats;
+}
+
 int
 RTMP_IsConnected(RTMP *r)
 {
@@ -610,6 +668,12 @@ static struct urlopt {
   	"Buffer time in milliseconds" },
   { AVC("timeout"),   OFF(Link.timeout),       OPT_INT, 0,
   	"Session timeout in seconds" },
+  { AVC("chunksize"), OFF(Link.chunkSize),     OPT_INT, 0,
+  	"Outgoing chunk size to ask for" },
+  { AVC("flvhdr"),    OFF(m_read.hdrMode),     OPT_INT, 0,
+  	"FLV header flags: 0 probe stream, 1 both, 2 from metadata" },
+  { AVC("hdrbuf"),    OFF(m_read.hdrBufSize),  OPT_INT, 0,
+  	"Most bytes to buffer while probing for the FLV header" },
   { AVC("pubUser"),   OFF(Link.pubUser),       OPT_STR, 0,
         "Publisher username" },
   { AVC("pubPasswd"), OFF(Link.pubPasswd),     OPT_STR, 0,
@@ -1142,9 +1206,10 @@ RTMP_ConnectStream(RTMP *r, int seekTime)
 	{
 	  if (!packet.m_nBodySize)
 	    continue;
-	  if ((packet.m_packetType == RTMP_PACKET_TYPE_AUDIO) ||
-	      (packet.m_packetType == RTMP_PACKET_TYPE_VIDEO) ||
-	      (packet.m_packetType == RTMP_PACKET_TYPE_INFO))
+	  if (((packet.m_packetType == RTMP_PACKET_TYPE_AUDIO) ||
+	       (packet.m_packetType == RTMP_PACKET_TYPE_VIDEO) ||
+	       (packet.m_packetType == RTMP_PACKET_TYPE_INFO)) &&
+	      !FindStream(r, packet.m_nInfoField2))
 	    {
 	      RTMP_Log(RTMP_LOGWARNING, "Received FLV packet before play()! Ignoring.");
 	      RTMPPacket_Free(&packet);
@@ -1174,6 +1239,7 @@ RTMP_ToggleStream(RTMP *r)
 {
   int res;
 
+  r->m_stats.toggles++;
   if (!r->m_pausing)
     {
       if (RTMP_IsTimedout(r) && r->m_read.status == RTMP_READ_EOF)
@@ -1183,6 +1249,7 @@ RTMP_ToggleStream(RTMP *r)
       if (!res)
 	return res;
 
+      r->m_stats.pauses++;
       r->m_pausing = 1;
       sleep(1);
     }
@@ -1203,6 +1270,90 @@ RTMP_DeleteStream(RTMP *r)
   r->m_stream_id = -1;
 }
 
+RTMPStream *
+RTMP_AddStream(RTMP *r, const AVal *playpath, RTMPStreamCB *cb, void *ctx)
+{
+  RTMPStream *s, **sp;
+
+  s = calloc(1, sizeof(RTMPStream));
+  if (!s)
+    return NULL;
+  s->playpath.av_val = malloc(playpath->av_len + 1);
+  if (!s->playpath.av_val)
+    {
+      free(s);
+      return NULL;
+    }
+  memcpy(s->playpath.av_val, playpath->av_val, playpath->av_len);
+  s->playpath.av_val[playpath->av_len] = '\0';
+  s->playpath.av_len = playpath->av_len;
+  s->cb = cb;
+  s->ctx = ctx;
+
+  for (sp = &r->m_streams; *sp; sp = &(*sp)->next)
+    ;
+  *sp = s;
+
+  /* otherwise it's created along with the main stream */
+  if (r->m_bPlaying && RTMP_IsConnected(r))
+    CreateStream(r, s);
+  return s;
+}
+
+void
+RTMP_RemoveStream(RTMP *r, RTMPStream *s)
+{
+  RTMPStream **sp;
+
+  for (sp = &r->m_streams; *sp; sp = &(*sp)->next)
+    {
+      if (*sp == s)
+	{
+	  *sp = s->next;
+	  break;
+	}
+    }
+  if (s->id > 0 && RTMP_IsConnected(r))
+    SendDeleteStream(r, s->id);
+  free(s->playpath.av_val);
+  free(s);
+}
+
+static int
+CreateStream(RTMP *r, RTMPStream *s)
+{
+  s->id = 0;
+  s->state = RTMP_STREAM_CREATING;
+  if (!RTMP_SendCreateStream(r))
+    return FALSE;
+  s->txn = r->m_numInvokes;
+  return TRUE;
+}
+
+static RTMPStream *
+FindStream(RTMP *r, int id)
+{
+  RTMPStream *s;
+
+  if (id <= 0)
+    return NULL;
+  for (s = r->m_streams; s; s = s->next)
+    if (s->id == id)
+      return s;
+  return NULL;
+}
+
+static RTMPStream *
+FindStreamCall(RTMP *r, int txn)
+{
+  RTMPStream *s;
+
+  for (s = r->m_streams; s; s = s->next)
+    if (s->txn && s->txn == txn)
+      return s;
+  return NULL;
+}
+
 int
 RTMP_GetNextMediaPacket(RTMP *r, RTMPPacket *packet)
 {
@@ -1244,8 +1395,7 @@ RTMP_GetNextMediaPacket(RTMP *r, RTMPPacket *packet)
   if (bHasMediaPacket)
     r->m_bPlaying = TRUE;
   else if (r->m_sb.sb_timedout && !r->m_pausing)
-    r->m_pauseStamp = r->m_mediaChannel < r->m_channelsAllocatedIn ?
-                      r->m_channelTimestamp[r->m_mediaChannel] : 0;
+    r->m_pauseStamp = RTMP_GetChannelTime(r, r->m_mediaChannel);
 
   return bHasMediaPacket;
 }
@@ -1254,6 +1404,16 @@ int
 RTMP_ClientPacket(RTMP *r, RTMPPacket *packet)
 {
   int bHasMediaPacket = 0;
+  RTMPStream *s;
+
+  /* anything on an added stream goes to that stream */
+  if (packet->m_nInfoField2 != r->m_stream_id &&
+      (s = FindStream(r, packet->m_nInfoField2)))
+    {
+      HandleStreamPacket(r, s, packet);
+      return 0;
+    }
+
   switch (packet->m_packetType)
     {
     case RTMP_PACKET_TYPE_CHUNK_SIZE:
@@ -1458,7 +1618,7 @@ ReadN(RTMP *r, char *buffer, int n)
                     }
 
                   RTMP_Log(RTMP_LOGDEBUG, "Trying to fill HTTP buffer, Retries: %d", retries);
-                  status = RTMPSockBuf_Fill(&r->m_sb);
+                  status = SockFill(r);
                   /* Reconnect socket when closed by some moronic servers after
                    * every HTTP data packet */
                   if (status < 1)
@@ -1495,7 +1655,7 @@ ReadN(RTMP *r, char *buffer, int n)
                 }
               else if (status == -2)
                 {
-                  if (RTMPSockBuf_Fill(&r->m_sb) < 1)
+                  if (SockFill(r) < 1)
                     if (!r->m_sb.sb_timedout)
                       {
                         RTMP_Close(r);
@@ -1515,7 +1675,7 @@ ReadN(RTMP *r, char *buffer, int n)
            * is empty */
           if (r->m_resplen && (!r->m_sb.sb_size))
             {
-              if (RTMPSockBuf_Fill(&r->m_sb) < 1)
+              if (SockFill(r) < 1)
                 if (!r->m_sb.sb_timedout)
                   RTMP_Close(r);
             }
@@ -1529,7 +1689,7 @@ ReadN(RTMP *r, char *buffer, int n)
           avail = r->m_sb.sb_size;
 	  if (avail == 0)
 	    {
-	      if (RTMPSockBuf_Fill(&r->m_sb) < 1)
+	      if (SockFill(r) < 1)
 	        {
 	          if (!r->m_sb.sb_timedout)
 	            RTMP_Close(r);
@@ -1542,6 +1702,7 @@ ReadN(RTMP *r, char *buffer, int n)
       if (nRead > 0)
 	{
 	  memcpy(ptr, r->m_sb.sb_start, nRead);
+	  r->m_stats.bytesCopied += nRead;
 	  r->m_sb.sb_start += nRead;
 	  r->m_sb.sb_size -= nRead;
 	  nBytes = nRead;
@@ -1570,7 +1731,11 @@ ReadN(RTMP *r, char *buffer, int n)
 #ifdef CRYPTO
       if (r->Link.rc4keyIn)
 	{
-	  RC4_encrypt(r->Link.rc4keyIn, nBytes, ptr);
+	  /* some of it may have been decrypted for ChunkReady() already */
+	  int plain = nBytes < r->m_nPlain ? nBytes : r->m_nPlain;
+	  r->m_nPlain -= plain;
+	  if (nBytes > plain)
+	    RC4_encrypt(r->Link.rc4keyIn, nBytes - plain, ptr + plain);
 	}
 #endif
 
@@ -1581,6 +1746,144 @@ ReadN(RTMP *r, char *buffer, int n)
   return nOriginalSize - n;
 }
 
+/* RTMPSockBuf_Fill and _Send with the bookkeeping for RTMP_GetStats */
+static int
+SockFill(RTMP *r)
+{
+  int timedout = r->m_sb.sb_timedout, nBytes;
+
+  /* unread bytes get moved to the front first */
+  if (r->m_sb.sb_start != r->m_sb.sb_buf)
+    r->m_stats.bytesCopied += r->m_sb.sb_size;
+  nBytes = RTMPSockBuf_Fill(&r->m_sb);
+  r->m_stats.recvCalls++;
+  if (nBytes > 0)
+    r->m_stats.bytesIn += nBytes;
+  else if (r->m_sb.sb_timedout && !timedout)
+    r->m_stats.timeouts++;
+  return nBytes;
+}
+
+static int
+SockSend(RTMP *r, const char *buf, int len)
+{
+  int nBytes = RTMPSockBuf_Send(&r->m_sb, buf, len);
+
+  r->m_stats.sendCalls++;
+  if (nBytes > 0)
+    r->m_stats.bytesOut += nBytes;
+  return nBytes;
+}
+
+int
+RTMP_SockFill(RTMP *r)
+{
+  return SockFill(r);
+}
+
+int
+RTMP_SockSend(RTMP *r, const char *buf, int len)
+{
+  return SockSend(r, buf, len);
+}
+
+#ifdef _WIN32
+#define WouldBlock(err)	((err) == WSAEWOULDBLOCK)
+#else
+#define WouldBlock(err)	((err) == EWOULDBLOCK || (err) == EAGAIN)
+#endif
+
+/* keep what a non-blocking socket didn't take for RTMP_Flush() */
+static int
+OutQueue(RTMP *r, const char *buf, int len)
+{
+  if (r->m_outLen + len > r->m_outMax)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, peer isn't reading, %d bytes queued",
+	  __FUNCTION__, r->m_outLen);
+      RTMP_Close(r);
+      return FALSE;
+    }
+  if (r->m_outStart + r->m_outLen + len > r->m_outSize)
+    {
+      if (r->m_outStart)
+	{
+	  memmove(r->m_outBuf, r->m_outBuf + r->m_outStart, r->m_outLen);
+	  r->m_outStart = 0;
+	}
+      if (r->m_outLen + len > r->m_outSize)
+	{
+	  int size = r->m_outSize ? r->m_outSize : 4096;
+	  char *ptr;
+	  while (size < r->m_outLen + len)
+	    size *= 2;
+	  ptr = realloc(r->m_outBuf, size);
+	  if (!ptr)
+	    {
+	      RTMP_Log(RTMP_LOGERROR, "%s, no memory to queue %d bytes",
+		  __FUNCTION__, len);
+	      RTMP_Close(r);
+	      return FALSE;
+	    }
+	  r->m_stats.allocs++;
+	  r->m_outBuf = ptr;
+	  r->m_outSize = size;
+	}
+    }
+  memcpy(r->m_outBuf + r->m_outStart + r->m_outLen, buf, len);
+  r->m_outLen += len;
+  r->m_stats.bytesCopied += len;
+  return TRUE;
+}
+
+int
+RTMP_Flush(RTMP *r)
+{
+  while (r->m_outLen > 0)
+    {
+      int nBytes = SockSend(r, r->m_outBuf + r->m_outStart, r->m_outLen);
+      if (nBytes < 0)
+	{
+	  int sockerr = GetSockError();
+	  if (sockerr == EINTR && !RTMP_ctrlC)
+	    continue;
+	  if (r->m_bNonBlock && WouldBlock(sockerr))
+	    break;
+	  RTMP_Log(RTMP_LOGERROR, "%s, RTMP send error %d (%d bytes)", __FUNCTION__,
+	      sockerr, r->m_outLen);
+	  RTMP_Close(r);
+	  return -1;
+	}
+      r->m_outStart += nBytes;
+      r->m_outLen -= nBytes;
+    }
+  if (!r->m_outLen)
+    r->m_outStart = 0;
+  return r->m_outLen;
+}
+
+int
+RTMP_SetNonBlock(RTMP *r, int on)
+{
+#ifdef _WIN32
+  u_long arg = on ? 1 : 0;
+  if (ioctlsocket(r->m_sb.sb_socket, FIONBIO, &arg))
+    return FALSE;
+#else
+  int flags = fcntl(r->m_sb.sb_socket, F_GETFL);
+  if (flags == -1 || fcntl(r->m_sb.sb_socket, F_SETFL,
+	on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK) == -1)
+    return FALSE;
+#endif
+  r->m_bNonBlock = on;
+  if (on && !r->m_outMax)
+    r->m_outMax = RTMP_OUTQ_MAX;
+  /* a blocking socket has to take the rest now */
+  if (!on && r->m_outLen && RTMP_Flush(r) < 0)
+    return FALSE;
+  return TRUE;
+}
+
 static int
 WriteN(RTMP *r, const char *buffer, int n)
 {
@@ -1592,7 +1895,10 @@ WriteN(RTMP *r, const char *buffer, int n)
   if (r->Link.rc4keyOut)
     {
       if (n > sizeof(buf))
-	encrypted = (char *)malloc(n);
+	{
+	  encrypted = (char *)malloc(n);
+	  r->m_stats.allocs++;
+	}
       else
 	encrypted = (char *)buf;
       ptr = encrypted;
@@ -1603,6 +1909,7 @@ WriteN(RTMP *r, const char *buffer, int n)
   if (r->Link.ConnectPacket)
     {
       char *ConnectPacket = malloc(r->Link.HandshakeResponse.av_len + n);
+      r->m_stats.allocs++;
       memcpy(ConnectPacket, r->Link.HandshakeResponse.av_val, r->Link.HandshakeResponse.av_len);
       memcpy(ConnectPacket + r->Link.HandshakeResponse.av_len, ptr, n);
       ptr = ConnectPacket;
@@ -1610,6 +1917,10 @@ WriteN(RTMP *r, const char *buffer, int n)
       r->Link.ConnectPacket = FALSE;
     }
 
+  /* don't overtake what is still queued */
+  if (r->m_outLen)
+    n = OutQueue(r, ptr, n) ? 0 : -1;
+
   while (n > 0)
     {
       int nBytes;
@@ -1617,12 +1928,20 @@ WriteN(RTMP *r, const char *buffer, int n)
       if (r->Link.protocol & RTMP_FEATURE_HTTP)
         nBytes = HTTP_Post(r, RTMPT_SEND, ptr, n);
       else
-        nBytes = RTMPSockBuf_Send(&r->m_sb, ptr, n);
+        nBytes = SockSend(r, ptr, n);
       /*RTMP_Log(RTMP_LOGDEBUG, "%s: %d\n", __FUNCTION__, nBytes); */
 
       if (nBytes < 0)
 	{
 	  int sockerr = GetSockError();
+
+	  if (r->m_bNonBlock && WouldBlock(sockerr))
+	    {
+	      if (OutQueue(r, ptr, n))
+		n = 0;
+	      break;
+	    }
+
 	  RTMP_Log(RTMP_LOGERROR, "%s, RTMP send error %d (%d bytes)", __FUNCTION__,
 	      sockerr, n);
 
@@ -2095,8 +2414,7 @@ RTMP_SendPause(RTMP *r, int DoPause, int iTime)
 int RTMP_Pause(RTMP *r, int DoPause)
 {
   if (DoPause)
-    r->m_pauseStamp = r->m_mediaChannel < r->m_channelsAllocatedIn ?
-                      r->m_channelTimestamp[r->m_mediaChannel] : 0;
+    r->m_pauseStamp = RTMP_GetChannelTime(r, r->m_mediaChannel);
   return RTMP_SendPause(r, DoPause, r->m_pauseStamp);
 }
 
@@ -2151,6 +2469,38 @@ RTMP_SendServerBW(RTMP *r)
   return RTMP_SendPacket(r, &packet, FALSE);
 }
 
+/* Tell the server we're switching to size byte chunks, and switch */
+int
+RTMP_SendChunkSize(RTMP *r, int size)
+{
+  RTMPPacket packet;
+  char pbuf[256], *pend = pbuf + sizeof(pbuf);
+
+  if (size < 1 || size > RTMP_MAX_CHUNKSIZE)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, invalid chunk size %d", __FUNCTION__, size);
+      return FALSE;
+    }
+
+  packet.m_nChannel = 0x02;	/* control channel (invoke) */
+  packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
+  packet.m_packetType = RTMP_PACKET_TYPE_CHUNK_SIZE;
+  packet.m_nTimeStamp = 0;
+  packet.m_nInfoField2 = 0;
+  packet.m_hasAbsTimestamp = 0;
+  packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
+
+  packet.m_nBodySize = 4;
+
+  AMF_EncodeInt32(packet.m_body, pend, size);
+  if (!RTMP_SendPacket(r, &packet, FALSE))
+    return FALSE;
+
+  RTMP_Log(RTMP_LOGDEBUG, "%s, chunk size changed to %d", __FUNCTION__, size);
+  r->m_outChunkSize = size;
+  return TRUE;
+}
+
 int
 RTMP_SendClientBW(RTMP *r)
 {
@@ -2283,7 +2633,7 @@ SendPong(RTMP *r, double txn)
 SAVC(play);
 
 static int
-SendPlay(RTMP *r)
+SendPlay(RTMP *r, int streamId, AVal *playpath)
 {
   RTMPPacket packet;
   char pbuf[1024], *pend = pbuf + sizeof(pbuf);
@@ -2293,7 +2643,7 @@ SendPlay(RTMP *r)
   packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
   packet.m_packetType = RTMP_PACKET_TYPE_INVOKE;
   packet.m_nTimeStamp = 0;
-  packet.m_nInfoField2 = r->m_stream_id;	/*0x01000000; */
+  packet.m_nInfoField2 = streamId;	/*0x01000000; */
   packet.m_hasAbsTimestamp = 0;
   packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
@@ -2304,8 +2654,8 @@ SendPlay(RTMP *r)
 
   RTMP_Log(RTMP_LOGDEBUG, "%s, seekTime=%d, stopTime=%d, sending play: %s",
       __FUNCTION__, r->Link.seekTime, r->Link.stopTime,
-      r->Link.playpath.av_val);
-  enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
+      playpath->av_val);
+  enc = AMF_EncodeString(enc, pend, playpath);
   if (!enc)
     return FALSE;
 
@@ -3030,6 +3380,7 @@ HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
   char *pageUrl = r->Link.pageUrl.av_len ? r->Link.pageUrl.av_val : "";
   int param_count;
   AVal av_Command, av_Response;
+  RTMPStream *s;
   if (body[0] != 0x02)		/* make sure it is a string method name we start with */
     {
       RTMP_Log(RTMP_LOGWARNING, "%s, Sanity failed. no string method in invoke packet",
@@ -3081,6 +3432,17 @@ HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
 		  SendSecureTokenResponse(r, &p.p_vu.p_aval);
 		}
 	    }
+	  /* 128 byte chunks cost a header for every 128 bytes we
+	   * publish. Messages are never interleaved on the way out, so
+	   * bigger ones don't hold up the audio.
+	   */
+	  if (r->Link.chunkSize > 0 || (r->Link.protocol & RTMP_FEATURE_WRITE))
+	    {
+	      int size = r->Link.chunkSize > 0 ? r->Link.chunkSize
+		: RTMP_WRITE_CHUNKSIZE;
+	      if (size != r->m_outChunkSize)
+		RTMP_SendChunkSize(r, size);
+	    }
 	  if (r->Link.protocol & RTMP_FEATURE_WRITE)
 	    {
 	      SendReleaseStream(r);
@@ -3246,7 +3608,20 @@ HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
             }
           else
             RTMP_SendCreateStream(r);
+
+	  for (s = r->m_streams; s; s = s->next)
+	    if (!s->txn && s->state == RTMP_STREAM_CREATING)
+	      CreateStream(r, s);
         }
+      else if (AVMATCH(&methodInvoked, &av_createStream) &&
+	       (s = FindStreamCall(r, (int)txn)))
+	{
+	  s->id = (int) AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 3));
+	  s->state = RTMP_STREAM_PLAYING;
+	  SendPlay(r, s->id, &s->playpath);
+	  s->txn = r->m_numInvokes;
+	  RTMP_SendCtrl(r, 3, s->id, r->m_nBufferMS);
+	}
       else if (AVMATCH(&methodInvoked, &av_createStream))
         {
           r->m_stream_id = (int) AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 3));
@@ -3271,7 +3646,7 @@ HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
 	    {
 	      if (r->Link.lFlags & RTMP_LF_PLST)
 	        SendPlaylist(r);
-	      SendPlay(r);
+	      SendPlay(r, r->m_stream_id, &r->Link.playpath);
 	      RTMP_SendCtrl(r, 3, r->m_stream_id, r->m_nBufferMS);
 	    }
 	}
@@ -3406,6 +3781,7 @@ HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
           r->Link.redirected = FALSE;
           RTMP_Close(r);
           RTMP_Log(RTMP_LOGINFO, "trying to connect with redirected url");
+          r->m_stats.reconnects++;
           RTMP_Connect(r, NULL);
         }
       else
@@ -3424,6 +3800,7 @@ HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
           if(r->Link.pFlags & RTMP_PUB_CLATE)
               r->Link.pFlags |= RTMP_PUB_CLEAN;
           RTMP_Log(RTMP_LOGERROR, "authenticating publisher");
+          r->m_stats.reconnects++;
 
           if (!RTMP_Connect(r, NULL) || !RTMP_ConnectStream(r, 0))
               goto leave;
@@ -3642,6 +4019,86 @@ leave:
   return ret;
 }
 
+static void
+HandleStreamPacket(RTMP *r, RTMPStream *s, RTMPPacket *packet)
+{
+  AMFObject obj, obj2;
+  AVal method, code;
+  char *body = packet->m_body;
+  unsigned int nBodySize = packet->m_nBodySize;
+  int i;
+
+  switch (packet->m_packetType)
+    {
+    case RTMP_PACKET_TYPE_AUDIO:
+    case RTMP_PACKET_TYPE_VIDEO:
+    case RTMP_PACKET_TYPE_INFO:
+    case RTMP_PACKET_TYPE_FLASH_VIDEO:
+      if (s->cb)
+	s->cb(s, packet, s->ctx);
+      return;
+
+    case RTMP_PACKET_TYPE_FLEX_MESSAGE:
+      body++;
+      nBodySize--;
+      /* fallthru */
+    case RTMP_PACKET_TYPE_INVOKE:
+      break;
+
+    default:
+      return;
+    }
+
+  if (!nBodySize || body[0] != 0x02 ||
+      AMF_Decode(&obj, body, nBodySize, FALSE) < 0)
+    return;
+
+  AMFProp_GetString(AMF_GetProp(&obj, NULL, 0), &method);
+  if (AVMATCH(&method, &av_onStatus))
+    {
+      AMFProp_GetObject(AMF_GetProp(&obj, NULL, 3), &obj2);
+      AMFProp_GetString(AMF_GetProp(&obj2, &av_code, -1), &code);
+      RTMP_Log(RTMP_LOGDEBUG, "%s, stream %d onStatus: %s", __FUNCTION__,
+	  s->id, code.av_val);
+
+      if (AVMATCH(&code, &av_NetStream_Failed)
+	  || AVMATCH(&code, &av_NetStream_Play_Failed)
+	  || AVMATCH(&code, &av_NetStream_Play_StreamNotFound))
+	{
+	  RTMP_Log(RTMP_LOGERROR, "Stream %.*s: %s", s->playpath.av_len,
+	      s->playpath.av_val, code.av_val);
+	  s->state = RTMP_STREAM_FAILED;
+	}
+      else if (AVMATCH(&code, &av_NetStream_Play_Start)
+	  || AVMATCH(&code, &av_NetStream_Play_PublishNotify))
+	{
+	  s->state = RTMP_STREAM_STARTED;
+	}
+      else if (AVMATCH(&code, &av_NetStream_Play_Complete)
+	  || AVMATCH(&code, &av_NetStream_Play_Stop)
+	  || AVMATCH(&code, &av_NetStream_Play_UnpublishNotify))
+	{
+	  s->state = RTMP_STREAM_DONE;
+	}
+
+      /* this stream's play call is answered, other streams' stay */
+      if (s->state > RTMP_STREAM_PLAYING && s->txn)
+	{
+	  for (i = 0; i < r->m_numCalls; i++)
+	    {
+	      if (r->m_methodCalls[i].num == s->txn
+		  && AVMATCH(&r->m_methodCalls[i].name, &av_play))
+		{
+		  AV_erase(r->m_methodCalls, &r->m_numCalls, i, TRUE);
+		  break;
+		}
+	    }
+	  s->txn = 0;
+	}
+    }
+  AMF_Reset(&obj);
+}
+
 int
 RTMP_FindFirstMatchingProperty(AMFObject *obj, const AVal *name,
 			       AMFObjectProperty * p)
@@ -3897,9 +4354,9 @@ HandleCtrl(RTMP *r, const RTMPPacket *packet)
 	    break;
 	  if (!r->m_pausing)
 	    {
-	      r->m_pauseStamp = r->m_mediaChannel < r->m_channelsAllocatedIn ?
-	                        r->m_channelTimestamp[r->m_mediaChannel] : 0;
+	      r->m_pauseStamp = RTMP_GetChannelTime(r, r->m_mediaChannel);
 	      RTMP_SendPause(r, TRUE, r->m_pauseStamp);
+	      r->m_stats.pauses++;
 	      r->m_pausing = 1;
 	    }
 	  else if (r->m_pausing == 2)
@@ -3995,40 +4452,338 @@ EncodeInt32LE(char *output, int nVal)
   return 4;
 }
 
-int
-RTMP_ReadPacket(RTMP *r, RTMPPacket *packet)
+/* The state of chunk stream id, a new one is added if bCreate. A sparse
+ * entry may move when another one is added.
+ */
+static RTMPChunkState *
+ChunkState(RTMPChunkMap *m, int id, int bCreate)
 {
-  uint8_t hbuf[RTMP_MAX_HEADER_SIZE] = { 0 };
-  char *header = (char *)hbuf;
-  int nSize, hSize, nToRead, nChunk;
-  int didAlloc = FALSE;
+  int i;
 
-  RTMP_Log(RTMP_LOGDEBUG2, "%s: fd=%d", __FUNCTION__, r->m_sb.sb_socket);
+  if (id < RTMP_DENSE_CHANNELS)
+    return &m->dense[id];
 
-  if (ReadN(r, (char *)hbuf, 1) == 0)
-    {
-      RTMP_Log(RTMP_LOGERROR, "%s, failed to read RTMP packet header", __FUNCTION__);
-      return FALSE;
-    }
+  for (i = 0; i < m->nSparse; i++)
+    if (m->sparseIds[i] == id)
+      return &m->sparse[i];
 
-  packet->m_headerType = (hbuf[0] & 0xc0) >> 6;
-  packet->m_nChannel = (hbuf[0] & 0x3f);
-  header++;
-  if (packet->m_nChannel == 0)
+  if (!bCreate || id >= RTMP_CHANNELS)
+    return NULL;
+
+  if (!(m->nSparse & 7))
     {
-      if (ReadN(r, (char *)&hbuf[1], 1) != 1)
-	{
-	  RTMP_Log(RTMP_LOGERROR, "%s, failed to read RTMP packet header 2nd byte",
-	      __FUNCTION__);
-	  return FALSE;
-	}
-      packet->m_nChannel = hbuf[1];
-      packet->m_nChannel += 64;
-      header++;
+      int n = m->nSparse + 8;
+      int *ids = realloc(m->sparseIds, sizeof(int) * n);
+      RTMPChunkState *states;
+
+      if (!ids)
+	return NULL;
+      m->sparseIds = ids;
+      states = realloc(m->sparse, sizeof(RTMPChunkState) * n);
+      if (!states)
+	return NULL;
+      m->sparse = states;
     }
-  else if (packet->m_nChannel == 1)
-    {
-      int tmp;
+  i = m->nSparse++;
+  m->sparseIds[i] = id;
+  memset(&m->sparse[i], 0, sizeof(RTMPChunkState));
+  return &m->sparse[i];
+}
+
+/* forget all chunk streams, dropping partly received messages */
+static void
+ChunkMapReset(RTMPChunkMap *m)
+{
+  int i;
+
+  for (i = 0; i < RTMP_DENSE_CHANNELS; i++)
+    if (m->dense[i].body)
+      free(m->dense[i].body - RTMP_MAX_HEADER_SIZE);
+  for (i = 0; i < m->nSparse; i++)
+    if (m->sparse[i].body)
+      free(m->sparse[i].body - RTMP_MAX_HEADER_SIZE);
+  free(m->sparseIds);
+  free(m->sparse);
+  memset(m, 0, sizeof(RTMPChunkMap));
+}
+
+/* remember the header of a packet sent, for compressing the next one */
+static void
+ChunkSent(RTMP *r, const RTMPPacket *packet)
+{
+  RTMPChunkState *cs = ChunkState(&r->m_chunksOut, packet->m_nChannel, TRUE);
+
+  if (!cs)
+    return;
+  cs->headerType = packet->m_headerType;
+  cs->type = packet->m_packetType;
+  cs->timestamp = packet->m_nTimeStamp;
+  cs->streamId = packet->m_nInfoField2;
+  cs->bodySize = packet->m_nBodySize;
+  cs->bUsed = TRUE;
+
+  r->m_stats.msgsOut[STATS_TYPE(packet->m_packetType)]++;
+  r->m_stats.chunksOut[STATS_TYPE(packet->m_packetType)] += packet->m_nBodySize
+    ? (packet->m_nBodySize + r->m_outChunkSize - 1) / r->m_outChunkSize : 1;
+}
+
+/* The state of a chunk stream as read (bOut FALSE) or sent, added if
+ * missing. For callers that parse or write chunks themselves; a pointer
+ * is only good until the next call for another stream.
+ */
+RTMPChunkState *
+RTMP_GetChunkState(RTMP *r, int bOut, int channel)
+{
+  return ChunkState(bOut ? &r->m_chunksOut : &r->m_chunksIn, channel, TRUE);
+}
+
+/* abs timestamp of the last message received on channel */
+uint32_t
+RTMP_GetChannelTime(RTMP *r, int channel)
+{
+  RTMPChunkState *cs = ChunkState(&r->m_chunksIn, channel, FALSE);
+
+  return cs ? cs->absTime : 0;
+}
+
+/* Bytes the next chunk takes, header included, or 0 if not even its
+ * header is buffered yet.
+ */
+static int
+ChunkLength(RTMP *r)
+{
+  unsigned char *p = (unsigned char *)r->m_sb.sb_start;
+  int avail = r->m_sb.sb_size, hSize = 1, nSize, channel;
+  unsigned int bodySize = 0, bytesRead = 0, nChunk;
+  RTMPChunkState *cs;
+
+  if (avail < 1)
+    return 0;
+  channel = p[0] & 0x3f;
+  if (channel == 0)
+    {
+      if (avail < 2)
+	return 0;
+      channel = p[1] + 64;
+      hSize = 2;
+    }
+  else if (channel == 1)
+    {
+      if (avail < 3)
+	return 0;
+      channel = (p[2] << 8) + p[1] + 64;
+      hSize = 3;
+    }
+  nSize = packetSize[(p[0] & 0xc0) >> 6] - 1;
+  if (avail < hSize + nSize)
+    return 0;
+
+  cs = ChunkState(&r->m_chunksIn, channel, FALSE);
+  if (cs && cs->bUsed)
+    {
+      bodySize = cs->bodySize;
+      bytesRead = cs->bytesRead;
+    }
+  if (nSize >= 6)
+    {
+      bodySize = AMF_DecodeInt24((char *)p + hSize + 3);
+      bytesRead = 0;
+    }
+  if (nSize >= 3 && AMF_DecodeInt24((char *)p + hSize) == 0xffffff)
+    nSize += 4;		/* extended timestamp */
+
+  nChunk = bodySize - bytesRead;
+  if (nChunk > (unsigned int)r->m_inChunkSize)
+    nChunk = r->m_inChunkSize;
+  return hSize + nSize + nChunk;
+}
+
+/* Have the next chunk in m_sb before RTMP_ReadPacket() starts on it, so
+ * it never stops halfway through on a non-blocking socket. Returns 1 if
+ * it is there, 0 if it hasn't arrived yet, 2 if it can't fit into m_sb
+ * and -1 if the connection is gone.
+ */
+static int
+ChunkReady(RTMP *r)
+{
+  int need, nBytes;
+
+  while (1)
+    {
+#ifdef CRYPTO
+      /* decrypt it to see the header, ReadN() skips what's done */
+      if (r->Link.rc4keyIn && r->m_nPlain < r->m_sb.sb_size)
+	{
+	  RC4_encrypt(r->Link.rc4keyIn, r->m_sb.sb_size - r->m_nPlain,
+	      r->m_sb.sb_start + r->m_nPlain);
+	  r->m_nPlain = r->m_sb.sb_size;
+	}
+#endif
+      need = ChunkLength(r);
+      if (need && need <= r->m_sb.sb_size)
+	return 1;
+      if (r->m_sb.sb_size >= (int)sizeof(r->m_sb.sb_buf) - 1)
+	return 2;
+
+      r->m_sb.sb_timedout = FALSE;
+      nBytes = SockFill(r);
+      if (nBytes < 1)
+	return r->m_sb.sb_timedout ? 0 : -1;
+    }
+}
+
+/* Collect a chunk that doesn't fit into m_sb in m_chunkBuf, over as
+ * many calls as it takes. Returns like ChunkReady().
+ */
+static int
+ChunkCollect(RTMP *r)
+{
+  int n;
+
+  if (!r->m_chunkBuf)
+    {
+      r->m_chunkNeed = ChunkLength(r);
+      r->m_chunkBuf = malloc(r->m_chunkNeed);
+      if (!r->m_chunkBuf)
+	{
+	  RTMP_Log(RTMP_LOGERROR, "%s, no memory for a chunk of %d bytes",
+	      __FUNCTION__, r->m_chunkNeed);
+	  return -1;
+	}
+      r->m_stats.allocs++;
+      r->m_chunkLen = 0;
+    }
+
+  while (r->m_chunkLen < r->m_chunkNeed)
+    {
+      if (!r->m_sb.sb_size)
+	{
+	  r->m_sb.sb_timedout = FALSE;
+	  if (SockFill(r) < 1)
+	    return r->m_sb.sb_timedout ? 0 : -1;
+	}
+#ifdef CRYPTO
+      if (r->Link.rc4keyIn && r->m_nPlain < r->m_sb.sb_size)
+	{
+	  RC4_encrypt(r->Link.rc4keyIn, r->m_sb.sb_size - r->m_nPlain,
+	      r->m_sb.sb_start + r->m_nPlain);
+	  r->m_nPlain = r->m_sb.sb_size;
+	}
+#endif
+      n = r->m_chunkNeed - r->m_chunkLen;
+      if (n > r->m_sb.sb_size)
+	n = r->m_sb.sb_size;
+      memcpy(r->m_chunkBuf + r->m_chunkLen, r->m_sb.sb_start, n);
+      r->m_stats.bytesCopied += n;
+      r->m_chunkLen += n;
+      r->m_sb.sb_start += n;
+      r->m_sb.sb_size -= n;
+#ifdef CRYPTO
+      r->m_nPlain -= n;
+#endif
+    }
+  return 1;
+}
+
+/* ReadPacket() the collected chunk, with whatever came after it still
+ * behind it
+ */
+static int
+ChunkReadCollected(RTMP *r, RTMPPacket *packet)
+{
+  int need = r->m_chunkNeed, rest = r->m_sb.sb_size, ret;
+  char *buf = realloc(r->m_chunkBuf, need + rest);
+
+  if (!buf)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, no memory for a chunk of %d bytes",
+	  __FUNCTION__, need);
+      RTMP_Close(r);
+      return FALSE;
+    }
+  memcpy(buf + need, r->m_sb.sb_start, rest);
+  r->m_stats.bytesCopied += rest;
+  r->m_chunkBuf = NULL;
+  r->m_chunkLen = r->m_chunkNeed = 0;
+
+  r->m_sb.sb_start = buf;
+  r->m_sb.sb_size = need + rest;
+#ifdef CRYPTO
+  r->m_nPlain += need;		/* all of the chunk is decrypted already */
+#endif
+  ret = ReadPacket(r, packet);
+
+  memmove(r->m_sb.sb_buf, r->m_sb.sb_start, r->m_sb.sb_size);
+  r->m_sb.sb_start = r->m_sb.sb_buf;
+  free(buf);
+  return ret;
+}
+
+int
+RTMP_ReadPacket(RTMP *r, RTMPPacket *packet)
+{
+  int ready;
+
+  /* a chunk started while non-blocking is finished the same way */
+  if (!r->m_chunkBuf
+      && (!r->m_bNonBlock || (r->Link.protocol & RTMP_FEATURE_HTTP)))
+    return ReadPacket(r, packet);
+
+  ready = r->m_chunkBuf ? 2 : ChunkReady(r);
+  if (ready == 2)
+    ready = ChunkCollect(r);
+
+  switch (ready)
+    {
+    case 1:
+      if (r->m_chunkBuf)
+	return ChunkReadCollected(r, packet);
+      return ReadPacket(r, packet);
+    case 0:
+      r->m_sb.sb_timedout = TRUE;
+      return FALSE;
+    default:
+      RTMP_Log(RTMP_LOGDEBUG, "%s, RTMP socket closed by peer", __FUNCTION__);
+      RTMP_Close(r);
+      return FALSE;
+    }
+}
+
+static int
+ReadPacket(RTMP *r, RTMPPacket *packet)
+{
+  uint8_t hbuf[RTMP_MAX_HEADER_SIZE] = { 0 };
+  char *header = (char *)hbuf;
+  int nSize, hSize, nToRead, nChunk;
+  int didAlloc = FALSE;
+  RTMPChunkState *cs;
+
+  RTMP_Log(RTMP_LOGDEBUG2, "%s: fd=%d", __FUNCTION__, r->m_sb.sb_socket);
+
+  if (ReadN(r, (char *)hbuf, 1) == 0)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, failed to read RTMP packet header", __FUNCTION__);
+      return FALSE;
+    }
+
+  packet->m_headerType = (hbuf[0] & 0xc0) >> 6;
+  packet->m_nChannel = (hbuf[0] & 0x3f);
+  header++;
+  if (packet->m_nChannel == 0)
+    {
+      if (ReadN(r, (char *)&hbuf[1], 1) != 1)
+	{
+	  RTMP_Log(RTMP_LOGERROR, "%s, failed to read RTMP packet header 2nd byte",
+	      __FUNCTION__);
+	  return FALSE;
+	}
+      packet->m_nChannel = hbuf[1];
+      packet->m_nChannel += 64;
+      header++;
+    }
+  else if (packet->m_nChannel == 1)
+    {
+      int tmp;
       if (ReadN(r, (char *)&hbuf[1], 2) != 2)
 	{
 	  RTMP_Log(RTMP_LOGERROR, "%s, failed to read RTMP packet header 3nd byte",
@@ -4043,34 +4798,27 @@ RTMP_ReadPacket(RTMP *r, RTMPPacket *packet)
 
   nSize = packetSize[packet->m_headerType];
 
-  if (packet->m_nChannel >= r->m_channelsAllocatedIn)
-    {
-      int n = packet->m_nChannel + 10;
-      int *timestamp = realloc(r->m_channelTimestamp, sizeof(int) * n);
-      RTMPPacket **packets = realloc(r->m_vecChannelsIn, sizeof(RTMPPacket*) * n);
-      if (!timestamp)
-        free(r->m_channelTimestamp);
-      if (!packets)
-        free(r->m_vecChannelsIn);
-      r->m_channelTimestamp = timestamp;
-      r->m_vecChannelsIn = packets;
-      if (!timestamp || !packets) {
-        r->m_channelsAllocatedIn = 0;
-        return FALSE;
-      }
-      memset(r->m_channelTimestamp + r->m_channelsAllocatedIn, 0, sizeof(int) * (n - r->m_channelsAllocatedIn));
-      memset(r->m_vecChannelsIn + r->m_channelsAllocatedIn, 0, sizeof(RTMPPacket*) * (n - r->m_channelsAllocatedIn));
-      r->m_channelsAllocatedIn = n;
+  cs = ChunkState(&r->m_chunksIn, packet->m_nChannel, TRUE);
+  if (!cs)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, no memory for chunk stream %d",
+	  __FUNCTION__, packet->m_nChannel);
+      return FALSE;
     }
 
   if (nSize == RTMP_LARGE_HEADER_SIZE)	/* if we get a full header the timestamp is absolute */
     packet->m_hasAbsTimestamp = TRUE;
 
-  else if (nSize < RTMP_LARGE_HEADER_SIZE)
+  else if (nSize < RTMP_LARGE_HEADER_SIZE && cs->bUsed)
     {				/* using values from the last message of this channel */
-      if (r->m_vecChannelsIn[packet->m_nChannel])
-	memcpy(packet, r->m_vecChannelsIn[packet->m_nChannel],
-	       sizeof(RTMPPacket));
+      packet->m_headerType = cs->headerType;
+      packet->m_packetType = cs->type;
+      packet->m_hasAbsTimestamp = cs->bAbsTimestamp;
+      packet->m_nTimeStamp = cs->timestamp;
+      packet->m_nInfoField2 = cs->streamId;
+      packet->m_nBodySize = cs->bodySize;
+      packet->m_nBytesRead = cs->bytesRead;
+      packet->m_body = cs->body;
     }
 
   nSize--;
@@ -4095,6 +4843,7 @@ RTMP_ReadPacket(RTMP *r, RTMPPacket *packet)
 	  packet->m_nBodySize = AMF_DecodeInt24(header + 3);
 	  packet->m_nBytesRead = 0;
 	  RTMPPacket_Free(packet);
+	  cs->body = NULL;
 
 	  if (nSize > 6)
 	    {
@@ -4126,6 +4875,7 @@ RTMP_ReadPacket(RTMP *r, RTMPPacket *packet)
 	  RTMP_Log(RTMP_LOGDEBUG, "%s, failed to allocate packet", __FUNCTION__);
 	  return FALSE;
 	}
+      r->m_stats.allocs++;
       didAlloc = TRUE;
       packet->m_headerType = (hbuf[0] & 0xc0) >> 6;
     }
@@ -4154,25 +4904,34 @@ RTMP_ReadPacket(RTMP *r, RTMPPacket *packet)
   RTMP_LogHexString(RTMP_LOGDEBUG2, (uint8_t *)packet->m_body + packet->m_nBytesRead, nChunk);
 
   packet->m_nBytesRead += nChunk;
-
-  /* keep the packet as ref for other packets on this channel */
-  if (!r->m_vecChannelsIn[packet->m_nChannel])
-    r->m_vecChannelsIn[packet->m_nChannel] = malloc(sizeof(RTMPPacket));
-  memcpy(r->m_vecChannelsIn[packet->m_nChannel], packet, sizeof(RTMPPacket));
+  r->m_stats.chunksIn[STATS_TYPE(packet->m_packetType)]++;
+
+  /* keep the header as ref for other packets on this channel */
+  cs->headerType = packet->m_headerType;
+  cs->type = packet->m_packetType;
+  cs->bAbsTimestamp = packet->m_hasAbsTimestamp;
+  cs->timestamp = packet->m_nTimeStamp;
+  cs->streamId = packet->m_nInfoField2;
+  cs->bodySize = packet->m_nBodySize;
+  cs->bytesRead = packet->m_nBytesRead;
+  cs->body = packet->m_body;
+  cs->bUsed = TRUE;
 
   if (RTMPPacket_IsReady(packet))
     {
+      r->m_stats.msgsIn[STATS_TYPE(packet->m_packetType)]++;
+
       /* make packet's timestamp absolute */
       if (!packet->m_hasAbsTimestamp)
-	packet->m_nTimeStamp += r->m_channelTimestamp[packet->m_nChannel];	/* timestamps seem to be always relative!! */
+	packet->m_nTimeStamp += cs->absTime;	/* timestamps seem to be always relative!! */
 
-      r->m_channelTimestamp[packet->m_nChannel] = packet->m_nTimeStamp;
+      cs->absTime = packet->m_nTimeStamp;
 
       /* reset the data from the stored packet. we keep the header since we may use it later if a new packet for this channel */
       /* arrives and requests to re-use some info (small packet header) */
-      r->m_vecChannelsIn[packet->m_nChannel]->m_body = NULL;
-      r->m_vecChannelsIn[packet->m_nChannel]->m_nBytesRead = 0;
-      r->m_vecChannelsIn[packet->m_nChannel]->m_hasAbsTimestamp = FALSE;	/* can only be false if we reuse header */
+      cs->body = NULL;
+      cs->bytesRead = 0;
+      cs->bAbsTimestamp = FALSE;	/* can only be false if we reuse header */
     }
   else
     {
@@ -4257,14 +5016,35 @@ HandShake(RTMP *r, int FP9HandShake)
   return TRUE;
 }
 
+typedef struct SHandShakeState
+{
+  char serverbuf[RTMP_SIG_SIZE + 1];
+} SHandShakeState;
+
+static void
+SHandShakeFree(RTMP *r)
+{
+  free(r->m_serveHS);
+  r->m_serveHS = NULL;
+}
+
+/* read C0 and C1, answer with S0, S1 and S2 */
 static int
-SHandShake(RTMP *r)
+SHandShake0(RTMP *r)
 {
   int i;
-  char serverbuf[RTMP_SIG_SIZE + 1], *serversig = serverbuf + 1;
+  SHandShakeState *hs;
+  char *serverbuf, *serversig;
   char clientsig[RTMP_SIG_SIZE];
   uint32_t uptime;
-  int bMatch;
+
+  SHandShakeFree(r);
+  hs = malloc(sizeof(SHandShakeState));
+  if (!hs)
+    return FALSE;
+  r->m_serveHS = hs;
+  serverbuf = hs->serverbuf;
+  serversig = serverbuf + 1;
 
   if (ReadN(r, serverbuf, 1) != 1)	/* 0x03 or 0x06 */
     return FALSE;
@@ -4290,9 +5070,6 @@ SHandShake(RTMP *r)
     serversig[i] = (char)(rand() % 256);
 #endif
 
-  if (!WriteN(r, serverbuf, RTMP_SIG_SIZE + 1))
-    return FALSE;
-
   if (ReadN(r, clientsig, RTMP_SIG_SIZE) != RTMP_SIG_SIZE)
     return FALSE;
 
@@ -4305,20 +5082,44 @@ SHandShake(RTMP *r)
   RTMP_Log(RTMP_LOGDEBUG, "%s: Player Version: %d.%d.%d.%d", __FUNCTION__,
       clientsig[4], clientsig[5], clientsig[6], clientsig[7]);
 
+  /* S0, S1 and S2 go out together */
+  if (!WriteN(r, serverbuf, RTMP_SIG_SIZE + 1))
+    return FALSE;
+
   /* 2nd part of handshake */
   if (!WriteN(r, clientsig, RTMP_SIG_SIZE))
     return FALSE;
+  return TRUE;
+}
+
+/* read and check C2 */
+static int
+SHandShake1(RTMP *r)
+{
+  SHandShakeState *hs = r->m_serveHS;
+  char clientsig[RTMP_SIG_SIZE];
+  int bMatch;
+
+  if (!hs)
+    return FALSE;
 
   if (ReadN(r, clientsig, RTMP_SIG_SIZE) != RTMP_SIG_SIZE)
     return FALSE;
 
-  bMatch = (memcmp(serversig, clientsig, RTMP_SIG_SIZE) == 0);
+  bMatch = (memcmp(hs->serverbuf + 1, clientsig, RTMP_SIG_SIZE) == 0);
   if (!bMatch)
     {
       RTMP_Log(RTMP_LOGWARNING, "%s, client signature does not match!", __FUNCTION__);
     }
+  SHandShakeFree(r);
   return TRUE;
 }
+
+static int
+SHandShake(RTMP *r)
+{
+  return SHandShake0(r) && SHandShake1(r);
+}
 #endif
 
 int
@@ -4345,88 +5146,63 @@ RTMP_SendChunk(RTMP *r, RTMPChunk *chunk)
   return wrote;
 }
 
-int
-RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
+/* Encode the first chunk header of packet into hbuf, which must hold
+ * RTMP_MAX_HEADER_SIZE bytes, compressing it against the last packet sent
+ * on the same channel. *cSizep gets the number of extra channel id bytes.
+ * Returns the header length, 0 on failure.
+ */
+static int
+EncodeChunkHeader(RTMP *r, RTMPPacket *packet, char *hbuf, int *cSizep)
 {
-  const RTMPPacket *prevPacket;
+  const RTMPChunkState *prev;
   uint32_t last = 0;
-  int nSize;
-  int hSize, cSize;
-  char *header, *hptr, *hend, hbuf[RTMP_MAX_HEADER_SIZE], c;
+  int nSize, hSize, cSize;
+  char *hptr, *hend = hbuf + RTMP_MAX_HEADER_SIZE, c;
   uint32_t t;
-  char *buffer, *tbuf = NULL, *toff = NULL;
-  int nChunkSize;
-  int tlen;
 
-  if (packet->m_nChannel >= r->m_channelsAllocatedOut)
+  prev = ChunkState(&r->m_chunksOut, packet->m_nChannel, TRUE);
+  if (!prev)
     {
-      int n = packet->m_nChannel + 10;
-      RTMPPacket **packets = realloc(r->m_vecChannelsOut, sizeof(RTMPPacket*) * n);
-      if (!packets) {
-        free(r->m_vecChannelsOut);
-        r->m_vecChannelsOut = NULL;
-        r->m_channelsAllocatedOut = 0;
-        return FALSE;
-      }
-      r->m_vecChannelsOut = packets;
-      memset(r->m_vecChannelsOut + r->m_channelsAllocatedOut, 0, sizeof(RTMPPacket*) * (n - r->m_channelsAllocatedOut));
-      r->m_channelsAllocatedOut = n;
+      RTMP_Log(RTMP_LOGERROR, "%s, no memory for chunk stream %d",
+	  __FUNCTION__, packet->m_nChannel);
+      return 0;
     }
 
-  prevPacket = r->m_vecChannelsOut[packet->m_nChannel];
-  if (prevPacket && packet->m_headerType != RTMP_PACKET_SIZE_LARGE)
+  if (prev->bUsed && packet->m_headerType != RTMP_PACKET_SIZE_LARGE)
     {
       /* compress a bit by using the prev packet's attributes */
-      if (prevPacket->m_nBodySize == packet->m_nBodySize
-	  && prevPacket->m_packetType == packet->m_packetType
+      if (prev->bodySize == packet->m_nBodySize
+	  && prev->type == packet->m_packetType
 	  && packet->m_headerType == RTMP_PACKET_SIZE_MEDIUM)
 	packet->m_headerType = RTMP_PACKET_SIZE_SMALL;
 
-      if (prevPacket->m_nTimeStamp == packet->m_nTimeStamp
+      if (prev->timestamp == packet->m_nTimeStamp
 	  && packet->m_headerType == RTMP_PACKET_SIZE_SMALL)
 	packet->m_headerType = RTMP_PACKET_SIZE_MINIMUM;
-      last = prevPacket->m_nTimeStamp;
+      last = prev->timestamp;
     }
 
   if (packet->m_headerType > 3)	/* sanity */
     {
       RTMP_Log(RTMP_LOGERROR, "sanity failed!! trying to send header of type: 0x%02x.",
 	  (unsigned char)packet->m_headerType);
-      return FALSE;
+      return 0;
     }
 
   nSize = packetSize[packet->m_headerType];
   hSize = nSize; cSize = 0;
   t = packet->m_nTimeStamp - last;
 
-  if (packet->m_body)
-    {
-      header = packet->m_body - nSize;
-      hend = packet->m_body;
-    }
-  else
-    {
-      header = hbuf + 6;
-      hend = hbuf + sizeof(hbuf);
-    }
-
   if (packet->m_nChannel > 319)
     cSize = 2;
   else if (packet->m_nChannel > 63)
     cSize = 1;
-  if (cSize)
-    {
-      header -= cSize;
-      hSize += cSize;
-    }
+  hSize += cSize;
 
   if (nSize > 1 && t >= 0xffffff)
-    {
-      header -= 4;
-      hSize += 4;
-    }
+    hSize += 4;
 
-  hptr = header;
+  hptr = hbuf;
   c = packet->m_headerType << 6;
   switch (cSize)
     {
@@ -4465,6 +5241,36 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
   if (nSize > 1 && t >= 0xffffff)
     hptr = AMF_EncodeInt32(hptr, hend, t);
 
+  *cSizep = cSize;
+  return hSize;
+}
+
+int
+RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
+{
+  int nSize;
+  int hSize, cSize;
+  char *header, hbuf[RTMP_MAX_HEADER_SIZE], c;
+  char *buffer, *tbuf = NULL, *toff = NULL;
+  int nChunkSize;
+  int tlen;
+
+  hSize = EncodeChunkHeader(r, packet, hbuf, &cSize);
+  if (!hSize)
+    return FALSE;
+  c = hbuf[0];
+
+  /* the header goes right in front of the body if there is one */
+  if (packet->m_body)
+    {
+      header = packet->m_body - hSize;
+      memcpy(header, hbuf, hSize);
+    }
+  else
+    {
+      header = hbuf;
+    }
+
   nSize = packet->m_nBodySize;
   buffer = packet->m_body;
   nChunkSize = r->m_outChunkSize;
@@ -4481,6 +5287,7 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
 	  tbuf = malloc(tlen);
 	  if (!tbuf)
 	    return FALSE;
+	  r->m_stats.allocs++;
 	  toff = tbuf;
 	}
     }
@@ -4496,6 +5303,7 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
       if (tbuf)
         {
 	  memcpy(toff, header, nChunkSize + hSize);
+	  r->m_stats.bytesCopied += nChunkSize + hSize;
 	  toff += nChunkSize + hSize;
 	}
       else
@@ -4553,9 +5361,7 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
       }
     }
 
-  if (!r->m_vecChannelsOut[packet->m_nChannel])
-    r->m_vecChannelsOut[packet->m_nChannel] = malloc(sizeof(RTMPPacket));
-  memcpy(r->m_vecChannelsOut[packet->m_nChannel], packet, sizeof(RTMPPacket));
+  ChunkSent(r, packet);
   return TRUE;
 }
 
@@ -4565,9 +5371,22 @@ RTMP_Serve(RTMP *r)
   return SHandShake(r);
 }
 
+int
+RTMP_Serve0(RTMP *r)
+{
+  return SHandShake0(r);
+}
+
+int
+RTMP_Serve1(RTMP *r)
+{
+  return SHandShake1(r);
+}
+
 void
 RTMP_Close(RTMP *r)
 {
+  RTMPStream *s;
   int i;
 
   if (RTMP_IsConnected(r))
@@ -4580,6 +5399,9 @@ RTMP_Close(RTMP *r)
 	    SendFCUnpublish(r);
 	  SendDeleteStream(r, i);
 	}
+      for (s = r->m_streams; s; s = s->next)
+	if (s->id > 0)
+	  SendDeleteStream(r, s->id);
       if (r->m_clientID.av_val)
         {
 	  HTTP_Post(r, RTMPT_CLOSE, "", 1);
@@ -4593,6 +5415,16 @@ RTMP_Close(RTMP *r)
   r->m_stream_id = -1;
   r->m_sb.sb_socket = -1;
   r->m_nBWCheckCounter = 0;
+
+  /* added streams are played again after a reconnect */
+  for (s = r->m_streams; s; s = s->next)
+    {
+      s->id = 0;
+      s->txn = 0;
+      if (s->state < RTMP_STREAM_DONE)
+	s->state = RTMP_STREAM_CREATING;
+    }
+
   r->m_nBytesIn = 0;
   r->m_nBytesInSent = 0;
 
@@ -4610,31 +5442,8 @@ RTMP_Close(RTMP *r)
   r->m_write.m_nBytesRead = 0;
   RTMPPacket_Free(&r->m_write);
 
-  for (i = 0; i < r->m_channelsAllocatedIn; i++)
-    {
-      if (r->m_vecChannelsIn[i])
-	{
-	  RTMPPacket_Free(r->m_vecChannelsIn[i]);
-	  free(r->m_vecChannelsIn[i]);
-	  r->m_vecChannelsIn[i] = NULL;
-	}
-    }
-  free(r->m_vecChannelsIn);
-  r->m_vecChannelsIn = NULL;
-  free(r->m_channelTimestamp);
-  r->m_channelTimestamp = NULL;
-  r->m_channelsAllocatedIn = 0;
-  for (i = 0; i < r->m_channelsAllocatedOut; i++)
-    {
-      if (r->m_vecChannelsOut[i])
-	{
-	  free(r->m_vecChannelsOut[i]);
-	  r->m_vecChannelsOut[i] = NULL;
-	}
-    }
-  free(r->m_vecChannelsOut);
-  r->m_vecChannelsOut = NULL;
-  r->m_channelsAllocatedOut = 0;
+  ChunkMapReset(&r->m_chunksIn);
+  ChunkMapReset(&r->m_chunksOut);
   AV_clear(r->m_methodCalls, r->m_numCalls);
   r->m_methodCalls = NULL;
   r->m_numCalls = 0;
@@ -4643,6 +5452,22 @@ RTMP_Close(RTMP *r)
   r->m_bPlaying = FALSE;
   r->m_sb.sb_size = 0;
 
+  r->m_bNonBlock = FALSE;
+  r->m_nPlain = 0;
+  free(r->m_chunkBuf);
+  r->m_chunkBuf = NULL;
+  r->m_chunkLen = 0;
+  r->m_chunkNeed = 0;
+  SHandShakeFree(r);
+  free(r->m_outBuf);
+  r->m_outBuf = NULL;
+  r->m_outStart = 0;
+  r->m_outLen = 0;
+  r->m_outSize = 0;
+  /* a new connection starts over with the default */
+  r->m_inChunkSize = RTMP_DEFAULT_CHUNKSIZE;
+  r->m_outChunkSize = RTMP_DEFAULT_CHUNKSIZE;
+
   r->m_msgCounter = 0;
   r->m_resplen = 0;
   r->m_unackd = 0;
@@ -4699,7 +5524,7 @@ RTMPSockBuf_Fill(RTMPSockBuf *sb)
    * available buffer */
   if (sb->sb_start != sb->sb_buf)
     {
-      memcpy(sb->sb_buf, sb->sb_start, sb->sb_size);
+      memmove(sb->sb_buf, sb->sb_start, sb->sb_size);
       sb->sb_start = sb->sb_buf;
     }
 
@@ -4730,7 +5555,7 @@ RTMPSockBuf_Fill(RTMPSockBuf *sb)
 	  if (sockerr == EINTR && !RTMP_ctrlC)
 	    continue;
 
-	  if (sockerr == EWOULDBLOCK || sockerr == EAGAIN)
+	  if (sockerr == EWOULDBLOCK || sockerr == EAGAIN || WouldBlock(sockerr))
 	    {
 	      sb->sb_timedout = TRUE;
 	      nBytes = 0;
@@ -4866,8 +5691,8 @@ HTTP_Post(RTMP *r, RTMPTCmd cmd, const char *buf, int len)
                       r->m_clientID.av_val ? r->m_clientID.av_val : "",
                       r->m_msgCounter, r->Link.hostname.av_len, r->Link.hostname.av_val,
                       r->Link.port, len);
-  RTMPSockBuf_Send(&r->m_sb, hbuf, hlen);
-  hlen = RTMPSockBuf_Send(&r->m_sb, buf, len);
+  SockSend(r, hbuf, hlen);
+  hlen = SockSend(r, buf, len);
   r->m_msgCounter++;
   return hlen;
 }
@@ -4879,7 +5704,7 @@ HTTP_read(RTMP *r, int fill)
   int hlen;
 
   if (fill)
-    RTMPSockBuf_Fill(&r->m_sb);
+    SockFill(r);
 
   /* Check if socket buffer is empty or HTTP header isn't completely received */
   memset(r->m_sb.sb_start + r->m_sb.sb_size, '\0', 1);
@@ -4917,7 +5742,7 @@ HTTP_read(RTMP *r, int fill)
   /* Refill buffer if no payload is received */
   if (hlen && (!r->m_sb.sb_size))
     {
-      RTMPSockBuf_Fill(&r->m_sb);
+      SockFill(r);
       ptr = r->m_sb.sb_buf;
       r->m_sb.sb_start = ptr;
     }
@@ -4952,27 +5777,24 @@ HTTP_read(RTMP *r, int fill)
 
 #define MAX_IGNORED_FRAMES	100
 
-/* Read from the stream until we get a media packet.
+/* Read from the stream until we get a media packet and run it through
+ * the resume checks.
  * Returns -3 if Play.Close/Stop, -2 if fatal error, -1 if no more media
- * packets, 0 if ignorable error, >0 if there is a media packet
+ * packets, 0 if ignorable error, 1 if there is a media packet. Its data
+ * starts at *body, past anything the resume checks skipped, and the
+ * caller has to free the packet.
  */
 static int
-Read_1_Packet(RTMP *r, char *buf, unsigned int buflen)
+GetMediaPacket(RTMP *r, RTMPPacket *packet, char **body,
+	       unsigned int *bodySize)
 {
-  uint32_t prevTagSize = 0;
   int rtnGetNextMediaPacket = 0, ret = RTMP_READ_EOF;
-  RTMPPacket packet = { 0 };
-  int recopy = FALSE;
-  unsigned int size;
-  char *ptr, *pend;
-  uint32_t nTimeStamp = 0;
-  unsigned int len;
 
-  rtnGetNextMediaPacket = RTMP_GetNextMediaPacket(r, &packet);
+  rtnGetNextMediaPacket = RTMP_GetNextMediaPacket(r, packet);
   while (rtnGetNextMediaPacket)
     {
-      char *packetBody = packet.m_body;
-      unsigned int nPacketLen = packet.m_nBodySize;
+      char *packetBody = packet->m_body;
+      unsigned int nPacketLen = packet->m_nBodySize;
 
       /* Return RTMP_READ_COMPLETE if this was completed nicely with
        * invoke message Play.Stop or Play.Complete
@@ -4986,17 +5808,17 @@ Read_1_Packet(RTMP *r, char *buf, unsigned int buflen)
 	  break;
 	}
 
-      r->m_read.dataType |= (((packet.m_packetType == RTMP_PACKET_TYPE_AUDIO) << 2) |
-			     (packet.m_packetType == RTMP_PACKET_TYPE_VIDEO));
+      r->m_read.dataType |= (((packet->m_packetType == RTMP_PACKET_TYPE_AUDIO) << 2) |
+			     (packet->m_packetType == RTMP_PACKET_TYPE_VIDEO));
 
-      if (packet.m_packetType == RTMP_PACKET_TYPE_VIDEO && nPacketLen <= 5)
+      if (packet->m_packetType == RTMP_PACKET_TYPE_VIDEO && nPacketLen <= 5)
 	{
 	  RTMP_Log(RTMP_LOGDEBUG, "ignoring too small video packet: size: %d",
 	      nPacketLen);
 	  ret = RTMP_READ_IGNORE;
 	  break;
 	}
-      if (packet.m_packetType == RTMP_PACKET_TYPE_AUDIO && nPacketLen <= 1)
+      if (packet->m_packetType == RTMP_PACKET_TYPE_AUDIO && nPacketLen <= 1)
 	{
 	  RTMP_Log(RTMP_LOGDEBUG, "ignoring too small audio packet: size: %d",
 	      nPacketLen);
@@ -5011,23 +5833,23 @@ Read_1_Packet(RTMP *r, char *buf, unsigned int buflen)
 	}
 #ifdef _DEBUG
       RTMP_Log(RTMP_LOGDEBUG, "type: %02X, size: %d, TS: %d ms, abs TS: %d",
-	  packet.m_packetType, nPacketLen, packet.m_nTimeStamp,
-	  packet.m_hasAbsTimestamp);
-      if (packet.m_packetType == RTMP_PACKET_TYPE_VIDEO)
+	  packet->m_packetType, nPacketLen, packet->m_nTimeStamp,
+	  packet->m_hasAbsTimestamp);
+      if (packet->m_packetType == RTMP_PACKET_TYPE_VIDEO)
 	RTMP_Log(RTMP_LOGDEBUG, "frametype: %02X", (*packetBody & 0xf0));
 #endif
 
       if (r->m_read.flags & RTMP_READ_RESUME)
         {
           RTMP_Log(RTMP_LOGDEBUG2, "Received timestamp: %d, type %d",
-                   packet.m_nTimeStamp, packet.m_packetType);
-          if (packet.m_nTimeStamp > 0 && r->m_read.nResumeDriftTS > 0)
-            packet.m_nTimeStamp -= r->m_read.nResumeDriftTS;
-          RTMP_Log(RTMP_LOGDEBUG2, "Adjusted timestamp: %d", packet.m_nTimeStamp);
+                   packet->m_nTimeStamp, packet->m_packetType);
+          if (packet->m_nTimeStamp > 0 && r->m_read.nResumeDriftTS > 0)
+            packet->m_nTimeStamp -= r->m_read.nResumeDriftTS;
+          RTMP_Log(RTMP_LOGDEBUG2, "Adjusted timestamp: %d", packet->m_nTimeStamp);
 
           /* check the header if we get one */
           if (r->m_read.nMetaHeaderSize > 0
-              && packet.m_packetType == RTMP_PACKET_TYPE_INFO)
+              && packet->m_packetType == RTMP_PACKET_TYPE_INFO)
             {
               AMFObject metaObj;
               int nRes = AMF_Decode(&metaObj, packetBody, nPacketLen, FALSE);
@@ -5059,7 +5881,7 @@ Read_1_Packet(RTMP *r, char *buf, unsigned int buflen)
           if (r->m_read.nInitialFrameSize > 0)
             {
               /* video or audio data */
-              if (packet.m_packetType == r->m_read.initialFrameType
+              if (packet->m_packetType == r->m_read.initialFrameType
                   && r->m_read.nInitialFrameSize == nPacketLen)
                 {
                   /* we don't compare the sizes since the packet can
@@ -5073,7 +5895,7 @@ Read_1_Packet(RTMP *r, char *buf, unsigned int buflen)
                     {
                       RTMP_Log(RTMP_LOGDEBUG, "Checked keyframe successfully!");
                       r->m_read.flags |= RTMP_READ_GOTKF;
-                      r->m_read.nResumeDriftTS = packet.m_nTimeStamp;
+                      r->m_read.nResumeDriftTS = packet->m_nTimeStamp;
                       /* ignore it! (what about audio data after it? it is
                        * handled by ignoring all 0ms frames, see below)
                        */
@@ -5087,7 +5909,7 @@ Read_1_Packet(RTMP *r, char *buf, unsigned int buflen)
                * in the first FLV stream chunk and we have to compare
                * it and filter it out !!
                */
-              if (packet.m_packetType == RTMP_PACKET_TYPE_FLASH_VIDEO)
+              if (packet->m_packetType == RTMP_PACKET_TYPE_FLASH_VIDEO)
                 {
                   /* basically we have to find the keyframe with the
                    * correct TS being nResumeTS
@@ -5169,7 +5991,7 @@ Read_1_Packet(RTMP *r, char *buf, unsigned int buflen)
                 }
             }
 
-	  if (packet.m_nTimeStamp > 0
+	  if (packet->m_nTimeStamp > 0
 	      && (r->m_read.flags & (RTMP_READ_GOTKF|RTMP_READ_GOTFLVK)))
 	    {
 	      /* another problem is that the server can actually change from
@@ -5190,7 +6012,7 @@ Read_1_Packet(RTMP *r, char *buf, unsigned int buflen)
 	   * (seeking might put us somewhere before it)
 	   */
 	  if (!(r->m_read.flags & RTMP_READ_GOTKF) &&
-	  	packet.m_packetType != RTMP_PACKET_TYPE_FLASH_VIDEO)
+	  	packet->m_packetType != RTMP_PACKET_TYPE_FLASH_VIDEO)
 	    {
 	      RTMP_Log(RTMP_LOGWARNING,
 		  "Stream does not start with requested frame, ignoring data... ");
@@ -5203,7 +6025,7 @@ Read_1_Packet(RTMP *r, char *buf, unsigned int buflen)
 	    }
 	  /* ok, do the same for FLV streams */
 	  if (!(r->m_read.flags & RTMP_READ_GOTFLVK) &&
-	  	packet.m_packetType == RTMP_PACKET_TYPE_FLASH_VIDEO)
+	  	packet->m_packetType == RTMP_PACKET_TYPE_FLASH_VIDEO)
 	    {
 	      RTMP_Log(RTMP_LOGWARNING,
 		  "Stream does not start with requested FLV frame, ignoring data... ");
@@ -5222,12 +6044,12 @@ Read_1_Packet(RTMP *r, char *buf, unsigned int buflen)
 	   * the preceding if clause)
 	   */
 	  if (!(r->m_read.flags & RTMP_READ_NO_IGNORE) &&
-	  	packet.m_packetType != RTMP_PACKET_TYPE_FLASH_VIDEO)
+	  	packet->m_packetType != RTMP_PACKET_TYPE_FLASH_VIDEO)
 	    {
               /* exclude type RTMP_PACKET_TYPE_FLASH_VIDEO since it can
                * contain several FLV packets
                */
-	      if (packet.m_nTimeStamp == 0)
+	      if (packet->m_nTimeStamp == 0)
 		{
 		  ret = RTMP_READ_IGNORE;
 		  break;
@@ -5240,6 +6062,125 @@ Read_1_Packet(RTMP *r, char *buf, unsigned int buflen)
 	    }
 	}
 
+      *body = packetBody;
+      *bodySize = nPacketLen;
+      ret = 1;
+      break;
+    }
+
+  /* a non-blocking socket just has nothing complete yet */
+  if (!rtnGetNextMediaPacket && r->m_bNonBlock && r->m_sb.sb_timedout
+      && RTMP_IsConnected(r))
+    ret = RTMP_READ_IGNORE;
+
+  if (ret <= 0 && rtnGetNextMediaPacket)
+    RTMPPacket_Free(packet);
+  return ret;
+}
+
+/* Shift the timestamps of the FLV tags in an aggregate packet to our
+ * timeline and fix inconsistent tag sizes, reading from packetBody and
+ * writing to ptr, which may be the same. Returns the offset at which the
+ * missing tag size of a cut off last tag belongs, 0 if there's none.
+ */
+static unsigned int
+FixFLVTags(RTMP *r, RTMPPacket *packet, const char *packetBody,
+	   unsigned int nPacketLen, char *ptr, char *pend,
+	   uint32_t *nTimeStamp, uint32_t *prevTagSize)
+{
+  unsigned int pos = 0, append = 0;
+  int delta;
+
+  /* grab first timestamp and see if it needs fixing */
+  *nTimeStamp = AMF_DecodeInt24(packetBody + 4);
+  *nTimeStamp |= (packetBody[7] << 24);
+  delta = packet->m_nTimeStamp - *nTimeStamp + r->m_read.nResumeTS;
+
+  while (pos + 11 < nPacketLen)
+    {
+      /* size without header (11) and without prevTagSize (4) */
+      uint32_t dataSize = AMF_DecodeInt24(packetBody + pos + 1);
+      *nTimeStamp = AMF_DecodeInt24(packetBody + pos + 4);
+      *nTimeStamp |= (packetBody[pos + 7] << 24);
+
+      if (delta)
+	{
+	  *nTimeStamp += delta;
+	  AMF_EncodeInt24(ptr+pos+4, pend, *nTimeStamp);
+	  ptr[pos+7] = *nTimeStamp>>24;
+	}
+
+      /* set data type */
+      r->m_read.dataType |= (((*(packetBody + pos) == 0x08) << 2) |
+			     (*(packetBody + pos) == 0x09));
+
+      if (pos + 11 + dataSize + 4 > nPacketLen)
+	{
+	  if (pos + 11 + dataSize > nPacketLen)
+	    {
+	      RTMP_Log(RTMP_LOGERROR,
+		  "Wrong data size (%u), stream corrupted, aborting!",
+		  dataSize);
+	      break;
+	    }
+	  RTMP_Log(RTMP_LOGWARNING, "No tagSize found, appending!");
+
+	  /* we have to append a last tagSize! */
+	  *prevTagSize = dataSize + 11;
+	  append = pos + 11 + dataSize;
+	}
+      else
+	{
+	  *prevTagSize =
+	    AMF_DecodeInt32(packetBody + pos + 11 + dataSize);
+
+#ifdef _DEBUG
+	  RTMP_Log(RTMP_LOGDEBUG,
+	      "FLV Packet: type %02X, dataSize: %lu, tagSize: %lu, timeStamp: %lu ms",
+	      (unsigned char)packetBody[pos], dataSize, *prevTagSize,
+	      *nTimeStamp);
+#endif
+
+	  if (*prevTagSize != (dataSize + 11))
+	    {
+#ifdef _DEBUG
+	      RTMP_Log(RTMP_LOGWARNING,
+		  "Tag and data size are not consitent, writing tag size according to dataSize+11: %d",
+		  dataSize + 11);
+#endif
+
+	      *prevTagSize = dataSize + 11;
+	      AMF_EncodeInt32(ptr + pos + 11 + dataSize, pend,
+			      *prevTagSize);
+	    }
+	}
+
+      pos += *prevTagSize + 4;	/*(11+dataSize+4); */
+    }
+  return append;
+}
+
+/* Read from the stream until we get a media packet.
+ * Returns -3 if Play.Close/Stop, -2 if fatal error, -1 if no more media
+ * packets, 0 if ignorable error, >0 if there is a media packet
+ */
+static int
+Read_1_Packet(RTMP *r, char *buf, unsigned int buflen)
+{
+  uint32_t prevTagSize = 0;
+  int ret;
+  RTMPPacket packet = { 0 };
+  int recopy = FALSE;
+  unsigned int size;
+  char *ptr, *pend;
+  uint32_t nTimeStamp = 0;
+  unsigned int len;
+  char *packetBody;
+  unsigned int nPacketLen;
+
+  ret = GetMediaPacket(r, &packet, &packetBody, &nPacketLen);
+  while (ret > 0)
+    {
       /* calculate packet size and allocate slop buffer if necessary */
       size = nPacketLen +
 	((packet.m_packetType == RTMP_PACKET_TYPE_AUDIO
@@ -5258,6 +6199,7 @@ Read_1_Packet(RTMP *r, char *buf, unsigned int buflen)
 	      ret = RTMP_READ_ERROR;		/* fatal error */
 	      break;
 	    }
+	  r->m_stats.allocs++;
 	  recopy = TRUE;
 	  ptr = r->m_read.buf;
 	}
@@ -5310,83 +6252,20 @@ Read_1_Packet(RTMP *r, char *buf, unsigned int buflen)
 	}
 
       memcpy(ptr, packetBody, nPacketLen);
+      r->m_stats.bytesCopied += nPacketLen;
       len = nPacketLen;
 
       /* correct tagSize and obtain timestamp if we have an FLV stream */
       if (packet.m_packetType == RTMP_PACKET_TYPE_FLASH_VIDEO)
 	{
-	  unsigned int pos = 0;
-	  int delta;
-
-	  /* grab first timestamp and see if it needs fixing */
-	  nTimeStamp = AMF_DecodeInt24(packetBody + 4);
-	  nTimeStamp |= (packetBody[7] << 24);
-	  delta = packet.m_nTimeStamp - nTimeStamp + r->m_read.nResumeTS;
-
-	  while (pos + 11 < nPacketLen)
+	  unsigned int append = FixFLVTags(r, &packet, packetBody, nPacketLen,
+					   ptr, pend, &nTimeStamp,
+					   &prevTagSize);
+	  if (append)
 	    {
-	      /* size without header (11) and without prevTagSize (4) */
-	      uint32_t dataSize = AMF_DecodeInt24(packetBody + pos + 1);
-	      nTimeStamp = AMF_DecodeInt24(packetBody + pos + 4);
-	      nTimeStamp |= (packetBody[pos + 7] << 24);
-
-	      if (delta)
-		{
-		  nTimeStamp += delta;
-		  AMF_EncodeInt24(ptr+pos+4, pend, nTimeStamp);
-		  ptr[pos+7] = nTimeStamp>>24;
-		}
-
-	      /* set data type */
-	      r->m_read.dataType |= (((*(packetBody + pos) == 0x08) << 2) |
-				     (*(packetBody + pos) == 0x09));
-
-	      if (pos + 11 + dataSize + 4 > nPacketLen)
-		{
-		  if (pos + 11 + dataSize > nPacketLen)
-		    {
-		      RTMP_Log(RTMP_LOGERROR,
-			  "Wrong data size (%u), stream corrupted, aborting!",
-			  dataSize);
-		      ret = RTMP_READ_ERROR;
-		      break;
-		    }
-		  RTMP_Log(RTMP_LOGWARNING, "No tagSize found, appending!");
-
-		  /* we have to append a last tagSize! */
-		  prevTagSize = dataSize + 11;
-		  AMF_EncodeInt32(ptr + pos + 11 + dataSize, pend,
-				  prevTagSize);
-		  size += 4;
-		  len += 4;
-		}
-	      else
-		{
-		  prevTagSize =
-		    AMF_DecodeInt32(packetBody + pos + 11 + dataSize);
-
-#ifdef _DEBUG
-		  RTMP_Log(RTMP_LOGDEBUG,
-		      "FLV Packet: type %02X, dataSize: %lu, tagSize: %lu, timeStamp: %lu ms",
-		      (unsigned char)packetBody[pos], dataSize, prevTagSize,
-		      nTimeStamp);
-#endif
-
-		  if (prevTagSize != (dataSize + 11))
-		    {
-#ifdef _DEBUG
-		      RTMP_Log(RTMP_LOGWARNING,
-			  "Tag and data size are not consitent, writing tag size according to dataSize+11: %d",
-			  dataSize + 11);
-#endif
-
-		      prevTagSize = dataSize + 11;
-		      AMF_EncodeInt32(ptr + pos + 11 + dataSize, pend,
-				      prevTagSize);
-		    }
-		}
-
-	      pos += prevTagSize + 4;	/*(11+dataSize+4); */
+	      AMF_EncodeInt32(ptr + append, pend, prevTagSize);
+	      size += 4;
+	      len += 4;
 	    }
 	}
       ptr += len;
@@ -5408,13 +6287,13 @@ Read_1_Packet(RTMP *r, char *buf, unsigned int buflen)
       break;
     }
 
-  if (rtnGetNextMediaPacket)
-    RTMPPacket_Free(&packet);
+  RTMPPacket_Free(&packet);
 
   if (recopy)
     {
       len = ret > buflen ? buflen : ret;
       memcpy(buf, r->m_read.buf, len);
+      r->m_stats.bytesCopied += len;
       r->m_read.bufpos = r->m_read.buf + len;
       r->m_read.buflen = ret - len;
     }
@@ -5427,6 +6306,30 @@ static const char flvHeader[] = { 'F', 'L', 'V', 0x01,
   0x00, 0x00, 0x00, 0x00
 };
 
+/* Is there input that can be read without waiting for the network?
+ * Only looks at the start of the next packet, the rest of it may still
+ * be in flight.
+ */
+int
+RTMP_ReadPending(RTMP *r)
+{
+  struct pollfd pfd;
+
+  if (r->m_sb.sb_size > 0)
+    return TRUE;
+  if (r->m_sb.sb_socket == -1)
+    return FALSE;
+  /* RTMPT would have to send a poll first */
+  if ((r->Link.protocol & RTMP_FEATURE_HTTP) && !r->m_resplen)
+    return FALSE;
+
+  /* not select, the socket may be past FD_SETSIZE */
+  pfd.fd = r->m_sb.sb_socket;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  return poll(&pfd, 1, 0) > 0;
+}
+
 #define HEADERBUF	(1024*1024)
 int
 RTMP_Read(RTMP *r, char *buf, int size)
@@ -5451,17 +6354,27 @@ fail:
     {
       if (!(r->m_read.flags & RTMP_READ_RESUME))
 	{
-	  char *mybuf = malloc(HEADERBUF), *end = mybuf + HEADERBUF;
+	  int bufsize = r->m_read.hdrBufSize > 0 ? r->m_read.hdrBufSize
+	    : HEADERBUF;
+	  char *mybuf, *end;
 	  int cnt = 0;
+
+	  /* nothing to wait for, the header goes out by itself */
+	  if (r->m_read.hdrMode == RTMP_HDR_BOTH)
+	    bufsize = 0;
+	  bufsize += sizeof(flvHeader);
+	  mybuf = malloc(bufsize);
+	  end = mybuf + bufsize;
 	  r->m_read.buf = mybuf;
-	  r->m_read.buflen = HEADERBUF;
+	  r->m_read.buflen = bufsize;
 
 	  memcpy(mybuf, flvHeader, sizeof(flvHeader));
 	  r->m_read.buf += sizeof(flvHeader);
 	  r->m_read.buflen -= sizeof(flvHeader);
 	  cnt += sizeof(flvHeader);
 
-	  while (r->m_read.timestamp == 0)
+	  while (r->m_read.hdrMode != RTMP_HDR_BOTH
+		 && r->m_read.timestamp == 0)
 	    {
 	      nRead = Read_1_Packet(r, r->m_read.buf, r->m_read.buflen);
 	      if (nRead < 0)
@@ -5485,7 +6398,22 @@ fail:
 	      r->m_read.buflen -= nRead;
 	      if (r->m_read.dataType == 5)
 	        break;
+	      /* onMetaData fills in dataType, media showing up first
+	       * means there is none and we can't tell
+	       */
+	      if (r->m_read.hdrMode == RTMP_HDR_META && nRead)
+		{
+		  if (r->m_read.buf[-nRead] != RTMP_PACKET_TYPE_INFO)
+		    {
+		      r->m_read.dataType = 5;
+		      break;
+		    }
+		  if (r->m_read.dataType)
+		    break;
+		}
 	    }
+	  if (r->m_read.hdrMode == RTMP_HDR_BOTH)
+	    r->m_read.dataType = 5;
 	  mybuf[4] = r->m_read.dataType;
 	  r->m_read.buflen = r->m_read.buf - mybuf;
 	  r->m_read.buf = mybuf;
@@ -5510,6 +6438,7 @@ fail:
       if (nRead > size)
 	nRead = size;
       memcpy(buf, r->m_read.bufpos, nRead);
+      r->m_stats.bytesCopied += nRead;
       r->m_read.buflen -= nRead;
       if (!r->m_read.buflen)
 	{
@@ -5528,11 +6457,21 @@ fail:
 
   while (size > 0 && (nRead = Read_1_Packet(r, buf, size)) >= 0)
     {
-      if (!nRead) continue;
+      if (!nRead)
+	{
+	  if (r->m_bNonBlock && r->m_sb.sb_timedout)
+	    break;
+	  continue;
+	}
       buf += nRead;
       total += nRead;
       size -= nRead;
-      break;
+      /* in fill mode keep going as long as it doesn't block, unless
+       * the last tag didn't fit and the rest of it got buffered
+       */
+      if (!(r->m_read.flags & RTMP_READ_FILL) || r->m_read.buf
+	  || !RTMP_ReadPending(r))
+	break;
     }
   if (nRead < 0)
     r->m_read.status = nRead;
@@ -5542,6 +6481,93 @@ fail:
   return total;
 }
 
+int
+RTMP_ReadTag(RTMP *r, RTMPTag *tag)
+{
+  uint32_t nTimeStamp = 0, prevTagSize = 0;
+  char *ptr, *pend;
+  int ret;
+
+  memset(tag, 0, sizeof(RTMPTag));
+  switch (r->m_read.status) {
+  case RTMP_READ_EOF:
+  case RTMP_READ_COMPLETE:
+    return 0;
+  case RTMP_READ_ERROR:
+    SetSockError(EINVAL);
+    return -1;
+  default:
+    break;
+  }
+
+  ret = GetMediaPacket(r, &tag->packet, &tag->body, &tag->bodySize);
+  if (ret <= 0)
+    {
+      memset(tag, 0, sizeof(RTMPTag));
+      if (ret == RTMP_READ_IGNORE)
+	return 0;
+      r->m_read.status = ret;
+      if (ret == RTMP_READ_ERROR)
+	{
+	  SetSockError(EINVAL);
+	  return -1;
+	}
+      return 0;
+    }
+
+  tag->type = tag->packet.m_packetType;
+  if (tag->type == RTMP_PACKET_TYPE_AUDIO
+      || tag->type == RTMP_PACKET_TYPE_VIDEO
+      || tag->type == RTMP_PACKET_TYPE_INFO)
+    {
+      nTimeStamp = r->m_read.nResumeTS + tag->packet.m_nTimeStamp;
+      prevTagSize = 11 + tag->bodySize;
+
+      ptr = tag->header;
+      pend = ptr + sizeof(tag->header);
+      *ptr++ = tag->type;
+      ptr = AMF_EncodeInt24(ptr, pend, tag->bodySize);
+      ptr = AMF_EncodeInt24(ptr, pend, nTimeStamp);
+      *ptr++ = (char)((nTimeStamp & 0xFF000000) >> 24);
+      AMF_EncodeInt24(ptr, pend, 0);
+      tag->hlen = 11;
+    }
+
+  if (tag->type == RTMP_PACKET_TYPE_FLASH_VIDEO)
+    {
+      /* fixed up in place, the packet body is ours */
+      unsigned int append = FixFLVTags(r, &tag->packet, tag->body,
+				       tag->bodySize, tag->body,
+				       tag->body + tag->bodySize, &nTimeStamp,
+				       &prevTagSize);
+      if (append)
+	{
+	  tag->bodySize = append;
+	  AMF_EncodeInt32(tag->trailer, tag->trailer + 4, prevTagSize);
+	  tag->tlen = 4;
+	}
+    }
+  else
+    {
+      AMF_EncodeInt32(tag->trailer, tag->trailer + 4, prevTagSize);
+      tag->tlen = 4;
+    }
+
+  tag->timestamp = nTimeStamp;
+  r->m_read.timestamp = (r->Link.lFlags & RTMP_LF_LIVE) ?
+    tag->packet.m_nTimeStamp : nTimeStamp;
+
+  return tag->hlen + tag->bodySize + tag->tlen;
+}
+
+void
+RTMP_FreeTag(RTMPTag *tag)
+{
+  RTMPPacket_Free(&tag->packet);
+  tag->body = NULL;
+  tag->bodySize = 0;
+}
+
 static const AVal av_setDataFrame = AVC("@setDataFrame");
 
 int
@@ -5569,6 +6595,19 @@ RTMP_Write(RTMP *r, const char *buf, int size)
 	      s2 -= 13;
 	    }
 
+	  /* a whole tag is here, send it without copying */
+	  num = s2 >= 11 ? AMF_DecodeInt24(buf + 1) : 0;
+	  if (s2 >= 11 && s2 >= 11 + num + 4)
+	    {
+	      uint32_t ts = AMF_DecodeInt24(buf + 4);
+	      ts |= (unsigned char)buf[7] << 24;
+	      if (!RTMP_WriteTag(r, *buf, ts, buf + 11, num))
+		return -1;
+	      buf += 11 + num + 4;
+	      s2 -= 11 + num + 4;
+	      continue;
+	    }
+
 	  pkt->m_packetType = *buf++;
 	  pkt->m_nBodySize = AMF_DecodeInt24(buf);
 	  buf += 3;
@@ -5596,6 +6635,7 @@ RTMP_Write(RTMP *r, const char *buf, int size)
 	      RTMP_Log(RTMP_LOGDEBUG, "%s, failed to allocate packet", __FUNCTION__);
 	      return FALSE;
 	    }
+	  r->m_stats.allocs++;
 	  enc = pkt->m_body;
 	  pend = enc + pkt->m_nBodySize;
 	  if (pkt->m_packetType == RTMP_PACKET_TYPE_INFO)
@@ -5612,6 +6652,7 @@ RTMP_Write(RTMP *r, const char *buf, int size)
       if (num > s2)
 	num = s2;
       memcpy(enc, buf, num);
+      r->m_stats.bytesCopied += num;
       pkt->m_nBytesRead += num;
       s2 -= num;
       buf += num;
@@ -5631,6 +6672,159 @@ RTMP_Write(RTMP *r, const char *buf, int size)
   return size+s2;
 }
 
+#define TAG_IOVS	64
+
+#ifndef _WIN32
+/* Send the gathered chunks straight from the caller's buffers */
+static int
+WriteV(RTMP *r, struct iovec *iov, int cnt)
+{
+  while (cnt)
+    {
+      ssize_t nBytes = writev(r->m_sb.sb_socket, iov, cnt);
+
+      r->m_stats.sendCalls++;
+
+      if (nBytes < 0)
+	{
+	  int sockerr = GetSockError();
+	  RTMP_Log(RTMP_LOGERROR, "%s, RTMP send error %d", __FUNCTION__,
+	      sockerr);
+
+	  if (sockerr == EINTR && !RTMP_ctrlC)
+	    continue;
+
+	  RTMP_Close(r);
+	  return FALSE;
+	}
+      r->m_stats.bytesOut += nBytes;
+
+      while (cnt && (size_t)nBytes >= iov->iov_len)
+	{
+	  nBytes -= iov->iov_len;
+	  iov++;
+	  cnt--;
+	}
+      if (cnt)
+	{
+	  iov->iov_base = (char *)iov->iov_base + nBytes;
+	  iov->iov_len -= nBytes;
+	}
+    }
+  return TRUE;
+}
+#endif
+
+int
+RTMP_WriteTag(RTMP *r, uint8_t type, uint32_t timestamp, const char *body,
+	      unsigned int size)
+{
+  RTMPPacket packet = { 0 };
+  char hbuf[RTMP_MAX_HEADER_SIZE], cbuf[3], prefix[32];
+  int hSize, cSize, plen = 0;
+
+  packet.m_nChannel = 0x04;	/* source channel */
+  packet.m_nInfoField2 = r->m_stream_id;
+  packet.m_packetType = type;
+  packet.m_nTimeStamp = timestamp;
+  if (((type == RTMP_PACKET_TYPE_AUDIO || type == RTMP_PACKET_TYPE_VIDEO) &&
+       !timestamp) || type == RTMP_PACKET_TYPE_INFO)
+    packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
+  else
+    packet.m_headerType = RTMP_PACKET_SIZE_MEDIUM;
+
+  if (type == RTMP_PACKET_TYPE_INFO)
+    plen = AMF_EncodeString(prefix, prefix + sizeof(prefix),
+			    &av_setDataFrame) - prefix;
+  packet.m_nBodySize = plen + size;
+
+#ifndef _WIN32
+  /* a non-blocking socket may take only part of it, the rest has to
+   * wait behind what is queued already
+   */
+  if (!(r->Link.protocol & RTMP_FEATURE_HTTP) && !r->Link.ConnectPacket
+      && !r->m_bNonBlock && !r->m_outLen
+#ifdef CRYPTO
+      && !r->Link.rc4keyOut
+#if !defined(NO_SSL)
+      && !r->m_sb.sb_ssl
+#endif
+#endif
+      )
+    {
+      struct iovec iov[TAG_IOVS];
+      const char *src = plen ? prefix : body;
+      unsigned int left = packet.m_nBodySize, srcLeft = plen ? plen : size;
+      int cnt = 0;
+
+      hSize = EncodeChunkHeader(r, &packet, hbuf, &cSize);
+      if (!hSize)
+	return FALSE;
+      /* continuation headers only repeat the channel */
+      cbuf[0] = 0xc0 | hbuf[0];
+      memcpy(cbuf + 1, hbuf + 1, cSize);
+
+      iov[cnt].iov_base = hbuf;
+      iov[cnt++].iov_len = hSize;
+      while (left)
+	{
+	  unsigned int chunk = left < r->m_outChunkSize ? left : r->m_outChunkSize;
+
+	  left -= chunk;
+	  while (chunk)
+	    {
+	      unsigned int n = chunk < srcLeft ? chunk : srcLeft;
+
+	      iov[cnt].iov_base = (char *)src;
+	      iov[cnt++].iov_len = n;
+	      src += n;
+	      srcLeft -= n;
+	      chunk -= n;
+	      if (!srcLeft)
+		{
+		  src = body;
+		  srcLeft = size;
+		}
+	    }
+	  if (!left)
+	    break;
+	  /* room for the next header and up to two pieces */
+	  if (cnt > TAG_IOVS - 3)
+	    {
+	      if (!WriteV(r, iov, cnt))
+		return FALSE;
+	      cnt = 0;
+	    }
+	  iov[cnt].iov_base = cbuf;
+	  iov[cnt++].iov_len = 1 + cSize;
+	}
+      if (!WriteV(r, iov, cnt))
+	return FALSE;
+
+      ChunkSent(r, &packet);
+      return TRUE;
+    }
+#endif
+
+  /* the data has to go through a buffer of ours anyway */
+  {
+    int ret;
+
+    if (!RTMPPacket_Alloc(&packet, packet.m_nBodySize))
+      {
+	RTMP_Log(RTMP_LOGDEBUG, "%s, failed to allocate packet", __FUNCTION__);
+	return FALSE;
+      }
+    r->m_stats.allocs++;
+    memcpy(packet.m_body, prefix, plen);
+    memcpy(packet.m_body + plen, body, size);
+    r->m_stats.bytesCopied += plen + size;
+    ret = RTMP_SendPacket(r, &packet, FALSE);
+    RTMPPacket_Free(&packet);
+    return ret;
+  }
+}
+
 static int
 ConnectSocket(RTMP *r)
 {
@@ -59,17 +59,21 @@ extern "C"
 #define RTMP_PROTOCOL_RTMFP     RTMP_FEATURE_MFP
 
 #define RTMP_DEFAULT_CHUNKSIZE	128
+#define RTMP_WRITE_CHUNKSIZE	4096	/* what we ask for when publishing */
+#define RTMP_MAX_CHUNKSIZE	0xffffff
 
 /* needs to fit largest number of bytes recv() may return */
 #define RTMP_BUFFER_CACHE_SIZE (16*1024)
 
 #define	RTMP_CHANNELS	65600
+#define RTMP_DENSE_CHANNELS	64	/* the ids with a one byte basic header */
 
   extern const char RTMPProtocolStringsLower[][7];
   extern const AVal RTMP_DefaultFlashVer;
   extern int RTMP_ctrlC;
 
   uint32_t RTMP_GetTime(void);
+  uint64_t RTMP_GetTimeUS(void);
 
 /*      RTMP_PACKET_TYPE_...                0x00 */
 #define RTMP_PACKET_TYPE_CHUNK_SIZE         0x01
@@ -124,6 +128,32 @@ extern "C"
     char *m_body;
   } RTMPPacket;
 
+  /* what is kept of a chunk stream for the headers that leave fields
+   * out, and the message it is in the middle of
+   */
+  typedef struct RTMPChunkState
+  {
+    uint32_t timestamp;		/* as in the last full header, maybe a delta */
+    uint32_t absTime;		/* abs timestamp of the last message */
+    uint32_t bodySize;
+    uint32_t bytesRead;
+    int32_t streamId;
+    uint8_t type;
+    uint8_t headerType;
+    uint8_t bAbsTimestamp;
+    uint8_t bUsed;
+    char *body;			/* partial message, NULL in between */
+  } RTMPChunkState;
+
+  /* low ids are indexed directly, the rare higher ones are searched */
+  typedef struct RTMPChunkMap
+  {
+    RTMPChunkState dense[RTMP_DENSE_CHANNELS];
+    int nSparse;
+    int *sparseIds;
+    RTMPChunkState *sparse;
+  } RTMPChunkMap;
+
   typedef struct RTMPSockBuf
   {
     int sb_socket;
@@ -183,6 +213,7 @@ extern "C"
     int CombineConnectPacket;
     int redirected;
     int timeout;		/* connection timeout in seconds */
+    int chunkSize;		/* outgoing chunk size to set after connect */
     AVal Extras;
     AVal HandshakeResponse;
 
@@ -223,6 +254,7 @@ extern "C"
 #define RTMP_READ_GOTKF		0x08
 #define RTMP_READ_GOTFLVK	0x10
 #define RTMP_READ_SEEKING	0x20
+#define RTMP_READ_FILL		0x40	/* pack tags until the buffer is full */
     int8_t status;
 #define RTMP_READ_COMPLETE	-3
 #define RTMP_READ_ERROR	-2
@@ -239,6 +271,13 @@ extern "C"
     uint32_t nInitialFrameSize;
     uint32_t nIgnoredFrameCounter;
     uint32_t nIgnoredFlvFrameCounter;
+
+    /* how the FLV header's audio/video flags are found */
+    int hdrMode;
+#define RTMP_HDR_PROBE	0	/* buffer tags until both were seen */
+#define RTMP_HDR_BOTH	1	/* send it right away with both flags */
+#define RTMP_HDR_META	2	/* take them from onMetaData */
+    int hdrBufSize;		/* most bytes buffered while probing */
   } RTMP_READ;
 
   typedef struct RTMP_METHOD
@@ -247,6 +286,52 @@ extern "C"
     int num;
   } RTMP_METHOD;
 
+  /* an additional NetStream played over the same connection, see
+   * RTMP_AddStream(). Its media never shows up in RTMP_Read() and
+   * friends, it is handed to cb instead.
+   */
+  typedef struct RTMPStream RTMPStream;
+  typedef void (RTMPStreamCB)(RTMPStream *s, RTMPPacket *packet, void *ctx);
+
+  struct RTMPStream
+  {
+    struct RTMPStream *next;
+    AVal playpath;
+    int id;			/* message stream id, 0 until created */
+    int txn;			/* of the pending createStream or play call */
+    int state;
+#define RTMP_STREAM_CREATING	0
+#define RTMP_STREAM_PLAYING	1	/* play was sent */
+#define RTMP_STREAM_STARTED	2	/* server sent Play.Start */
+#define RTMP_STREAM_DONE	3	/* stopped, completed or closed */
+#define RTMP_STREAM_FAILED	4
+    RTMPStreamCB *cb;
+    void *ctx;
+  };
+
+  /* running totals for one RTMP object, kept across RTMP_Close().
+   * Packet types from 0x20 up are counted in slot 0, which no
+   * real type uses.
+   */
+#define RTMP_STATS_TYPES	0x20
+  typedef struct RTMPStats
+  {
+    uint64_t bytesIn;		/* as read from the socket */
+    uint64_t bytesOut;		/* as written to the socket */
+    uint64_t recvCalls;
+    uint64_t sendCalls;
+    uint64_t bytesCopied;	/* data memcpy'd on its way through */
+    uint64_t allocs;		/* packet bodies and send buffers */
+    uint64_t timeouts;		/* reads that ran into Link.timeout */
+    uint64_t pauses;		/* pause requests from BUFX or ToggleStream */
+    uint64_t toggles;		/* calls to RTMP_ToggleStream() */
+    uint64_t reconnects;	/* after a redirect or publisher auth */
+    uint64_t chunksIn[RTMP_STATS_TYPES];
+    uint64_t chunksOut[RTMP_STATS_TYPES];
+    uint64_t msgsIn[RTMP_STATS_TYPES];
+    uint64_t msgsOut[RTMP_STATS_TYPES];
+  } RTMPStats;
+
   typedef struct RTMP
   {
     int m_inChunkSize;
@@ -270,12 +355,11 @@ extern "C"
     int m_numInvokes;
     int m_numCalls;
     RTMP_METHOD *m_methodCalls;	/* remote method calls queue */
+    RTMPStream *m_streams;	/* added with RTMP_AddStream */
 
-    int m_channelsAllocatedIn;
-    int m_channelsAllocatedOut;
-    RTMPPacket **m_vecChannelsIn;
-    RTMPPacket **m_vecChannelsOut;
-    int *m_channelTimestamp;	/* abs timestamp of last packet */
+    RTMPChunkMap m_chunksIn;
+    RTMPChunkMap m_chunksOut;
+    RTMPStats m_stats;
 
     double m_fAudioCodecs;	/* audioCodecs for the connect packet */
     double m_fVideoCodecs;	/* videoCodecs for the connect packet */
@@ -293,8 +377,38 @@ extern "C"
     RTMPPacket m_write;
     RTMPSockBuf m_sb;
     RTMP_LNK Link;
+
+    /* see RTMP_SetNonBlock() */
+    int m_bNonBlock;
+    int m_nPlain;		/* bytes at m_sb.sb_start already decrypted */
+    char *m_chunkBuf;		/* a chunk too big for m_sb, while it arrives */
+    int m_chunkLen;
+    int m_chunkNeed;
+    void *m_serveHS;		/* between RTMP_Serve0() and RTMP_Serve1() */
+    char *m_outBuf;		/* output the socket had no room for */
+    int m_outStart;
+    int m_outLen;
+    int m_outSize;
+    int m_outMax;		/* give up on a peer that lets more pile up */
   } RTMP;
 
+  /* one FLV tag from RTMP_ReadTag(), to be written out as header, body
+   * and trailer in that order. body points into packet and stays valid
+   * until RTMP_FreeTag().
+   */
+  typedef struct RTMPTag
+  {
+    uint8_t type;
+    uint32_t timestamp;		/* on the output timeline */
+    char header[11];
+    unsigned int hlen;		/* 0 for FLV packets, they carry their own */
+    char *body;
+    unsigned int bodySize;
+    char trailer[4];		/* prevTagSize */
+    unsigned int tlen;
+    RTMPPacket packet;
+  } RTMPTag;
+
   int RTMP_ParseURL(const char *url, int *protocol, AVal *host,
 		     unsigned int *port, AVal *playpath, AVal *app);
 
@@ -330,18 +444,50 @@ extern "C"
   int RTMP_Serve(RTMP *r);
   int RTMP_TLS_Accept(RTMP *r, void *ctx);
 
+  /* The two halves of RTMP_Serve(), for a caller that waits for the
+   * client's data itself: RTMP_Serve0() once C0 and C1 are buffered in
+   * m_sb, RTMP_Serve1() once C2 is.
+   */
+  int RTMP_Serve0(RTMP *r);
+  int RTMP_Serve1(RTMP *r);
+
+  /* With a non-blocking socket RTMP_ReadPacket() only starts on a chunk
+   * that has fully arrived, one too big for m_sb is collected in a
+   * buffer of its own meanwhile. When it hasn't, it returns FALSE with
+   * RTMP_IsTimedout() set and the connection still up, RTMP_Read()
+   * returns 0 then without touching m_read.status (it can't probe for
+   * the FLV header that way, use RTMP_HDR_BOTH). Output the socket
+   * won't take is queued, up to m_outMax bytes, for RTMP_Flush()
+   * which returns how much is still queued or -1 on error.
+   */
+  int RTMP_SetNonBlock(RTMP *r, int on);
+  int RTMP_Flush(RTMP *r);
+
   int RTMP_ReadPacket(RTMP *r, RTMPPacket *packet);
   int RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue);
   int RTMP_SendChunk(RTMP *r, RTMPChunk *chunk);
   int RTMP_IsConnected(RTMP *r);
   int RTMP_Socket(RTMP *r);
   int RTMP_IsTimedout(RTMP *r);
+  uint32_t RTMP_GetChannelTime(RTMP *r, int channel);
+  RTMPChunkState *RTMP_GetChunkState(RTMP *r, int bOut, int channel);
   double RTMP_GetDuration(RTMP *r);
+  void RTMP_GetStats(RTMP *r, RTMPStats *stats);
   int RTMP_ToggleStream(RTMP *r);
 
   int RTMP_ConnectStream(RTMP *r, int seekTime);
   int RTMP_ReconnectStream(RTMP *r, int seekTime);
   void RTMP_DeleteStream(RTMP *r);
+
+  /* Play another playpath on this connection. The stream is created
+   * once the connection is up, its media packets are passed to cb by
+   * whatever reads the connection next. The handle stays valid across
+   * RTMP_Close() until RTMP_RemoveStream() or RTMP_Free(), an RTMP that
+   * isn't from RTMP_Alloc() must remove its streams itself.
+   */
+  RTMPStream *RTMP_AddStream(RTMP *r, const AVal *playpath,
+			     RTMPStreamCB *cb, void *ctx);
+  void RTMP_RemoveStream(RTMP *r, RTMPStream *s);
   int RTMP_GetNextMediaPacket(RTMP *r, RTMPPacket *packet);
   int RTMP_ClientPacket(RTMP *r, RTMPPacket *packet);
 
@@ -373,14 +519,35 @@ extern "C"
   int RTMPSockBuf_Send(RTMPSockBuf *sb, const char *buf, int len);
   int RTMPSockBuf_Close(RTMPSockBuf *sb);
 
+  /* the same on r->m_sb, counted for RTMP_GetStats() */
+  int RTMP_SockFill(RTMP *r);
+  int RTMP_SockSend(RTMP *r, const char *buf, int len);
+
   int RTMP_SendCreateStream(RTMP *r);
   int RTMP_SendSeek(RTMP *r, int dTime);
   int RTMP_SendServerBW(RTMP *r);
+  int RTMP_SendChunkSize(RTMP *r, int size);
   int RTMP_SendClientBW(RTMP *r);
   void RTMP_DropRequest(RTMP *r, int i, int freeit);
   int RTMP_Read(RTMP *r, char *buf, int size);
+  int RTMP_ReadPending(RTMP *r);
   int RTMP_Write(RTMP *r, const char *buf, int size);
 
+  /* Get the next tag without copying its data. Returns the number of
+   * bytes in the tag, 0 if there was none (check m_read.status) and
+   * -1 on error. No FLV file header is produced, and data still
+   * buffered by RTMP_Read() is not returned, drain that first.
+   */
+  int RTMP_ReadTag(RTMP *r, RTMPTag *tag);
+  void RTMP_FreeTag(RTMPTag *tag);
+
+  /* Publish one FLV tag, the body is sent from where it is and can be
+   * reused as soon as this returns. Metadata gets wrapped in
+   * @setDataFrame like with RTMP_Write().
+   */
+  int RTMP_WriteTag(RTMP *r, uint8_t type, uint32_t timestamp,
+		    const char *body, unsigned int size);
+
 /* hashswf.c */
   int RTMP_HashSWF(const char *url, unsigned int *size, unsigned char *hash,
 		   int age);
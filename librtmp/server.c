@@ -0,0 +1,666 @@
+/*
+ *  This file is part of librtmp.
+ *
+ *  librtmp is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation; either version 2.1,
+ *  or (at your option) any later version.
+ *
+ *  librtmp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with librtmp see the file COPYING.  If not, write to
+ *  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *  http://www.gnu.org/copyleft/lgpl.html
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "rtmp_sys.h"
+#include "log.h"
+#include "server.h"
+
+#ifdef linux
+#include <sys/epoll.h>
+#define USE_EPOLL
+#elif defined(_WIN32)
+#define poll	WSAPoll
+#else
+#include <poll.h>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#endif
+
+#define RTMP_SIG_SIZE	1536
+#define SERVER_BURST	64	/* packets per connection before the next one's turn */
+#define SERVER_TICK	1000	/* msec, for the timeouts and RTMPServer_Stop() */
+
+#define EV_IN	1
+#define EV_OUT	2
+
+#define SAVC(x)	static const AVal av_##x = AVC(#x)
+
+SAVC(connect);
+SAVC(createStream);
+SAVC(play);
+SAVC(publish);
+
+struct RTMPServer
+{
+  int socket;
+  RTMPServerCB cb;
+  void *ctx;
+  volatile int bStop;
+  int hsTimeout;		/* seconds */
+  int idleTimeout;
+  uint32_t lastScan;
+
+  RTMPConn *conns;
+  int nConns;
+  int nMore;			/* connections with packets left in m_sb */
+#ifdef USE_EPOLL
+  int epfd;
+#else
+  struct pollfd *fds;
+  RTMPConn **fdConns;
+  int nFds;
+#endif
+};
+
+static int
+SetNonBlock(int sockfd)
+{
+#ifdef _WIN32
+  u_long arg = 1;
+  return ioctlsocket(sockfd, FIONBIO, &arg) == 0;
+#else
+  int flags = fcntl(sockfd, F_GETFL);
+  return flags != -1 && fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) != -1;
+#endif
+}
+
+static int
+ConnWatch(RTMPServer *s, RTMPConn *c, int events)
+{
+#ifdef USE_EPOLL
+  struct epoll_event ev = { 0 };
+  int op = c->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+  if (events == c->events)
+    return TRUE;
+  if (!events)
+    {
+      op = EPOLL_CTL_DEL;
+      /* closing it took it out already */
+      if (c->rtmp.m_sb.sb_socket == -1)
+	{
+	  c->events = 0;
+	  return TRUE;
+	}
+    }
+  if (events & EV_IN)
+    ev.events |= EPOLLIN;
+  if (events & EV_OUT)
+    ev.events |= EPOLLOUT;
+  ev.data.ptr = c;
+  if (epoll_ctl(s->epfd, op, c->rtmp.m_sb.sb_socket, &ev) == -1)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, epoll_ctl failed for %s: %d", __FUNCTION__,
+	  c->peer, GetSockError());
+      return FALSE;
+    }
+#endif
+  c->events = events;
+  return TRUE;
+}
+
+static void
+ConnFree(RTMPServer *s, RTMPConn *c)
+{
+  ConnWatch(s, c, 0);
+  if (c->prev)
+    c->prev->next = c->next;
+  else
+    s->conns = c->next;
+  if (c->next)
+    c->next->prev = c->prev;
+  s->nConns--;
+  if (c->bMore)
+    s->nMore--;
+
+  if (c->state != RTMPCONN_DETACHED)
+    {
+      RTMP_Log(RTMP_LOGDEBUG, "%s, closing %s", __FUNCTION__, c->peer);
+      if (s->cb.close)
+	s->cb.close(c);
+      RTMP_Close(&c->rtmp);
+    }
+  RTMPPacket_Free(&c->packet);
+  free(c);
+}
+
+static void
+Accept(RTMPServer *s)
+{
+  while (1)
+    {
+      struct sockaddr_in addr;
+      socklen_t addrlen = sizeof(struct sockaddr_in);
+      RTMPConn *c;
+      int sockfd = accept(s->socket, (struct sockaddr *) &addr, &addrlen);
+
+      if (sockfd < 0)
+	{
+	  int sockerr = GetSockError();
+	  if (sockerr != EWOULDBLOCK && sockerr != EAGAIN
+#ifdef _WIN32
+	      && sockerr != WSAEWOULDBLOCK
+#endif
+	      )
+	    RTMP_Log(RTMP_LOGERROR, "%s, accept failed: %d", __FUNCTION__, sockerr);
+	  return;
+	}
+
+      c = calloc(1, sizeof(RTMPConn));
+      if (!c)
+	{
+	  RTMP_Log(RTMP_LOGERROR, "%s, no memory for a connection", __FUNCTION__);
+	  closesocket(sockfd);
+	  continue;
+	}
+      RTMP_Init(&c->rtmp);
+      c->rtmp.m_sb.sb_socket = sockfd;
+      c->server = s;
+      c->lastIO = RTMP_GetTime();
+      snprintf(c->peer, sizeof(c->peer), "%s:%d", inet_ntoa(addr.sin_addr),
+	  ntohs(addr.sin_port));
+      RTMP_Log(RTMP_LOGDEBUG, "%s, accepted connection from %s", __FUNCTION__,
+	  c->peer);
+
+      if ((s->cb.accept && !s->cb.accept(c)) || !RTMP_SetNonBlock(&c->rtmp, TRUE))
+	{
+	  RTMP_Close(&c->rtmp);
+	  free(c);
+	  continue;
+	}
+
+      c->next = s->conns;
+      if (c->next)
+	c->next->prev = c;
+      s->conns = c;
+      s->nConns++;
+      if (!ConnWatch(s, c, EV_IN))
+	ConnFree(s, c);
+    }
+}
+
+/* have n bytes of the handshake buffered, 0 if they aren't here yet */
+static int
+ConnFill(RTMPConn *c, int n)
+{
+  RTMPSockBuf *sb = &c->rtmp.m_sb;
+
+  while (sb->sb_size < n)
+    {
+      sb->sb_timedout = FALSE;
+      if (RTMP_SockFill(&c->rtmp) < 1)
+	return sb->sb_timedout ? 0 : -1;
+    }
+  return 1;
+}
+
+static int
+ConnCommand(RTMPConn *c, RTMPPacket *packet, int offset)
+{
+  RTMPServerCB *cb = &c->server->cb;
+  RTMPConn_CommandCB *func;
+  AMFObject obj;
+  AVal method;
+  double txn;
+  int ret;
+
+  if (packet->m_nBodySize <= (unsigned int)offset
+      || packet->m_body[offset] != AMF_STRING)
+    {
+      RTMP_Log(RTMP_LOGWARNING, "%s, no method name in command from %s",
+	  __FUNCTION__, c->peer);
+      return TRUE;
+    }
+  if (AMF_Decode(&obj, packet->m_body + offset, packet->m_nBodySize - offset,
+	FALSE) < 0)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, error decoding command from %s",
+	  __FUNCTION__, c->peer);
+      return FALSE;
+    }
+  AMFProp_GetString(AMF_GetProp(&obj, NULL, 0), &method);
+  txn = AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 1));
+  RTMP_Log(RTMP_LOGDEBUG, "%s, %s invoking <%.*s>", __FUNCTION__, c->peer,
+      method.av_len, method.av_val);
+
+  if (AVMATCH(&method, &av_connect))
+    func = cb->connect;
+  else if (AVMATCH(&method, &av_createStream))
+    func = cb->createStream;
+  else if (AVMATCH(&method, &av_play))
+    func = cb->play;
+  else if (AVMATCH(&method, &av_publish))
+    func = cb->publish;
+  else
+    func = NULL;
+  if (!func)
+    func = cb->invoke;
+
+  ret = func ? func(c, packet, &obj, txn) : TRUE;
+  AMF_Reset(&obj);
+  return ret;
+}
+
+static int
+ConnPacket(RTMPConn *c, RTMPPacket *packet)
+{
+  RTMPServerCB *cb = &c->server->cb;
+
+  switch (packet->m_packetType)
+    {
+    case RTMP_PACKET_TYPE_CHUNK_SIZE:
+      if (packet->m_nBodySize >= 4)
+	{
+	  int size = AMF_DecodeInt32(packet->m_body) & 0x7fffffff;
+	  if (size < 1 || size > RTMP_MAX_CHUNKSIZE)
+	    {
+	      RTMP_Log(RTMP_LOGERROR, "%s, bad chunk size %d from %s",
+		  __FUNCTION__, size, c->peer);
+	      return FALSE;
+	    }
+	  c->rtmp.m_inChunkSize = size;
+	  RTMP_Log(RTMP_LOGDEBUG, "%s, %s chunk size %d", __FUNCTION__, c->peer,
+	      size);
+	}
+      return TRUE;
+    case RTMP_PACKET_TYPE_FLEX_MESSAGE:
+      return ConnCommand(c, packet, 1);
+    case RTMP_PACKET_TYPE_INVOKE:
+      return ConnCommand(c, packet, 0);
+    default:
+      return cb->packet ? cb->packet(c, packet) : TRUE;
+    }
+}
+
+/* FALSE when the connection has to go right away */
+static int
+ConnRead(RTMPServer *s, RTMPConn *c)
+{
+  RTMP *r = &c->rtmp;
+  int i, ok;
+
+  switch (c->state)
+    {
+    case RTMPCONN_HANDSHAKE0:
+      if ((i = ConnFill(c, RTMP_SIG_SIZE + 1)) < 1)
+	return i == 0;
+      if (!RTMP_Serve0(r))
+	{
+	  RTMP_Log(RTMP_LOGERROR, "%s, handshake with %s failed", __FUNCTION__,
+	      c->peer);
+	  return FALSE;
+	}
+      c->state = RTMPCONN_HANDSHAKE1;
+      /* C2 may be here already */
+      /* FALLTHRU */
+    case RTMPCONN_HANDSHAKE1:
+      if ((i = ConnFill(c, RTMP_SIG_SIZE)) < 1)
+	return i == 0;
+      if (!RTMP_Serve1(r))
+	{
+	  RTMP_Log(RTMP_LOGERROR, "%s, handshake with %s failed", __FUNCTION__,
+	      c->peer);
+	  return FALSE;
+	}
+      c->state = RTMPCONN_READY;
+      if (s->cb.ready && !s->cb.ready(c))
+	{
+	  c->bClose = TRUE;
+	  return TRUE;
+	}
+      if (c->state == RTMPCONN_DETACHED)
+	return TRUE;
+      /* FALLTHRU */
+    case RTMPCONN_READY:
+      break;
+    default:
+      return TRUE;
+    }
+
+  for (i = 0; i < SERVER_BURST; i++)
+    {
+      r->m_sb.sb_timedout = FALSE;
+      if (!RTMP_ReadPacket(r, &c->packet))
+	return RTMP_IsConnected(r) && RTMP_IsTimedout(r);
+      if (!RTMPPacket_IsReady(&c->packet))
+	continue;
+
+      ok = ConnPacket(c, &c->packet);
+      RTMPPacket_Free(&c->packet);
+      if (!ok)
+	c->bClose = TRUE;
+      if (c->bClose || c->state == RTMPCONN_DETACHED)
+	return TRUE;
+    }
+
+  /* the rest may be in m_sb already, no event would tell */
+  c->bMore = TRUE;
+  s->nMore++;
+  return TRUE;
+}
+
+static void
+ConnEvent(RTMPServer *s, RTMPConn *c, int events)
+{
+  RTMP *r = &c->rtmp;
+  int ok = TRUE;
+
+  if (c->bMore)
+    {
+      c->bMore = FALSE;
+      s->nMore--;
+    }
+  if (events)
+    c->lastIO = RTMP_GetTime();
+
+  if ((events & EV_OUT) && RTMP_Flush(r) < 0)
+    ok = FALSE;
+  if (ok && !c->bClose && (events & EV_IN))
+    ok = ConnRead(s, c);
+
+  if (c->state == RTMPCONN_DETACHED || !ok || !RTMP_IsConnected(r)
+      || (c->bClose && !r->m_outLen))
+    {
+      ConnFree(s, c);
+      return;
+    }
+  if (!ConnWatch(s, c, (c->bClose ? 0 : EV_IN) | (r->m_outLen ? EV_OUT : 0)))
+    ConnFree(s, c);
+}
+
+static void
+ScanTimeouts(RTMPServer *s, uint32_t now)
+{
+  RTMPConn *c, *next;
+
+  for (c = s->conns; c; c = next)
+    {
+      int limit = c->state == RTMPCONN_READY ? s->idleTimeout : s->hsTimeout;
+
+      next = c->next;
+      if (limit && now - c->lastIO > (uint32_t)limit * 1000)
+	{
+	  RTMP_Log(RTMP_LOGWARNING, "%s, %s timed out", __FUNCTION__, c->peer);
+	  ConnFree(s, c);
+	}
+    }
+}
+
+RTMPServer *
+RTMPServer_Open(const char *address, int port, const RTMPServerCB *cb, void *ctx)
+{
+  struct sockaddr_in addr;
+  int sockfd, tmp;
+  RTMPServer *s;
+
+  sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (sockfd == -1)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, couldn't create socket", __FUNCTION__);
+      return NULL;
+    }
+
+  tmp = 1;
+  setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (char *) &tmp, sizeof(tmp));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = inet_addr(address);
+  addr.sin_port = htons(port);
+
+  if (bind(sockfd, (struct sockaddr *) &addr, sizeof(struct sockaddr_in)) == -1)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, TCP bind failed for port number: %d",
+	  __FUNCTION__, port);
+      closesocket(sockfd);
+      return NULL;
+    }
+
+  if (listen(sockfd, 128) == -1 || !SetNonBlock(sockfd))
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, listen failed", __FUNCTION__);
+      closesocket(sockfd);
+      return NULL;
+    }
+
+  s = calloc(1, sizeof(RTMPServer));
+  if (!s)
+    {
+      closesocket(sockfd);
+      return NULL;
+    }
+  s->socket = sockfd;
+  s->cb = *cb;
+  s->ctx = ctx;
+  s->hsTimeout = 5;
+
+#ifdef USE_EPOLL
+  s->epfd = epoll_create(64);
+  if (s->epfd != -1)
+    {
+      struct epoll_event ev = { 0 };
+      ev.events = EPOLLIN;
+      ev.data.ptr = NULL;	/* the listener */
+      if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, sockfd, &ev) == -1)
+	{
+	  close(s->epfd);
+	  s->epfd = -1;
+	}
+    }
+  if (s->epfd == -1)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, epoll setup failed: %d", __FUNCTION__,
+	  GetSockError());
+      closesocket(sockfd);
+      free(s);
+      return NULL;
+    }
+#endif
+  return s;
+}
+
+void *
+RTMPServer_Context(RTMPServer *s)
+{
+  return s->ctx;
+}
+
+void
+RTMPServer_SetTimeouts(RTMPServer *s, int handshake, int idle)
+{
+  s->hsTimeout = handshake;
+  s->idleTimeout = idle;
+}
+
+#ifdef USE_EPOLL
+static int
+Wait(RTMPServer *s, int timeout)
+{
+  struct epoll_event evs[64];
+  int i, n;
+
+  n = epoll_wait(s->epfd, evs, 64, timeout);
+  if (n < 0)
+    return GetSockError() == EINTR;
+
+  for (i = 0; i < n; i++)
+    {
+      RTMPConn *c = evs[i].data.ptr;
+      int events = 0;
+
+      if (!c)
+	{
+	  Accept(s);
+	  continue;
+	}
+      if (evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+	events |= EV_IN;
+      if (evs[i].events & EPOLLOUT)
+	events |= EV_OUT;
+      ConnEvent(s, c, events);
+    }
+  return TRUE;
+}
+#else
+static int
+Wait(RTMPServer *s, int timeout)
+{
+  RTMPConn *c;
+  int i, n;
+
+  if (s->nFds < s->nConns + 1)
+    {
+      int size = s->nConns + 64;
+      struct pollfd *fds = realloc(s->fds, size * sizeof(struct pollfd));
+      RTMPConn **fdConns;
+
+      if (fds)
+	s->fds = fds;
+      fdConns = realloc(s->fdConns, size * sizeof(RTMPConn *));
+      if (fdConns)
+	s->fdConns = fdConns;
+      if (!fds || !fdConns)
+	return FALSE;
+      s->nFds = size;
+    }
+
+  s->fds[0].fd = s->socket;
+  s->fds[0].events = POLLIN;
+  for (c = s->conns, n = 1; c; c = c->next, n++)
+    {
+      s->fds[n].fd = c->rtmp.m_sb.sb_socket;
+      s->fds[n].events = ((c->events & EV_IN) ? POLLIN : 0) |
+	((c->events & EV_OUT) ? POLLOUT : 0);
+      s->fdConns[n] = c;
+    }
+
+  i = poll(s->fds, n, timeout);
+  if (i < 0)
+    return GetSockError() == EINTR;
+
+  /* new connections aren't in fdConns, so accept them last */
+  for (i = 1; i < n; i++)
+    {
+      int events = 0;
+
+      if (s->fds[i].revents & (POLLIN | POLLERR | POLLHUP))
+	events |= EV_IN;
+      if (s->fds[i].revents & POLLOUT)
+	events |= EV_OUT;
+      if (events)
+	ConnEvent(s, s->fdConns[i], events);
+    }
+  if (s->fds[0].revents & POLLIN)
+    Accept(s);
+  return TRUE;
+}
+#endif
+
+int
+RTMPServer_Run(RTMPServer *s)
+{
+  s->bStop = FALSE;
+  s->lastScan = RTMP_GetTime();
+
+  while (!s->bStop)
+    {
+      uint32_t now;
+
+      if (!Wait(s, s->nMore ? 0 : SERVER_TICK))
+	{
+	  RTMP_Log(RTMP_LOGERROR, "%s, waiting for events failed: %d",
+	      __FUNCTION__, GetSockError());
+	  return FALSE;
+	}
+
+      if (s->nMore)
+	{
+	  RTMPConn *c, *next;
+	  for (c = s->conns; c; c = next)
+	    {
+	      next = c->next;
+	      if (c->bMore)
+		ConnEvent(s, c, EV_IN);
+	    }
+	}
+
+      now = RTMP_GetTime();
+      if (now - s->lastScan >= SERVER_TICK)
+	{
+	  s->lastScan = now;
+	  ScanTimeouts(s, now);
+	}
+    }
+  return TRUE;
+}
+
+void
+RTMPServer_Stop(RTMPServer *s)
+{
+  s->bStop = TRUE;
+}
+
+void
+RTMPServer_Close(RTMPServer *s)
+{
+  while (s->conns)
+    ConnFree(s, s->conns);
+#ifdef USE_EPOLL
+  close(s->epfd);
+#else
+  free(s->fds);
+  free(s->fdConns);
+#endif
+  if (closesocket(s->socket))
+    RTMP_Log(RTMP_LOGERROR, "%s, failed to close listening socket, error %d",
+	__FUNCTION__, GetSockError());
+  free(s);
+}
+
+void
+RTMPConn_Close(RTMPConn *c)
+{
+  c->bClose = TRUE;
+}
+
+int
+RTMPConn_Detach(RTMPConn *c, RTMP *r)
+{
+  RTMP *src = &c->rtmp;
+
+  if (c->state != RTMPCONN_READY)
+    return FALSE;
+  /* output still queued goes out before the new owner writes */
+  if (!RTMP_SetNonBlock(src, FALSE))
+    return FALSE;
+  ConnWatch(c->server, c, 0);
+
+  memcpy(r, src, sizeof(RTMP));
+  r->m_sb.sb_start = r->m_sb.sb_buf + (src->m_sb.sb_start - src->m_sb.sb_buf);
+  RTMP_Init(src);
+  c->state = RTMPCONN_DETACHED;
+  return TRUE;
+}
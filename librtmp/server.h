@@ -0,0 +1,115 @@
+#ifndef __RTMP_SERVER_H__
+#define __RTMP_SERVER_H__
+/*
+ *  This file is part of librtmp.
+ *
+ *  librtmp is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation; either version 2.1,
+ *  or (at your option) any later version.
+ *
+ *  librtmp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with librtmp see the file COPYING.  If not, write to
+ *  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *  http://www.gnu.org/copyleft/lgpl.html
+ */
+
+/* A single threaded RTMP server loop. It accepts the connections, does
+ * the handshakes without blocking and reads the packets of all clients
+ * as they arrive, handing the commands to the callbacks below. Replies
+ * are sent with the usual librtmp calls, whatever the client doesn't
+ * take right away is queued and sent when it can.
+ */
+
+#include "rtmp.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  typedef struct RTMPServer RTMPServer;
+  typedef struct RTMPConn RTMPConn;
+
+  enum
+  {
+    RTMPCONN_HANDSHAKE0,	/* waiting for C0 and C1 */
+    RTMPCONN_HANDSHAKE1,	/* waiting for C2 */
+    RTMPCONN_READY,
+    RTMPCONN_DETACHED
+  };
+
+  struct RTMPConn
+  {
+    RTMP rtmp;
+    RTMPServer *server;
+    void *ctx;			/* for the callbacks */
+    char peer[24];		/* address:port */
+    int state;
+    int bClose;			/* once the output is sent */
+    uint32_t lastIO;
+    RTMPPacket packet;
+
+    /* the server's own */
+    RTMPConn *next;
+    RTMPConn *prev;
+    int events;
+    int bMore;
+  };
+
+  /* obj is the decoded command, its first two properties the method name
+   * and the transaction id. The strings point into packet->m_body, a
+   * callback that keeps them can take the body over and set m_body to
+   * NULL.
+   */
+  typedef int (RTMPConn_CommandCB)(RTMPConn *c, RTMPPacket *packet,
+	AMFObject *obj, double txn);
+
+  /* Returning FALSE from any of these closes the connection after what
+   * was sent so far is out. A command without its own callback goes to
+   * invoke.
+   */
+  typedef struct RTMPServerCB
+  {
+    int (*accept)(RTMPConn *c);	/* still blocking, before the handshake */
+    int (*ready)(RTMPConn *c);	/* after the handshake */
+    RTMPConn_CommandCB *connect;
+    RTMPConn_CommandCB *createStream;
+    RTMPConn_CommandCB *play;
+    RTMPConn_CommandCB *publish;
+    RTMPConn_CommandCB *invoke;
+    int (*packet)(RTMPConn *c, RTMPPacket *packet);	/* all the others */
+    void (*close)(RTMPConn *c);	/* not for detached ones */
+  } RTMPServerCB;
+
+  RTMPServer *RTMPServer_Open(const char *address, int port,
+	const RTMPServerCB *cb, void *ctx);
+  void *RTMPServer_Context(RTMPServer *s);
+
+  /* in seconds, 0 to never time out */
+  void RTMPServer_SetTimeouts(RTMPServer *s, int handshake, int idle);
+
+  /* serves until RTMPServer_Stop() is called, from any thread */
+  int RTMPServer_Run(RTMPServer *s);
+  void RTMPServer_Stop(RTMPServer *s);
+  void RTMPServer_Close(RTMPServer *s);
+
+  void RTMPConn_Close(RTMPConn *c);
+
+  /* Hand the connection over to a blocking RTMP of its own, e.g. for a
+   * thread that serves it. The loop forgets about it once the callback
+   * returns.
+   */
+  int RTMPConn_Detach(RTMPConn *c, RTMP *r);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
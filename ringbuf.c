@@ -0,0 +1,185 @@
+/*  Byte ring between one producer and one consumer thread
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with RTMPDump; see the file COPYING.  If not, write to
+ *  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *  http://www.gnu.org/copyleft/gpl.html
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ringbuf.h"
+#include "librtmp/rtmp.h"
+
+int
+RingInit(RingBuf *rb, size_t size)
+{
+  memset(rb, 0, sizeof(RingBuf));
+  rb->buf = malloc(size);
+  if (!rb->buf)
+    return FALSE;
+  rb->size = size;
+  MutexInit(&rb->lock);
+  CondInit(&rb->cond);
+  return TRUE;
+}
+
+void
+RingFree(RingBuf *rb)
+{
+  if (!rb->buf)
+    return;
+  free(rb->buf);
+  rb->buf = NULL;
+  CondDestroy(&rb->cond);
+  MutexDestroy(&rb->lock);
+}
+
+size_t
+RingUsed(RingBuf *rb)
+{
+  size_t used;
+
+  MutexLock(&rb->lock);
+  used = rb->head - rb->tail;
+  MutexUnlock(&rb->lock);
+  return used;
+}
+
+/* Queue len bytes. Without bWait only what fits right now is taken.
+ * Returns the number of bytes queued, -1 if the consumer aborted.
+ */
+int
+RingPut(RingBuf *rb, const char *data, size_t len, int bWait)
+{
+  size_t done = 0;
+
+  MutexLock(&rb->lock);
+  while (done < len)
+    {
+      size_t used, n, off;
+
+      if (rb->state == RING_ABORTED)
+	{
+	  MutexUnlock(&rb->lock);
+	  return -1;
+	}
+      used = rb->head - rb->tail;
+      if (used == rb->size)
+	{
+	  uint32_t start;
+
+	  if (!bWait)
+	    break;
+	  rb->nStalls++;
+	  start = RTMP_GetTime();
+	  while (rb->head - rb->tail == rb->size && rb->state != RING_ABORTED)
+	    CondWait(&rb->cond, &rb->lock);
+	  rb->stallMS += RTMP_GetTime() - start;
+	  continue;
+	}
+
+      /* copy outside the lock, only the consumer moves tail and it
+       * never looks past head
+       */
+      off = rb->head % rb->size;
+      n = rb->size - used;
+      if (n > rb->size - off)
+	n = rb->size - off;
+      if (n > len - done)
+	n = len - done;
+      MutexUnlock(&rb->lock);
+      memcpy(rb->buf + off, data + done, n);
+      MutexLock(&rb->lock);
+
+      rb->head += n;
+      done += n;
+      if (rb->head - rb->tail > rb->highWater)
+	rb->highWater = rb->head - rb->tail;
+      CondBroadcast(&rb->cond);
+    }
+  MutexUnlock(&rb->lock);
+  return done;
+}
+
+void
+RingClose(RingBuf *rb)
+{
+  MutexLock(&rb->lock);
+  if (rb->state == RING_OPEN)
+    rb->state = RING_CLOSED;
+  CondBroadcast(&rb->cond);
+  MutexUnlock(&rb->lock);
+}
+
+void
+RingWaitDone(RingBuf *rb)
+{
+  MutexLock(&rb->lock);
+  while (!rb->bDone)
+    CondWait(&rb->cond, &rb->lock);
+  MutexUnlock(&rb->lock);
+}
+
+/* Wait for data. Returns the length of the contiguous run at *data,
+ * 0 once the ring is closed and drained or aborted.
+ */
+size_t
+RingGet(RingBuf *rb, const char **data)
+{
+  size_t n = 0, off;
+
+  MutexLock(&rb->lock);
+  while (rb->head == rb->tail && rb->state == RING_OPEN)
+    CondWait(&rb->cond, &rb->lock);
+  if (rb->state != RING_ABORTED && rb->head != rb->tail)
+    {
+      off = rb->tail % rb->size;
+      n = rb->head - rb->tail;
+      if (n > rb->size - off)
+	n = rb->size - off;
+      *data = rb->buf + off;
+    }
+  MutexUnlock(&rb->lock);
+  return n;
+}
+
+void
+RingConsume(RingBuf *rb, size_t len)
+{
+  MutexLock(&rb->lock);
+  rb->tail += len;
+  CondBroadcast(&rb->cond);
+  MutexUnlock(&rb->lock);
+}
+
+void
+RingAbort(RingBuf *rb)
+{
+  MutexLock(&rb->lock);
+  rb->state = RING_ABORTED;
+  CondBroadcast(&rb->cond);
+  MutexUnlock(&rb->lock);
+}
+
+void
+RingDone(RingBuf *rb)
+{
+  MutexLock(&rb->lock);
+  rb->bDone = TRUE;
+  CondBroadcast(&rb->cond);
+  MutexUnlock(&rb->lock);
+}
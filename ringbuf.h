@@ -0,0 +1,64 @@
+/*  Byte ring between one producer and one consumer thread
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with RTMPDump; see the file COPYING.  If not, write to
+ *  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *  http://www.gnu.org/copyleft/gpl.html
+ *
+ */
+
+#ifndef __RINGBUF_H__
+#define __RINGBUF_H__ 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include "thread.h"
+
+#define RING_OPEN	0
+#define RING_CLOSED	1	/* producer is done, drain what's left */
+#define RING_ABORTED	2	/* consumer gave up */
+
+typedef struct RingBuf
+{
+  char *buf;
+  size_t size;
+  uint64_t head;		/* bytes put so far */
+  uint64_t tail;		/* bytes consumed so far */
+  int state;
+  int bDone;			/* consumer has stopped touching the ring */
+  TMUTEX lock;
+  TCOND cond;
+
+  /* high-water metrics */
+  size_t highWater;		/* most bytes ever queued */
+  unsigned long nStalls;	/* times the producer found the ring full */
+  uint32_t stallMS;		/* time it spent waiting for room */
+} RingBuf;
+
+int RingInit(RingBuf *rb, size_t size);
+void RingFree(RingBuf *rb);
+
+/* producer side */
+int RingPut(RingBuf *rb, const char *data, size_t len, int bWait);
+void RingClose(RingBuf *rb);
+void RingWaitDone(RingBuf *rb);
+size_t RingUsed(RingBuf *rb);
+
+/* consumer side */
+size_t RingGet(RingBuf *rb, const char **data);
+void RingConsume(RingBuf *rb, size_t len);
+void RingAbort(RingBuf *rb);
+void RingDone(RingBuf *rb);
+
+#endif /* __RINGBUF_H__ */
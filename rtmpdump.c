@@ -21,6 +21,7 @@
  */
 
 #define _FILE_OFFSET_BITS	64
+#define _GNU_SOURCE		/* O_DIRECT, fallocate, sync_file_range */
 
 #include <stdlib.h>
 #include <string.h>
@@ -32,6 +33,7 @@
 
 #include "librtmp/rtmp_sys.h"
 #include "librtmp/log.h"
+#include "ringbuf.h"
 
 #ifdef WIN32
 #define fseeko fseeko64
@@ -39,7 +41,13 @@
 #include <io.h>
 #include <fcntl.h>
 #define	SET_BINMODE(f)	setmode(fileno(f), O_BINARY)
+#define fsync(fd)	_commit(fd)
+#define poll	WSAPoll
 #else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
 #define	SET_BINMODE(f)
 #endif
 
@@ -51,6 +59,9 @@
 #define DEF_TIMEOUT	30	/* seconds */
 #define DEF_BUFTIME	(10 * 60 * 60 * 1000)	/* 10 hours default */
 #define DEF_SKIPFRM	0
+#define DEF_RINGBUF	8192	/* kbytes buffered between network and disk */
+#define DEF_BLOCKSIZE	1024	/* kbytes per output write */
+#define DEF_PREALLOC	16	/* mbytes allocated ahead of the output */
 
 // starts sockets
 int
@@ -130,16 +141,806 @@ static const AVal av_token = AVC("token");
 static const AVal av_playlist = AVC("playlist");
 static const AVal av_true = AVC("true");
 
+/* Output file backend
+ *
+ * Regular files we opened ourselves are written in large blocks aligned
+ * to OUT_ALIGN with pwrite, optionally with O_DIRECT. Space is
+ * fallocate'd ahead of the writes and finished blocks are pushed to disk
+ * and dropped from the page cache, so many parallel recordings don't
+ * pile up dirty pages or fragment the filesystem. Pipes, and anything
+ * where this isn't available, go through stdio as before.
+ */
+#define OUT_ALIGN	4096
+
+typedef struct OUTFILE
+{
+  FILE *file;
+  int fd;			/* -1 when writing through stdio */
+  int bDirect;
+  char *block;			/* aligned staging buffer */
+  size_t blockSize;
+  size_t blockLen;		/* bytes staged in block */
+  off_t blockStart;		/* file offset of block[0] */
+  off_t prevBlock;		/* last full block, for writeback, or -1 */
+  off_t end;			/* where the next write lands */
+  off_t fileSize;
+  off_t allocEnd;		/* space reserved up to here */
+  off_t prealloc;		/* reservation step, 0 for none */
+  uint32_t fsyncMS;		/* 0 for no periodic fsync */
+  uint32_t lastSync;
+} OUTFILE;
+
+static void
+OutInit(OUTFILE *o, FILE *file, int bOwned, uint32_t blockKB, int bDirect,
+	uint32_t preallocMB, uint32_t fsyncSec)
+{
+  memset(o, 0, sizeof(OUTFILE));
+  o->file = file;
+  o->fd = -1;
+  o->end = ftello(file);
+  o->prevBlock = -1;
+  o->fsyncMS = fsyncSec * 1000;
+  o->lastSync = RTMP_GetTime();
+
+#ifndef WIN32
+  {
+    struct stat st;
+    void *mem;
+    int fd = fileno(file);
+
+    /* pwrite ignores the offset on O_APPEND descriptors, e.g. stdout
+     * redirected with >>, and would append every block again
+     */
+    if (!bOwned || !blockKB || o->end < 0 || fstat(fd, &st)
+	|| !S_ISREG(st.st_mode) || (fcntl(fd, F_GETFL) & O_APPEND))
+      return;
+
+    o->blockSize = ((off_t) blockKB * 1024 + OUT_ALIGN - 1) & ~(OUT_ALIGN - 1);
+    if (posix_memalign(&mem, OUT_ALIGN, o->blockSize))
+      return;
+    o->block = mem;
+
+    /* start on an aligned offset, with the bytes before end in the block */
+    fflush(file);
+    o->blockStart = o->end & ~((off_t) OUT_ALIGN - 1);
+    o->blockLen = o->end - o->blockStart;
+    if (o->blockLen
+	&& pread(fd, o->block, o->blockLen, o->blockStart) != (ssize_t) o->blockLen)
+      {
+	RTMP_Log(RTMP_LOGWARNING, "Couldn't read back the end of the output, using stdio");
+	free(o->block);
+	o->block = NULL;
+	return;
+      }
+
+    o->fd = fd;
+    o->fileSize = o->allocEnd = st.st_size;
+    o->prealloc = (off_t) preallocMB * 1024 * 1024;
+#ifdef O_DIRECT
+    if (bDirect)
+      {
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) == 0)
+	  o->bDirect = TRUE;
+	else
+	  RTMP_Log(RTMP_LOGWARNING, "O_DIRECT not supported on the output file");
+      }
+#else
+    if (bDirect)
+      RTMP_Log(RTMP_LOGWARNING, "O_DIRECT not supported on this system");
+#endif
+  }
+#endif
+}
+
+#ifndef WIN32
+static void
+OutPrealloc(OUTFILE *o, off_t upto)
+{
+#ifdef FALLOC_FL_KEEP_SIZE
+  off_t len;
+
+  if (!o->prealloc || upto <= o->allocEnd)
+    return;
+  len = (upto - o->allocEnd + o->prealloc - 1) / o->prealloc * o->prealloc;
+  /* keep the size so readers and --resume never see the reserved space */
+  if (fallocate(o->fd, FALLOC_FL_KEEP_SIZE, o->allocEnd, len) == 0)
+    o->allocEnd += len;
+  else
+    {
+      RTMP_Log(RTMP_LOGDEBUG, "%s: fallocate failed, error %d", __FUNCTION__,
+	  errno);
+      o->prealloc = 0;
+    }
+#endif
+}
+
+/* start writeback of a full block and drop the one before it from the
+ * page cache once it has reached the disk
+ */
+static void
+OutWriteback(OUTFILE *o, off_t off)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+  sync_file_range(o->fd, off, o->blockSize, SYNC_FILE_RANGE_WRITE);
+  if (o->prevBlock >= 0)
+    sync_file_range(o->fd, o->prevBlock, o->blockSize,
+		    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+		    SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+#ifdef POSIX_FADV_DONTNEED
+  if (o->prevBlock >= 0)
+    posix_fadvise(o->fd, o->prevBlock, o->blockSize, POSIX_FADV_DONTNEED);
+#endif
+  o->prevBlock = off;
+}
+
+/* write the first len bytes of the block at blockStart */
+static int
+OutWriteBlock(OUTFILE *o, size_t len)
+{
+  size_t wlen = len, done = 0;
+  off_t off = o->blockStart;
+
+  if (o->bDirect)
+    {
+      wlen = (len + OUT_ALIGN - 1) & ~(OUT_ALIGN - 1);
+      memset(o->block + len, 0, wlen - len);
+    }
+  OutPrealloc(o, off + wlen);
+
+  while (done < wlen)
+    {
+      ssize_t n = pwrite(o->fd, o->block + done, wlen - done, off + done);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  RTMP_Log(RTMP_LOGERROR, "%s: pwrite failed, error %d", __FUNCTION__,
+	      errno);
+	  return FALSE;
+	}
+      done += n;
+    }
+
+  if (off + (off_t) wlen > o->fileSize)
+    {
+      off_t real = off + (off_t) len;
+      if (real < o->fileSize)
+	real = o->fileSize;
+      /* cut off the O_DIRECT padding again */
+      if (wlen != len && ftruncate(o->fd, real))
+	RTMP_Log(RTMP_LOGWARNING, "%s: ftruncate failed, error %d",
+	    __FUNCTION__, errno);
+      o->fileSize = real;
+    }
+
+  if (!o->bDirect && len == o->blockSize)
+    OutWriteback(o, off);
+  return TRUE;
+}
+#endif
+
+/* hand the staged tail of the output to the kernel */
+static int
+OutFlush(OUTFILE *o)
+{
+#ifndef WIN32
+  if (o->fd >= 0)
+    return !o->blockLen || OutWriteBlock(o, o->blockLen);
+#endif
+  return fflush(o->file) == 0;
+}
+
+/* make everything written so far durable */
+static void
+OutSync(OUTFILE *o)
+{
+  OutFlush(o);
+#if !defined(WIN32) && defined(_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0
+  if (o->fd >= 0)
+    fdatasync(o->fd);
+  else
+#endif
+    fsync(fileno(o->file));
+  o->lastSync = RTMP_GetTime();
+}
+
+static int
+OutWrite(OUTFILE *o, const char *buf, size_t len)
+{
+#ifndef WIN32
+  if (o->fd >= 0)
+    {
+      size_t done = 0;
+
+      while (done < len)
+	{
+	  size_t n = o->blockSize - o->blockLen;
+	  if (n > len - done)
+	    n = len - done;
+	  memcpy(o->block + o->blockLen, buf + done, n);
+	  o->blockLen += n;
+	  done += n;
+	  if (o->blockLen == o->blockSize)
+	    {
+	      if (!OutWriteBlock(o, o->blockSize))
+		return FALSE;
+	      o->blockStart += o->blockSize;
+	      o->blockLen = 0;
+	    }
+	}
+    }
+  else
+#endif
+  if (fwrite(buf, sizeof(unsigned char), len, o->file) != len)
+    return FALSE;
+
+  o->end += len;
+  if (o->fsyncMS && RTMP_GetTime() - o->lastSync > o->fsyncMS)
+    OutSync(o);
+  return TRUE;
+}
+
+/* done writing, leave the FILE positioned at the end of the output */
+static void
+OutClose(OUTFILE *o)
+{
+  if (!o->file)
+    return;
+  OutFlush(o);
+#ifndef WIN32
+  if (o->fd >= 0)
+    {
+      /* give back what we reserved past the end */
+      if (o->allocEnd > o->fileSize && ftruncate(o->fd, o->fileSize))
+	RTMP_Log(RTMP_LOGDEBUG, "%s: ftruncate failed, error %d",
+	    __FUNCTION__, errno);
+#ifdef O_DIRECT
+      if (o->bDirect)
+	fcntl(o->fd, F_SETFL, fcntl(o->fd, F_GETFL) & ~O_DIRECT);
+#endif
+      free(o->block);
+      o->block = NULL;
+      o->fd = -1;
+      fseeko(o->file, o->end, SEEK_SET);
+    }
+#endif
+  o->file = NULL;
+}
+
+/* Keyframe index sidecar
+ *
+ * While downloading into a file we keep <file>.idx next to it. It is an
+ * append-only list of 16 byte records following an 8 byte magic:
+ *   type(1) tagsize(3) timestamp(4) offset(8), all big-endian
+ * 'K' is a video keyframe tag, 'A' an audio tag usable as seek point in
+ * audio-only files, 'M' the onMetaData tag and 'S' the end of the last
+ * tag known to be on disk. Records are held back until the FLV data they
+ * refer to has been synced, so --resume can seek straight to the last
+ * keyframe instead of walking the file.
+ */
+#define IDX_MAGIC	"FLVIDX\0\1"
+#define IDX_MAGICLEN	8
+#define IDX_RECSIZE	16
+#define IDX_MAXPEND	64
+#define IDX_SYNCMS	2000	/* sync the FLV and the index this often */
+#define IDX_AUDIOMS	1000	/* spacing of audio seek points */
+#define IDX_HDRSIZE	(11 + 13)	/* tag header + "\002\000\012onMetaData" */
+
+typedef struct FLVIndex
+{
+  FILE *fp;
+  char *name;
+  off_t next;			/* offset of the next tag header in the FLV */
+  off_t good;			/* end of the last complete tag */
+  off_t synced;			/* good as of the last 'S' record */
+  uint32_t ts;			/* timestamp of the tag at next */
+  uint32_t goodTS;
+  uint32_t lastAudioTS;
+  int bVideo;
+  int bAudio;
+  int bMeta;
+  int hlen;
+  char hbuf[IDX_HDRSIZE];
+  int npend;
+  char pend[IDX_MAXPEND * IDX_RECSIZE];
+  uint32_t lastSync;
+} FLVIndex;
+
+static void
+IndexEncode(char *rec, int type, uint32_t tagsize, uint32_t ts, off_t offset)
+{
+  char *end = rec + IDX_RECSIZE;
+
+  rec[0] = type;
+  AMF_EncodeInt24(rec + 1, end, tagsize);
+  AMF_EncodeInt32(rec + 4, end, ts);
+  AMF_EncodeInt32(rec + 8, end, (uint32_t) ((uint64_t) offset >> 32));
+  AMF_EncodeInt32(rec + 12, end, (uint32_t) offset);
+}
+
+static off_t
+IndexOffset(const char *rec)
+{
+  return (off_t) (((uint64_t) AMF_DecodeInt32(rec + 8) << 32) |
+		  AMF_DecodeInt32(rec + 12));
+}
+
+/* end of the FLV data a record depends on */
+static off_t
+IndexEnd(const char *rec)
+{
+  if (rec[0] == 'S')
+    return IndexOffset(rec);
+  return IndexOffset(rec) + AMF_DecodeInt24(rec + 1) + 15;
+}
+
+/* read all complete records of an index, returns their count */
+static int
+IndexRead(const char *name, char **recs)
+{
+  FILE *fp;
+  char magic[IDX_MAGICLEN];
+  off_t len;
+  int n = 0;
+
+  *recs = NULL;
+  fp = fopen(name, "rb");
+  if (!fp)
+    return 0;
+
+  if (fread(magic, 1, IDX_MAGICLEN, fp) != IDX_MAGICLEN
+      || memcmp(magic, IDX_MAGIC, IDX_MAGICLEN))
+    {
+      RTMP_Log(RTMP_LOGWARNING, "%s is not a keyframe index, ignoring", name);
+      fclose(fp);
+      return 0;
+    }
+
+  fseeko(fp, 0, SEEK_END);
+  len = ftello(fp) - IDX_MAGICLEN;
+  n = len / IDX_RECSIZE;	/* a torn last record is dropped */
+  if (n > 0)
+    {
+      *recs = malloc(n * IDX_RECSIZE);
+      fseeko(fp, IDX_MAGICLEN, SEEK_SET);
+      if (!*recs || fread(*recs, IDX_RECSIZE, n, fp) != (size_t) n)
+	{
+	  free(*recs);
+	  *recs = NULL;
+	  n = 0;
+	}
+    }
+  fclose(fp);
+  return n;
+}
+
+static void
+IndexInit(FLVIndex *idx, const char *flvFile)
+{
+  memset(idx, 0, sizeof(FLVIndex));
+  idx->name = malloc(strlen(flvFile) + sizeof(".idx"));
+  if (idx->name)
+    sprintf(idx->name, "%s.idx", flvFile);
+}
+
+/* Start indexing output written at offset. Records for data at or past
+ * offset are stale and get dropped from the sidecar.
+ */
+static void
+IndexStart(FLVIndex *idx, off_t offset, int bHeader)
+{
+  char *recs;
+  int i, n;
+
+  if (!idx || !idx->name)
+    return;
+
+  n = IndexRead(idx->name, &recs);
+  if (idx->fp)
+    fclose(idx->fp);
+  idx->fp = fopen(idx->name, "wb");
+  if (!idx->fp)
+    {
+      RTMP_Log(RTMP_LOGWARNING,
+	  "Couldn't create keyframe index %s, resuming will need to scan the file",
+	  idx->name);
+      free(recs);
+      return;
+    }
+
+  idx->bMeta = FALSE;
+  fwrite(IDX_MAGIC, 1, IDX_MAGICLEN, idx->fp);
+  for (i = 0; i < n; i++)
+    {
+      char *rec = recs + i * IDX_RECSIZE;
+      if (IndexEnd(rec) > offset)
+	break;
+      if (rec[0] == 'M')
+	idx->bMeta = TRUE;
+      fwrite(rec, 1, IDX_RECSIZE, idx->fp);
+    }
+  free(recs);
+  fflush(idx->fp);
+  fsync(fileno(idx->fp));
+
+  idx->next = offset + (bHeader ? 13 : 0);
+  idx->good = idx->synced = idx->next;
+  idx->goodTS = idx->ts = 0;
+  idx->hlen = 0;
+  idx->npend = 0;
+  idx->bVideo = idx->bAudio = FALSE;
+  idx->lastSync = RTMP_GetTime();
+}
+
+/* Write out the pending records whose tags are complete, once the FLV
+ * data underneath them is on disk.
+ */
+static void
+IndexSync(FLVIndex *idx, OUTFILE *out)
+{
+  char rec[IDX_RECSIZE];
+  int i, n = 0;
+
+  if (!idx || !idx->fp)
+    return;
+
+  idx->lastSync = RTMP_GetTime();
+  if (idx->good == idx->synced)
+    return;
+
+  OutSync(out);
+
+  for (i = 0; i < idx->npend; i++)
+    {
+      char *p = idx->pend + i * IDX_RECSIZE;
+      if (IndexEnd(p) > idx->good)
+	break;
+    }
+  n = i;
+  if (n)
+    fwrite(idx->pend, IDX_RECSIZE, n, idx->fp);
+  idx->npend -= n;
+  memmove(idx->pend, idx->pend + n * IDX_RECSIZE, idx->npend * IDX_RECSIZE);
+
+  IndexEncode(rec, 'S', 0, idx->goodTS, idx->good);
+  fwrite(rec, 1, IDX_RECSIZE, idx->fp);
+  fflush(idx->fp);
+  fsync(fileno(idx->fp));
+  idx->synced = idx->good;
+}
+
+static void
+IndexAdd(FLVIndex *idx, OUTFILE *out, int type, uint32_t tagsize, uint32_t ts,
+	 off_t offset)
+{
+  if (idx->npend == IDX_MAXPEND)
+    {
+      IndexSync(idx, out);
+      /* nothing could be flushed, the oldest pending tag is still
+       * incomplete. Should never happen with sane tag sizes.
+       */
+      if (idx->npend == IDX_MAXPEND)
+	return;
+    }
+  IndexEncode(idx->pend + idx->npend * IDX_RECSIZE, type, tagsize, ts,
+	      offset);
+  idx->npend++;
+}
+
+/* Follow the FLV tags in data just written at offset start */
+static void
+IndexWrite(FLVIndex *idx, OUTFILE *out, const char *buf, int len, off_t start)
+{
+  off_t end = start + len;
+
+  if (!idx || !idx->fp)
+    return;
+
+  while (idx->next + idx->hlen < end)
+    {
+      off_t p = idx->next + idx->hlen;
+      uint32_t dsize = 0;
+      int need = 11, n, bSized = idx->hlen >= 4;
+
+      if (bSized)
+	{
+	  dsize = AMF_DecodeInt24(idx->hbuf + 1);
+	  need += dsize < IDX_HDRSIZE - 11 ? dsize : IDX_HDRSIZE - 11;
+	}
+      n = need - idx->hlen;
+      if (n > end - p)
+	n = end - p;
+      memcpy(idx->hbuf + idx->hlen, buf + (p - start), n);
+      idx->hlen += n;
+      if (idx->hlen < need || !bSized)
+	continue;
+
+      {
+	char *h = idx->hbuf;
+	int type = h[0] & 0x1f;
+	off_t tag = idx->next;
+
+	/* everything up to this header has been written */
+	idx->good = tag;
+	idx->goodTS = idx->ts;
+
+	idx->ts = AMF_DecodeInt24(h + 4) | ((uint32_t) (uint8_t) h[7] << 24);
+	idx->next += dsize + 15;
+	idx->hlen = 0;
+
+	if (type == 0x09 && dsize > 0)
+	  {
+	    idx->bVideo = TRUE;
+	    if ((h[11] & 0xf0) == 0x10)
+	      IndexAdd(idx, out, 'K', dsize, idx->ts, tag);
+	  }
+	else if (type == 0x08 && dsize > 0 && !idx->bVideo)
+	  {
+	    if (!idx->bAudio || idx->ts - idx->lastAudioTS >= IDX_AUDIOMS)
+	      {
+		IndexAdd(idx, out, 'A', dsize, idx->ts, tag);
+		idx->lastAudioTS = idx->ts;
+		idx->bAudio = TRUE;
+	      }
+	  }
+	else if (type == 0x12 && !idx->bMeta && dsize >= 13
+		 && h[11] == AMF_STRING
+		 && AMF_DecodeInt16(h + 12) == av_onMetaData.av_len
+		 && !memcmp(h + 14, av_onMetaData.av_val, av_onMetaData.av_len))
+	  {
+	    IndexAdd(idx, out, 'M', dsize, idx->ts, tag);
+	    idx->bMeta = TRUE;
+	  }
+      }
+    }
+  if (idx->next <= end)
+    {
+      idx->good = idx->next;
+      idx->goodTS = idx->ts;
+    }
+
+  if (RTMP_GetTime() - idx->lastSync > IDX_SYNCMS)
+    IndexSync(idx, out);
+}
+
+/* bDone: the download is complete, the sidecar isn't needed anymore */
+static void
+IndexClose(FLVIndex *idx, OUTFILE *out, int bDone)
+{
+  if (idx->fp)
+    {
+      if (!bDone)
+	IndexSync(idx, out);
+      fclose(idx->fp);
+      idx->fp = NULL;
+    }
+  if (idx->name)
+    {
+      if (bDone)
+	remove(idx->name);
+      free(idx->name);
+      idx->name = NULL;
+    }
+}
+
+/* Look up where to resume from. Returns the offsets of the onMetaData tag
+ * and of the keyframe nSkipKeyFrames back from the last one that was
+ * synced, 0 when unknown. Both are only hints and get verified against
+ * the file.
+ */
+static void
+IndexFind(const char *flvFile, int nSkipKeyFrames, off_t *metaOffset,
+	  off_t *keyOffset)
+{
+  FLVIndex idx;
+  char *recs;
+  off_t good = 0;
+  int i, n, type = 'A';
+
+  *metaOffset = *keyOffset = 0;
+
+  IndexInit(&idx, flvFile);
+  if (!idx.name)
+    return;
+  n = IndexRead(idx.name, &recs);
+  free(idx.name);
+
+  for (i = 0; i < n; i++)
+    {
+      char *rec = recs + i * IDX_RECSIZE;
+      if (rec[0] == 'S' && IndexOffset(rec) > good)
+	good = IndexOffset(rec);
+      else if (rec[0] == 'K')
+	type = 'K';
+    }
+
+  for (i = n - 1; i >= 0; i--)
+    {
+      char *rec = recs + i * IDX_RECSIZE;
+      if (IndexEnd(rec) > good)
+	continue;
+      if (rec[0] == 'M')
+	*metaOffset = IndexOffset(rec);
+      else if (rec[0] == type && !*keyOffset)
+	{
+	  if (nSkipKeyFrames > 0)
+	    nSkipKeyFrames--;
+	  else
+	    *keyOffset = IndexOffset(rec);
+	}
+    }
+  free(recs);
+
+  if (*keyOffset)
+    RTMP_Log(RTMP_LOGDEBUG, "Keyframe index: resume at 0x%llx, meta data at 0x%llx",
+	(unsigned long long) *keyOffset, (unsigned long long) *metaOffset);
+}
+
+/* The resume code walks the output file through a window of it, mapped
+ * where possible, instead of a seek and a read per tag. The window is
+ * bounded so huge files don't need to fit into the address space.
+ */
+#define FLV_WINDOW	(16 * 1024 * 1024)
+#define FLV_SYNCSIZE	0x100000	/* 1MB should be enough for 3500K bitrates */
+
+typedef struct FLVWindow
+{
+  FILE *file;
+  off_t size;			/* of the file */
+  off_t start;			/* file offset of buf */
+  size_t len;
+  const char *buf;
+  void *mem;			/* mapping or malloc'ed copy */
+  size_t memlen;
+  int bMapped;
+} FLVWindow;
+
+static void
+WindowInit(FLVWindow *w, FILE *file, off_t size)
+{
+  memset(w, 0, sizeof(FLVWindow));
+  w->file = file;
+  w->size = size;
+}
+
+static void
+WindowRelease(FLVWindow *w)
+{
+  if (w->mem)
+    {
+#ifndef WIN32
+      if (w->bMapped)
+	munmap(w->mem, w->memlen);
+      else
+#endif
+	free(w->mem);
+    }
+  w->mem = NULL;
+  w->buf = NULL;
+  w->len = 0;
+}
+
+/* Returns a pointer to len bytes of the file at pos, valid until the next
+ * call, or NULL if they're not in the file. bBackward tells which way we
+ * are walking so the window is placed to cover the next requests too.
+ */
+static const char *
+WindowGet(FLVWindow *w, off_t pos, size_t len, int bBackward)
+{
+  off_t start;
+  size_t wlen;
+
+  if (pos < 0 || pos + (off_t) len > w->size)
+    return NULL;
+  if (w->buf && pos >= w->start && pos + len <= w->start + w->len)
+    return w->buf + (pos - w->start);
+
+  WindowRelease(w);
+  wlen = len > FLV_WINDOW ? len : FLV_WINDOW;
+  start = bBackward ? pos + (off_t) len - (off_t) wlen : pos;
+  if (start + (off_t) wlen > w->size)
+    start = w->size - wlen;
+  if (start < 0)
+    start = 0;
+  /* the window stays bounded, only a small file gets mapped whole */
+  if (start + (off_t) wlen > w->size)
+    wlen = w->size - start;
+
+#ifndef WIN32
+  {
+    off_t pgoff = start & ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+
+    w->memlen = wlen + (start - pgoff);
+    w->mem = mmap(NULL, w->memlen, PROT_READ, MAP_SHARED, fileno(w->file),
+		  pgoff);
+    if (w->mem != MAP_FAILED)
+      {
+	w->bMapped = TRUE;
+	w->buf = (char *) w->mem + (start - pgoff);
+      }
+    else
+      w->mem = NULL;
+  }
+#endif
+  if (!w->mem)
+    {
+      w->bMapped = FALSE;
+      w->mem = malloc(wlen);
+      if (!w->mem)
+	return NULL;
+      fseeko(w->file, start, SEEK_SET);
+      if (fread(w->mem, 1, wlen, w->file) != wlen)
+	{
+	  WindowRelease(w);
+	  return NULL;
+	}
+      w->buf = w->mem;
+    }
+  w->start = start;
+  w->len = wlen;
+  return w->buf + (pos - w->start);
+}
+
+/* Find the last complete tag of a file whose tail got cut off. Instead of
+ * probing every byte for a tag header, look for its trailer: for any
+ * sane tag the top byte of the size is zero, and the size has to point
+ * back at a header with a known type, zero StreamID and matching length.
+ * Returns the file offset of that trailer, 0 if there's none.
+ */
+static off_t
+FLVResync(FLVWindow *w)
+{
+  off_t len = w->size > FLV_SYNCSIZE ? FLV_SYNCSIZE : w->size;
+  const char *buf, *t;
+
+  if (len <= 13 + 15)
+    return 0;
+  len -= 13;			// do not read header
+  buf = WindowGet(w, w->size - len, len, TRUE);
+  if (!buf)
+    return 0;
+
+  for (t = buf + len - 4; t >= buf + 11; t--)
+    {
+      uint32_t tagSize;
+      const char *h;
+      int dataType;
+
+      if (*t)
+	continue;
+      tagSize = AMF_DecodeInt32(t);
+      if (tagSize < 11 || tagSize > (uint32_t) (t - buf))
+	continue;
+      h = t - tagSize;
+      /* Check for Audio/Video/Script */
+      dataType = h[0] & 0x1f;
+      if (dataType != 8 && dataType != 9 && dataType != 18)
+	continue;
+      /* Check for StreamID */
+      if (h[8] || h[9] || h[10])
+	continue;
+      if (AMF_DecodeInt24(h + 1) + 11 != tagSize)
+	continue;
+
+      RTMP_Log(RTMP_LOGDEBUG, "Sync success - found last tag at 0x%x",
+	  (uint32_t) (w->size - len + (h - buf)));
+      return w->size - len + (t - buf);
+    }
+  return 0;
+}
+
 int
 OpenResumeFile(const char *flvFile,	// file name [in]
 	       FILE ** file,	// opened file [out]
 	       off_t * size,	// size of the file [out]
 	       char **metaHeader,	// meta data read from the file [out]
 	       uint32_t * nMetaHeaderSize,	// length of metaHeader [out]
-	       double *duration)	// duration of the stream in ms [out]
+	       double *duration,	// duration of the stream in ms [out]
+	       off_t metaOffset)	// offset of the meta data tag if known, else 0 [in]
 {
-  size_t bufferSize = 0;
-  char hbuf[16], *buffer = NULL;
+  FLVWindow w;
+  const char *hbuf, *buffer;
 
   *nMetaHeaderSize = 0;
   *size = 0;
@@ -157,16 +958,21 @@ OpenResumeFile(const char *flvFile,	// file name [in]
       // verify FLV format and read header
       uint32_t prevTagSize = 0;
 
+      WindowInit(&w, *file, *size);
+
       // check we've got a valid FLV file to continue!
-      if (fread(hbuf, 1, 13, *file) != 13)
+      hbuf = WindowGet(&w, 0, 13, FALSE);
+      if (!hbuf)
 	{
 	  RTMP_Log(RTMP_LOGERROR, "Couldn't read FLV file header!");
+	  WindowRelease(&w);
 	  return RD_FAILED;
 	}
       if (hbuf[0] != 'F' || hbuf[1] != 'L' || hbuf[2] != 'V'
 	  || hbuf[3] != 0x01)
 	{
 	  RTMP_Log(RTMP_LOGERROR, "Invalid FLV file!");
+	  WindowRelease(&w);
 	  return RD_FAILED;
 	}
 
@@ -174,15 +980,17 @@ OpenResumeFile(const char *flvFile,	// file name [in]
 	{
 	  RTMP_Log(RTMP_LOGERROR,
 	      "FLV file contains neither video nor audio, aborting!");
+	  WindowRelease(&w);
 	  return RD_FAILED;
 	}
 
       uint32_t dataOffset = AMF_DecodeInt32(hbuf + 5);
-      fseek(*file, dataOffset, SEEK_SET);
 
-      if (fread(hbuf, 1, 4, *file) != 4)
+      hbuf = WindowGet(&w, dataOffset, 4, FALSE);
+      if (!hbuf)
 	{
 	  RTMP_Log(RTMP_LOGERROR, "Invalid FLV file: missing first prevTagSize!");
+	  WindowRelease(&w);
 	  return RD_FAILED;
 	}
       prevTagSize = AMF_DecodeInt32(hbuf);
@@ -197,29 +1005,24 @@ OpenResumeFile(const char *flvFile,	// file name [in]
       off_t pos = dataOffset + 4;
       int bFoundMetaHeader = FALSE;
 
+      // the keyframe index knows where it is, otherwise walk the tags
+      if (metaOffset > pos && metaOffset < *size - 4)
+	pos = metaOffset;
+      else
+	metaOffset = 0;
+
       while (pos < *size - 4 && !bFoundMetaHeader)
 	{
-	  fseeko(*file, pos, SEEK_SET);
-	  if (fread(hbuf, 1, 4, *file) != 4)
+	  hbuf = WindowGet(&w, pos, 4, FALSE);
+	  if (!hbuf)
 	    break;
 
 	  uint32_t dataSize = AMF_DecodeInt24(hbuf + 1);
 
 	  if (hbuf[0] == 0x12)
 	    {
-	      if (dataSize > bufferSize)
-		{
-                  /* round up to next page boundary */
-                  bufferSize = dataSize + 4095;
-		  bufferSize ^= (bufferSize & 4095);
-		  free(buffer);
-                  buffer = malloc(bufferSize);
-                  if (!buffer)
-		    return RD_FAILED;
-		}
-
-	      fseeko(*file, pos + 11, SEEK_SET);
-	      if (fread(buffer, 1, dataSize, *file) != dataSize)
+	      buffer = WindowGet(&w, pos + 11, dataSize, FALSE);
+	      if (!buffer)
 		break;
 
 	      AMFObject metaObj;
@@ -259,10 +1062,17 @@ OpenResumeFile(const char *flvFile,	// file name [in]
 	      //metaObj.Reset();
 	      //delete obj;
 	    }
+	  if (metaOffset)
+	    {
+	      RTMP_Log(RTMP_LOGDEBUG, "No meta data at indexed offset, scanning");
+	      pos = dataOffset + 4;
+	      metaOffset = 0;
+	      continue;
+	    }
 	  pos += (dataSize + 11 + 4);
 	}
 
-      free(buffer);
+      WindowRelease(&w);
       if (!bFoundMetaHeader)
 	RTMP_Log(RTMP_LOGWARNING, "Couldn't locate meta data!");
     }
@@ -270,27 +1080,26 @@ OpenResumeFile(const char *flvFile,	// file name [in]
   return RD_SUCCESS;
 }
 
-int
-GetLastKeyframe(FILE * file,	// output file [in]
-		int nSkipKeyFrames,	// max number of frames to skip when searching for key frame [in]
-		uint32_t * dSeek,	// offset of the last key frame [out]
-		char **initialFrame,	// content of the last keyframe [out]
-		int *initialFrameType,	// initial frame type (audio/video) [out]
-		uint32_t * nInitialFrameSize)	// length of initialFrame [out]
+static int
+FindLastKeyframe(FLVWindow * w,	// window on the output file [in]
+		 int nSkipKeyFrames,	// max number of frames to skip when searching for key frame [in]
+		 off_t keyOffset,	// offset of the keyframe from the index, 0 if unknown [in]
+		 uint32_t * dSeek,	// offset of the last key frame [out]
+		 char **initialFrame,	// content of the last keyframe [out]
+		 int *initialFrameType,	// initial frame type (audio/video) [out]
+		 uint32_t * nInitialFrameSize)	// length of initialFrame [out]
 {
   const size_t bufferSize = 16;
   char buffer[bufferSize];
+  const char *p;
   uint8_t dataType;
   int bAudioOnly;
-  off_t size;
-  char *syncbuf, *p;
-
-  fseek(file, 0, SEEK_END);
-  size = ftello(file);
+  off_t size = w->size;
 
-  fseek(file, 4, SEEK_SET);
-  if (fread(&dataType, sizeof(uint8_t), 1, file) != 1)
+  p = WindowGet(w, 4, 1, TRUE);
+  if (!p)
     return RD_FAILED;
+  dataType = p[0];
 
   bAudioOnly = (dataType & 0x4) && !(dataType & 0x1);
 
@@ -304,11 +1113,35 @@ GetLastKeyframe(FILE * file,	// output file [in]
   // find the last seekable frame
   off_t tsize = 0;
   uint32_t prevTagSize = 0;
+  int bIndexed = FALSE;
+
+  // the index hands us the keyframe, check it is really there
+  if (keyOffset > 13 && keyOffset + 16 <= size)
+    {
+      p = WindowGet(w, keyOffset, 12, TRUE);
+      if (p && ((bAudioOnly && p[0] == 0x08)
+		|| (!bAudioOnly && p[0] == 0x09 && (p[11] & 0xf0) == 0x10)))
+	{
+	  memcpy(buffer, p, 12);
+	  prevTagSize = AMF_DecodeInt24(buffer + 1) + 11;
+	  p = WindowGet(w, keyOffset + prevTagSize, 4, TRUE);
+	  if (p && AMF_DecodeInt32(p) == prevTagSize)
+	    {
+	      tsize = size - keyOffset;
+	      bIndexed = TRUE;
+	    }
+	}
+      if (!bIndexed)
+	{
+	  RTMP_Log(RTMP_LOGWARNING,
+	      "Keyframe index doesn't match the file, searching for the last keyframe");
+	  prevTagSize = 0;
+	}
+    }
 
   // go through the file and find the last video keyframe
-  do
+  if (!bIndexed) do
     {
-      int xread;
     skipkeyframe:
       if (size - tsize < 13)
 	{
@@ -316,60 +1149,27 @@ GetLastKeyframe(FILE * file,	// output file [in]
 	      "Unexpected start of file, error in tag sizes, couldn't arrive at prevTagSize=0");
 	  return RD_FAILED;
 	}
-      fseeko(file, size - tsize - 4, SEEK_SET);
-      xread = fread(buffer, 1, 4, file);
-      if (xread != 4)
+      p = WindowGet(w, size - tsize - 4, 4, TRUE);
+      if (!p)
 	{
 	  RTMP_Log(RTMP_LOGERROR, "Couldn't read prevTagSize from file!");
 	  return RD_FAILED;
 	}
 
-      prevTagSize = AMF_DecodeInt32(buffer);
+      prevTagSize = AMF_DecodeInt32(p);
       //RTMP_Log(RTMP_LOGDEBUG, "Last packet: prevTagSize: %d", prevTagSize);
 
       if (prevTagSize <= 0 || prevTagSize > size - 4 - 13)
         {
           /* Last packet was not fully received - try to sync to last tag */
+          off_t trailer = FLVResync(w);
+
           prevTagSize = 0;
-          tsize = size > 0x100000 ? 0x100000 : size; /* 1MB should be enough for 3500K bitrates */
-          if (tsize > 13 + 15)
+          if (trailer)
             {
-              tsize -= 13; // do not read header
-              syncbuf = (char *) malloc(tsize);
-              if (syncbuf)
-                {
-                  fseeko(file, size - tsize, SEEK_SET);
-                  if (fread(syncbuf, 1, tsize, file) == tsize)
-                    {
-                      p = syncbuf + tsize;
-                      while (p >= syncbuf + 15)
-                        {
-                          /* Check for StreamID */
-                          if (AMF_DecodeInt24(p - 7) == 0)
-                            {
-                              /* Check for Audio/Video/Script */
-                              dataType = p[-15] & 0x1F;
-                              if (dataType == 8 || dataType == 9 || dataType == 18)
-                                {
-                                  prevTagSize = AMF_DecodeInt24(p - 14);
-                                  if ((prevTagSize < tsize) && (p + prevTagSize + 11 <= syncbuf + tsize - 4)
-                                      && (AMF_DecodeInt32(p - 4 + prevTagSize) == prevTagSize + 11))
-                                    {
-                                      prevTagSize = syncbuf + tsize - p + 15;
-                                      RTMP_Log(RTMP_LOGDEBUG, "Sync success - found last tag at 0x%x", (uint32_t) (size - prevTagSize));
-                                      prevTagSize -= 4;
-                                      tsize = 0;
-                                      break;
-                                    }
-                                  else
-                                    prevTagSize = 0;
-                                }
-                            }
-                          --p;
-                        }
-                    }
-                  free(syncbuf);
-                }
+              p = WindowGet(w, trailer, 4, TRUE);
+              prevTagSize = AMF_DecodeInt32(p);
+              tsize = size - trailer - 4;
             }
         }
       if (prevTagSize == 0)
@@ -388,12 +1188,13 @@ GetLastKeyframe(FILE * file,	// output file [in]
       tsize += prevTagSize + 4;
 
       // read header
-      fseeko(file, size - tsize, SEEK_SET);
-      if (fread(buffer, 1, 12, file) != 12)
+      p = WindowGet(w, size - tsize, 12, TRUE);
+      if (!p)
 	{
 	  RTMP_Log(RTMP_LOGERROR, "Couldn't read header!");
 	  return RD_FAILED;
 	}
+      memcpy(buffer, p, 12);
       //*
 #ifdef _DEBUG
       uint32_t ts = AMF_DecodeInt24(buffer + 4);
@@ -425,14 +1226,15 @@ GetLastKeyframe(FILE * file,	// output file [in]
   // save keyframe to compare/find position in stream
   *initialFrameType = buffer[0];
   *nInitialFrameSize = prevTagSize - 11;
-  *initialFrame = (char *) malloc(*nInitialFrameSize);
 
-  fseeko(file, size - tsize + 11, SEEK_SET);
-  if (fread(*initialFrame, 1, *nInitialFrameSize, file) != *nInitialFrameSize)
+  p = WindowGet(w, size - tsize + 11, *nInitialFrameSize, TRUE);
+  if (!p)
     {
       RTMP_Log(RTMP_LOGERROR, "Couldn't read last keyframe, aborting!");
       return RD_FAILED;
     }
+  *initialFrame = (char *) malloc(*nInitialFrameSize);
+  memcpy(*initialFrame, p, *nInitialFrameSize);
 
   *dSeek = AMF_DecodeInt24(buffer + 4);	// set seek position to keyframe tmestamp
   *dSeek |= (buffer[7] << 24);
@@ -473,7 +1275,7 @@ GetLastKeyframe(FILE * file,	// output file [in]
     {
       // seek to position after keyframe in our file (we will ignore the keyframes resent by the server
       // since they are sent a couple of times and handling this would be a mess)
-      fseeko(file, size - tsize + prevTagSize + 4, SEEK_SET);
+      fseeko(w->file, size - tsize + prevTagSize + 4, SEEK_SET);
 
       // make sure the WriteStream doesn't write headers and ignores all the 0ms TS packets
       // (including several meta data headers and the keyframe we seeked to)
@@ -485,16 +1287,158 @@ GetLastKeyframe(FILE * file,	// output file [in]
   return RD_SUCCESS;
 }
 
+int
+GetLastKeyframe(FILE * file,	// output file [in]
+		int nSkipKeyFrames,	// max number of frames to skip when searching for key frame [in]
+		off_t keyOffset,	// offset of the keyframe from the index, 0 if unknown [in]
+		uint32_t * dSeek,	// offset of the last key frame [out]
+		char **initialFrame,	// content of the last keyframe [out]
+		int *initialFrameType,	// initial frame type (audio/video) [out]
+		uint32_t * nInitialFrameSize)	// length of initialFrame [out]
+{
+  FLVWindow w;
+  int nStatus;
+
+  fseek(file, 0, SEEK_END);
+  WindowInit(&w, file, ftello(file));
+  nStatus = FindLastKeyframe(&w, nSkipKeyFrames, keyOffset, dSeek,
+			     initialFrame, initialFrameType, nInitialFrameSize);
+  WindowRelease(&w);
+  return nStatus;
+}
+
+/* Output of a download. With a ring the file is written by its own
+ * thread, so a stalling disk doesn't stop us from reading the socket.
+ */
+typedef struct WRITER
+{
+  OUTFILE *out;
+  FLVIndex *idx;
+  off_t size;			/* where the next write lands */
+  int bThreaded;
+  RingBuf ring;
+} WRITER;
+
+static int
+WriteOut(WRITER *w, const char *buf, int len)
+{
+  if (!OutWrite(w->out, buf, len))
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s: Failed writing, exiting!", __FUNCTION__);
+      return -1;
+    }
+  IndexWrite(w->idx, w->out, buf, len, w->size);
+  w->size += len;
+  return len;
+}
+
+static TFTYPE
+WriterThread(void *arg)
+{
+  WRITER *w = arg;
+  const char *data;
+  size_t len;
+
+  while ((len = RingGet(&w->ring, &data)) > 0)
+    {
+      if (WriteOut(w, data, len) < 0)
+	{
+	  RingAbort(&w->ring);
+	  break;
+	}
+      RingConsume(&w->ring, len);
+    }
+  RingDone(&w->ring);
+  TFRET();
+}
+
+static void
+WriterStart(WRITER *w, OUTFILE *out, FLVIndex *idx, uint32_t ringSize)
+{
+  w->out = out;
+  w->idx = idx;
+  w->size = out->end;
+  w->bThreaded = FALSE;
+
+  if (!ringSize)
+    return;
+  if (!RingInit(&w->ring, ringSize))
+    {
+      RTMP_Log(RTMP_LOGWARNING,
+	  "Couldn't allocate a %u kB write buffer, writing synchronously",
+	  ringSize / 1024);
+      return;
+    }
+  if (ThreadFailed(ThreadCreate(WriterThread, w)))
+    {
+      RTMP_Log(RTMP_LOGWARNING,
+	  "Couldn't start the writer thread, writing synchronously");
+      RingFree(&w->ring);
+      return;
+    }
+  w->bThreaded = TRUE;
+}
+
+static int
+WriterPut(WRITER *w, const char *buf, int len)
+{
+  if (w->bThreaded)
+    return RingPut(&w->ring, buf, len, TRUE);
+  return WriteOut(w, buf, len);
+}
+
+/* wait for the writer to drain the ring */
+static void
+WriterFinish(WRITER *w)
+{
+  if (!w->bThreaded)
+    return;
+
+  RingClose(&w->ring);
+  RingWaitDone(&w->ring);
+  RTMP_Log(RTMP_LOGINFO,
+      "Write buffer: high-water %.1f kB of %.1f kB, full %lu times, waited %.3f sec",
+      (double) w->ring.highWater / 1024.0, (double) w->ring.size / 1024.0,
+      w->ring.nStalls, (double) w->ring.stallMS / 1000.0);
+  RingFree(&w->ring);
+  w->bThreaded = FALSE;
+}
+
+/* what the connection cost, for -z */
+static void
+LogStats(RTMP *r)
+{
+  RTMPStats st;
+  int i;
+
+  if (RTMP_debuglevel < RTMP_LOGDEBUG)
+    return;
+  RTMP_GetStats(r, &st);
+  RTMP_Log(RTMP_LOGDEBUG, "Bytes in %llu, out %llu, recv calls %llu, send calls %llu",
+      (unsigned long long) st.bytesIn, (unsigned long long) st.bytesOut,
+      (unsigned long long) st.recvCalls, (unsigned long long) st.sendCalls);
+  RTMP_Log(RTMP_LOGDEBUG, "Bytes copied %llu, allocations %llu, timeouts %llu, pauses %llu, toggles %llu",
+      (unsigned long long) st.bytesCopied, (unsigned long long) st.allocs,
+      (unsigned long long) st.timeouts, (unsigned long long) st.pauses,
+      (unsigned long long) st.toggles);
+  for (i = 0; i < RTMP_STATS_TYPES; i++)
+    if (st.chunksIn[i] || st.chunksOut[i])
+      RTMP_Log(RTMP_LOGDEBUG, "Type 0x%02x: %llu messages in %llu chunks received, %llu in %llu sent",
+	  i, (unsigned long long) st.msgsIn[i], (unsigned long long) st.chunksIn[i],
+	  (unsigned long long) st.msgsOut[i], (unsigned long long) st.chunksOut[i]);
+}
+
 int
 Download(RTMP * rtmp,		// connected RTMP object
-	 FILE * file, uint32_t dSeek, uint32_t dStopOffset, double duration, int bResume, char *metaHeader, uint32_t nMetaHeaderSize, char *initialFrame, int initialFrameType, uint32_t nInitialFrameSize, int nSkipKeyFrames, int bStdoutMode, int bLiveStream, int bRealtimeStream, int bHashes, int bOverrideBufferTime, uint32_t bufferTime, double *percent)	// percentage downloaded [out]
+	 OUTFILE * out, FLVIndex * idx, uint32_t ringSize, uint32_t dSeek, uint32_t dStopOffset, double duration, int bResume, char *metaHeader, uint32_t nMetaHeaderSize, char *initialFrame, int initialFrameType, uint32_t nInitialFrameSize, int nSkipKeyFrames, int bStdoutMode, int bLiveStream, int bRealtimeStream, int bHashes, int bOverrideBufferTime, uint32_t bufferTime, double *percent)	// percentage downloaded [out]
 {
-  int32_t now, lastUpdate;
+  uint32_t now, lastUpdate;
   int bufferSize = 64 * 1024;
   char *buffer;
   int nRead = 0;
-  off_t size = ftello(file);
+  off_t size = out->end;
   unsigned long lastPercent = 0;
+  WRITER writer;
 
   rtmp->m_read.timestamp = dSeek;
 
@@ -547,6 +1491,7 @@ Download(RTMP * rtmp,		// connected RTMP object
 
   if (bResume && nInitialFrameSize > 0)
     rtmp->m_read.flags |= RTMP_READ_RESUME;
+  rtmp->m_read.flags |= RTMP_READ_FILL;
   rtmp->m_read.initialFrameType = initialFrameType;
   rtmp->m_read.nResumeTS = dSeek;
   rtmp->m_read.metaHeader = metaHeader;
@@ -554,7 +1499,11 @@ Download(RTMP * rtmp,		// connected RTMP object
   rtmp->m_read.nMetaHeaderSize = nMetaHeaderSize;
   rtmp->m_read.nInitialFrameSize = nInitialFrameSize;
 
+  IndexStart(idx, size,
+	     !(rtmp->m_read.flags & (RTMP_READ_HEADER | RTMP_READ_RESUME)));
+
   buffer = (char *) malloc(bufferSize);
+  WriterStart(&writer, out, idx, ringSize);
 
   now = RTMP_GetTime();
   lastUpdate = now - 1000;
@@ -564,10 +1513,9 @@ Download(RTMP * rtmp,		// connected RTMP object
       //RTMP_LogPrintf("nRead: %d\n", nRead);
       if (nRead > 0)
 	{
-	  if (fwrite(buffer, sizeof(unsigned char), nRead, file) !=
-	      (size_t) nRead)
+	  if (WriterPut(&writer, buffer, nRead) != nRead)
 	    {
-	      RTMP_Log(RTMP_LOGERROR, "%s: Failed writing, exiting!", __FUNCTION__);
+	      WriterFinish(&writer);
 	      free(buffer);
 	      return RD_FAILED;
 	    }
@@ -603,7 +1551,7 @@ Download(RTMP * rtmp,		// connected RTMP object
 	      else
 		{
 		  now = RTMP_GetTime();
-		  if (abs(now - lastUpdate) > 200)
+		  if (now - lastUpdate > 200)
 		    {
 		      RTMP_LogStatus("\r%.3f kB / %.2f sec (%.1f%%)",
 				(double) size / 1024.0,
@@ -615,7 +1563,7 @@ Download(RTMP * rtmp,		// connected RTMP object
 	  else
 	    {
 	      now = RTMP_GetTime();
-	      if (abs(now - lastUpdate) > 200)
+	      if (now - lastUpdate > 200)
 		{
 		  if (bHashes)
 		    RTMP_LogStatus("#");
@@ -638,6 +1586,9 @@ Download(RTMP * rtmp,		// connected RTMP object
     }
   while (!RTMP_ctrlC && nRead > -1 && RTMP_IsConnected(rtmp) && !RTMP_IsTimedout(rtmp));
   free(buffer);
+  WriterFinish(&writer);
+  IndexSync(idx, out);
+  OutFlush(out);
   if (nRead < 0)
     nRead = rtmp->m_read.status;
 
@@ -680,6 +1631,628 @@ Download(RTMP * rtmp,		// connected RTMP object
   return RD_SUCCESS;
 }
 
+/* --flvheader: both, meta or probe[:kB] */
+static int
+ParseHeaderMode(const char *arg, int *mode, int *bufSize)
+{
+  if (!strcmp(arg, "both"))
+    *mode = RTMP_HDR_BOTH;
+  else if (!strcmp(arg, "meta"))
+    *mode = RTMP_HDR_META;
+  else if (!strncmp(arg, "probe", 5) && (!arg[5] || arg[5] == ':'))
+    {
+      *mode = RTMP_HDR_PROBE;
+      if (arg[5])
+	*bufSize = atoi(arg + 6) * 1024;
+    }
+  else
+    return FALSE;
+  return TRUE;
+}
+
+/* Batch mode: record all jobs of a list over a few threads. Each thread
+ * polls the sockets of its own jobs, so a recorder doesn't need a
+ * process per stream. A job line is
+ *
+ *   output url [option=value ...]
+ *
+ * taking the librtmp URL options, plus retries=num (-1 for no limit)
+ * and resume=0|1 for what to do after a connection failed. Recorded
+ * streams are resumed from the last keyframe, live streams go on in a
+ * new file, output.1, output.2 and so on. Empty lines and lines
+ * starting with # are skipped.
+ */
+#define BATCH_RETRIES	5
+#define BATCH_MAXWAIT	60	/* seconds between two tries, at most */
+#define BATCH_BUFSIZE	(64 * 1024)
+
+#define JOB_WAIT	0	/* until nextTry */
+#define JOB_RUN		1
+#define JOB_DONE	2
+
+typedef struct JOB
+{
+  struct BATCH *batch;
+  char *line;			/* holds output and url */
+  char *output;
+  char *url;
+  char *urlbuf;			/* the copy RTMP_SetupURL takes apart */
+  int num;
+  int maxRetries;
+  int bResume;
+  int nTries;
+  int nPart;
+  int bLive;
+  int bData;			/* something was written to this part */
+  int state;
+  int bStarting;		/* JobThread() has it, under batch->lock */
+  int status;
+  uint32_t nextTry;
+  uint32_t lastData;
+  double duration;
+  char *metaHeader;
+  char *initialFrame;
+  FILE *file;
+  OUTFILE out;
+  RTMP rtmp;
+} JOB;
+
+typedef struct BATCH
+{
+  JOB *jobs;
+  int nJobs;
+  int nThreads;
+  uint32_t bufferTime;
+  long timeout;
+  int hdrMode;
+  int hdrBufSize;
+  int nRunning;			/* batch and start threads */
+  TMUTEX lock;
+  TCOND cond;
+} BATCH;
+
+typedef struct BATCHTHREAD
+{
+  BATCH *batch;
+  int first;			/* handles jobs first, first + nThreads, ... */
+} BATCHTHREAD;
+
+/* split off the batch options, the rest is passed to RTMP_SetupURL */
+static int
+ParseJob(JOB *j, char *line, int num)
+{
+  char *p, *q, *out;
+
+  memset(j, 0, sizeof(JOB));
+  j->num = num;
+  j->maxRetries = BATCH_RETRIES;
+  j->bResume = TRUE;
+
+  j->line = strdup(line);
+  if (!j->line)
+    return FALSE;
+  p = j->line + strspn(j->line, " \t");
+  j->output = p;
+  p += strcspn(p, " \t");
+  if (!*p)
+    return FALSE;
+  *p++ = '\0';
+  p += strspn(p, " \t");
+  j->url = p;
+
+  for (out = q = p; *q; )
+    {
+      size_t len = strcspn(q, " \t");
+
+      if (!strncmp(q, "retries=", 8))
+	j->maxRetries = atoi(q + 8);
+      else if (!strncmp(q, "resume=", 7))
+	j->bResume = atoi(q + 7) != 0;
+      else
+	{
+	  if (out != j->url)
+	    *out++ = ' ';
+	  memmove(out, q, len);
+	  out += len;
+	}
+      q += len;
+      q += strspn(q, " \t");
+    }
+  *out = '\0';
+  return *j->url != '\0';
+}
+
+/* output, then output.1 and so on for later parts of a live stream */
+static char *
+JobFile(JOB *j)
+{
+  char *name = malloc(strlen(j->output) + 16);
+
+  if (!name)
+    return NULL;
+  if (j->nPart)
+    sprintf(name, "%s.%d", j->output, j->nPart);
+  else
+    strcpy(name, j->output);
+  return name;
+}
+
+static void
+JobClose(JOB *j)
+{
+  RTMP_Close(&j->rtmp);
+  if (j->file)
+    {
+      OutClose(&j->out);
+      fclose(j->file);
+      j->file = NULL;
+    }
+  free(j->urlbuf);
+  j->urlbuf = NULL;
+  free(j->metaHeader);
+  j->metaHeader = NULL;
+  free(j->initialFrame);
+  j->initialFrame = NULL;
+}
+
+/* the job stopped with status, an incomplete one is tried again later
+ * if its retries allow
+ */
+static void
+JobEnd(JOB *j, int status)
+{
+  JobClose(j);
+  j->status = status;
+
+  if (status != RD_INCOMPLETE || RTMP_ctrlC
+      || (j->maxRetries >= 0 && j->nTries > j->maxRetries))
+    {
+      j->state = JOB_DONE;
+      RTMP_LogPrintf("Job %d: %s %s\n", j->num, j->output,
+		status == RD_SUCCESS ? "complete" :
+		status == RD_INCOMPLETE ? "incomplete, giving up" : "failed");
+      return;
+    }
+
+  {
+    int wait = 1 << (j->nTries < 6 ? j->nTries : 6);
+    if (wait > BATCH_MAXWAIT)
+      wait = BATCH_MAXWAIT;
+    RTMP_Log(RTMP_LOGWARNING, "Job %d: %s incomplete, retrying in %d sec",
+	j->num, j->output, wait);
+    j->state = JOB_WAIT;
+    j->nextTry = RTMP_GetTime() + wait * 1000;
+  }
+}
+
+static void
+JobStart(BATCH *b, JOB *j)
+{
+  RTMP *r = &j->rtmp;
+  uint32_t dSeek = 0, nMetaHeaderSize = 0, nInitialFrameSize = 0;
+  int initialFrameType = 0, bResume = FALSE;
+  off_t size = 0;
+  char *name;
+
+  j->nTries++;
+  j->state = JOB_RUN;
+
+  RTMP_Init(r);
+  r->Link.timeout = b->timeout;
+  j->urlbuf = strdup(j->url);
+  if (!j->urlbuf || !RTMP_SetupURL(r, j->urlbuf))
+    {
+      RTMP_Log(RTMP_LOGERROR, "Job %d: couldn't parse URL: %s", j->num,
+	  j->url);
+      JobEnd(j, RD_FAILED);
+      return;
+    }
+  RTMP_SetBufferMS(r, b->bufferTime);
+  r->m_read.hdrMode = b->hdrMode;
+  r->m_read.hdrBufSize = b->hdrBufSize;
+  j->bLive = (r->Link.lFlags & RTMP_LF_LIVE) != 0;
+  if (!j->bLive && !(r->Link.protocol & RTMP_FEATURE_HTTP))
+    r->Link.lFlags |= RTMP_LF_BUFX;
+
+  /* a retry of a live stream mustn't overwrite what was recorded */
+  if (j->bLive && j->bData)
+    {
+      j->nPart++;
+      j->bData = FALSE;
+    }
+  name = JobFile(j);
+  if (!name)
+    {
+      JobEnd(j, RD_FAILED);
+      return;
+    }
+
+  if (!j->bLive && j->bResume)
+    {
+      if (OpenResumeFile(name, &j->file, &size, &j->metaHeader,
+			 &nMetaHeaderSize, &j->duration, 0) == RD_FAILED)
+	goto fail;
+      /* nothing but the FLV header from an attempt that got no data */
+      if (j->file && size > 13)
+	{
+	  if (GetLastKeyframe(j->file, 0, 0, &dSeek, &j->initialFrame,
+			      &initialFrameType, &nInitialFrameSize) == RD_FAILED)
+	    goto fail;
+	  bResume = dSeek > 0;
+	}
+    }
+  if (!j->file || !bResume)
+    {
+      if (j->file)
+	fclose(j->file);
+      j->file = fopen(name, "w+b");
+      if (!j->file)
+	{
+	  RTMP_Log(RTMP_LOGERROR, "Job %d: failed to open %s", j->num, name);
+	  goto fail;
+	}
+    }
+  /* stdio, a block buffer per job would add up */
+  OutInit(&j->out, j->file, TRUE, 0, FALSE, 0, 0);
+
+  RTMP_LogPrintf("Job %d: %s %s\n", j->num, bResume ? "resuming" : "starting",
+	    name);
+  free(name);
+  name = NULL;
+
+  if (!RTMP_Connect(r, NULL) || !RTMP_ConnectStream(r, dSeek))
+    {
+      JobEnd(j, RD_INCOMPLETE);
+      return;
+    }
+
+  r->m_read.timestamp = dSeek;
+  if (bResume && nInitialFrameSize > 0)
+    r->m_read.flags |= RTMP_READ_RESUME;
+  r->m_read.flags |= RTMP_READ_FILL;
+  r->m_read.initialFrameType = initialFrameType;
+  r->m_read.nResumeTS = dSeek;
+  r->m_read.metaHeader = j->metaHeader;
+  r->m_read.initialFrame = j->initialFrame;
+  r->m_read.nMetaHeaderSize = nMetaHeaderSize;
+  r->m_read.nInitialFrameSize = nInitialFrameSize;
+  /* RTMPT has to be read blocking, bounded by the timeout */
+  if (!(r->Link.protocol & RTMP_FEATURE_HTTP) && !RTMP_SetNonBlock(r, TRUE))
+    {
+      JobEnd(j, RD_INCOMPLETE);
+      return;
+    }
+  j->lastData = RTMP_GetTime();
+  return;
+
+fail:
+  free(name);
+  JobEnd(j, RD_FAILED);
+}
+
+/* Connecting blocks, so every try is started by a thread of its own and
+ * handed back to the batch thread once the stream plays
+ */
+static TFTYPE
+JobThread(void *arg)
+{
+  JOB *j = arg;
+  BATCH *b = j->batch;
+
+  JobStart(b, j);
+
+  MutexLock(&b->lock);
+  j->bStarting = FALSE;
+  b->nRunning--;
+  CondSignal(&b->cond);
+  MutexUnlock(&b->lock);
+  TFRET();
+}
+
+static void
+JobLaunch(BATCH *b, JOB *j)
+{
+  MutexLock(&b->lock);
+  j->bStarting = TRUE;
+  b->nRunning++;
+  MutexUnlock(&b->lock);
+
+  if (ThreadFailed(ThreadCreate(JobThread, j)))
+    {
+      RTMP_Log(RTMP_LOGWARNING, "Job %d: no thread to connect, connecting here",
+	  j->num);
+      JobThread(j);
+    }
+}
+
+static int
+JobStarting(BATCH *b, JOB *j)
+{
+  int ret;
+
+  MutexLock(&b->lock);
+  ret = j->bStarting;
+  MutexUnlock(&b->lock);
+  return ret;
+}
+
+/* read what is there without waiting for the rest */
+static void
+JobRead(JOB *j, char *buf)
+{
+  RTMP *r = &j->rtmp;
+  int nRead;
+
+  nRead = RTMP_Read(r, buf, BATCH_BUFSIZE);
+  if (nRead > 0)
+    {
+      if (!OutWrite(&j->out, buf, nRead))
+	{
+	  RTMP_Log(RTMP_LOGERROR, "Job %d: failed writing %s", j->num,
+	      j->output);
+	  JobEnd(j, RD_FAILED);
+	  return;
+	}
+      j->lastData = RTMP_GetTime();
+      j->bData = TRUE;
+      if (j->duration <= 0)
+	j->duration = RTMP_GetDuration(r);
+      /* the end may have come along with the last data */
+      if (!r->m_read.status)
+	return;
+    }
+
+  /* a packet without media, or nothing complete yet */
+  if (nRead == 0 && !r->m_read.status && RTMP_IsConnected(r))
+    return;
+
+  if (r->m_read.status == RTMP_READ_COMPLETE)
+    JobEnd(j, RD_SUCCESS);
+  else if (r->m_read.status == RTMP_READ_EOF && !j->bLive
+	   && j->duration > 0 && r->m_read.timestamp >= j->duration * 999.0)
+    JobEnd(j, RD_SUCCESS);
+  else
+    JobEnd(j, RD_INCOMPLETE);
+}
+
+static TFTYPE
+BatchThread(void *arg)
+{
+  BATCHTHREAD *t = arg;
+  BATCH *b = t->batch;
+  struct pollfd *fds;
+  JOB **polled;
+  char *buf;
+  int i, n, nLeft;
+
+  n = (b->nJobs - t->first + b->nThreads - 1) / b->nThreads;
+  fds = malloc(n * sizeof(struct pollfd));
+  polled = malloc(n * sizeof(JOB *));
+  buf = malloc(BATCH_BUFSIZE);
+  if (!fds || !polled || !buf)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s: failed to allocate memory", __FUNCTION__);
+      goto done;
+    }
+
+  do
+    {
+      uint32_t now = RTMP_GetTime();
+      int wait = 1000, nfds = 0, bBuffered = FALSE;
+
+      nLeft = 0;
+      for (i = t->first; i < b->nJobs; i += b->nThreads)
+	{
+	  JOB *j = &b->jobs[i];
+
+	  if (JobStarting(b, j))
+	    {
+	      /* look again soon, it is played or given up any moment */
+	      nLeft++;
+	      if (wait > 100)
+		wait = 100;
+	      continue;
+	    }
+	  if (j->state == JOB_WAIT && (int32_t) (now - j->nextTry) >= 0)
+	    {
+	      JobLaunch(b, j);
+	      nLeft++;
+	      continue;
+	    }
+	  if (j->state == JOB_DONE)
+	    continue;
+	  nLeft++;
+	  if (j->state == JOB_WAIT)
+	    {
+	      if ((int32_t) (j->nextTry - now) < wait)
+		wait = j->nextTry - now;
+	      continue;
+	    }
+	  /* lastData may be a bit newer than now, set by JobThread() */
+	  if ((int32_t) (now - j->lastData) > j->rtmp.Link.timeout * 1000)
+	    {
+	      RTMP_Log(RTMP_LOGERROR, "Job %d: no data for %d sec", j->num,
+		  j->rtmp.Link.timeout);
+	      JobEnd(j, RD_INCOMPLETE);
+	      continue;
+	    }
+	  /* data librtmp already has won't wake up poll, unless it is just
+	   * the start of a chunk
+	   */
+	  if (j->rtmp.m_read.buf
+	      || (j->rtmp.m_sb.sb_size > 0 && !RTMP_IsTimedout(&j->rtmp)))
+	    bBuffered = TRUE;
+	  fds[nfds].fd = RTMP_Socket(&j->rtmp);
+	  fds[nfds].events = POLLIN;
+	  if (j->rtmp.m_outLen)
+	    fds[nfds].events |= POLLOUT;
+	  fds[nfds].revents = 0;
+	  polled[nfds++] = j;
+	}
+      if (!nLeft || RTMP_ctrlC)
+	break;
+      if (bBuffered || wait < 0)
+	wait = 0;
+
+      if (poll(fds, nfds, wait) < 0 && GetSockError() != EINTR)
+	{
+	  RTMP_Log(RTMP_LOGERROR, "%s: poll failed, %d", __FUNCTION__,
+	      GetSockError());
+	  break;
+	}
+      for (i = 0; i < nfds; i++)
+	{
+	  JOB *j = polled[i];
+
+	  if ((fds[i].revents & POLLOUT) && RTMP_Flush(&j->rtmp) < 0)
+	    {
+	      JobEnd(j, RD_INCOMPLETE);
+	      continue;
+	    }
+	  if ((fds[i].revents & ~POLLOUT) || j->rtmp.m_read.buf
+	      || (j->rtmp.m_sb.sb_size > 0 && !RTMP_IsTimedout(&j->rtmp)))
+	    JobRead(j, buf);
+	}
+    }
+  while (!RTMP_ctrlC);
+
+done:
+  free(fds);
+  free(polled);
+  free(buf);
+
+  MutexLock(&b->lock);
+  b->nRunning--;
+  CondSignal(&b->cond);
+  MutexUnlock(&b->lock);
+  TFRET();
+}
+
+static int
+Batch(const char *listFile, int nThreads, uint32_t bufferTime, long timeout,
+      int hdrMode, int hdrBufSize)
+{
+  BATCH b = { 0 };
+  BATCHTHREAD *threads;
+  FILE *fp;
+  char line[2048];
+  int i, nLine = 0, nFailed = 0, nIncomplete = 0;
+
+  fp = fopen(listFile, "r");
+  if (!fp)
+    {
+      RTMP_Log(RTMP_LOGERROR, "Failed to open job list %s", listFile);
+      return RD_FAILED;
+    }
+  while (fgets(line, sizeof(line), fp))
+    {
+      char *p = line + strspn(line, " \t");
+      JOB *jobs;
+
+      nLine++;
+      p[strcspn(p, "\r\n")] = '\0';
+      if (!*p || *p == '#')
+	continue;
+      jobs = realloc(b.jobs, (b.nJobs + 1) * sizeof(JOB));
+      if (!jobs)
+	break;
+      b.jobs = jobs;
+      if (!ParseJob(&b.jobs[b.nJobs], p, b.nJobs + 1))
+	{
+	  RTMP_Log(RTMP_LOGERROR, "%s:%d: expected an output file and a URL",
+	      listFile, nLine);
+	  free(b.jobs[b.nJobs].line);
+	  continue;
+	}
+      b.nJobs++;
+    }
+  fclose(fp);
+  if (!b.nJobs)
+    {
+      RTMP_Log(RTMP_LOGERROR, "No jobs in %s", listFile);
+      free(b.jobs);
+      return RD_FAILED;
+    }
+
+  if (nThreads <= 0)
+    {
+#ifdef _SC_NPROCESSORS_ONLN
+      nThreads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+      if (nThreads <= 0)
+	nThreads = 1;
+    }
+  if (nThreads > b.nJobs)
+    nThreads = b.nJobs;
+
+  b.nThreads = nThreads;
+  b.bufferTime = bufferTime;
+  b.timeout = timeout;
+  /* jobs are read without blocking, which can't probe */
+  if (hdrMode >= 0 && hdrMode != RTMP_HDR_BOTH)
+    RTMP_Log(RTMP_LOGWARNING, "--flvheader is always both with --batch");
+  b.hdrMode = RTMP_HDR_BOTH;
+  b.hdrBufSize = hdrBufSize;
+  b.nRunning = nThreads;
+  MutexInit(&b.lock);
+  CondInit(&b.cond);
+  for (i = 0; i < b.nJobs; i++)
+    b.jobs[i].batch = &b;
+
+  RTMP_LogPrintf("Recording %d streams in %d threads\n", b.nJobs, nThreads);
+  threads = malloc(nThreads * sizeof(BATCHTHREAD));
+  if (!threads)
+    return RD_FAILED;
+  for (i = 0; i < nThreads; i++)
+    {
+      threads[i].batch = &b;
+      threads[i].first = i;
+      if (ThreadFailed(ThreadCreate(BatchThread, &threads[i])))
+	{
+	  RTMP_Log(RTMP_LOGERROR, "Couldn't start batch thread %d", i);
+	  MutexLock(&b.lock);
+	  b.nRunning--;
+	  MutexUnlock(&b.lock);
+	}
+    }
+
+  MutexLock(&b.lock);
+  while (b.nRunning)
+    CondWait(&b.cond, &b.lock);
+  MutexUnlock(&b.lock);
+
+  for (i = 0; i < b.nJobs; i++)
+    {
+      /* interrupted */
+      if (b.jobs[i].state == JOB_RUN)
+	{
+	  JobClose(&b.jobs[i]);
+	  b.jobs[i].status = RD_INCOMPLETE;
+	}
+      else if (b.jobs[i].state == JOB_WAIT)
+	b.jobs[i].status = RD_INCOMPLETE;
+
+      if (b.jobs[i].status == RD_INCOMPLETE)
+	nIncomplete++;
+      else if (b.jobs[i].status != RD_SUCCESS)
+	nFailed++;
+      free(b.jobs[i].line);
+    }
+  RTMP_LogPrintf("%d of %d jobs complete, %d incomplete, %d failed\n",
+	    b.nJobs - nIncomplete - nFailed, b.nJobs, nIncomplete, nFailed);
+
+  free(threads);
+  free(b.jobs);
+  CondDestroy(&b.cond);
+  MutexDestroy(&b.lock);
+
+  if (nFailed)
+    return RD_FAILED;
+  if (nIncomplete)
+    return RD_INCOMPLETE;
+  return RD_SUCCESS;
+}
+
 #define STR2AVAL(av,str)	av.av_val = str; av.av_len = strlen(av.av_val)
 
 void usage(char *prog)
@@ -739,6 +2312,29 @@ void usage(char *prog)
 	    ("--flv|-o string         FLV output file name, if the file name is - print stream to stdout\n");
 	  RTMP_LogPrintf
 	    ("--resume|-e             Resume a partial RTMP download\n");
+	  RTMP_LogPrintf
+	    ("--noindex|-N            Don't keep a keyframe index (file.idx) for fast resuming\n");
+	  RTMP_LogPrintf
+	    ("--ringbuf|-G num        Buffer num kB between network and disk in a writer thread, 0 to write directly (default: %u)\n",
+	     DEF_RINGBUF);
+	  RTMP_LogPrintf
+	    ("--blocksize|-K num      Write the output file in aligned blocks of num kB, 0 to use stdio (default: %u)\n",
+	     DEF_BLOCKSIZE);
+	  RTMP_LogPrintf
+	    ("--direct|-D             Write the output file with O_DIRECT, bypassing the page cache\n");
+	  RTMP_LogPrintf
+	    ("--prealloc|-P num       Reserve disk space num MB ahead of the output, 0 to disable (default: %u)\n",
+	     DEF_PREALLOC);
+	  RTMP_LogPrintf
+	    ("--fsync|-F num          Flush the output file to disk every num seconds (default: never)\n");
+	  RTMP_LogPrintf
+	    ("--flvheader|-H mode     How to find the FLV header flags: both (set both right away), meta (from\n");
+	  RTMP_LogPrintf
+	    ("                        onMetaData) or probe[:num] (buffer up to num kB of the stream, default)\n");
+	  RTMP_LogPrintf
+	    ("--batch|-I file         Record all jobs listed in file, one \"output url [options]\" per line\n");
+	  RTMP_LogPrintf
+	    ("--threads|-U num        Threads for --batch (default: one per CPU)\n");
 	  RTMP_LogPrintf
 	    ("--timeout|-m num        Timeout connection num seconds (default: %u)\n",
 	     DEF_TIMEOUT);
@@ -807,6 +2403,18 @@ main(int argc, char **argv)
   int bLiveStream = FALSE;	// is it a live stream? then we can't seek/resume
   int bRealtimeStream = FALSE;  // If true, disable the BUFX hack (be patient)
   int bHashes = FALSE;		// display byte counters not hashes by default
+  int bIndex = TRUE;		// keep a keyframe index next to the output file
+  uint32_t ringSize = DEF_RINGBUF * 1024;	// write buffer, 0 writes synchronously
+  uint32_t blockKB = DEF_BLOCKSIZE;	// output block size, 0 for stdio
+  uint32_t preallocMB = DEF_PREALLOC;
+  uint32_t fsyncSec = 0;	// fsync the output this often, 0 for never
+  int bDirect = FALSE;		// write the output with O_DIRECT
+  int hdrMode = -1;		// FLV header strategy, -1 leaves it to librtmp
+  int hdrBufSize = 0;
+  char *batchFile = NULL;	// job list for batch mode
+  int nThreads = 0;		// batch threads, 0 for one per CPU
+  OUTFILE out = { 0 };
+  FLVIndex flvIndex = { 0 };
 
   long int timeout = DEF_TIMEOUT;	// timeout connection after 120 seconds
   uint32_t dStartOffset = 0;	// seek position in non-live mode
@@ -903,6 +2511,15 @@ main(int argc, char **argv)
     {"stop", 1, NULL, 'B'},
     {"token", 1, NULL, 'T'},
     {"hashes", 0, NULL, '#'},
+    {"noindex", 0, NULL, 'N'},
+    {"ringbuf", 1, NULL, 'G'},
+    {"blocksize", 1, NULL, 'K'},
+    {"direct", 0, NULL, 'D'},
+    {"prealloc", 1, NULL, 'P'},
+    {"fsync", 1, NULL, 'F'},
+    {"flvheader", 1, NULL, 'H'},
+    {"batch", 1, NULL, 'I'},
+    {"threads", 1, NULL, 'U'},
     {"debug", 0, NULL, 'z'},
     {"quiet", 0, NULL, 'q'},
     {"verbose", 0, NULL, 'V'},
@@ -913,7 +2530,7 @@ main(int argc, char **argv)
 
   while ((opt =
 	  getopt_long(argc, argv,
-                      "hVveqzRr:s:t:i:p:a:b:f:o:u:C:n:c:l:y:Ym:k:d:A:B:T:w:x:W:X:S:#j:J:",
+                      "hVveqzRNDr:s:t:i:p:a:b:f:o:u:C:n:c:l:y:Ym:k:d:A:B:T:w:x:W:X:S:#j:J:G:K:P:F:H:I:U:",
 		      longopts, NULL)) != -1)
     {
       switch (opt)
@@ -1114,6 +2731,67 @@ main(int argc, char **argv)
 	case '#':
 	  bHashes = TRUE;
 	  break;
+	case 'N':
+	  bIndex = FALSE;
+	  break;
+	case 'G':
+	  {
+	    int kb = atoi(optarg);
+	    if (kb < 0 || kb > 1024 * 1024)
+	      {
+		RTMP_Log(RTMP_LOGERROR,
+		    "Write buffer size must be between 0 and 1048576 kB, ignoring\n");
+	      }
+	    else
+	      {
+		ringSize = kb * 1024;
+	      }
+	    break;
+	  }
+	case 'K':
+	  {
+	    int kb = atoi(optarg);
+	    if (kb < 0 || kb > 64 * 1024)
+	      RTMP_Log(RTMP_LOGERROR,
+		  "Block size must be between 0 and 65536 kB, ignoring");
+	    else
+	      blockKB = kb;
+	    break;
+	  }
+	case 'D':
+	  bDirect = TRUE;
+	  break;
+	case 'P':
+	  {
+	    int mb = atoi(optarg);
+	    if (mb < 0 || mb > 1024 * 1024)
+	      RTMP_Log(RTMP_LOGERROR,
+		  "Preallocation must be between 0 and 1048576 MB, ignoring");
+	    else
+	      preallocMB = mb;
+	    break;
+	  }
+	case 'F':
+	  {
+	    int sec = atoi(optarg);
+	    if (sec < 0 || sec > 24 * 60 * 60)
+	      RTMP_Log(RTMP_LOGERROR,
+		  "Flush interval must be between 0 and 86400 seconds, ignoring");
+	    else
+	      fsyncSec = sec;
+	    break;
+	  }
+	case 'H':
+	  if (!ParseHeaderMode(optarg, &hdrMode, &hdrBufSize))
+	    RTMP_Log(RTMP_LOGERROR,
+		"Unknown FLV header mode %s, ignoring", optarg);
+	  break;
+	case 'I':
+	  batchFile = optarg;
+	  break;
+	case 'U':
+	  nThreads = atoi(optarg);
+	  break;
 	case 'q':
 	  RTMP_debuglevel = RTMP_LOGCRIT;
 	  break;
@@ -1140,6 +2818,14 @@ main(int argc, char **argv)
 	}
     }
 
+  if (batchFile)
+    {
+      nStatus = Batch(batchFile, nThreads, bufferTime, timeout, hdrMode,
+		      hdrBufSize);
+      CleanupSockets();
+      return nStatus;
+    }
+
   if (!hostname.av_len && !fullUrl.av_len)
     {
       RTMP_Log(RTMP_LOGERROR,
@@ -1262,6 +2948,12 @@ main(int argc, char **argv)
 	}
     }
 
+  if (hdrMode >= 0)
+    {
+      rtmp.m_read.hdrMode = hdrMode;
+      rtmp.m_read.hdrBufSize = hdrBufSize;
+    }
+
   /* Try to keep the stream moving if it pauses on us */
   if (!bLiveStream && !bRealtimeStream && !(protocol & RTMP_FEATURE_HTTP))
     rtmp.Link.lFlags |= RTMP_LF_BUFX;
@@ -1271,9 +2963,14 @@ main(int argc, char **argv)
   // ok, we have to get the timestamp of the last keyframe (only keyframes are seekable) / last audio frame (audio only streams)
   if (bResume)
     {
+      off_t metaOffset = 0, keyOffset = 0;
+
+      if (bIndex)
+	IndexFind(flvFile, nSkipKeyFrames, &metaOffset, &keyOffset);
+
       nStatus =
 	OpenResumeFile(flvFile, &file, &size, &metaHeader, &nMetaHeaderSize,
-		       &duration);
+		       &duration, metaOffset);
       if (nStatus == RD_FAILED)
 	goto clean;
 
@@ -1284,7 +2981,7 @@ main(int argc, char **argv)
 	}
       else
 	{
-	  nStatus = GetLastKeyframe(file, nSkipKeyFrames,
+	  nStatus = GetLastKeyframe(file, nSkipKeyFrames, keyOffset,
 				    &dSeek, &initialFrame,
 				    &initialFrameType, &nInitialFrameSize);
 	  if (nStatus == RD_FAILED)
@@ -1320,6 +3017,10 @@ main(int argc, char **argv)
 	}
     }
 
+  if (bIndex && !bStdoutMode)
+    IndexInit(&flvIndex, flvFile);
+  OutInit(&out, file, !bStdoutMode, blockKB, bDirect, preallocMB, fsyncSec);
+
 #ifdef _DEBUG
   netstackdump = fopen("netstackdump", "wb");
   netstackdump_read = fopen("netstackdump_read", "wb");
@@ -1428,7 +3129,7 @@ main(int argc, char **argv)
 	  bResume = TRUE;
 	}
 
-      nStatus = Download(&rtmp, file, dSeek, dStopOffset, duration, bResume,
+      nStatus = Download(&rtmp, &out, &flvIndex, ringSize, dSeek, dStopOffset, duration, bResume,
 			 metaHeader, nMetaHeaderSize, initialFrame,
 			 initialFrameType, nInitialFrameSize, nSkipKeyFrames,
 			 bStdoutMode, bLiveStream, bRealtimeStream, bHashes,
@@ -1454,9 +3155,13 @@ main(int argc, char **argv)
     }
 
 clean:
+  LogStats(&rtmp);
   RTMP_Log(RTMP_LOGDEBUG, "Closing connection.\n");
   RTMP_Close(&rtmp);
 
+  IndexClose(&flvIndex, &out, nStatus == RD_SUCCESS);
+  OutClose(&out);
+
   if (file != 0)
     fclose(file);
 
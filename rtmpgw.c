@@ -22,7 +22,10 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
 #include <math.h>
+#include <time.h>
 
 #include <signal.h>
 #include <getopt.h>
@@ -33,12 +36,24 @@
 #include "librtmp/log.h"
 
 #include "thread.h"
+#include "ringbuf.h"
+#include "hls.h"
+
+#ifdef WIN32
+#define poll	WSAPoll
+#else
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <poll.h>
+#endif
 
 #define RD_SUCCESS		0
 #define RD_FAILED		1
 #define RD_INCOMPLETE		2
 
 #define PACKET_SIZE 1024*1024
+#define REQUEST_SIZE 8192	/* longest request header we take */
 
 #ifdef WIN32
 #define InitSockets()	{\
@@ -71,6 +86,71 @@ typedef struct
 
 STREAMING_SERVER *httpServer = 0;	// server structure pointer
 
+/* one stream being served, for the status line and /metrics */
+typedef struct GW_SESSION
+{
+  struct GW_SESSION *next;
+  int id;
+  int sockfd;
+  char playpath[256];
+  uint32_t connectMS;		/* in RTMP_Connect */
+  uint32_t startMS;		/* from connected to the first data */
+  uint64_t bytesUp;		/* read from the RTMP server */
+  uint64_t bytesSent;		/* written to the HTTP client */
+  uint64_t queued;		/* waiting in its output queue */
+  uint64_t dropped;		/* tags it was too slow for */
+  uint64_t reconnects;
+  uint64_t lastUp;		/* bytesUp at the last status tick */
+  double rate;			/* upstream bytes/sec since then */
+  uint32_t timestamp;		/* stream position */
+  double duration;
+} GW_SESSION;
+
+#define LAT_BUCKETS	10
+static const double latBounds[LAT_BUCKETS] = {
+  0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5
+};
+
+typedef struct
+{
+  uint64_t bucket[LAT_BUCKETS + 1];	/* the last one is +Inf */
+  uint64_t count;
+  double sum;
+} LATENCY;
+
+enum
+{
+  ERR_NONE = -1,
+  ERR_REQUEST,			/* bad or unsupported HTTP request */
+  ERR_CONNECT,			/* couldn't connect to the RTMP server */
+  ERR_UPSTREAM,			/* stream broke off before it was complete */
+  ERR_SEND,			/* sending to the client failed */
+  ERR_KINDS
+};
+static const char *errKinds[ERR_KINDS] = {
+  "request", "connect", "upstream", "send"
+};
+
+static struct
+{
+  TMUTEX lock;
+  GW_SESSION *sessions;
+  int nSessions;
+  int lastId;
+  uint32_t lastTick;
+  uint64_t requests;
+  uint64_t errors[ERR_KINDS];
+  /* totals of finished sessions, running ones are added when reported */
+  uint64_t reconnects;
+  uint64_t bytesUp;
+  uint64_t bytesSent;
+  uint64_t dropped;
+  uint64_t hlsPlaylists;
+  uint64_t hlsSegments;
+  LATENCY connect;
+  LATENCY start;
+} gw;
+
 STREAMING_SERVER *startStreaming(const char *address, int port);
 void stopStreaming(STREAMING_SERVER * server);
 
@@ -108,6 +188,9 @@ typedef struct
   uint32_t dStartOffset;
   uint32_t dStopOffset;
 
+  int hdrMode;			// FLV header strategy, -1 leaves it to librtmp
+  int hdrBufSize;
+
 #ifdef CRYPTO
   unsigned char hash[RTMP_SWF_HASHLEN];
 #endif
@@ -266,84 +349,1842 @@ http_unescape(char *data)
 	  dst_x += 1;
 	}
     }
-  data[dst_x] = '\0';
+  data[dst_x] = '\0';
+}
+
+TFTYPE
+controlServerThread(void *unused)
+{
+  char ich;
+  while (1)
+    {
+      ich = getchar();
+      switch (ich)
+	{
+	case 'q':
+	  RTMP_LogPrintf("Exiting\n");
+	  stopStreaming(httpServer);
+	  exit(0);
+	  break;
+	default:
+	  RTMP_LogPrintf("Unknown command \'%c\', ignoring\n", ich);
+	}
+    }
+  TFRET();
+}
+
+/*
+ssize_t readHTTPLine(int sockfd, char *buffer, size_t length)
+{
+	size_t i=0;
+
+	while(i < length-1) {
+		char c;
+		int n = read(sockfd, &c, 1);
+
+		if(n == 0)
+			break;
+
+		buffer[i] = c;
+		i++;
+
+		if(c == '\n')
+			break;
+	}
+	buffer[i]='\0';
+	i++;
+
+	return i;
+}
+
+int isHTTPRequestEOF(char *line, size_t length)
+{
+	if(length < 2)
+		return TRUE;
+
+	if(line[0]=='\r' && line[1]=='\n')
+		return TRUE;
+
+	return FALSE;
+}
+*/
+
+/* What to do with a live stream when a client can't keep up */
+enum
+{
+  SLOW_WAIT,			/* nothing, the upstream waits for the client */
+  SLOW_DROP,			/* drop video until the next keyframe, keep audio */
+  SLOW_SKIP			/* drop everything until the next keyframe */
+};
+static const char *slowPolicies[] = { "wait", "drop", "skip", NULL };
+
+static int slowPolicy = SLOW_DROP;
+static size_t queueSize = 4096 * 1024;	/* output queued per client */
+static uint32_t hlsTarget = 4000;	/* ms an HLS segment should last */
+static int hlsWindow = 6;		/* segments in an HLS playlist */
+
+#ifdef WIN32
+#define SOCK_BLOCKED(e)	((e) == WSAEWOULDBLOCK)
+#else
+#define SOCK_BLOCKED(e)	((e) == EAGAIN || (e) == EWOULDBLOCK)
+#endif
+
+/* an HTTP client connection, which may carry several requests */
+typedef struct CLIENT
+{
+  int sockfd;
+  int http11;			/* the request was HTTP/1.1 */
+  int keepAlive;		/* wait for another request after this one */
+  int chunked;			/* the response body is chunked */
+  int live;			/* the stream can drop tags when we fall behind */
+  int dropping;			/* dropping tags until the next keyframe */
+  int timeout;			/* seconds the client may stall */
+  uint64_t sent;		/* bytes of the response written to the socket */
+  uint64_t dropped;		/* tags dropped for being late */
+  RingBuf out;			/* what the socket didn't take yet */
+  struct CLIENT *nextLive;	/* on the same live source */
+  uint32_t tsBase;		/* live timestamps start at 0 for each client */
+  int haveBase;
+  uint32_t timestamp;		/* of the last live tag queued */
+  int len;			/* bytes of the next request(s) in buf */
+  char buf[REQUEST_SIZE];
+} CLIENT;
+
+/* wait until the socket takes data again, with poll since there may
+ * be more clients than FD_SETSIZE
+ */
+static int
+ClientWait(CLIENT *c)
+{
+  struct pollfd pfd;
+  int n, ms = 0;
+
+  /* -m isn't range checked, very long means forever */
+  if (c->timeout > 0)
+    ms = c->timeout < 1000000 ? c->timeout * 1000 : -1;
+  do
+    {
+      pfd.fd = c->sockfd;
+      pfd.events = POLLOUT;
+      pfd.revents = 0;
+      n = poll(&pfd, 1, ms);
+    }
+  while (n < 0 && GetSockError() == EINTR);
+  if (n == 0)
+    RTMP_Log(RTMP_LOGERROR, "%s, client stalled for %d seconds", __FUNCTION__,
+	     c->timeout);
+  return n > 0;
+}
+
+/* Push out what is queued, with bWait until it is all gone.
+ * Returns FALSE if the client is gone or stuck.
+ */
+static int
+ClientFlush(CLIENT *c, int bWait)
+{
+  const char *data;
+  size_t len;
+  int n;
+
+  while (RingUsed(&c->out))
+    {
+      len = RingGet(&c->out, &data);
+      n = send(c->sockfd, data, len, 0);
+      if (n > 0)
+	{
+	  RingConsume(&c->out, n);
+	  c->sent += n;
+	  continue;
+	}
+      if (n < 0 && GetSockError() == EINTR)
+	continue;
+      if (n < 0 && !SOCK_BLOCKED(GetSockError()))
+	return FALSE;
+      if (!bWait)
+	break;
+      if (!ClientWait(c))
+	return FALSE;
+    }
+  return TRUE;
+}
+
+/* Send all of data, waiting for the socket when it is full.
+ * Returns len, -1 on error.
+ */
+static int
+ClientSendAll(CLIENT *c, const char *data, size_t len)
+{
+  size_t done = 0;
+  int n;
+
+  while (done < len)
+    {
+      n = send(c->sockfd, data + done, len - done, 0);
+      if (n > 0)
+	{
+	  done += n;
+	  c->sent += n;
+	  continue;
+	}
+      if (n < 0 && GetSockError() == EINTR)
+	continue;
+      if (n < 0 && !SOCK_BLOCKED(GetSockError()))
+	return -1;
+      if (!ClientWait(c))
+	return -1;
+    }
+  return len;
+}
+
+#define SEND_TAGS	64	/* most tags gathered into one send */
+#define SEND_PIECES	(SEND_TAGS * 3 + 2)
+
+/* Write cnt pieces to the client. What the socket doesn't take right
+ * away is queued, and only when the queue is full do we wait for it.
+ * Returns the bytes taken, -1 on error.
+ */
+static int
+ClientWrite(CLIENT *c, char **bufs, unsigned int *lens, int cnt)
+{
+  unsigned int off = 0;
+  int i = 0, n, total = 0;
+
+  for (n = 0; n < cnt; n++)
+    total += lens[n];
+
+  /* nothing waiting, so try the socket straight from the caller's
+   * buffers
+   */
+  if (!RingUsed(&c->out))
+    {
+#ifdef WIN32
+      for (; i < cnt; i++)
+	{
+	  n = lens[i] ? send(c->sockfd, bufs[i], lens[i], 0) : 0;
+	  if (n < 0)
+	    {
+	      if (!SOCK_BLOCKED(GetSockError()))
+		return -1;
+	      break;
+	    }
+	  c->sent += n;
+	  if ((unsigned int)n < lens[i])
+	    {
+	      off = n;
+	      break;
+	    }
+	}
+#else
+      struct iovec iov[SEND_PIECES];
+
+      for (n = 0; n < cnt; n++)
+	{
+	  iov[n].iov_base = bufs[n];
+	  iov[n].iov_len = lens[n];
+	}
+      do
+	n = writev(c->sockfd, iov, cnt);
+      while (n < 0 && errno == EINTR);
+      if (n < 0)
+	{
+	  if (!SOCK_BLOCKED(errno))
+	    return -1;
+	  n = 0;
+	}
+      c->sent += n;
+      /* skip what went out, short writes are possible */
+      while (i < cnt && (unsigned int)n >= lens[i])
+	n -= lens[i++];
+      off = n;
+#endif
+    }
+
+  for (; i < cnt; i++, off = 0)
+    {
+      while (off < lens[i])
+	{
+	  n = RingPut(&c->out, bufs[i] + off, lens[i] - off, FALSE);
+	  off += n;
+	  if (off < lens[i] && !ClientFlush(c, FALSE))
+	    return -1;
+	  /* still full, the client is holding us up */
+	  if (!n && RingUsed(&c->out) == c->out.size && !ClientWait(c))
+	    return -1;
+	}
+    }
+  if (!ClientFlush(c, FALSE))
+    return -1;
+  return total;
+}
+
+/* Send part of the response body, as one chunk if the body is chunked.
+ * Returns len, -1 on error.
+ */
+static int
+ClientSend(CLIENT *c, char *data, int len)
+{
+  char hdr[16];
+  char *bufs[3] = { hdr, data, "\r\n" };
+  unsigned int lens[3] = { 0, len, 2 };
+
+  if (!c->chunked)
+    return ClientWrite(c, bufs + 1, lens + 1, 1);
+
+  /* an empty chunk would end the body */
+  if (!len)
+    return 0;
+  lens[0] = sprintf(hdr, "%x\r\n", len);
+  return ClientWrite(c, bufs, lens, 3);
+}
+
+/* Send a response header, or the whole of a short response, and wait
+ * for it to go out.
+ */
+static int
+ClientPut(CLIENT *c, char *data, int len)
+{
+  unsigned int ulen = len;
+
+  return ClientWrite(c, &data, &ulen, 1) == len && ClientFlush(c, TRUE);
+}
+
+/* end the response body, once it is all out the next request can be
+ * answered
+ */
+static int
+ClientEnd(CLIENT *c)
+{
+  char *end = "0\r\n\r\n";
+  unsigned int len = 5;
+
+  if (c->chunked && ClientWrite(c, &end, &len, 1) < 0)
+    return FALSE;
+  return ClientFlush(c, TRUE);
+}
+
+/* what a tag is to a player joining a live stream */
+enum
+{
+  TAG_OTHER,
+  TAG_META,			/* onMetaData */
+  TAG_AVCHDR,			/* AVC sequence header */
+  TAG_AACHDR,			/* AAC sequence header */
+  TAG_KEY,			/* video keyframe */
+  TAG_FRAME			/* any other audio or video */
+};
+
+static int
+TagKind(int type, const char *body, unsigned int len)
+{
+  switch (type)
+    {
+    case RTMP_PACKET_TYPE_INFO:
+      if (len >= 13 && body[0] == AMF_STRING && !memcmp(body + 3, "onMetaData", 10))
+	return TAG_META;
+      break;
+    case RTMP_PACKET_TYPE_VIDEO:
+      if (!len)
+	break;
+      if (len >= 2 && (body[0] & 0x0f) == 7 && body[1] == 0)
+	return TAG_AVCHDR;
+      return (body[0] & 0xf0) == 0x10 ? TAG_KEY : TAG_FRAME;
+    case RTMP_PACKET_TYPE_AUDIO:
+      if (!len)
+	break;
+      if (len >= 2 && (body[0] & 0xf0) == 0xa0 && body[1] == 0)
+	return TAG_AACHDR;
+      return TAG_FRAME;
+    }
+  return TAG_OTHER;
+}
+
+/* For a live stream, drop tags a client that fell behind won't be
+ * missing much, from when the queue passes half full until a keyframe
+ * finds it below that again.
+ */
+static int
+ClientDrop(CLIENT *c, int type, int kind, size_t size)
+{
+  size_t used;
+
+  if (!c->live || slowPolicy == SLOW_WAIT
+      || (kind != TAG_KEY && kind != TAG_FRAME))
+    return FALSE;
+
+  used = RingUsed(&c->out);
+  if (kind == TAG_KEY)
+    c->dropping = used >= c->out.size / 2;
+  else if (!c->dropping && used >= c->out.size / 2
+	   && (type == RTMP_PACKET_TYPE_VIDEO || slowPolicy == SLOW_SKIP))
+    c->dropping = TRUE;
+
+  /* nothing media may wait for room */
+  if (!c->dropping && used + size > c->out.size)
+    c->dropping = TRUE;
+
+  if (!c->dropping)
+    return FALSE;
+  /* audio is small, it keeps flowing as long as it fits */
+  if (type == RTMP_PACKET_TYPE_AUDIO && slowPolicy == SLOW_DROP
+      && used + size <= c->out.size)
+    return FALSE;
+  c->dropped++;
+  return TRUE;
+}
+
+/* Send tags straight from the packets they were read into, as one
+ * chunk if the body is chunked. Returns the bytes of tag data sent,
+ * -1 on error.
+ */
+static int
+SendTags(CLIENT *c, RTMPTag *tags, int nTags)
+{
+  char hdr[16];
+  char *bufs[SEND_PIECES];
+  unsigned int lens[SEND_PIECES];
+  int i, cnt = 0, total = 0;
+
+  for (i = 0; i < nTags; i++)
+    total += tags[i].hlen + tags[i].bodySize + tags[i].tlen;
+  if (!total)
+    return 0;
+
+  if (c->chunked)
+    {
+      bufs[cnt] = hdr;
+      lens[cnt++] = sprintf(hdr, "%x\r\n", total);
+    }
+  for (i = 0; i < nTags; i++)
+    {
+      bufs[cnt] = tags[i].header;
+      lens[cnt++] = tags[i].hlen;
+      bufs[cnt] = tags[i].body;
+      lens[cnt++] = tags[i].bodySize;
+      bufs[cnt] = tags[i].trailer;
+      lens[cnt++] = tags[i].tlen;
+    }
+  if (c->chunked)
+    {
+      bufs[cnt] = "\r\n";
+      lens[cnt++] = 2;
+    }
+
+  if (ClientWrite(c, bufs, lens, cnt) < 0)
+    return -1;
+  return total;
+}
+
+static void
+LatencyAdd(LATENCY *h, uint32_t ms)
+{
+  double sec = ms / 1000.0;
+  int i;
+
+  for (i = 0; i < LAT_BUCKETS && sec > latBounds[i]; i++);
+  h->bucket[i]++;
+  h->count++;
+  h->sum += sec;
+}
+
+static GW_SESSION *
+SessionStart(int sockfd, RTMP_REQUEST *req)
+{
+  GW_SESSION *s = calloc(1, sizeof(GW_SESSION));
+  AVal *name = req->playpath.av_len ? &req->playpath : &req->fullUrl;
+
+  if (!s)
+    return NULL;
+  s->sockfd = sockfd;
+  snprintf(s->playpath, sizeof(s->playpath), "%.*s", name->av_len,
+	   name->av_val);
+
+  MutexLock(&gw.lock);
+  s->id = ++gw.lastId;
+  s->next = gw.sessions;
+  gw.sessions = s;
+  gw.nSessions++;
+  gw.requests++;
+  MutexUnlock(&gw.lock);
+  return s;
+}
+
+static void
+SessionEnd(GW_SESSION *s, int err)
+{
+  GW_SESSION **prev;
+
+  MutexLock(&gw.lock);
+  for (prev = &gw.sessions; *prev; prev = &(*prev)->next)
+    if (*prev == s)
+      {
+	*prev = s->next;
+	break;
+      }
+  gw.nSessions--;
+  gw.reconnects += s->reconnects;
+  gw.bytesUp += s->bytesUp;
+  gw.bytesSent += s->bytesSent;
+  gw.dropped += s->dropped;
+  if (err != ERR_NONE)
+    gw.errors[err]++;
+  MutexUnlock(&gw.lock);
+  free(s);
+}
+
+static void
+SessionConnected(GW_SESSION *s, uint32_t ms)
+{
+  MutexLock(&gw.lock);
+  if (s)
+    s->connectMS = ms;
+  LatencyAdd(&gw.connect, ms);
+  MutexUnlock(&gw.lock);
+}
+
+static void
+SessionProgress(GW_SESSION *s, RTMP *r, CLIENT *c, double duration,
+		uint32_t connected)
+{
+  if (!s)
+    return;
+  MutexLock(&gw.lock);
+  if (!s->bytesSent && c->sent)
+    {
+      s->startMS = RTMP_GetTime() - connected;
+      LatencyAdd(&gw.start, s->startMS);
+    }
+  /* a client of a shared live source has its upstream counted by the
+   * reader, see SessionUpstream()
+   */
+  if (r)
+    {
+      s->bytesUp = r->m_stats.bytesIn;
+      s->reconnects = r->m_stats.reconnects;
+      s->timestamp = r->m_read.timestamp;
+    }
+  else
+    s->timestamp = c->timestamp;
+  s->bytesSent = c->sent;
+  s->queued = RingUsed(&c->out);
+  s->dropped = c->dropped;
+  s->duration = duration;
+  MutexUnlock(&gw.lock);
+}
+
+static void
+SessionUpstream(GW_SESSION *s, RTMP *r)
+{
+  MutexLock(&gw.lock);
+  s->bytesUp = r->m_stats.bytesIn;
+  s->reconnects = r->m_stats.reconnects;
+  MutexUnlock(&gw.lock);
+}
+
+static void
+CountError(int err)
+{
+  MutexLock(&gw.lock);
+  gw.errors[err]++;
+  MutexUnlock(&gw.lock);
+}
+
+/* bytes the kernel still holds for the client */
+static int
+SendQueue(int sockfd)
+{
+#ifdef TIOCOUTQ
+  int n = 0;
+
+  if (ioctl(sockfd, TIOCOUTQ, &n) == 0)
+    return n;
+#endif
+  return 0;
+}
+
+/* Called about once a second from the main thread, so that nothing
+ * gets formatted while data is moving.
+ */
+static void
+GatewayTick(void)
+{
+  GW_SESSION *s;
+  uint32_t now = RTMP_GetTime(), elapsed;
+  uint64_t sent = 0;
+
+  MutexLock(&gw.lock);
+  elapsed = now - gw.lastTick;
+  gw.lastTick = now;
+  for (s = gw.sessions; s; s = s->next)
+    {
+      if (elapsed)
+	s->rate = (s->bytesUp - s->lastUp) * 1000.0 / elapsed;
+      s->lastUp = s->bytesUp;
+      sent += s->bytesSent;
+    }
+
+  s = gw.sessions;
+  if (gw.nSessions == 1 && s->bytesSent)
+    {
+      if (s->duration > 0)
+	RTMP_LogStatus("\r%.3f KB / %.2f sec (%.1f%%)",
+		       (double) s->bytesSent / 1024.0,
+		       (double) s->timestamp / 1000.0,
+		       s->timestamp / (s->duration * 10.0));
+      else
+	RTMP_LogStatus("\r%.3f KB / %.2f sec",
+		       (double) s->bytesSent / 1024.0,
+		       (double) s->timestamp / 1000.0);
+    }
+  else if (gw.nSessions > 1)
+    {
+      RTMP_LogStatus("\r%d streams, %.3f KB sent", gw.nSessions,
+		     (double) sent / 1024.0);
+    }
+  MutexUnlock(&gw.lock);
+}
+
+typedef struct
+{
+  char *buf;
+  int len;
+  int size;
+} TEXT;
+
+static void
+TextAdd(TEXT *t, const char *fmt, ...)
+{
+  va_list ap;
+  char *buf;
+  int n;
+
+  while (1)
+    {
+      va_start(ap, fmt);
+      n = vsnprintf(t->buf + t->len, t->size - t->len, fmt, ap);
+      va_end(ap);
+      if (n < 0)
+	return;
+      if (t->len + n < t->size)
+	break;
+      buf = realloc(t->buf, (t->len + n + 1) * 2);
+      if (!buf)
+	return;
+      t->buf = buf;
+      t->size = (t->len + n + 1) * 2;
+    }
+  t->len += n;
+}
+
+static void
+TextLatency(TEXT *t, const char *name, const char *help, LATENCY *h)
+{
+  uint64_t n = 0;
+  int i;
+
+  TextAdd(t, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+  for (i = 0; i < LAT_BUCKETS; i++)
+    {
+      n += h->bucket[i];
+      TextAdd(t, "%s_bucket{le=\"%g\"} %llu\n", name, latBounds[i],
+	      (unsigned long long) n);
+    }
+  TextAdd(t, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+	  (unsigned long long) h->count);
+  TextAdd(t, "%s_sum %.3f\n%s_count %llu\n", name, h->sum, name,
+	  (unsigned long long) h->count);
+}
+
+/* the labels of a per-session line, quotes and backslashes escaped */
+static const char *
+SessionLabels(GW_SESSION *s, char *buf, int size)
+{
+  char *ptr = buf, *end = buf + size - 3, *src = s->playpath;
+
+  ptr += snprintf(buf, size, "session=\"%d\",playpath=\"", s->id);
+  for (; *src && ptr < end; src++)
+    {
+      if (*src == '"' || *src == '\\')
+	*ptr++ = '\\';
+      else if (*src == '\n')
+	{
+	  *ptr++ = '\\';
+	  *ptr++ = 'n';
+	  continue;
+	}
+      *ptr++ = *src;
+    }
+  *ptr++ = '"';
+  *ptr = '\0';
+  return buf;
+}
+
+#define SESSION_METRIC(name, type, help, fmt, val)	\
+  TextAdd(&t, "# HELP " name " " help "\n# TYPE " name " " type "\n");	\
+  for (s = gw.sessions; s; s = s->next)	\
+    TextAdd(&t, name "{%s} " fmt "\n", SessionLabels(s, lbl, sizeof(lbl)), val)
+
+/* The /metrics page in the Prometheus text format. Returns a malloc'ed
+ * buffer with *len set, NULL on failure.
+ */
+static char *
+Metrics(int *len)
+{
+  TEXT t = { NULL, 0, 0 };
+  GW_SESSION *s;
+  uint64_t up, sent, reconnects, dropped;
+  char lbl[320];
+  int i;
+
+  MutexLock(&gw.lock);
+  up = gw.bytesUp;
+  sent = gw.bytesSent;
+  reconnects = gw.reconnects;
+  dropped = gw.dropped;
+  for (s = gw.sessions; s; s = s->next)
+    {
+      dropped += s->dropped;
+      up += s->bytesUp;
+      sent += s->bytesSent;
+      reconnects += s->reconnects;
+    }
+
+  TextAdd(&t, "# HELP rtmpgw_sessions Streams being served.\n"
+	  "# TYPE rtmpgw_sessions gauge\nrtmpgw_sessions %d\n",
+	  gw.nSessions);
+  TextAdd(&t, "# HELP rtmpgw_requests_total Stream requests accepted.\n"
+	  "# TYPE rtmpgw_requests_total counter\n"
+	  "rtmpgw_requests_total %llu\n", (unsigned long long) gw.requests);
+  TextAdd(&t, "# HELP rtmpgw_errors_total Requests that failed, by stage.\n"
+	  "# TYPE rtmpgw_errors_total counter\n");
+  for (i = 0; i < ERR_KINDS; i++)
+    TextAdd(&t, "rtmpgw_errors_total{kind=\"%s\"} %llu\n", errKinds[i],
+	    (unsigned long long) gw.errors[i]);
+  TextAdd(&t, "# HELP rtmpgw_reconnects_total Times an RTMP server had to be dialed again.\n"
+	  "# TYPE rtmpgw_reconnects_total counter\n"
+	  "rtmpgw_reconnects_total %llu\n", (unsigned long long) reconnects);
+  TextAdd(&t, "# HELP rtmpgw_upstream_bytes_total Bytes read from RTMP servers.\n"
+	  "# TYPE rtmpgw_upstream_bytes_total counter\n"
+	  "rtmpgw_upstream_bytes_total %llu\n", (unsigned long long) up);
+  TextAdd(&t, "# HELP rtmpgw_sent_bytes_total Bytes sent to HTTP clients.\n"
+	  "# TYPE rtmpgw_sent_bytes_total counter\n"
+	  "rtmpgw_sent_bytes_total %llu\n", (unsigned long long) sent);
+  TextAdd(&t, "# HELP rtmpgw_dropped_tags_total Live tags dropped for clients that fell behind.\n"
+	  "# TYPE rtmpgw_dropped_tags_total counter\n"
+	  "rtmpgw_dropped_tags_total %llu\n", (unsigned long long) dropped);
+  TextAdd(&t, "# HELP rtmpgw_hls_requests_total HLS playlists and segments served.\n"
+	  "# TYPE rtmpgw_hls_requests_total counter\n"
+	  "rtmpgw_hls_requests_total{kind=\"playlist\"} %llu\n"
+	  "rtmpgw_hls_requests_total{kind=\"segment\"} %llu\n",
+	  (unsigned long long) gw.hlsPlaylists,
+	  (unsigned long long) gw.hlsSegments);
+  TextLatency(&t, "rtmpgw_connect_seconds",
+	      "Time taken to connect to the RTMP server.", &gw.connect);
+  TextLatency(&t, "rtmpgw_start_seconds",
+	      "Time from connecting to the first media data.", &gw.start);
+
+  SESSION_METRIC("rtmpgw_session_upstream_bytes", "counter",
+		 "Bytes read from the RTMP server.", "%llu",
+		 (unsigned long long) s->bytesUp);
+  SESSION_METRIC("rtmpgw_session_upstream_rate", "gauge",
+		 "Bytes per second read from the RTMP server lately.", "%.0f",
+		 s->rate);
+  SESSION_METRIC("rtmpgw_session_sent_bytes", "counter",
+		 "Bytes sent to the client.", "%llu",
+		 (unsigned long long) s->bytesSent);
+  SESSION_METRIC("rtmpgw_session_send_queue_bytes", "gauge",
+		 "Bytes waiting to go out to the client, queued by us and the kernel.",
+		 "%llu", (unsigned long long) (s->queued + SendQueue(s->sockfd)));
+  SESSION_METRIC("rtmpgw_session_dropped_tags", "counter",
+		 "Live tags dropped because the client fell behind.", "%llu",
+		 (unsigned long long) s->dropped);
+  SESSION_METRIC("rtmpgw_session_connect_seconds", "gauge",
+		 "Time taken to connect to the RTMP server.", "%.3f",
+		 s->connectMS / 1000.0);
+  MutexUnlock(&gw.lock);
+
+  *len = t.len;
+  return t.buf;
+}
+
+/* Send the status line and header fields of a response, fields is
+ * empty or a run of complete header lines.
+ */
+static int
+SendHead(CLIENT *c, const char *status, const char *fields)
+{
+  char buf[1024];
+  int len;
+
+  len = snprintf(buf, sizeof(buf), "HTTP/1.%d %s\r\n"
+		 "Server: HTTP-RTMP Stream Server " RTMPDUMP_VERSION "\r\n%s%s\r\n",
+		 c->http11, status, fields, !c->keepAlive ? "Connection: close\r\n"
+		 : c->http11 ? "" : "Connection: keep-alive\r\n");
+  if (len >= (int)sizeof(buf))
+    return FALSE;
+  return ClientPut(c, buf, len);
+}
+
+static int
+SendMetrics(CLIENT *c)
+{
+  char fields[128];
+  char *body;
+  int blen, ret;
+
+  body = Metrics(&blen);
+  if (!body)
+    return SendHead(c, "500 Internal Server Error", "Content-Length: 0\r\n");
+  sprintf(fields, "Content-Type: text/plain; version=0.0.4\r\n"
+	  "Content-Length: %d\r\n", blen);
+  ret = SendHead(c, "200 OK", fields) && ClientPut(c, body, blen);
+  free(body);
+  return ret;
+}
+
+/* Wait for the next request on the connection and copy its header to
+ * header. Returns the header length, 0 if the client hung up, -1 on
+ * timeout or error and -2 if the header is longer than REQUEST_SIZE.
+ */
+static int
+ReadRequest(CLIENT *c, char *header, int size)
+{
+  struct pollfd pfd;
+  int i, n;
+
+  while (1)
+    {
+      /* the header ends with an empty line */
+      for (i = 0; i < c->len; i++)
+	{
+	  if (c->buf[i] != '\n')
+	    continue;
+	  if (i + 1 < c->len && c->buf[i + 1] == '\n')
+	    i += 2;
+	  else if (i + 2 < c->len && c->buf[i + 1] == '\r'
+		   && c->buf[i + 2] == '\n')
+	    i += 3;
+	  else
+	    continue;
+
+	  n = i < size - 1 ? i : size - 1;
+	  memcpy(header, c->buf, n);
+	  header[n] = '\0';
+	  /* keep what the client pipelined after it */
+	  c->len -= i;
+	  memmove(c->buf, c->buf + i, c->len);
+	  return n;
+	}
+      if (c->len == sizeof(c->buf))
+	{
+	  RTMP_Log(RTMP_LOGERROR, "%s, request header too large", __FUNCTION__);
+	  return -2;
+	}
+
+      pfd.fd = c->sockfd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      if (poll(&pfd, 1, 5000) <= 0)
+	return -1;
+      n = recv(c->sockfd, c->buf + c->len, sizeof(c->buf) - c->len, 0);
+      if (n <= 0)
+	return n;
+      c->len += n;
+    }
+}
+
+/* value of a header field, up to the end of its line */
+static char *
+HeaderField(char *header, const char *name, char *value, int size)
+{
+  int nlen = strlen(name);
+  char *p = header, *end;
+
+  while ((p = strchr(p, '\n')) != NULL)
+    {
+      p++;
+      if (strncasecmp(p, name, nlen) || p[nlen] != ':')
+	continue;
+      p += nlen + 1;
+      while (*p == ' ' || *p == '\t')
+	p++;
+      end = p;
+      while (*end && *end != '\r' && *end != '\n')
+	end++;
+      if (end - p >= size)
+	return NULL;
+      memcpy(value, p, end - p);
+      value[end - p] = '\0';
+      return value;
+    }
+  return NULL;
+}
+
+/* Keyframe positions of VOD streams from their onMetaData, so byte
+ * ranges of the original file can be mapped to a time to start at.
+ */
+typedef struct
+{
+  char key[REQUEST_SIZE];	/* the request path */
+  int n;
+  double *times;
+  double *pos;
+  double filesize;
+} SEEK_INDEX;
+
+#define SEEK_CACHE	16
+#define SEEK_PROBE_TIME	3	/* seconds to look for the keyframes */
+
+static struct
+{
+  TMUTEX lock;
+  SEEK_INDEX idx[SEEK_CACHE];
+  int next;
+} seeks;
+
+static const AVal av_onMetaData = AVC("onMetaData");
+static const AVal av_keyframes = AVC("keyframes");
+static const AVal av_times = AVC("times");
+static const AVal av_filepositions = AVC("filepositions");
+static const AVal av_filesize = AVC("filesize");
+
+static double *
+NumberArray(AMFObject *obj, const AVal *name, int *n)
+{
+  AMFObject arr;
+  double *vals;
+  int i;
+
+  AMFProp_GetObject(AMF_GetProp(obj, name, -1), &arr);
+  *n = AMF_CountProp(&arr);
+  if (!*n)
+    return NULL;
+  vals = malloc(*n * sizeof(double));
+  if (vals)
+    for (i = 0; i < *n; i++)
+      vals[i] = AMFProp_GetNumber(AMF_GetProp(&arr, NULL, i));
+  return vals;
+}
+
+/* Remember the keyframes of an onMetaData body, returns TRUE if it had
+ * a usable index.
+ */
+static int
+SeekIndexAdd(const char *key, char *body, int size)
+{
+  AMFObject obj, kf;
+  AMFObjectProperty prop;
+  AVal name;
+  SEEK_INDEX *s, tmp = { "" };
+  int i, nTimes, nPos;
+
+  if (AMF_Decode(&obj, body, size, FALSE) < 0)
+    return FALSE;
+  AMFProp_GetString(AMF_GetProp(&obj, NULL, 0), &name);
+  if (!AVMATCH(&name, &av_onMetaData)
+      || !RTMP_FindFirstMatchingProperty(&obj, &av_keyframes, &prop)
+      || prop.p_type != AMF_OBJECT)
+    {
+      AMF_Reset(&obj);
+      return FALSE;
+    }
+  AMFProp_GetObject(&prop, &kf);
+  tmp.times = NumberArray(&kf, &av_times, &nTimes);
+  tmp.pos = NumberArray(&kf, &av_filepositions, &nPos);
+  tmp.n = nTimes < nPos ? nTimes : nPos;
+  if (RTMP_FindFirstMatchingProperty(&obj, &av_filesize, &prop))
+    tmp.filesize = prop.p_vu.p_number;
+  AMF_Reset(&obj);
+
+  if (!tmp.times || !tmp.pos || !tmp.n || tmp.filesize <= 0)
+    {
+      free(tmp.times);
+      free(tmp.pos);
+      return FALSE;
+    }
+  snprintf(tmp.key, sizeof(tmp.key), "%s", key);
+  RTMP_Log(RTMP_LOGDEBUG, "%s, %d keyframes for %s", __FUNCTION__, tmp.n, key);
+
+  MutexLock(&seeks.lock);
+  for (i = 0; i < SEEK_CACHE; i++)
+    if (!strcmp(seeks.idx[i].key, tmp.key))
+      break;
+  if (i == SEEK_CACHE)
+    {
+      i = seeks.next;
+      seeks.next = (seeks.next + 1) % SEEK_CACHE;
+    }
+  s = &seeks.idx[i];
+  free(s->times);
+  free(s->pos);
+  *s = tmp;
+  MutexUnlock(&seeks.lock);
+  return TRUE;
+}
+
+/* pick up onMetaData from a stretch of FLV as RTMP_Read returns it */
+static int
+SeekIndexScan(const char *key, char *buf, int len)
+{
+  char *p = buf, *end = buf + len;
+
+  if (len >= 13 && !memcmp(buf, "FLV", 3))
+    p += 13;
+  while (end - p >= 11)
+    {
+      int size = AMF_DecodeInt24(p + 1);
+      if (end - p < 11 + size)
+	break;
+      if (*p == RTMP_PACKET_TYPE_INFO && SeekIndexAdd(key, p + 11, size))
+	return TRUE;
+      p += 11 + size + 4;
+    }
+  return FALSE;
+}
+
+/* Find the keyframe before byte start of the original file. Returns
+ * TRUE if it is past the first one, FALSE if it isn't and -1 if there is
+ * no index for key.
+ */
+static int
+SeekIndexFind(const char *key, double start, double *from,
+	      uint32_t *startMS)
+{
+  SEEK_INDEX *s;
+  int i, ret = -1;
+
+  MutexLock(&seeks.lock);
+  for (i = 0; i < SEEK_CACHE; i++)
+    if (!strcmp(seeks.idx[i].key, key))
+      break;
+  if (i < SEEK_CACHE)
+    {
+      s = &seeks.idx[i];
+      ret = FALSE;
+      for (i = s->n - 1; i >= 0; i--)
+	if (s->pos[i] <= start)
+	  break;
+      if (i >= 0 && s->times[i] > 0 && start < s->filesize)
+	{
+	  *from = s->pos[i];
+	  *startMS = s->times[i] * 1000.0;
+	  ret = TRUE;
+	}
+    }
+  MutexUnlock(&seeks.lock);
+  return ret;
+}
+
+static int
+SetupRTMP(RTMP *r, RTMP_REQUEST *req, uint32_t dSeek)
+{
+  RTMP_Log(RTMP_LOGDEBUG, "Setting buffer time to: %dms", req->bufferTime);
+  RTMP_Init(r);
+  RTMP_SetBufferMS(r, req->bufferTime);
+  if (!req->fullUrl.av_len)
+    {
+      RTMP_SetupStream(r, req->protocol, &req->hostname, req->rtmpport, &req->sockshost,
+                       &req->playpath, &req->tcUrl, &req->swfUrl, &req->pageUrl, &req->app, &req->auth, &req->swfHash, req->swfSize, &req->flashVer, &req->subscribepath, &req->usherToken, &req->WeebToken, dSeek, req->dStopOffset,
+                       req->bLiveStream, req->timeout);
+    }
+  else
+    {
+      if (RTMP_SetupURL(r, req->fullUrl.av_val) == FALSE)
+        {
+          RTMP_Log(RTMP_LOGERROR, "Couldn't parse URL: %s", req->fullUrl.av_val);
+          return FALSE;
+        }
+      if (dSeek)
+	r->Link.seekTime = dSeek;
+      if (req->dStopOffset)
+	r->Link.stopTime = req->dStopOffset;
+    }
+  /* backward compatibility, we always sent this as true before */
+  if (req->auth.av_len)
+    r->Link.lFlags |= RTMP_LF_AUTH;
+
+  r->Link.extras = req->extras;
+  r->Link.token = req->token;
+  r->m_read.timestamp = dSeek;
+  r->m_read.flags |= RTMP_READ_FILL;
+  if (req->hdrMode >= 0)
+    {
+      r->m_read.hdrMode = req->hdrMode;
+      r->m_read.hdrBufSize = req->hdrBufSize;
+    }
+  return TRUE;
+}
+
+/* Connect just long enough to get the onMetaData of a VOD stream
+ * whose keyframes we don't know yet. The client is waiting for its
+ * response meanwhile, so this gets SEEK_PROBE_TIME seconds at most.
+ */
+static int
+SeekIndexProbe(RTMP_REQUEST *req, const char *key)
+{
+  RTMP rtmp = { 0 };
+  RTMPTag tag;
+  uint32_t start = RTMP_GetTime();
+  int i, n, ret = FALSE;
+
+  if (!SetupRTMP(&rtmp, req, 0))
+    return FALSE;
+  if (rtmp.Link.timeout > SEEK_PROBE_TIME)
+    rtmp.Link.timeout = SEEK_PROBE_TIME;
+  RTMP_Log(RTMP_LOGDEBUG, "%s, fetching keyframes for %s", __FUNCTION__, key);
+  if (RTMP_Connect(&rtmp, NULL))
+    {
+      for (i = 0; i < 64 && !ret; i++)
+	{
+	  if (RTMP_GetTime() - start > SEEK_PROBE_TIME * 1000)
+	    {
+	      RTMP_Log(RTMP_LOGDEBUG, "%s, no onMetaData in time", __FUNCTION__);
+	      break;
+	    }
+	  n = RTMP_ReadTag(&rtmp, &tag);
+	  if (n < 0 || (!n && rtmp.m_read.status < 0))
+	    break;
+	  if (tag.type == RTMP_PACKET_TYPE_INFO)
+	    ret = SeekIndexAdd(key, tag.body, tag.bodySize);
+	  else if (n > 0 && (tag.type == RTMP_PACKET_TYPE_AUDIO
+			     || tag.type == RTMP_PACKET_TYPE_VIDEO))
+	    i = 64;		/* media before metadata, there is none */
+	  RTMP_FreeTag(&tag);
+	}
+    }
+  RTMP_Close(&rtmp);
+  return ret;
+}
+
+/* Live streams asked for with the same request share one RTMP
+ * connection. Its reader fans the tags out to the queues of the
+ * clients and keeps what a joining client needs to start playing
+ * right away: the FLV header, onMetaData, the sequence headers and
+ * the tags since the last video keyframe.
+ */
+typedef struct
+{
+  char *buf;
+  size_t len;
+  size_t size;
+} TAGBUF;
+
+typedef struct LIVE_SOURCE
+{
+  struct LIVE_SOURCE *next;
+  char key[REQUEST_SIZE];	/* the request path */
+  RTMP_REQUEST req;
+  STREAMING_SERVER *server;
+  RTMP rtmp;
+  TMUTEX lock;
+  int refs;			/* the reader and the clients */
+  CLIENT *clients;
+  int done;
+  int err;			/* why the reader stopped */
+  uint32_t connected;		/* when RTMP_Connect returned */
+  GW_SESSION *owner;		/* carries the upstream counters */
+  uint64_t counted;		/* upstream bytes the owner reported */
+  uint64_t countedReconnects;
+
+  char flvHeader[13];
+  int haveHeader;
+  TAGBUF meta;
+  TAGBUF avcHeader;
+  TAGBUF aacHeader;
+  TAGBUF gop;			/* tags since the last video keyframe */
+  int haveKey;			/* gop starts with one */
+  int haveVideo;
+
+  Hls *hls;			/* segments for HLS clients */
+  uint32_t hlsUsed;		/* when one last asked for something */
+} LIVE_SOURCE;
+
+/* a source nobody but HLS clients uses is kept this long after the
+ * last request
+ */
+#define HLS_IDLE	30000
+
+static struct
+{
+  TMUTEX lock;
+  LIVE_SOURCE *sources;
+  unsigned int hlsSeq;		/* where the last HLS source stopped */
+} lives;
+
+static int
+TagBufSet(TAGBUF *t, size_t len, const char *hdr, const char *body,
+	  unsigned int bodySize, const char *trailer)
+{
+  size_t need = len + 11 + bodySize + 4;
+
+  if (need > t->size)
+    {
+      char *buf = realloc(t->buf, need);
+      if (!buf)
+	return FALSE;
+      t->buf = buf;
+      t->size = need;
+    }
+  memcpy(t->buf + len, hdr, 11);
+  memcpy(t->buf + len + 11, body, bodySize);
+  memcpy(t->buf + len + 11 + bodySize, trailer, 4);
+  t->len = need;
+  return TRUE;
+}
+
+/* Queue a tag for one client, with its timestamp moved so the client's
+ * stream starts at 0. Call with the source locked.
+ */
+static void
+LivePut(CLIENT *c, const char *hdr, const char *body, unsigned int bodySize,
+	const char *trailer, int kind, int burst)
+{
+  size_t size = 11 + bodySize + 4;
+  uint32_t ts = AMF_DecodeInt24(hdr + 4) | ((uint32_t)(unsigned char)hdr[7] << 24);
+  char h[11];
+
+  /* what a client is sent on joining must not count as falling behind */
+  if (!burst && ClientDrop(c, hdr[0], kind, size))
+    return;
+  if (RingUsed(&c->out) + size > c->out.size)
+    {
+      c->dropped++;
+      c->dropping = TRUE;
+      return;
+    }
+
+  if (!c->haveBase && (kind == TAG_KEY || kind == TAG_FRAME))
+    {
+      c->tsBase = ts;
+      c->haveBase = TRUE;
+    }
+  ts = c->haveBase && ts >= c->tsBase ? ts - c->tsBase : 0;
+  memcpy(h, hdr, 11);
+  AMF_EncodeInt24(h + 4, h + 7, ts);
+  h[7] = ts >> 24;
+  c->timestamp = ts;
+
+  RingPut(&c->out, h, 11, FALSE);
+  RingPut(&c->out, body, bodySize, FALSE);
+  RingPut(&c->out, trailer, 4, FALSE);
+}
+
+/* queue the FLV tags in buf for a joining client */
+static void
+LivePutTags(CLIENT *c, TAGBUF *t)
+{
+  char *p = t->buf, *end = t->buf + t->len;
+
+  while (end - p >= 15)
+    {
+      unsigned int size = AMF_DecodeInt24(p + 1);
+      LivePut(c, p, p + 11, size, p + 11 + size, TagKind(*p, p + 11, size),
+	      TRUE);
+      p += 11 + size + 4;
+    }
+}
+
+/* One tag from upstream: remember it if a joining client will need it
+ * and pass it on.
+ */
+static void
+LiveTag(LIVE_SOURCE *src, const char *hdr, const char *body,
+	unsigned int bodySize, const char *trailer)
+{
+  int kind = TagKind(hdr[0], body, bodySize);
+  CLIENT *c;
+
+  MutexLock(&src->lock);
+  if (hdr[0] == RTMP_PACKET_TYPE_VIDEO)
+    src->haveVideo = TRUE;
+  switch (kind)
+    {
+    case TAG_META:
+      TagBufSet(&src->meta, 0, hdr, body, bodySize, trailer);
+      break;
+    case TAG_AVCHDR:
+      TagBufSet(&src->avcHeader, 0, hdr, body, bodySize, trailer);
+      break;
+    case TAG_AACHDR:
+      TagBufSet(&src->aacHeader, 0, hdr, body, bodySize, trailer);
+      break;
+    case TAG_KEY:
+      src->haveKey = TagBufSet(&src->gop, 0, hdr, body, bodySize, trailer);
+      break;
+    case TAG_FRAME:
+      /* a GOP a client couldn't take in one go isn't worth keeping,
+       * joining clients wait for the next keyframe then
+       */
+      if (src->haveKey
+	  && (src->gop.len + 15 + bodySize > queueSize / 4
+	      || !TagBufSet(&src->gop, src->gop.len, hdr, body, bodySize,
+			    trailer)))
+	{
+	  src->haveKey = FALSE;
+	  src->gop.len = 0;
+	}
+      break;
+    }
+  for (c = src->clients; c; c = c->nextLive)
+    LivePut(c, hdr, body, bodySize, trailer, kind, FALSE);
+  if (src->hls)
+    HlsTag(src->hls, hdr[0], AMF_DecodeInt24(hdr + 4)
+	   | ((uint32_t)(unsigned char)hdr[7] << 24), body, bodySize);
+  MutexUnlock(&src->lock);
+}
+
+/* tags as RTMP_Read returns them or inside an aggregate */
+static void
+LiveTags(LIVE_SOURCE *src, const char *buf, size_t len)
+{
+  const char *p = buf, *end = buf + len;
+
+  while (end - p >= 15)
+    {
+      unsigned int size = AMF_DecodeInt24(p + 1);
+      if ((size_t)(end - p) < 15 + size)
+	break;
+      LiveTag(src, p, p + 11, size, p + 11 + size);
+      p += 11 + size + 4;
+    }
+}
+
+static void
+LiveRelease(LIVE_SOURCE *src)
+{
+  int refs;
+
+  MutexLock(&src->lock);
+  refs = --src->refs;
+  MutexUnlock(&src->lock);
+  if (refs)
+    return;
+  MutexDestroy(&src->lock);
+  free(src->meta.buf);
+  free(src->avcHeader.buf);
+  free(src->aacHeader.buf);
+  free(src->gop.buf);
+  if (src->hls)
+    {
+      HlsFree(src->hls);
+      free(src->hls);
+    }
+  free(src);
+}
+
+/* Take the source off the list, call with lives locked */
+static void
+LiveUnlink(LIVE_SOURCE *src)
+{
+  LIVE_SOURCE **prev;
+
+  for (prev = &lives.sources; *prev; prev = &(*prev)->next)
+    if (*prev == src)
+      {
+	*prev = src->next;
+	break;
+      }
+}
+
+/* whether anybody still reads the source, call with it locked */
+static int
+LiveWanted(LIVE_SOURCE *src)
+{
+  return src->clients
+    || (src->hls && RTMP_GetTime() - src->hlsUsed < HLS_IDLE);
+}
+
+static TFTYPE
+LiveThread(void *arg)
+{
+  LIVE_SOURCE *src = arg;
+  CLIENT *c;
+  char *buffer = NULL;
+  uint32_t now;
+  int nRead = 0, err = ERR_NONE, wanted;
+
+  if (!SetupRTMP(&src->rtmp, &src->req, 0))
+    {
+      err = ERR_REQUEST;
+      goto done;
+    }
+  RTMP_LogPrintf("Connecting live source %s\n", src->key);
+  now = RTMP_GetTime();
+  if (!RTMP_Connect(&src->rtmp, NULL))
+    {
+      RTMP_LogPrintf("%s, failed to connect!\n", __FUNCTION__);
+      err = ERR_CONNECT;
+      goto done;
+    }
+  MutexLock(&src->lock);
+  src->connected = RTMP_GetTime();
+  SessionConnected(src->owner, src->connected - now);
+  MutexUnlock(&src->lock);
+
+  /* the FLV header and what was buffered to fill in its flags */
+  buffer = malloc(PACKET_SIZE);
+  if (!buffer)
+    goto done;
+  do
+    {
+      nRead = RTMP_Read(&src->rtmp, buffer, PACKET_SIZE);
+      if (nRead >= 13 && !memcmp(buffer, "FLV", 3))
+	{
+	  MutexLock(&src->lock);
+	  memcpy(src->flvHeader, buffer, 13);
+	  src->haveHeader = TRUE;
+	  for (c = src->clients; c; c = c->nextLive)
+	    RingPut(&c->out, buffer, 13, FALSE);
+	  MutexUnlock(&src->lock);
+	  LiveTags(src, buffer + 13, nRead - 13);
+	}
+      else if (nRead > 0)
+	LiveTags(src, buffer, nRead);
+    }
+  while (nRead >= 0 && src->rtmp.m_read.buf && RTMP_IsConnected(&src->rtmp));
+
+  while (nRead >= 0 && RTMP_IsConnected(&src->rtmp)
+	 && src->server->state == STREAMING_ACCEPTING)
+    {
+      RTMPTag tag;
+
+      MutexLock(&src->lock);
+      if (src->owner)
+	SessionUpstream(src->owner, &src->rtmp);
+      wanted = LiveWanted(src);
+      MutexUnlock(&src->lock);
+      if (!wanted)
+	{
+	  /* decide again with lives locked as well, so nobody joins
+	   * between the decision and the source going from the list
+	   */
+	  MutexLock(&lives.lock);
+	  MutexLock(&src->lock);
+	  wanted = LiveWanted(src);
+	  if (!wanted)
+	    LiveUnlink(src);
+	  MutexUnlock(&src->lock);
+	  MutexUnlock(&lives.lock);
+	  if (!wanted)
+	    break;		/* everybody left */
+	}
+
+      nRead = RTMP_ReadTag(&src->rtmp, &tag);
+      if (nRead > 0)
+	{
+	  if (tag.hlen)
+	    LiveTag(src, tag.header, tag.body, tag.bodySize, tag.trailer);
+	  else
+	    LiveTags(src, tag.body, tag.bodySize);
+	}
+      else if (!nRead && src->rtmp.m_read.status < 0)
+	break;
+      RTMP_FreeTag(&tag);
+    }
+
+done:
+  free(buffer);
+
+  /* nobody joins from here on */
+  MutexLock(&lives.lock);
+  LiveUnlink(src);
+  /* a source started for the same stream later must not reuse the
+   * segment URLs
+   */
+  MutexLock(&src->lock);
+  if (src->hls)
+    {
+      unsigned int seq = HlsEnd(src->hls);
+      if ((int)(seq - lives.hlsSeq) > 0)
+	lives.hlsSeq = seq;
+    }
+  MutexUnlock(&src->lock);
+  MutexUnlock(&lives.lock);
+
+  MutexLock(&src->lock);
+  /* clients left on a live stream that stopped want more */
+  if (err == ERR_NONE && src->clients
+      && src->server->state == STREAMING_ACCEPTING
+      && src->rtmp.m_read.status != RTMP_READ_COMPLETE)
+    err = ERR_UPSTREAM;
+  src->done = TRUE;
+  src->err = err;
+  for (c = src->clients; c; c = c->nextLive)
+    RingClose(&c->out);
+  /* the rest of the upstream traffic goes to the totals */
+  if (src->owner)
+    {
+      SessionUpstream(src->owner, &src->rtmp);
+      src->owner = NULL;
+    }
+  else
+    {
+      MutexLock(&gw.lock);
+      gw.bytesUp += src->rtmp.m_stats.bytesIn - src->counted;
+      gw.reconnects += src->rtmp.m_stats.reconnects - src->countedReconnects;
+      MutexUnlock(&gw.lock);
+    }
+  MutexUnlock(&src->lock);
+
+  RTMP_Close(&src->rtmp);
+  RTMP_LogPrintf("Live source %s closed\n", src->key);
+  LiveRelease(src);
+  TFRET();
+}
+
+/* The live source for key, a new one if there is none yet and req is
+ * given. Call with lives locked, the reader is started by the caller.
+ */
+static LIVE_SOURCE *
+LiveFind(STREAMING_SERVER *server, RTMP_REQUEST *req, const char *key,
+	 GW_SESSION *sess, int *created)
+{
+  LIVE_SOURCE *src;
+
+  *created = FALSE;
+  for (src = lives.sources; src; src = src->next)
+    if (!strcmp(src->key, key))
+      return src;
+  if (!req)
+    return NULL;
+
+  src = calloc(1, sizeof(LIVE_SOURCE));
+  if (!src)
+    return NULL;
+  snprintf(src->key, sizeof(src->key), "%s", key);
+  memcpy(&src->req, req, sizeof(RTMP_REQUEST));
+  src->server = server;
+  src->refs = 1;
+  src->owner = sess;
+  MutexInit(&src->lock);
+  src->next = lives.sources;
+  lives.sources = src;
+  *created = TRUE;
+  return src;
+}
+
+/* Start the reader of a source LiveFind created. Call with lives still
+ * locked, the reader doesn't stop before the caller has joined then.
+ * Without a thread the source is dropped again.
+ */
+static int
+LiveStart(LIVE_SOURCE *src)
+{
+  if (!ThreadFailed(ThreadCreate(LiveThread, src)))
+    return TRUE;
+  RTMP_Log(RTMP_LOGERROR, "%s, can't start the reader for %s", __FUNCTION__,
+	   src->key);
+  LiveUnlink(src);
+  LiveRelease(src);
+  return FALSE;
+}
+
+/* Add a client to the live source for key, starting one if there is
+ * none yet, and queue what it needs to start playing.
+ */
+static LIVE_SOURCE *
+LiveJoin(STREAMING_SERVER *server, CLIENT *c, RTMP_REQUEST *req,
+	 const char *key, GW_SESSION *sess)
+{
+  LIVE_SOURCE *src;
+  int created;
+
+  MutexLock(&lives.lock);
+  src = LiveFind(server, req, key, sess, &created);
+  if (!src || (created && !LiveStart(src)))
+    {
+      MutexUnlock(&lives.lock);
+      return NULL;
+    }
+
+  MutexLock(&src->lock);
+  src->refs++;
+  c->nextLive = src->clients;
+  src->clients = c;
+  c->haveBase = FALSE;
+  if (src->haveHeader)
+    RingPut(&c->out, src->flvHeader, 13, FALSE);
+  LivePutTags(c, &src->meta);
+  LivePutTags(c, &src->avcHeader);
+  LivePutTags(c, &src->aacHeader);
+  if (src->haveKey)
+    LivePutTags(c, &src->gop);
+  else if (src->haveVideo)
+    c->dropping = TRUE;		/* start at the next keyframe */
+  MutexUnlock(&src->lock);
+  MutexUnlock(&lives.lock);
+
+  if (!created)
+    RTMP_LogPrintf("Joining live source %s\n", key);
+  return src;
+}
+
+/* Returns why the source stopped, ERR_NONE if it is still going */
+static int
+LiveLeave(LIVE_SOURCE *src, CLIENT *c, GW_SESSION *sess)
+{
+  CLIENT **prev;
+  int err;
+
+  MutexLock(&src->lock);
+  for (prev = &src->clients; *prev; prev = &(*prev)->nextLive)
+    if (*prev == c)
+      {
+	*prev = c->nextLive;
+	break;
+      }
+  /* what the owner reported is counted when its session ends */
+  if (sess && src->owner == sess)
+    {
+      SessionUpstream(sess, &src->rtmp);
+      src->counted = sess->bytesUp;
+      src->countedReconnects = sess->reconnects;
+      src->owner = NULL;
+    }
+  err = src->done ? src->err : ERR_NONE;
+  MutexUnlock(&src->lock);
+  LiveRelease(src);
+  return err;
 }
 
-TFTYPE
-controlServerThread(void *unused)
+/* Serve a live stream from a shared source. Returns what went wrong,
+ * ERR_NONE if the stream just ended.
+ */
+static int
+LiveServe(STREAMING_SERVER *server, CLIENT *c, RTMP_REQUEST *req,
+	  const char *key, GW_SESSION *sess)
 {
-  char ich;
-  while (1)
+  LIVE_SOURCE *src;
+  uint32_t joined = RTMP_GetTime();
+  const char *data;
+  size_t len;
+  int err = ERR_NONE, left;
+
+  src = LiveJoin(server, c, req, key, sess);
+  if (!src)
+    return ERR_CONNECT;
+
+  /* the reader fills our queue, we send it on */
+  while ((len = RingGet(&c->out, &data)) > 0)
     {
-      ich = getchar();
-      switch (ich)
+      char hdr[16];
+      int hlen = 0;
+
+      if (c->chunked)
+	hlen = sprintf(hdr, "%x\r\n", (unsigned int) len);
+      if ((hlen && ClientSendAll(c, hdr, hlen) < 0)
+	  || ClientSendAll(c, data, len) < 0
+	  || (hlen && ClientSendAll(c, "\r\n", 2) < 0))
 	{
-	case 'q':
-	  RTMP_LogPrintf("Exiting\n");
-	  stopStreaming(httpServer);
-	  exit(0);
+	  RTMP_Log(RTMP_LOGERROR, "%s, sending failed, error: %d", __FUNCTION__,
+		   GetSockError());
+	  err = ERR_SEND;
 	  break;
-	default:
-	  RTMP_LogPrintf("Unknown command \'%c\', ignoring\n", ich);
 	}
+      RingConsume(&c->out, len);
+      SessionProgress(sess, NULL, c, 0, joined);
     }
-  TFRET();
+
+  left = LiveLeave(src, c, sess);
+  if (err == ERR_NONE)
+    err = left;
+  if (err == ERR_NONE && !ClientEnd(c))
+    err = ERR_SEND;
+  return err;
 }
 
-/*
-ssize_t readHTTPLine(int sockfd, char *buffer, size_t length)
+/* The live source for key with HLS segments being cut, started if req
+ * is given and there is none. Returns it with a reference taken.
+ */
+static LIVE_SOURCE *
+LiveHls(STREAMING_SERVER *server, RTMP_REQUEST *req, const char *key)
 {
-	size_t i=0;
-
-	while(i < length-1) {
-		char c;
-		int n = read(sockfd, &c, 1);
-
-		if(n == 0)
-			break;
+  LIVE_SOURCE *src;
+  int created;
 
-		buffer[i] = c;
-		i++;
+  MutexLock(&lives.lock);
+  src = LiveFind(server, req, key, NULL, &created);
+  if (!src || (created && !LiveStart(src)))
+    {
+      MutexUnlock(&lives.lock);
+      return NULL;
+    }
 
-		if(c == '\n')
-			break;
+  MutexLock(&src->lock);
+  if (!src->hls)
+    {
+      /* numbered from the clock so caches in front never mix up the
+       * segments of one source with those of an earlier one
+       */
+      unsigned int seq = time(NULL);
+      Hls *hls = malloc(sizeof(Hls));
+
+      if ((int)(seq - lives.hlsSeq) < 0)
+	seq = lives.hlsSeq;
+      if (hls && HlsInit(hls, hlsTarget, hlsWindow, seq))
+	{
+	  TAGBUF *hdrs[2] = { &src->avcHeader, &src->aacHeader };
+	  int i;
+
+	  /* a source that is already going has seen them */
+	  for (i = 0; i < 2; i++)
+	    if (hdrs[i]->len)
+	      HlsTag(hls, hdrs[i]->buf[0], 0, hdrs[i]->buf + 11,
+		     AMF_DecodeInt24(hdrs[i]->buf + 1));
+	  src->hls = hls;
 	}
-	buffer[i]='\0';
-	i++;
-
-	return i;
+      else
+	free(hls);
+    }
+  src->hlsUsed = RTMP_GetTime();
+  src->refs++;
+  MutexUnlock(&src->lock);
+  MutexUnlock(&lives.lock);
+  return src;
 }
 
-int isHTTPRequestEOF(char *line, size_t length)
+/* Serve the HLS playlist or a segment of a live stream, cut from its
+ * shared source. name is what follows /hls/ in the path, query the
+ * stream options, which the segment URIs carry too.
+ */
+static int
+ServeHls(STREAMING_SERVER *server, CLIENT *c, RTMP_REQUEST *req,
+	 const char *name, const char *query)
 {
-	if(length < 2)
-		return TRUE;
+  LIVE_SOURCE *src = NULL;
+  HlsSegment *seg = NULL;
+  char key[REQUEST_SIZE], fields[256];
+  char *body = NULL, *q;
+  const char *status = NULL;
+  unsigned int seq = 0;
+  int playlist, len = 0, ret, err = ERR_REQUEST;
+
+  playlist = !strncmp(name, "index.m3u8", 10) && (!name[10] || name[10] == '?');
+  if (!playlist)
+    {
+      seq = strtoul(name, &q, 10);
+      if (q == name || strncmp(q, ".ts", 3) || (q[3] && q[3] != '?'))
+	status = "404 Not Found";
+    }
+  if (!status && !req->bLiveStream)
+    status = "400 HLS Needs A Live Stream";
+  if (status)
+    goto fail;
+
+  c->timeout = req->timeout;
+  c->sent = 0;
+  snprintf(key, sizeof(key), "/%s", query);
+
+  /* only a playlist request starts a source, segments come after it */
+  src = LiveHls(server, playlist ? req : NULL, key);
+  if (!src || !src->hls)
+    {
+      /* with req, no source means it couldn't be started */
+      status = src || playlist ? "500 Internal Server Error" : "404 Not Found";
+      goto fail;
+    }
 
-	if(line[0]=='\r' && line[1]=='\n')
-		return TRUE;
+  if (playlist)
+    {
+      uint32_t start = RTMP_GetTime();
+      int done = FALSE;
 
-	return FALSE;
+      /* a new source has nothing to list before its first cut */
+      while (!(body = HlsPlaylist(src->hls, query, &len)))
+	{
+	  MutexLock(&src->lock);
+	  done = src->done;
+	  err = src->err;
+	  MutexUnlock(&src->lock);
+	  if (done || server->state != STREAMING_ACCEPTING
+	      || RTMP_GetTime() - start > (uint32_t)req->timeout * 1000)
+	    break;
+	  msleep(100);
+	}
+      if (!body)
+	{
+	  if (done)
+	    {
+	      status = "502 Bad Gateway";
+	      if (err == ERR_NONE)
+		err = ERR_UPSTREAM;
+	    }
+	  else
+	    {
+	      status = "503 Service Unavailable";
+	      err = ERR_UPSTREAM;
+	    }
+	  goto fail;
+	}
+      /* a cache in front can hold it for half a segment */
+      snprintf(fields, sizeof(fields),
+	       "Content-Type: application/vnd.apple.mpegurl\r\n"
+	       "Cache-Control: max-age=%u\r\nContent-Length: %d\r\n",
+	       hlsTarget / 2000, len);
+      ret = SendHead(c, "200 OK", fields) && ClientPut(c, body, len);
+      free(body);
+    }
+  else
+    {
+      seg = HlsGet(src->hls, seq);
+      if (!seg)
+	{
+	  status = "404 Not Found";
+	  goto fail;
+	}
+      /* a segment URL always means the same data */
+      snprintf(fields, sizeof(fields), "Content-Type: video/mp2t\r\n"
+	       "Cache-Control: max-age=3600\r\nContent-Length: %lu\r\n",
+	       (unsigned long) seg->len);
+      ret = SendHead(c, "200 OK", fields)
+	&& ClientPut(c, seg->data, seg->len);
+      HlsRelease(src->hls, seg);
+    }
+  LiveRelease(src);
+
+  MutexLock(&gw.lock);
+  if (playlist)
+    gw.hlsPlaylists++;
+  else
+    gw.hlsSegments++;
+  gw.bytesSent += c->sent;
+  MutexUnlock(&gw.lock);
+  return ret && c->keepAlive;
+
+fail:
+  if (src)
+    LiveRelease(src);
+  RTMP_LogPrintf("%s, %s, /hls/%s\n", __FUNCTION__, status, name);
+  CountError(err);
+  return SendHead(c, status, "Content-Length: 0\r\n") && c->keepAlive;
 }
-*/
 
-void processTCPrequest(STREAMING_SERVER * server,	// server socket and state (our listening socket)
-		       int sockfd	// client connection socket
+/* Serve one request of a connection. Returns TRUE if the connection
+ * can take another one.
+ */
+static int
+ServeRequest(STREAMING_SERVER * server,	// server socket and state (our listening socket)
+	     CLIENT *c,	// client connection
+	     char *header	// request header, parsed in place
   )
 {
-  char buf[512] = { 0 };	// answer buffer
-  char header[2048] = { 0 };	// request header
+  int sockfd = c->sockfd;
+  char fields[512];		// extra response header fields
+  char value[256];		// header field value
+  char key[REQUEST_SIZE] = "";	// the request path, for the seek index
   char *filename = NULL;	// GET request: file name //512 not enuf
+  char *hlsName = NULL;		// what follows /hls/ in an HLS request
+  char *query = "";		// the options, ?... in the request path
   char *buffer = NULL;		// stream buffer
   char *ptr = NULL;		// header pointer
-  int len;
-
-  size_t nRead = 0;
-
-  char srvhead[] = "\r\nServer: HTTP-RTMP Stream Server " RTMPDUMP_VERSION "\r\n";
+  int keep = FALSE;
+  int indexed = FALSE;
+  double rangeStart = -1, rangeEnd = -1;
 
   char *status = "404 Not Found";
 
-  server->state = STREAMING_IN_PROGRESS;
+  GW_SESSION *sess = NULL;
+  int err = ERR_NONE;
+  uint32_t now;
 
   RTMP rtmp = { 0 };
   uint32_t dSeek = 0;		// can be used to start from a later point in the stream
@@ -352,58 +2193,60 @@ void processTCPrequest(STREAMING_SERVER * server,	// server socket and state (ou
   RTMP_REQUEST req;
   memcpy(&req, &defaultRTMPRequest, sizeof(RTMP_REQUEST));
 
-  // timeout for http requests
-  fd_set fds;
-  struct timeval tv;
-
-  memset(&tv, 0, sizeof(struct timeval));
-  tv.tv_sec = 5;
+  RTMP_Log(RTMP_LOGDEBUG, "%s: header: %s", __FUNCTION__, header);
 
-  // go through request lines
-  //do {
-  FD_ZERO(&fds);
-  FD_SET(sockfd, &fds);
-
-  if (select(sockfd + 1, &fds, NULL, NULL, &tv) <= 0)
+  ptr = strstr(header, "HTTP/1.1");
+  c->http11 = ptr && strchr(header, '\n') && ptr < strchr(header, '\n');
+  c->keepAlive = c->http11;
+  c->chunked = FALSE;
+  if (HeaderField(header, "Connection", value, sizeof(value)))
     {
-      RTMP_Log(RTMP_LOGERROR, "Request timeout/select failed, ignoring request");
-      goto quit;
+      if (!strcasecmp(value, "close"))
+	c->keepAlive = FALSE;
+      else if (!strcasecmp(value, "keep-alive"))
+	c->keepAlive = TRUE;
     }
-  else
+  if (HeaderField(header, "Range", value, sizeof(value)))
     {
-      nRead = recv(sockfd, header, 2047, 0);
-      header[2047] = '\0';
-
-      RTMP_Log(RTMP_LOGDEBUG, "%s: header: %s", __FUNCTION__, header);
+      /* only a single range from a given offset on, anything else is
+       * answered with the whole stream, which HTTP allows
+       */
+      char *p = value + 6, *q;
 
-      if (strstr(header, "Range: bytes=") != 0)
+      if (!strncmp(value, "bytes=", 6) && isdigit((unsigned char)*p))
 	{
-	  // TODO check range starts from 0 and asking till the end.
-	  RTMP_LogPrintf("%s, Range request not supported\n", __FUNCTION__);
-	  len = sprintf(buf, "HTTP/1.0 416 Requested Range Not Satisfiable%s\r\n",
-		  srvhead);
-	  send(sockfd, buf, len, 0);
-	  goto quit;
+	  rangeStart = strtod(p, &q);
+	  if (*q++ == '-')
+	    {
+	      if (isdigit((unsigned char)*q))
+		rangeEnd = strtod(q, &q);
+	      if (*q || (rangeEnd >= 0 && rangeEnd < rangeStart))
+		rangeStart = -1;
+	    }
+	  else
+	    rangeStart = -1;
 	}
+    }
 
-      if (strncmp(header, "GET", 3) == 0 && nRead > 4)
-	{
-	  filename = header + 4;
+  if (strncmp(header, "GET", 3) == 0 && strlen(header) > 4)
+    {
+      filename = header + 4;
 
-	  // filter " HTTP/..." from end of request
-	  char *p = filename;
-	  while (*p != '\0')
+      // filter " HTTP/..." from end of request
+      char *p = filename;
+      while (*p != '\0')
+	{
+	  if (*p == ' ' || *p == '\r' || *p == '\n')
 	    {
-	      if (*p == ' ')
-		{
-		  *p = '\0';
-		  break;
-		}
-	      p++;
+	      *p = '\0';
+	      break;
 	    }
+	  p++;
 	}
     }
-  //} while(!isHTTPRequestEOF(header, nRead));
+
+  if (filename && strcmp(filename, "/metrics") == 0)
+    return SendMetrics(c) && c->keepAlive;
 
   // if we got a filename from the GET method
   if (filename != NULL)
@@ -413,9 +2256,19 @@ void processTCPrequest(STREAMING_SERVER * server,	// server socket and state (ou
 	{			// if its not empty, is it /?
 	  ptr = filename + 1;
 
+	  // HLS playlists and segments carry the options as well
+	  if (!strncmp(ptr, "hls/", 4))
+	    {
+	      hlsName = ptr + 4;
+	      ptr = strchr(hlsName, '?');
+	      if (!ptr)
+		ptr = hlsName + strlen(hlsName);
+	    }
+
 	  // parse parameters
 	  if (*ptr == '?')
 	    {
+	      query = ptr;
 	      ptr++;
 	      int len = strlen(ptr);
 
@@ -529,9 +2382,61 @@ void processTCPrequest(STREAMING_SERVER * server,	// server socket and state (ou
 #endif
     }
 
-  // after validation of the http request send response header
-  len = sprintf(buf, "HTTP/1.0 200 OK%sContent-Type: video/flv\r\n\r\n", srvhead);
-  send(sockfd, buf, len, 0);
+  if (hlsName)
+    return ServeHls(server, c, &req, hlsName, query);
+
+  if (!req.bLiveStream && filename)
+    snprintf(key, sizeof(key), "%s", filename);
+
+  /* A byte range of a VOD stream starts at the keyframe before it. The
+   * remuxed bytes can't match the original file's, so it is answered as
+   * a stream of its own from there, with 200 and a new FLV header.
+   */
+  if (rangeStart > 0 && key[0])
+    {
+      double from;
+      uint32_t startMS;
+      int found;
+
+      found = SeekIndexFind(key, rangeStart, &from, &startMS);
+      if (found < 0 && SeekIndexProbe(&req, key))
+	found = SeekIndexFind(key, rangeStart, &from, &startMS);
+      if (found > 0)
+	{
+	  RTMP_LogPrintf("Range from byte %.0f, starting at keyframe %.0f, %u ms\n",
+			 rangeStart, from, startMS);
+	  req.dStartOffset = startMS;
+	}
+    }
+
+  sess = SessionStart(sockfd, &req);
+
+  // after validation of the http request send response header, the
+  // body runs until the stream ends so HTTP/1.0 needs the connection
+  // closed after it
+  if (c->http11)
+    c->chunked = TRUE;
+  else
+    c->keepAlive = FALSE;
+  c->live = req.bLiveStream;
+  c->timeout = req.timeout;
+  c->dropping = FALSE;
+  c->sent = 0;
+  c->dropped = 0;
+  snprintf(fields, sizeof(fields), "Content-Type: video/flv\r\n%s",
+	   c->chunked ? "Transfer-Encoding: chunked\r\n" : "");
+  if (!SendHead(c, "200 OK", fields))
+    {
+      err = ERR_SEND;
+      goto quit;
+    }
+
+  /* live clients share the upstream unless they want to hold it up */
+  if (req.bLiveStream && slowPolicy != SLOW_WAIT)
+    {
+      err = LiveServe(server, c, &req, filename ? filename : "/", sess);
+      goto quit;
+    }
 
   // send the packets
   buffer = (char *) calloc(PACKET_SIZE, 1);
@@ -551,79 +2456,94 @@ void processTCPrequest(STREAMING_SERVER * server,	// server socket and state (ou
       RTMP_LogPrintf("Starting at TS: %d ms\n", dSeek);
     }
 
-  RTMP_Log(RTMP_LOGDEBUG, "Setting buffer time to: %dms", req.bufferTime);
-  RTMP_Init(&rtmp);
-  RTMP_SetBufferMS(&rtmp, req.bufferTime);
-  if (!req.fullUrl.av_len)
-    {
-      RTMP_SetupStream(&rtmp, req.protocol, &req.hostname, req.rtmpport, &req.sockshost,
-                       &req.playpath, &req.tcUrl, &req.swfUrl, &req.pageUrl, &req.app, &req.auth, &req.swfHash, req.swfSize, &req.flashVer, &req.subscribepath, &req.usherToken, &req.WeebToken, dSeek, req.dStopOffset,
-                       req.bLiveStream, req.timeout);
-    }
-  else
+  if (!SetupRTMP(&rtmp, &req, dSeek))
     {
-      if (RTMP_SetupURL(&rtmp, req.fullUrl.av_val) == FALSE)
-        {
-          RTMP_Log(RTMP_LOGERROR, "Couldn't parse URL: %s", req.fullUrl.av_val);
-          return;
-        }
+      err = ERR_REQUEST;
+      goto cleanup;
     }
-  /* backward compatibility, we always sent this as true before */
-  if (req.auth.av_len)
-    rtmp.Link.lFlags |= RTMP_LF_AUTH;
-
-  rtmp.Link.extras = req.extras;
-  rtmp.Link.token = req.token;
-  rtmp.m_read.timestamp = dSeek;
 
   RTMP_LogPrintf("Connecting ... port: %d, app: %s\n", req.rtmpport, req.app.av_val);
+  now = RTMP_GetTime();
   if (!RTMP_Connect(&rtmp, NULL))
     {
       RTMP_LogPrintf("%s, failed to connect!\n", __FUNCTION__);
+      err = ERR_CONNECT;
     }
   else
     {
-      unsigned long size = 0;
-      double percent = 0;
       double duration = 0.0;
+      uint32_t connected = RTMP_GetTime();
 
       int nWritten = 0;
       int nRead = 0;
 
+      SessionConnected(sess, connected - now);
+
       do
 	{
-	  nRead = RTMP_Read(&rtmp, buffer, PACKET_SIZE);
+	  /* once the FLV header and whatever RTMP_Read buffered with it
+	   * are out, pass the tags on without copying them, gathering
+	   * as many as are ready into one send
+	   */
+	  if ((rtmp.m_read.flags & RTMP_READ_HEADER) && !rtmp.m_read.buf)
+	    {
+	      RTMPTag tags[SEND_TAGS];
+	      int i, n, nTags = 0;
+
+	      nRead = 0;
+	      do
+		{
+		  n = RTMP_ReadTag(&rtmp, &tags[nTags]);
+		  if (n < 0)
+		    nRead = -1;
+		  else if (n > 0)
+		    {
+		      nRead += n;
+		      nTags++;
+		    }
+		  else if (rtmp.m_read.status < 0)
+		    break;
+		}
+	      while (n >= 0 && nTags < SEND_TAGS && nRead < PACKET_SIZE
+		     && RTMP_ReadPending(&rtmp));
+
+	      if (nTags && nRead > 0)
+		nWritten = SendTags(c, tags, nTags);
+	      for (i = 0; i < nTags; i++)
+		{
+		  if (key[0] && !indexed
+		      && tags[i].type == RTMP_PACKET_TYPE_INFO)
+		    indexed = SeekIndexAdd(key, tags[i].body, tags[i].bodySize);
+		  RTMP_FreeTag(&tags[i]);
+		}
+	    }
+	  else
+	    {
+	      nRead = RTMP_Read(&rtmp, buffer, PACKET_SIZE);
+	      if (nRead > 0)
+		{
+		  if (key[0] && !indexed)
+		    indexed = SeekIndexScan(key, buffer, nRead);
+		  nWritten = ClientSend(c, buffer, nRead);
+		}
+	    }
 
 	  if (nRead > 0)
 	    {
-	      if ((nWritten = send(sockfd, buffer, nRead, 0)) < 0)
+	      if (nWritten < 0)
 		{
 		  RTMP_Log(RTMP_LOGERROR, "%s, sending failed, error: %d", __FUNCTION__,
 		      GetSockError());
-		  goto cleanup;	// we are in STREAMING_IN_PROGRESS, so we'll go to STREAMING_ACCEPTING
+		  err = ERR_SEND;
+		  goto cleanup;
 		}
 
-	      size += nRead;
-
 	      //RTMP_LogPrintf("write %dbytes (%.1f KB)\n", nRead, nRead/1024.0);
 	      if (duration <= 0)	// if duration unknown try to get it from the stream (onMetaData)
 		duration = RTMP_GetDuration(&rtmp);
 
-	      if (duration > 0)
-		{
-		  percent =
-		    ((double) (dSeek + rtmp.m_read.timestamp)) / (duration *
-							   1000.0) * 100.0;
-		  percent = ((double) (int) (percent * 10.0)) / 10.0;
-		  RTMP_LogStatus("\r%.3f KB / %.2f sec (%.1f%%)",
-			    (double) size / 1024.0,
-			    (double) (rtmp.m_read.timestamp) / 1000.0, percent);
-		}
-	      else
-		{
-		  RTMP_LogStatus("\r%.3f KB / %.2f sec", (double) size / 1024.0,
-			    (double) (rtmp.m_read.timestamp) / 1000.0);
-		}
+	      // the status line is printed from the main thread
+	      SessionProgress(sess, &rtmp, c, duration, connected);
 	    }
 #ifdef _DEBUG
 	  else
@@ -632,8 +2552,26 @@ void processTCPrequest(STREAMING_SERVER * server,	// server socket and state (ou
 	    }
 #endif
 	}
-      while (server->state == STREAMING_IN_PROGRESS && nRead > -1
+      while (server->state == STREAMING_ACCEPTING && nRead > -1
 	     && RTMP_IsConnected(&rtmp) && nWritten >= 0);
+
+      /* a VOD server may just hang up after the last packet */
+      if (server->state == STREAMING_ACCEPTING
+	  && rtmp.m_read.status != RTMP_READ_COMPLETE
+	  && (nRead < 0 || duration <= 0
+	      || dSeek + rtmp.m_read.timestamp + 1000 < duration * 1000.0))
+	{
+	  err = ERR_UPSTREAM;
+	  /* the client still gets what it was sent */
+	  ClientFlush(c, TRUE);
+	}
+      else if (server->state == STREAMING_ACCEPTING)
+	{
+	  if (ClientEnd(c))
+	    keep = c->keepAlive;
+	  else
+	    err = ERR_SEND;
+	}
     }
 cleanup:
   RTMP_LogPrintf("Closing connection... ");
@@ -647,19 +2585,99 @@ quit:
       buffer = NULL;
     }
 
-  if (sockfd)
-    closesocket(sockfd);
-
-  if (server->state == STREAMING_IN_PROGRESS)
-    server->state = STREAMING_ACCEPTING;
+  if (sess)
+    SessionEnd(sess, err);
 
-  return;
+  return keep;
 
 filenotfound:
   RTMP_LogPrintf("%s, %s, %s\n", __FUNCTION__, status, filename);
-  len = sprintf(buf, "HTTP/1.0 %s%s\r\n", status, srvhead);
-  send(sockfd, buf, len, 0);
-  goto quit;
+  CountError(ERR_REQUEST);
+  return SendHead(c, status, "Content-Length: 0\r\n") && c->keepAlive;
+}
+
+void processTCPrequest(STREAMING_SERVER * server,	// server socket and state (our listening socket)
+		       int sockfd	// client connection socket
+  )
+{
+  CLIENT *c = calloc(1, sizeof(CLIENT));
+  char header[REQUEST_SIZE + 1];	// request header, all that fits in c->buf
+  int nServed = 0;
+
+  if (!c)
+    {
+      closesocket(sockfd);
+      return;
+    }
+  c->sockfd = sockfd;
+  c->timeout = defaultRTMPRequest.timeout;
+  if (!RingInit(&c->out, queueSize))
+    {
+      closesocket(sockfd);
+      free(c);
+      return;
+    }
+
+  /* sends never block, what the client can't take yet is queued */
+#ifdef WIN32
+  {
+    u_long on = 1;
+    ioctlsocket(sockfd, FIONBIO, &on);
+  }
+#else
+  fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+#endif
+
+  /* requests follow each other on a persistent connection */
+  while (server->state == STREAMING_ACCEPTING)
+    {
+      int n = ReadRequest(c, header, sizeof(header));
+
+      if (n == -2)
+	{
+	  c->keepAlive = FALSE;
+	  SendHead(c, "431 Request Header Fields Too Large",
+		   "Content-Length: 0\r\n");
+	  ClientFlush(c, TRUE);
+	  CountError(ERR_REQUEST);
+	  break;
+	}
+      if (n <= 0)
+	{
+	  /* an idle persistent connection just goes away */
+	  if (!nServed)
+	    {
+	      RTMP_Log(RTMP_LOGERROR, "Request timeout/select failed, ignoring request");
+	      CountError(ERR_REQUEST);
+	    }
+	  break;
+	}
+      nServed++;
+      if (!ServeRequest(server, c, header))
+	break;
+    }
+
+  closesocket(sockfd);
+  RingFree(&c->out);
+  free(c);
+}
+
+
+typedef struct
+{
+  STREAMING_SERVER *server;
+  int sockfd;
+} REQUEST_ARGS;
+
+TFTYPE
+requestThread(void *arg)
+{
+  REQUEST_ARGS *args = arg;
+
+  processTCPrequest(args->server, args->sockfd);
+  RTMP_Log(RTMP_LOGDEBUG, "%s: processed request\n", __FUNCTION__);
+  free(args);
+  TFRET();
 }
 
 TFTYPE
@@ -677,11 +2695,26 @@ serverThread(void *arg)
 
       if (sockfd > 0)
 	{
-	  // Create a new process and transfer the control to that
+	  REQUEST_ARGS *args = malloc(sizeof(REQUEST_ARGS));
+
 	  RTMP_Log(RTMP_LOGDEBUG, "%s: accepted connection from %s\n", __FUNCTION__,
 	      inet_ntoa(addr.sin_addr));
-	  processTCPrequest(server, sockfd);
-	  RTMP_Log(RTMP_LOGDEBUG, "%s: processed request\n", __FUNCTION__);
+	  if (!args)
+	    {
+	      closesocket(sockfd);
+	      continue;
+	    }
+	  // each request gets its own thread, so /metrics can be asked
+	  // for while streams are running
+	  args->server = server;
+	  args->sockfd = sockfd;
+	  if (ThreadFailed(ThreadCreate(requestThread, args)))
+	    {
+	      RTMP_Log(RTMP_LOGERROR, "%s: no thread for the request, dropping it",
+		  __FUNCTION__);
+	      closesocket(sockfd);
+	      free(args);
+	    }
 	}
       else
 	{
@@ -740,14 +2773,12 @@ stopStreaming(STREAMING_SERVER * server)
 
   if (server->state != STREAMING_STOPPED)
     {
-      if (server->state == STREAMING_IN_PROGRESS)
-	{
-	  server->state = STREAMING_STOPPING;
+      server->state = STREAMING_STOPPING;
 
-	  // wait for streaming threads to exit
-	  while (server->state != STREAMING_STOPPED)
-	    msleep(1);
-	}
+      // wait for streaming threads to exit, no locking since we may
+      // be in a signal handler
+      while (gw.nSessions)
+	msleep(1);
 
       if (closesocket(server->socket))
 	RTMP_Log(RTMP_LOGERROR, "%s: Failed to close listening socket, error %d",
@@ -924,6 +2955,22 @@ ParseOption(char opt, char *arg, RTMP_REQUEST * req)
     case 'i':
       STR2AVAL(req->fullUrl, arg);
       break;
+    case 'H':
+      if (!strcmp(arg, "both"))
+	req->hdrMode = RTMP_HDR_BOTH;
+      else if (!strcmp(arg, "meta"))
+	req->hdrMode = RTMP_HDR_META;
+      else if (!strncmp(arg, "probe", 5) && (!arg[5] || arg[5] == ':'))
+	{
+	  req->hdrMode = RTMP_HDR_PROBE;
+	  if (arg[5])
+	    req->hdrBufSize = atoi(arg + 6) * 1024;
+	}
+      else
+	{
+	  RTMP_Log(RTMP_LOGERROR, "Unknown FLV header mode %s, ignoring", arg);
+	}
+      break;
     case 's':
       STR2AVAL(req->swfUrl, arg);
       break;
@@ -1008,6 +3055,7 @@ main(int argc, char **argv)
   defaultRTMPRequest.bufferTime = 20 * 1000;
 
   defaultRTMPRequest.swfAge = 30;
+  defaultRTMPRequest.hdrMode = -1;
 
   int opt;
   struct option longopts[] = {
@@ -1040,10 +3088,15 @@ main(int argc, char **argv)
     //{"skip",    1, NULL, 'k'},
     {"device", 1, NULL, 'D'},
     {"sport", 1, NULL, 'g'},
+    {"queue", 1, NULL, 'Q'},
+    {"slow", 1, NULL, 'L'},
+    {"segtime", 1, NULL, 'K'},
+    {"segments", 1, NULL, 'N'},
     {"subscribe", 1, NULL, 'd'},
     {"start", 1, NULL, 'A'},
     {"stop", 1, NULL, 'B'},
     {"token", 1, NULL, 'T'},
+    {"flvheader", 1, NULL, 'H'},
     {"debug", 0, NULL, 'z'},
     {"quiet", 0, NULL, 'q'},
     {"verbose", 0, NULL, 'V'},
@@ -1061,7 +3114,7 @@ main(int argc, char **argv)
 
   while ((opt =
 	  getopt_long(argc, argv,
-                      "hvqVzr:s:t:i:p:a:f:u:n:c:l:y:m:d:D:A:B:T:g:w:x:W:X:S:j:J:", longopts,
+                      "hvqVzr:s:t:i:p:a:f:u:n:c:l:y:m:d:D:A:B:T:g:w:x:W:X:S:j:J:H:Q:L:K:N:", longopts,
 		      NULL)) != -1)
     {
       switch (opt)
@@ -1117,6 +3170,10 @@ main(int argc, char **argv)
 	  RTMP_LogPrintf
 	    ("--timeout|-m num        Timeout connection num seconds (default: %lu)\n",
 	     defaultRTMPRequest.timeout);
+	  RTMP_LogPrintf
+	    ("--flvheader|-H mode     How to find the FLV header flags: both (set both right away), meta (from\n");
+	  RTMP_LogPrintf
+	    ("                        onMetaData) or probe[:num] (buffer up to num kB of the stream, default)\n");
 	  RTMP_LogPrintf
 	    ("--start|-A num          Start at num seconds into stream (not valid when using --live)\n");
 	  RTMP_LogPrintf
@@ -1135,8 +3192,24 @@ main(int argc, char **argv)
 	    ("--device|-D             Streaming device ip address (default: %s)\n",
 	     DEFAULT_HTTP_STREAMING_DEVICE);
 	  RTMP_LogPrintf
-	    ("--sport|-g              Streaming port (default: %d)\n\n",
+	    ("--sport|-g              Streaming port (default: %d)\n",
 	     nHttpStreamingPort);
+	  RTMP_LogPrintf
+	    ("--queue|-Q num          Output queued per client in kB (default: %lu)\n",
+	     (unsigned long) (queueSize / 1024));
+	  RTMP_LogPrintf
+	    ("--slow|-L policy        Live clients past half their queue: drop (video to the next\n");
+	  RTMP_LogPrintf
+	    ("                        keyframe), skip (everything to the next keyframe) or wait\n");
+	  RTMP_LogPrintf
+	    ("                        (default: %s)\n", slowPolicies[slowPolicy]);
+	  RTMP_LogPrintf
+	    ("--segtime|-K num        Cut HLS segments at the first keyframe after num seconds\n");
+	  RTMP_LogPrintf
+	    ("                        (default: %u)\n", hlsTarget / 1000);
+	  RTMP_LogPrintf
+	    ("--segments|-N num       HLS segments listed in the playlist (default: %d)\n\n",
+	     hlsWindow);
 	  RTMP_LogPrintf
 	    ("--quiet|-q              Suppresses all command output.\n");
 	  RTMP_LogPrintf("--verbose|-V            Verbose command output.\n");
@@ -1174,6 +3247,63 @@ main(int argc, char **argv)
 	      }
 	    break;
 	  }
+	case 'Q':
+	  {
+	    int kb = atoi(optarg);
+	    if (kb < 64)
+	      {
+		RTMP_Log(RTMP_LOGERROR,
+		    "Output queue too small (requested %d kB), ignoring", kb);
+	      }
+	    else
+	      {
+		queueSize = (size_t)kb * 1024;
+	      }
+	    break;
+	  }
+	case 'L':
+	  {
+	    int i;
+	    for (i = 0; slowPolicies[i]; i++)
+	      if (!strcmp(optarg, slowPolicies[i]))
+		break;
+	    if (!slowPolicies[i])
+	      {
+		RTMP_Log(RTMP_LOGERROR,
+		    "Unknown slow client policy %s, use drop, skip or wait", optarg);
+		return RD_FAILED;
+	      }
+	    slowPolicy = i;
+	    break;
+	  }
+	case 'K':
+	  {
+	    int secs = atoi(optarg);
+	    if (secs < 1)
+	      {
+		RTMP_Log(RTMP_LOGERROR,
+		    "Invalid segment length (requested %d seconds), ignoring", secs);
+	      }
+	    else
+	      {
+		hlsTarget = secs * 1000;
+	      }
+	    break;
+	  }
+	case 'N':
+	  {
+	    int n = atoi(optarg);
+	    if (n < 2)
+	      {
+		RTMP_Log(RTMP_LOGERROR,
+		    "Too few playlist segments (requested %d), ignoring", n);
+	      }
+	    else
+	      {
+		hlsWindow = n;
+	      }
+	    break;
+	  }
 	default:
 	  //RTMP_LogPrintf("unknown option: %c\n", opt);
 	  if (!ParseOption(opt, optarg, &defaultRTMPRequest))
@@ -1190,6 +3320,11 @@ main(int argc, char **argv)
   // start text UI
   ThreadCreate(controlServerThread, 0);
 
+  MutexInit(&gw.lock);
+  MutexInit(&seeks.lock);
+  MutexInit(&lives.lock);
+  gw.lastTick = RTMP_GetTime();
+
   // start http streaming
   if ((httpServer =
        startStreaming(httpStreamingDevice, nHttpStreamingPort)) == 0)
@@ -1203,6 +3338,7 @@ main(int argc, char **argv)
   while (httpServer->state != STREAMING_STOPPED)
     {
       sleep(1);
+      GatewayTick();
     }
   RTMP_Log(RTMP_LOGDEBUG, "Done, exiting...");
 
@@ -0,0 +1,503 @@
+/*  RTMP FLV Publisher
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with RTMPDump; see the file COPYING.  If not, write to
+ *  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *  http://www.gnu.org/copyleft/gpl.html
+ *
+ */
+
+/* Publishes an FLV file to an RTMP server, paced by the tag timestamps.
+ * With --streams it pushes the same file over several connections at
+ * once, e.g. to load an ingest server.
+ */
+
+#define _FILE_OFFSET_BITS	64
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <signal.h>
+#include <getopt.h>
+
+#include "librtmp/rtmp_sys.h"
+#include "librtmp/log.h"
+#include "thread.h"
+
+#ifdef WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
+#define RD_SUCCESS		0
+#define RD_FAILED		1
+#define RD_INCOMPLETE		2
+
+#define DEF_TIMEOUT	30	/* seconds */
+#define MAX_STREAMS	1024
+
+#ifdef WIN32
+#define InitSockets()	{\
+        WORD version;			\
+        WSADATA wsaData;		\
+					\
+        version = MAKEWORD(1,1);	\
+        WSAStartup(version, &wsaData);	}
+
+#define	CleanupSockets()	WSACleanup()
+#else
+#define InitSockets()
+#define	CleanupSockets()
+#endif
+
+typedef struct
+{
+  int id;
+  char *url;			/* our own copy, RTMP_SetupURL cuts it up */
+  RTMP rtmp;
+
+  uint32_t nTags;
+  uint64_t nBytes;
+  uint32_t lateMS;		/* worst lag behind the schedule */
+  int ret;
+} PUSHER;
+
+/* the file everyone is publishing */
+static const char *flvBuf;
+static size_t flvSize;
+static size_t flvStart;		/* first tag */
+
+static int bMaxSpeed = FALSE;
+static int nLoops = 1;		/* 0 loops forever */
+static long int timeout = DEF_TIMEOUT;
+
+static TMUTEX doneLock;
+static TCOND doneCond;
+static int nRunning;
+
+static void
+sigIntHandler(int sig)
+{
+  RTMP_ctrlC = TRUE;
+  RTMP_LogPrintf("Caught signal: %d, cleaning up, just a second...\n", sig);
+  signal(SIGINT, SIG_IGN);
+  signal(SIGTERM, SIG_IGN);
+#ifndef WIN32
+  signal(SIGHUP, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGQUIT, SIG_IGN);
+#endif
+}
+
+static void
+UnmapFile(void)
+{
+#ifdef WIN32
+  free((void *)flvBuf);
+#else
+  munmap((void *)flvBuf, flvSize);
+#endif
+  flvBuf = NULL;
+}
+
+static int
+MapFile(const char *name)
+{
+  FILE *f;
+  off_t size;
+
+  f = fopen(name, "rb");
+  if (!f)
+    {
+      RTMP_Log(RTMP_LOGERROR, "Failed to open %s", name);
+      return FALSE;
+    }
+  fseeko(f, 0, SEEK_END);
+  size = ftello(f);
+  if (size < 13)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s is too small for an FLV file", name);
+      fclose(f);
+      return FALSE;
+    }
+  flvSize = size;
+#ifdef WIN32
+  {
+    char *buf = malloc(flvSize);
+    fseeko(f, 0, SEEK_SET);
+    if (!buf || fread(buf, 1, flvSize, f) != flvSize)
+      {
+	RTMP_Log(RTMP_LOGERROR, "Failed to read %s", name);
+	free(buf);
+	fclose(f);
+	return FALSE;
+      }
+    flvBuf = buf;
+  }
+#else
+  flvBuf = mmap(NULL, flvSize, PROT_READ, MAP_SHARED, fileno(f), 0);
+  if (flvBuf == MAP_FAILED)
+    {
+      RTMP_Log(RTMP_LOGERROR, "Failed to map %s", name);
+      fclose(f);
+      return FALSE;
+    }
+  madvise((void *)flvBuf, flvSize, MADV_SEQUENTIAL);
+#endif
+  fclose(f);
+
+  if (flvBuf[0] != 'F' || flvBuf[1] != 'L' || flvBuf[2] != 'V')
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s is not an FLV file", name);
+      UnmapFile();
+      return FALSE;
+    }
+  flvStart = AMF_DecodeInt32(flvBuf + 5) + 4;
+  return TRUE;
+}
+
+/* Answer whatever the server sent meanwhile, pings and the like */
+static void
+HandleInput(RTMP *r)
+{
+  RTMPPacket packet = { 0 };
+
+  while (RTMP_IsConnected(r) && RTMP_ReadPending(r)
+	 && RTMP_ReadPacket(r, &packet))
+    {
+      if (RTMPPacket_IsReady(&packet))
+	{
+	  RTMP_ClientPacket(r, &packet);
+	  RTMPPacket_Free(&packet);
+	}
+    }
+}
+
+/* One pass over the file. base is added to all timestamps, *next gets
+ * the timestamp the next pass should start at.
+ */
+static int
+PushFile(PUSHER *p, uint64_t start, uint32_t base, uint32_t *next, int bFirst)
+{
+  RTMP *r = &p->rtmp;
+  size_t pos = flvStart;
+  uint32_t ts = 0, prevTs = 0, gap = 1;
+
+  while (pos + 11 <= flvSize && !RTMP_ctrlC)
+    {
+      const char *tag = flvBuf + pos;
+      uint32_t dataSize = AMF_DecodeInt24(tag + 1);
+      uint8_t type = tag[0];
+
+      if (pos + 11 + dataSize > flvSize)
+	{
+	  RTMP_Log(RTMP_LOGWARNING, "stream %d: file ends in a cut off tag",
+	      p->id);
+	  break;
+	}
+      prevTs = ts;
+      ts = AMF_DecodeInt24(tag + 4);
+      ts |= (unsigned char)tag[7] << 24;
+      if (ts > prevTs)
+	gap = ts - prevTs;
+      pos += 11 + dataSize + 4;
+
+      /* metadata only goes out once */
+      if (type == RTMP_PACKET_TYPE_INFO && !bFirst)
+	continue;
+      if (type != RTMP_PACKET_TYPE_AUDIO && type != RTMP_PACKET_TYPE_VIDEO
+	  && type != RTMP_PACKET_TYPE_INFO)
+	continue;
+
+      if (!bMaxSpeed)
+	{
+	  uint64_t due = start + (uint64_t)(base + ts) * 1000, now;
+
+	  while ((now = RTMP_GetTimeUS()) < due && !RTMP_ctrlC)
+	    {
+	      uint64_t wait = (due - now) / 1000;
+
+	      HandleInput(r);
+	      if (wait > 100)
+		wait = 100;
+	      if (wait)
+		msleep(wait);
+	      else
+		break;
+	    }
+	  if (now > due && (now - due) / 1000 > p->lateMS)
+	    p->lateMS = (now - due) / 1000;
+	}
+      else
+	HandleInput(r);
+
+      if (!RTMP_WriteTag(r, type, base + ts, tag + 11, dataSize))
+	{
+	  RTMP_Log(RTMP_LOGERROR, "stream %d: send failed", p->id);
+	  return FALSE;
+	}
+      p->nTags++;
+      p->nBytes += 11 + dataSize + 4;
+    }
+  *next = base + ts + gap;
+  return TRUE;
+}
+
+static TFTYPE
+PushThread(void *arg)
+{
+  PUSHER *p = arg;
+  RTMP *r = &p->rtmp;
+  uint64_t start;
+  uint32_t base = 0;
+  int loop;
+
+  p->ret = RD_FAILED;
+  RTMP_Init(r);
+  if (!RTMP_SetupURL(r, p->url))
+    {
+      RTMP_Log(RTMP_LOGERROR, "stream %d: couldn't parse URL", p->id);
+      goto done;
+    }
+  RTMP_EnableWrite(r);
+  r->Link.timeout = timeout;
+
+  if (!RTMP_Connect(r, NULL) || !RTMP_ConnectStream(r, 0))
+    {
+      RTMP_Log(RTMP_LOGERROR, "stream %d: failed to start publishing",
+	  p->id);
+      goto close;
+    }
+  RTMP_Log(RTMP_LOGINFO, "stream %d: publishing", p->id);
+
+  start = RTMP_GetTimeUS();
+  p->ret = RD_INCOMPLETE;
+  for (loop = 0; (!nLoops || loop < nLoops) && !RTMP_ctrlC; loop++)
+    {
+      if (!PushFile(p, start, base, &base, loop == 0))
+	goto close;
+    }
+  if (!RTMP_ctrlC)
+    p->ret = RD_SUCCESS;
+
+close:
+  RTMP_Close(r);
+done:
+  MutexLock(&doneLock);
+  nRunning--;
+  CondSignal(&doneCond);
+  MutexUnlock(&doneLock);
+  TFRET();
+}
+
+static void
+usage(char *prog)
+{
+  RTMP_LogPrintf
+    ("%s: publishes an FLV file to an RTMP server\n\n", prog);
+  RTMP_LogPrintf
+    ("--rtmp|-r url           URL with options included (e.g. rtmp://host[:port]/app/stream live=1)\n");
+  RTMP_LogPrintf
+    ("                        with several streams %%d in the URL is replaced by the stream number\n");
+  RTMP_LogPrintf
+    ("--flv|-o string         FLV file to publish\n");
+  RTMP_LogPrintf
+    ("--streams|-n num        Publish num streams in parallel (default: 1)\n");
+  RTMP_LogPrintf
+    ("--loop|-l num           Send the file num times, 0 to loop until interrupted (default: 1)\n");
+  RTMP_LogPrintf
+    ("--maxspeed|-x           Send as fast as possible instead of in realtime\n");
+  RTMP_LogPrintf
+    ("--timeout|-m num        Timeout connection num seconds (default: %u)\n",
+     DEF_TIMEOUT);
+  RTMP_LogPrintf
+    ("--quiet|-q              Suppresses all command output.\n");
+  RTMP_LogPrintf("--verbose|-V            Verbose command output.\n");
+  RTMP_LogPrintf("--debug|-z              Debug level command output.\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  int opt, i, nStreams = 1, nFailed = 0;
+  char *url = NULL, *flvFile = NULL, *num;
+  PUSHER *pushers;
+  uint64_t start, nBytes = 0;
+  uint32_t elapsed;
+
+  struct option longopts[] = {
+    {"help", 0, NULL, 'h'},
+    {"rtmp", 1, NULL, 'r'},
+    {"flv", 1, NULL, 'o'},
+    {"streams", 1, NULL, 'n'},
+    {"loop", 1, NULL, 'l'},
+    {"maxspeed", 0, NULL, 'x'},
+    {"timeout", 1, NULL, 'm'},
+    {"quiet", 0, NULL, 'q'},
+    {"verbose", 0, NULL, 'V'},
+    {"debug", 0, NULL, 'z'},
+    {0, 0, 0, 0}
+  };
+
+  RTMP_LogPrintf("RTMP FLV Publisher %s\n", RTMPDUMP_VERSION);
+  RTMP_LogPrintf("license: GPL\n\n");
+
+  while ((opt =
+	  getopt_long(argc, argv, "hxqVzr:o:n:l:m:", longopts, NULL)) != -1)
+    {
+      switch (opt)
+	{
+	case 'h':
+	  usage(argv[0]);
+	  return RD_SUCCESS;
+	case 'r':
+	  url = optarg;
+	  break;
+	case 'o':
+	  flvFile = optarg;
+	  break;
+	case 'n':
+	  nStreams = atoi(optarg);
+	  if (nStreams < 1 || nStreams > MAX_STREAMS)
+	    {
+	      RTMP_Log(RTMP_LOGERROR, "Number of streams must be 1 to %d",
+		  MAX_STREAMS);
+	      return RD_FAILED;
+	    }
+	  break;
+	case 'l':
+	  nLoops = atoi(optarg);
+	  if (nLoops < 0)
+	    {
+	      RTMP_Log(RTMP_LOGERROR, "Number of loops must be 0 or more");
+	      return RD_FAILED;
+	    }
+	  break;
+	case 'x':
+	  bMaxSpeed = TRUE;
+	  break;
+	case 'm':
+	  timeout = atoi(optarg);
+	  break;
+	case 'q':
+	  RTMP_debuglevel = RTMP_LOGCRIT;
+	  break;
+	case 'V':
+	  RTMP_debuglevel = RTMP_LOGDEBUG;
+	  break;
+	case 'z':
+	  RTMP_debuglevel = RTMP_LOGALL;
+	  break;
+	default:
+	  RTMP_LogPrintf("unknown option: %c\n", opt);
+	  usage(argv[0]);
+	  return RD_FAILED;
+	}
+    }
+
+  if (!url || !flvFile)
+    {
+      RTMP_Log(RTMP_LOGERROR, "You must specify a URL (-r) and a file (-o)");
+      return RD_FAILED;
+    }
+  if (!MapFile(flvFile))
+    return RD_FAILED;
+
+  signal(SIGINT, sigIntHandler);
+  signal(SIGTERM, sigIntHandler);
+#ifndef WIN32
+  signal(SIGHUP, sigIntHandler);
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGQUIT, sigIntHandler);
+#endif
+
+  InitSockets();
+  MutexInit(&doneLock);
+  CondInit(&doneCond);
+
+  pushers = calloc(nStreams, sizeof(PUSHER));
+  if (!pushers)
+    {
+      RTMP_Log(RTMP_LOGERROR, "Failed to allocate memory");
+      UnmapFile();
+      return RD_FAILED;
+    }
+
+  start = RTMP_GetTimeUS();
+  nRunning = nStreams;
+  for (i = 0; i < nStreams; i++)
+    {
+      PUSHER *p = &pushers[i];
+
+      p->id = i;
+      p->ret = RD_FAILED;
+      p->url = malloc(strlen(url) + 16);
+      if (!p->url)
+	RTMP_Log(RTMP_LOGERROR, "stream %d: failed to allocate memory", i);
+      else
+	{
+	  if ((num = strstr(url, "%d")))
+	    sprintf(p->url, "%.*s%d%s", (int)(num - url), url, i, num + 2);
+	  else
+	    strcpy(p->url, url);
+	  if (!ThreadFailed(ThreadCreate(PushThread, p)))
+	    continue;
+	  RTMP_Log(RTMP_LOGERROR, "stream %d: couldn't start a thread", i);
+	  free(p->url);
+	  p->url = NULL;
+	}
+      /* this one won't report back, don't wait for it */
+      MutexLock(&doneLock);
+      nRunning--;
+      MutexUnlock(&doneLock);
+    }
+
+  MutexLock(&doneLock);
+  while (nRunning)
+    CondWait(&doneCond, &doneLock);
+  MutexUnlock(&doneLock);
+  elapsed = (RTMP_GetTimeUS() - start) / 1000;
+
+  for (i = 0; i < nStreams; i++)
+    {
+      PUSHER *p = &pushers[i];
+
+      if (p->ret != RD_SUCCESS)
+	nFailed++;
+      nBytes += p->nBytes;
+      RTMP_Log(RTMP_LOGINFO,
+	  "stream %d: %u tags, %.3f kB, at most %u ms late%s", p->id,
+	  p->nTags, p->nBytes / 1024.0, p->lateMS,
+	  p->ret == RD_SUCCESS ? "" : ", incomplete");
+      free(p->url);
+    }
+  RTMP_LogPrintf("%d of %d streams done, %.3f kB in %.3f sec (%.1f kbit/s)\n",
+		 nStreams - nFailed, nStreams, nBytes / 1024.0,
+		 elapsed / 1000.0,
+		 elapsed ? nBytes * 8.0 / elapsed : 0.0);
+  free(pushers);
+  UnmapFile();
+
+  CondDestroy(&doneCond);
+  MutexDestroy(&doneLock);
+  CleanupSockets();
+
+  return nFailed ? RD_INCOMPLETE : RD_SUCCESS;
+}
@@ -40,6 +40,7 @@
 
 #include "librtmp/rtmp_sys.h"
 #include "librtmp/log.h"
+#include "librtmp/server.h"
 
 #include "thread.h"
 
@@ -77,24 +78,27 @@
 enum
 {
   STREAMING_ACCEPTING,
-  STREAMING_IN_PROGRESS,
   STREAMING_STOPPING,
   STREAMING_STOPPED
 };
 
 typedef struct
 {
-  int socket;
+  RTMPServer *rs;
   int state;
-  int streamID;
-  int arglen;
-  int argc;
   uint32_t filetime;	/* time of last download we started */
   AVal filename;	/* name of last download */
-  char *connect;
-
 } STREAMING_SERVER;
 
+/* what one client told us, for its rtmpdump command */
+typedef struct
+{
+  int streamID;
+  int arglen;
+  int argc;
+  char *connect;	/* body of the connect packet, Link points into it */
+} CLIENT;
+
 STREAMING_SERVER *rtmpServer = 0;	// server structure pointer
 void *sslCtx = NULL;
 
@@ -162,7 +166,6 @@ FILE *netstackdump_read = NULL;
 #define SAVC(x) static const AVal av_##x = AVC(#x)
 
 SAVC(app);
-SAVC(connect);
 SAVC(flashVer);
 SAVC(swfUrl);
 SAVC(pageUrl);
@@ -174,9 +177,7 @@ SAVC(videoCodecs);
 SAVC(videoFunction);
 SAVC(objectEncoding);
 SAVC(_result);
-SAVC(createStream);
 SAVC(getStreamLength);
-SAVC(play);
 SAVC(fmsVer);
 SAVC(mode);
 SAVC(level);
@@ -461,6 +462,571 @@ spawn_dumper(int argc, AVal *av, char *cmd)
 #endif
 }
 
+/* With -w the downloads run here on a fixed set of worker threads
+ * instead of in a forked rtmpdump. The argv built for rtmpdump is
+ * turned into a librtmp URL, so both modes fetch the same thing.
+ */
+#define POOL_MAXWORKERS	64
+#define POOL_QUEUE	64	/* downloads waiting for a worker */
+#define POOL_BUFSIZE	(64*1024)
+#define DNS_TTL		300	/* seconds a resolved host is reused */
+
+enum
+{
+  JOB_QUEUED,
+  JOB_RUNNING
+};
+
+typedef struct JOB
+{
+  struct JOB *next;
+  int state;
+  char *key;		/* tcUrl and playpath, to spot duplicates */
+  char *url;		/* librtmp URL with the options */
+  char *swfUrl;		/* to verify, if set */
+  char *file;
+  uint32_t queued;
+  uint32_t started;
+  double bytes;
+} JOB;
+
+typedef struct HOST
+{
+  struct HOST *next;
+  char *name;
+  int port;
+  time_t expires;
+  struct sockaddr_in addr;
+} HOST;
+
+#ifdef CRYPTO
+typedef struct SWF
+{
+  struct SWF *next;
+  char *url;
+  unsigned int size;
+  unsigned char hash[RTMP_SWF_HASHLEN];
+} SWF;
+#endif
+
+typedef struct
+{
+  TMUTEX lock;
+  TCOND cond;
+  int nWorkers;
+  int bStop;
+  JOB *head;		/* queued and running jobs, oldest first */
+  JOB *tail;
+  int nQueued;
+  int nRunning;
+  unsigned long nDone;
+  unsigned long nFailed;
+  unsigned long nDups;
+  unsigned long nFull;
+
+  /* lookups are slow and not thread-safe, so only one at a time */
+  TMUTEX resolveLock;
+  HOST *hosts;
+#ifdef CRYPTO
+  SWF *swfs;
+#endif
+} POOL;
+
+static POOL pool;
+static int poolSize;
+
+/* append " name=value" with the characters librtmp splits on escaped */
+static char *
+PoolOpt(char *ptr, const char *name, AVal *val, int unquote)
+{
+  int i;
+
+  ptr += sprintf(ptr, " %s=", name);
+  for (i = 0; i < val->av_len; i++)
+    {
+      char c = val->av_val[i];
+      /* undo the escaping done for the shell */
+      if (unquote && c == '\\' && i + 1 < val->av_len && val->av_val[i+1] == '"')
+        continue;
+      if (c == ' ' || c == '\\')
+	ptr += sprintf(ptr, "\\%02x", c);
+      else
+	*ptr++ = c;
+    }
+  *ptr = '\0';
+  return ptr;
+}
+
+static char *
+PoolStr(AVal *av)
+{
+  char *s = malloc(av->av_len + 1);
+  if (!s)
+    return NULL;
+  memcpy(s, av->av_val, av->av_len);
+  s[av->av_len] = '\0';
+  return s;
+}
+
+static void
+PoolFreeJob(JOB *job)
+{
+  free(job->key);
+  free(job->url);
+  free(job->swfUrl);
+  free(job->file);
+  free(job);
+}
+
+/* queue the rtmpdump argv as a download, unless it is already queued
+ * or running
+ */
+static int
+PoolAdd(int argc, AVal *av)
+{
+  AVal tcUrl = {0}, playpath = {0}, file = {0};
+  JOB *job, *j;
+  char *ptr;
+  int i, len = 0, nomem = FALSE;
+
+  for (i = 1; i < argc; i++)
+    len += av[i].av_len * 3 + 16;
+
+  job = calloc(1, sizeof(JOB));
+  if (!job || !(job->url = malloc(len + 1)))
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, out of memory", __FUNCTION__);
+      if (job)
+	PoolFreeJob(job);
+      return FALSE;
+    }
+  ptr = job->url;
+  *ptr = '\0';
+
+  for (i = 1; i < argc; i++)
+    {
+      AVal *opt = &av[i];
+      if (opt->av_len == 6 && !strncmp(opt->av_val, "--live", 6))
+	{
+	  ptr += sprintf(ptr, " live=1");
+	  continue;
+	}
+      if (opt->av_len != 2 || opt->av_val[0] != '-' || ++i >= argc)
+	break;
+      switch (opt->av_val[1])
+	{
+	case 'r':
+	  tcUrl = av[i];
+	  break;
+	case 'a':
+	  ptr = PoolOpt(ptr, "app", &av[i], FALSE);
+	  break;
+	case 'f':
+	  ptr = PoolOpt(ptr, "flashver", &av[i], FALSE);
+	  break;
+	case 'W':
+	  ptr = PoolOpt(ptr, "swfUrl", &av[i], FALSE);
+	  job->swfUrl = PoolStr(&av[i]);
+	  nomem |= !job->swfUrl;
+	  break;
+	case 'p':
+	  ptr = PoolOpt(ptr, "pageUrl", &av[i], FALSE);
+	  break;
+	case 'j':
+	  ptr = PoolOpt(ptr, "jtv", &av[i], TRUE);
+	  break;
+	case 'C':
+	  ptr = PoolOpt(ptr, "conn", &av[i], FALSE);
+	  break;
+	case 'y':
+	  playpath = av[i];
+	  ptr = PoolOpt(ptr, "playpath", &av[i], FALSE);
+	  break;
+	case 'o':
+	  file = av[i];
+	  break;
+	}
+    }
+
+  if (!tcUrl.av_len || !file.av_len)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, no URL or file name for the download",
+	  __FUNCTION__);
+      PoolFreeJob(job);
+      return FALSE;
+    }
+
+  /* the URL goes first, ahead of the options */
+  ptr = malloc(tcUrl.av_len + (ptr - job->url) + 1);
+  if (ptr)
+    {
+      memcpy(ptr, tcUrl.av_val, tcUrl.av_len);
+      strcpy(ptr + tcUrl.av_len, job->url);
+    }
+  free(job->url);
+  job->url = ptr;
+
+  job->key = malloc(tcUrl.av_len + playpath.av_len + 2);
+  if (job->key)
+    sprintf(job->key, "%.*s %.*s", tcUrl.av_len, tcUrl.av_val,
+      playpath.av_len, playpath.av_val);
+  job->file = PoolStr(&file);
+  if (!job->url || !job->key || !job->file || nomem)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, out of memory", __FUNCTION__);
+      PoolFreeJob(job);
+      return FALSE;
+    }
+
+  MutexLock(&pool.lock);
+  for (j = pool.head; j; j = j->next)
+    if (!strcmp(j->key, job->key))
+      break;
+  if (j)
+    {
+      pool.nDups++;
+      MutexUnlock(&pool.lock);
+      RTMP_LogPrintf("Already %s, skipping: %s\n",
+	j->state == JOB_QUEUED ? "queued" : "downloading", job->key);
+      PoolFreeJob(job);
+      return FALSE;
+    }
+  if (!pool.nWorkers)
+    {
+      MutexUnlock(&pool.lock);
+      RTMP_Log(RTMP_LOGERROR, "No download workers left, dropping: %s",
+	  job->key);
+      PoolFreeJob(job);
+      return FALSE;
+    }
+  if (pool.nQueued >= POOL_QUEUE)
+    {
+      pool.nFull++;
+      MutexUnlock(&pool.lock);
+      RTMP_Log(RTMP_LOGERROR, "Download queue full, dropping: %s", job->key);
+      PoolFreeJob(job);
+      return FALSE;
+    }
+  job->state = JOB_QUEUED;
+  job->queued = RTMP_GetTime();
+  if (pool.tail)
+    pool.tail->next = job;
+  else
+    pool.head = job;
+  pool.tail = job;
+  pool.nQueued++;
+  CondSignal(&pool.cond);
+  MutexUnlock(&pool.lock);
+  return TRUE;
+}
+
+/* resolve the host once and reuse it, like a spawned rtmpdump can't */
+static int
+PoolResolve(AVal *host, int port, struct sockaddr_in *addr)
+{
+  HOST *h;
+  time_t now = time(NULL);
+  int ret = TRUE;
+
+  MutexLock(&pool.resolveLock);
+  for (h = pool.hosts; h; h = h->next)
+    if (h->port == port && (int)strlen(h->name) == host->av_len
+	&& !strncmp(h->name, host->av_val, host->av_len))
+      break;
+  if (!h)
+    {
+      h = calloc(1, sizeof(HOST));
+      if (!h || !(h->name = PoolStr(host)))
+	{
+	  RTMP_Log(RTMP_LOGERROR, "%s, out of memory", __FUNCTION__);
+	  free(h);
+	  MutexUnlock(&pool.resolveLock);
+	  return FALSE;
+	}
+      h->port = port;
+      h->next = pool.hosts;
+      pool.hosts = h;
+    }
+  if (h->expires <= now)
+    {
+      memset(&h->addr, 0, sizeof(h->addr));
+      h->addr.sin_family = AF_INET;
+      h->addr.sin_port = htons(port);
+      h->addr.sin_addr.s_addr = inet_addr(h->name);
+      if (h->addr.sin_addr.s_addr == INADDR_NONE)
+	{
+	  struct hostent *he = gethostbyname(h->name);
+	  if (he == NULL || he->h_addr == NULL)
+	    {
+	      RTMP_Log(RTMP_LOGERROR, "Problem accessing the DNS. (addr: %s)",
+		  h->name);
+	      ret = FALSE;
+	    }
+	  else
+	    h->addr.sin_addr = *(struct in_addr *)he->h_addr;
+	}
+      if (ret)
+	h->expires = now + DNS_TTL;
+    }
+  if (ret)
+    *addr = h->addr;
+  MutexUnlock(&pool.resolveLock);
+  return ret;
+}
+
+#ifdef CRYPTO
+/* hash each player once per run instead of once per download */
+static int
+PoolHashSWF(const char *url, unsigned int *size, unsigned char *hash)
+{
+  SWF *s;
+  int ret = TRUE;
+
+  MutexLock(&pool.resolveLock);
+  for (s = pool.swfs; s; s = s->next)
+    if (!strcmp(s->url, url))
+      break;
+  if (!s)
+    {
+      s = calloc(1, sizeof(SWF));
+      if (s && RTMP_HashSWF(url, &s->size, s->hash, 0) == 0
+	  && (s->url = strdup(url)))
+	{
+	  s->next = pool.swfs;
+	  pool.swfs = s;
+	}
+      else
+	{
+	  free(s);
+	  s = NULL;
+	  ret = FALSE;
+	}
+    }
+  if (s)
+    {
+      *size = s->size;
+      memcpy(hash, s->hash, RTMP_SWF_HASHLEN);
+    }
+  MutexUnlock(&pool.resolveLock);
+  return ret;
+}
+#endif
+
+static int
+PoolDownload(JOB *job, char *buf)
+{
+  RTMP rtmp;
+  struct sockaddr_in addr;
+  char *url;
+  FILE *file;
+  int nRead = 0, ret = FALSE;
+
+  /* librtmp keeps pointers into the URL it was set up with */
+  url = malloc(strlen(job->url) + 128);
+  if (!url)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, out of memory", __FUNCTION__);
+      return FALSE;
+    }
+  strcpy(url, job->url);
+  if (job->swfUrl)
+    {
+#ifdef CRYPTO
+      unsigned char hash[RTMP_SWF_HASHLEN];
+      unsigned int size;
+      if (PoolHashSWF(job->swfUrl, &size, hash))
+	{
+	  char *ptr = url + strlen(url);
+	  int i;
+	  ptr += sprintf(ptr, " swfsize=%u swfhash=", size);
+	  for (i = 0; i < RTMP_SWF_HASHLEN; i++)
+	    ptr += sprintf(ptr, "%02x", hash[i]);
+	}
+      else
+#endif
+	strcat(url, " swfVfy=1");
+    }
+
+  RTMP_Init(&rtmp);
+  rtmp.Link.timeout = 30;
+  RTMP_SetBufferMS(&rtmp, 10 * 60 * 60 * 1000);
+  if (!RTMP_SetupURL(&rtmp, url))
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, couldn't parse %s", __FUNCTION__, job->url);
+      free(url);
+      return FALSE;
+    }
+
+  if (rtmp.Link.socksport)
+    {
+      if (!RTMP_Connect(&rtmp, NULL))
+	goto cleanup;
+    }
+  else
+    {
+      if (!PoolResolve(&rtmp.Link.hostname, rtmp.Link.port, &addr))
+	goto cleanup;
+      if (!RTMP_Connect0(&rtmp, (struct sockaddr *)&addr))
+	goto cleanup;
+      rtmp.m_bSendCounter = TRUE;
+      if (!RTMP_Connect1(&rtmp, NULL))
+	goto cleanup;
+    }
+  if (!RTMP_ConnectStream(&rtmp, 0))
+    goto cleanup;
+
+  file = fopen(job->file, "wb");
+  if (!file)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, failed to open %s", __FUNCTION__, job->file);
+      goto cleanup;
+    }
+  while (!pool.bStop && (nRead = RTMP_Read(&rtmp, buf, POOL_BUFSIZE)) > 0)
+    {
+      if (fwrite(buf, 1, nRead, file) != (size_t)nRead)
+	{
+	  RTMP_Log(RTMP_LOGERROR, "%s, failed to write to %s", __FUNCTION__,
+	      job->file);
+	  break;
+	}
+      job->bytes += nRead;
+    }
+  fclose(file);
+  /* a live stream has no end but the server hanging up */
+  ret = nRead == 0 && (rtmp.m_read.status == RTMP_READ_COMPLETE
+    || (rtmp.Link.lFlags & RTMP_LF_LIVE));
+
+cleanup:
+  RTMP_Close(&rtmp);
+  free(url);
+  return ret;
+}
+
+static TFTYPE
+PoolWorker(void *unused)
+{
+  char *buf = malloc(POOL_BUFSIZE);
+  JOB *job, *prev;
+  int ok;
+
+  MutexLock(&pool.lock);
+  if (!buf)
+    RTMP_Log(RTMP_LOGERROR, "%s, no buffer, worker exiting", __FUNCTION__);
+  while (buf && !pool.bStop)
+    {
+      for (job = pool.head; job && job->state != JOB_QUEUED; job = job->next);
+      if (!job)
+	{
+	  CondWait(&pool.cond, &pool.lock);
+	  continue;
+	}
+      job->state = JOB_RUNNING;
+      job->started = RTMP_GetTime();
+      pool.nQueued--;
+      pool.nRunning++;
+      MutexUnlock(&pool.lock);
+
+      RTMP_LogPrintf("Downloading %s to %s\n", job->key, job->file);
+      ok = PoolDownload(job, buf);
+      RTMP_LogPrintf("%s %s: %.0f bytes in %u ms\n",
+	ok ? "Finished" : "Incomplete", job->file, job->bytes,
+	RTMP_GetTime() - job->started);
+
+      MutexLock(&pool.lock);
+      if (pool.head == job)
+	prev = NULL;
+      else
+	for (prev = pool.head; prev->next != job; prev = prev->next);
+      if (prev)
+	prev->next = job->next;
+      else
+	pool.head = job->next;
+      if (pool.tail == job)
+	pool.tail = prev;
+      pool.nRunning--;
+      if (ok)
+	pool.nDone++;
+      else
+	pool.nFailed++;
+      PoolFreeJob(job);
+    }
+  pool.nWorkers--;
+  CondBroadcast(&pool.cond);
+  MutexUnlock(&pool.lock);
+  free(buf);
+  TFRET();
+}
+
+/* returns how many workers started; with none the caller goes back
+ * to spawning rtmpdump
+ */
+static int
+PoolStart(int n)
+{
+  int i, nStarted;
+
+  MutexInit(&pool.lock);
+  CondInit(&pool.cond);
+  MutexInit(&pool.resolveLock);
+  MutexLock(&pool.lock);
+  for (i = 0; i < n; i++)
+    {
+      if (ThreadFailed(ThreadCreate(PoolWorker, NULL)))
+	{
+	  RTMP_Log(RTMP_LOGERROR, "Couldn't start download worker %d", i);
+	  break;
+	}
+      pool.nWorkers++;
+    }
+  nStarted = pool.nWorkers;
+  MutexUnlock(&pool.lock);
+  return nStarted;
+}
+
+static void
+PoolStatus(void)
+{
+  JOB *job;
+  uint32_t now = RTMP_GetTime();
+
+  MutexLock(&pool.lock);
+  RTMP_LogPrintf("%d workers, %d running, %d queued; "
+    "%lu finished, %lu incomplete, %lu duplicates, %lu dropped\n",
+    pool.nWorkers, pool.nRunning, pool.nQueued,
+    pool.nDone, pool.nFailed, pool.nDups, pool.nFull);
+  for (job = pool.head; job; job = job->next)
+    {
+      if (job->state == JOB_RUNNING)
+	RTMP_LogPrintf("  running %6us %10.0f bytes  %s\n",
+	  (now - job->started) / 1000, job->bytes, job->file);
+      else
+	RTMP_LogPrintf("  queued  %6us %10s        %s\n",
+	  (now - job->queued) / 1000, "", job->file);
+    }
+  MutexUnlock(&pool.lock);
+}
+
+/* let running downloads close their files, drop the rest */
+static void
+PoolStop(void)
+{
+  JOB *job;
+
+  MutexLock(&pool.lock);
+  pool.bStop = TRUE;
+  RTMP_UserInterrupt();
+  CondBroadcast(&pool.cond);
+  while (pool.nWorkers)
+    CondWait(&pool.cond, &pool.lock);
+  while ((job = pool.head))
+    {
+      pool.head = job->next;
+      PoolFreeJob(job);
+    }
+  pool.tail = NULL;
+  MutexUnlock(&pool.lock);
+}
+
 static int
 countAMF(AMFObject *obj, int *argc)
 {
@@ -562,588 +1128,459 @@ dumpAMF(AMFObject *obj, char *ptr, AVal *argv, int *argc)
   return ptr;
 }
 
-// Returns 0 for OK/Failed/error, 1 for 'Stop or Complete'
-int
-ServeInvoke(STREAMING_SERVER *server, RTMP * r, RTMPPacket *packet, unsigned int offset)
+static int
+ServeAccept(RTMPConn *c)
 {
-  const char *body;
-  unsigned int nBodySize;
-  int ret = 0, nRes;
-
-  body = packet->m_body + offset;
-  nBodySize = packet->m_nBodySize - offset;
+  CLIENT *client;
+#ifdef linux
+  struct sockaddr_in dest;
+  socklen_t destlen = sizeof(struct sockaddr_in);
+  if (getsockopt(c->rtmp.m_sb.sb_socket, SOL_IP, SO_ORIGINAL_DST, &dest, &destlen) == 0)
+    RTMP_Log(RTMP_LOGDEBUG, "%s: accepted connection from %s to %s\n", __FUNCTION__,
+	c->peer, inet_ntoa(dest.sin_addr));
+  else
+#endif
+  RTMP_Log(RTMP_LOGDEBUG, "%s: accepted connection from %s\n", __FUNCTION__,
+      c->peer);
 
-  if (body[0] != 0x02)		// make sure it is a string method name we start with
+  if (sslCtx && !RTMP_TLS_Accept(&c->rtmp, sslCtx))
     {
-      RTMP_Log(RTMP_LOGWARNING, "%s, Sanity failed. no string method in invoke packet",
-	  __FUNCTION__);
-      return 0;
+      RTMP_Log(RTMP_LOGERROR, "TLS handshake failed");
+      return FALSE;
     }
+  client = calloc(1, sizeof(CLIENT));
+  if (!client)
+    return FALSE;
+  c->ctx = client;
+  return TRUE;
+}
 
-  AMFObject obj;
-  nRes = AMF_Decode(&obj, body, nBodySize, FALSE);
-  if (nRes < 0)
-    {
-      RTMP_Log(RTMP_LOGERROR, "%s, error decoding invoke packet", __FUNCTION__);
-      return 0;
-    }
+static int
+ServeConnect(RTMPConn *c, RTMPPacket *packet, AMFObject *obj, double txn)
+{
+  CLIENT *client = c->ctx;
+  RTMP *r = &c->rtmp;
+  AMFObject cobj;
+  AVal pname, pval;
+  int i;
 
-  AMF_Dump(&obj);
-  AVal method;
-  AMFProp_GetString(AMF_GetProp(&obj, NULL, 0), &method);
-  double txn = AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 1));
-  RTMP_Log(RTMP_LOGDEBUG, "%s, client invoking <%s>", __FUNCTION__, method.av_val);
+  AMF_Dump(obj);
+  client->connect = packet->m_body;
+  packet->m_body = NULL;
 
-  if (AVMATCH(&method, &av_connect))
+  AMFProp_GetObject(AMF_GetProp(obj, NULL, 2), &cobj);
+  for (i=0; i<cobj.o_num; i++)
     {
-      AMFObject cobj;
-      AVal pname, pval;
-      int i;
-
-      server->connect = packet->m_body;
-      packet->m_body = NULL;
-
-      AMFProp_GetObject(AMF_GetProp(&obj, NULL, 2), &cobj);
-      for (i=0; i<cobj.o_num; i++)
+      pname = cobj.o_props[i].p_name;
+      pval.av_val = NULL;
+      pval.av_len = 0;
+      if (cobj.o_props[i].p_type == AMF_STRING)
+	pval = cobj.o_props[i].p_vu.p_aval;
+      if (AVMATCH(&pname, &av_app))
 	{
-	  pname = cobj.o_props[i].p_name;
+	  r->Link.app = pval;
 	  pval.av_val = NULL;
-	  pval.av_len = 0;
-	  if (cobj.o_props[i].p_type == AMF_STRING)
-	    pval = cobj.o_props[i].p_vu.p_aval;
-	  if (AVMATCH(&pname, &av_app))
-	    {
-	      r->Link.app = pval;
-	      pval.av_val = NULL;
-	      if (!r->Link.app.av_val)
-	        r->Link.app.av_val = "";
-	      server->arglen += 6 + pval.av_len;
-	      server->argc += 2;
-	    }
-	  else if (AVMATCH(&pname, &av_flashVer))
-	    {
-	      r->Link.flashVer = pval;
-	      pval.av_val = NULL;
-	      server->arglen += 6 + pval.av_len;
-	      server->argc += 2;
-	    }
-	  else if (AVMATCH(&pname, &av_swfUrl))
-	    {
-	      r->Link.swfUrl = pval;
-	      pval.av_val = NULL;
-	      server->arglen += 6 + pval.av_len;
-	      server->argc += 2;
-	    }
-	  else if (AVMATCH(&pname, &av_tcUrl))
-	    {
-	      r->Link.tcUrl = pval;
-	      pval.av_val = NULL;
-	      server->arglen += 6 + pval.av_len;
-	      server->argc += 2;
-	    }
-	  else if (AVMATCH(&pname, &av_pageUrl))
-	    {
-	      r->Link.pageUrl = pval;
-	      pval.av_val = NULL;
-	      server->arglen += 6 + pval.av_len;
-	      server->argc += 2;
-	    }
-	  else if (AVMATCH(&pname, &av_audioCodecs))
-	    {
-	      r->m_fAudioCodecs = cobj.o_props[i].p_vu.p_number;
-	    }
-	  else if (AVMATCH(&pname, &av_videoCodecs))
-	    {
-	      r->m_fVideoCodecs = cobj.o_props[i].p_vu.p_number;
-	    }
-	  else if (AVMATCH(&pname, &av_objectEncoding))
-	    {
-	      r->m_fEncoding = cobj.o_props[i].p_vu.p_number;
-	    }
+	  if (!r->Link.app.av_val)
+	    r->Link.app.av_val = "";
+	  client->arglen += 6 + pval.av_len;
+	  client->argc += 2;
 	}
-      /* Still have more parameters? Copy them */
-      if (obj.o_num > 3)
+      else if (AVMATCH(&pname, &av_flashVer))
 	{
-	  int i = obj.o_num - 3;
-	  r->Link.extras.o_num = i;
-	  r->Link.extras.o_props = malloc(i*sizeof(AMFObjectProperty));
-	  memcpy(r->Link.extras.o_props, obj.o_props+3, i*sizeof(AMFObjectProperty));
-	  obj.o_num = 3;
-	  server->arglen += countAMF(&r->Link.extras, &server->argc);
+	  r->Link.flashVer = pval;
+	  pval.av_val = NULL;
+	  client->arglen += 6 + pval.av_len;
+	  client->argc += 2;
+	}
+      else if (AVMATCH(&pname, &av_swfUrl))
+	{
+	  r->Link.swfUrl = pval;
+	  pval.av_val = NULL;
+	  client->arglen += 6 + pval.av_len;
+	  client->argc += 2;
+	}
+      else if (AVMATCH(&pname, &av_tcUrl))
+	{
+	  r->Link.tcUrl = pval;
+	  pval.av_val = NULL;
+	  client->arglen += 6 + pval.av_len;
+	  client->argc += 2;
+	}
+      else if (AVMATCH(&pname, &av_pageUrl))
+	{
+	  r->Link.pageUrl = pval;
+	  pval.av_val = NULL;
+	  client->arglen += 6 + pval.av_len;
+	  client->argc += 2;
+	}
+      else if (AVMATCH(&pname, &av_audioCodecs))
+	{
+	  r->m_fAudioCodecs = cobj.o_props[i].p_vu.p_number;
+	}
+      else if (AVMATCH(&pname, &av_videoCodecs))
+	{
+	  r->m_fVideoCodecs = cobj.o_props[i].p_vu.p_number;
+	}
+      else if (AVMATCH(&pname, &av_objectEncoding))
+	{
+	  r->m_fEncoding = cobj.o_props[i].p_vu.p_number;
 	}
-      SendConnectResult(r, txn);
-      SendCheckBWResponse(r, FALSE, TRUE);
-    }
-  else if (AVMATCH(&method, &av_createStream))
-    {
-      SendResultNumber(r, txn, ++server->streamID);
     }
-  else if (AVMATCH(&method, &av_getStreamLength))
+  /* Still have more parameters? Copy them */
+  if (obj->o_num > 3)
     {
-      SendResultNumber(r, txn, 10.0);
+      int i = obj->o_num - 3;
+      r->Link.extras.o_num = i;
+      r->Link.extras.o_props = malloc(i*sizeof(AMFObjectProperty));
+      memcpy(r->Link.extras.o_props, obj->o_props+3, i*sizeof(AMFObjectProperty));
+      obj->o_num = 3;
+      client->arglen += countAMF(&r->Link.extras, &client->argc);
     }
-  else if (AVMATCH(&method, &av_NetStream_Authenticate_UsherToken))
-    {
-      AVal usherToken;
-      AMFProp_GetString(AMF_GetProp(&obj, NULL, 3), &usherToken);
-      AVreplace(&usherToken, &av_dquote, &av_escdquote);
-#ifdef WIN32
-      AVreplace(&usherToken, &av_caret, &av_esccaret);
-      AVreplace(&usherToken, &av_pipe, &av_escpipe);
-#endif
-      server->arglen += 6 + usherToken.av_len;
-      server->argc += 2;
-      r->Link.usherToken = usherToken;
-    }
-  else if (AVMATCH(&method, &av__checkbw))
-    {
-      SendCheckBWResponse(r, TRUE, FALSE);
-    }
-  else if (AVMATCH(&method, &av_checkBandwidth))
-    {
-      SendCheckBWResponse(r, FALSE, FALSE);
-    }
-  else if (AVMATCH(&method, &av_FCSubscribe))
+  SendConnectResult(r, txn);
+  SendCheckBWResponse(r, FALSE, TRUE);
+  return TRUE;
+}
+
+static int
+ServeCreateStream(RTMPConn *c, RTMPPacket *packet, AMFObject *obj, double txn)
+{
+  CLIENT *client = c->ctx;
+
+  AMF_Dump(obj);
+  SendResultNumber(&c->rtmp, txn, ++client->streamID);
+  return TRUE;
+}
+
+/* Returns FALSE to close the connection once the client has been told the
+ * stream stopped
+ */
+static int
+ServePlay(RTMPConn *c, RTMPPacket *packet, AMFObject *obj, double txn)
+{
+  STREAMING_SERVER *server = RTMPServer_Context(c->server);
+  CLIENT *client = c->ctx;
+  RTMP *r = &c->rtmp;
+  char *file, *p, *q, *cmd, *ptr;
+  AVal *argv, av;
+  int len, argc;
+  uint32_t now;
+  RTMPPacket pc = {0};
+  AMFProp_GetString(AMF_GetProp(obj, NULL, 3), &r->Link.playpath);
+  /*
+  r->Link.seekTime = AMFProp_GetNumber(AMF_GetProp(obj, NULL, 4));
+  if (obj->o_num > 5)
+    r->Link.length = AMFProp_GetNumber(AMF_GetProp(obj, NULL, 5));
+  */
+  double StartFlag = 0;
+  AMFObjectProperty *Start = AMF_GetProp(obj, NULL, 4);
+  if (!(Start->p_type == AMF_INVALID))
+    StartFlag = AMFProp_GetNumber(Start);
+  r->Link.app = AVcopy(r->Link.app);
+  if (StartFlag == -1000 || (r->Link.app.av_val && strstr(r->Link.app.av_val, "live")))
     {
-      SendOnFCSubscribe(r);
+      StartFlag = -1000;
+      client->arglen += 7;
+      client->argc += 1;
     }
-  else if (AVMATCH(&method, &av_play))
+  if (r->Link.tcUrl.av_len)
     {
-      char *file, *p, *q, *cmd, *ptr;
-      AVal *argv, av;
-      int len, argc;
-      uint32_t now;
-      RTMPPacket pc = {0};
-      AMFProp_GetString(AMF_GetProp(&obj, NULL, 3), &r->Link.playpath);
-      /*
-      r->Link.seekTime = AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 4));
-      if (obj.o_num > 5)
-	r->Link.length = AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 5));
-      */
-      double StartFlag = 0;
-      AMFObjectProperty *Start = AMF_GetProp(&obj, NULL, 4);
-      if (!(Start->p_type == AMF_INVALID))
-        StartFlag = AMFProp_GetNumber(Start);
-      r->Link.app = AVcopy(r->Link.app);
-      if (StartFlag == -1000 || (r->Link.app.av_val && strstr(r->Link.app.av_val, "live")))
-        {
-          StartFlag = -1000;
-          server->arglen += 7;
-          server->argc += 1;
-        }
-      if (r->Link.tcUrl.av_len)
+      len = client->arglen + r->Link.playpath.av_len + 4 +
+	sizeof("rtmpdump") + r->Link.playpath.av_len + 12 + 20;	/* and the timestamp */
+      client->argc += 5;
+
+      cmd = malloc(len + client->argc * sizeof(AVal));
+      ptr = cmd;
+      argv = (AVal *)(cmd + len);
+      argv[0].av_val = cmd;
+      argv[0].av_len = sizeof("rtmpdump")-1;
+      ptr += sprintf(ptr, "rtmpdump");
+      argc = 1;
+
+      argv[argc].av_val = ptr + 1;
+      argv[argc++].av_len = 2;
+      argv[argc].av_val = ptr + 5;
+      r->Link.tcUrl = StripParams(&r->Link.tcUrl);
+      ptr += sprintf(ptr," -r \"%s\"", r->Link.tcUrl.av_val);
+      argv[argc++].av_len = r->Link.tcUrl.av_len;
+
+      if (r->Link.app.av_val)
 	{
-	  len = server->arglen + r->Link.playpath.av_len + 4 +
-	    sizeof("rtmpdump") + r->Link.playpath.av_len + 12;
-	  server->argc += 5;
-
-	  cmd = malloc(len + server->argc * sizeof(AVal));
-	  ptr = cmd;
-	  argv = (AVal *)(cmd + len);
-	  argv[0].av_val = cmd;
-	  argv[0].av_len = sizeof("rtmpdump")-1;
-	  ptr += sprintf(ptr, "rtmpdump");
-	  argc = 1;
-
 	  argv[argc].av_val = ptr + 1;
 	  argv[argc++].av_len = 2;
 	  argv[argc].av_val = ptr + 5;
-	  r->Link.tcUrl = StripParams(&r->Link.tcUrl);
-	  ptr += sprintf(ptr," -r \"%s\"", r->Link.tcUrl.av_val);
-	  argv[argc++].av_len = r->Link.tcUrl.av_len;
-
-	  if (r->Link.app.av_val)
-	    {
-	      argv[argc].av_val = ptr + 1;
-	      argv[argc++].av_len = 2;
-	      argv[argc].av_val = ptr + 5;
-	      ptr += sprintf(ptr, " -a \"%s\"", r->Link.app.av_val);
-	      argv[argc++].av_len = r->Link.app.av_len;
-	    }
-	  if (r->Link.flashVer.av_val)
-	    {
-	      argv[argc].av_val = ptr + 1;
-	      argv[argc++].av_len = 2;
-	      argv[argc].av_val = ptr + 5;
-	      ptr += sprintf(ptr, " -f \"%s\"", r->Link.flashVer.av_val);
-	      argv[argc++].av_len = r->Link.flashVer.av_len;
-	    }
-	  if (r->Link.swfUrl.av_val)
-	    {
-	      argv[argc].av_val = ptr + 1;
-	      argv[argc++].av_len = 2;
-	      argv[argc].av_val = ptr + 5;
-	      r->Link.swfUrl = StripParams(&r->Link.swfUrl);
-	      ptr += sprintf(ptr, " -W \"%s\"", r->Link.swfUrl.av_val);
-	      argv[argc++].av_len = r->Link.swfUrl.av_len;
-	    }
-	  if (r->Link.pageUrl.av_val)
-	    {
-	      argv[argc].av_val = ptr + 1;
-	      argv[argc++].av_len = 2;
-	      argv[argc].av_val = ptr + 5;
-	      ptr += sprintf(ptr, " -p \"%s\"", r->Link.pageUrl.av_val);
-	      argv[argc++].av_len = r->Link.pageUrl.av_len;
-	    }
-	  if (r->Link.usherToken.av_val)
-	    {
-	      argv[argc].av_val = ptr + 1;
-	      argv[argc++].av_len = 2;
-	      argv[argc].av_val = ptr + 5;
-	      ptr += sprintf(ptr, " -j \"%s\"", r->Link.usherToken.av_val);
-	      argv[argc++].av_len = r->Link.usherToken.av_len;
-	      free(r->Link.usherToken.av_val);
-	      r->Link.usherToken.av_val = NULL;
-	      r->Link.usherToken.av_len = 0;
-	    }
-          if (StartFlag == -1000)
-            {
-              argv[argc].av_val = ptr + 1;
-              argv[argc++].av_len = 6;
-              ptr += sprintf(ptr, " --live");
-            }
-          if (r->Link.extras.o_num)
-            {
-              ptr = dumpAMF(&r->Link.extras, ptr, argv, &argc);
-              AMF_Reset(&r->Link.extras);
-            }
+	  ptr += sprintf(ptr, " -a \"%s\"", r->Link.app.av_val);
+	  argv[argc++].av_len = r->Link.app.av_len;
+	}
+      if (r->Link.flashVer.av_val)
+	{
 	  argv[argc].av_val = ptr + 1;
 	  argv[argc++].av_len = 2;
 	  argv[argc].av_val = ptr + 5;
-	  ptr += sprintf(ptr, " -y \"%.*s\"",
-	    r->Link.playpath.av_len, r->Link.playpath.av_val);
-	  argv[argc++].av_len = r->Link.playpath.av_len;
-
-          if (r->Link.playpath.av_len)
-            av = r->Link.playpath;
-          else
-            {
-              av.av_val = "file";
-              av.av_len = 4;
-            }
-	  /* strip trailing URL parameters */
-	  q = memchr(av.av_val, '?', av.av_len);
-	  if (q)
-	    {
-	      if (q == av.av_val)
-		{
-		  av.av_val++;
-		  av.av_len--;
-		}
-	      else
-		{
-		  av.av_len = q - av.av_val;
-		}
-	    }
-	  /* strip leading slash components */
-	  for (p=av.av_val+av.av_len-1; p>=av.av_val; p--)
-	    if (*p == '/')
-	      {
-		p++;
-		av.av_len -= p - av.av_val;
-		av.av_val = p;
-		break;
-	      }
-	  /* skip leading dot */
-	  if (av.av_val[0] == '.')
+	  ptr += sprintf(ptr, " -f \"%s\"", r->Link.flashVer.av_val);
+	  argv[argc++].av_len = r->Link.flashVer.av_len;
+	}
+      if (r->Link.swfUrl.av_val)
+	{
+	  argv[argc].av_val = ptr + 1;
+	  argv[argc++].av_len = 2;
+	  argv[argc].av_val = ptr + 5;
+	  r->Link.swfUrl = StripParams(&r->Link.swfUrl);
+	  ptr += sprintf(ptr, " -W \"%s\"", r->Link.swfUrl.av_val);
+	  argv[argc++].av_len = r->Link.swfUrl.av_len;
+	}
+      if (r->Link.pageUrl.av_val)
+	{
+	  argv[argc].av_val = ptr + 1;
+	  argv[argc++].av_len = 2;
+	  argv[argc].av_val = ptr + 5;
+	  ptr += sprintf(ptr, " -p \"%s\"", r->Link.pageUrl.av_val);
+	  argv[argc++].av_len = r->Link.pageUrl.av_len;
+	}
+      if (r->Link.usherToken.av_val)
+	{
+	  argv[argc].av_val = ptr + 1;
+	  argv[argc++].av_len = 2;
+	  argv[argc].av_val = ptr + 5;
+	  ptr += sprintf(ptr, " -j \"%s\"", r->Link.usherToken.av_val);
+	  argv[argc++].av_len = r->Link.usherToken.av_len;
+	  free(r->Link.usherToken.av_val);
+	  r->Link.usherToken.av_val = NULL;
+	  r->Link.usherToken.av_len = 0;
+	}
+      if (StartFlag == -1000)
+	{
+	  argv[argc].av_val = ptr + 1;
+	  argv[argc++].av_len = 6;
+	  ptr += sprintf(ptr, " --live");
+	}
+      if (r->Link.extras.o_num)
+	{
+	  ptr = dumpAMF(&r->Link.extras, ptr, argv, &argc);
+	  AMF_Reset(&r->Link.extras);
+	}
+      argv[argc].av_val = ptr + 1;
+      argv[argc++].av_len = 2;
+      argv[argc].av_val = ptr + 5;
+      ptr += sprintf(ptr, " -y \"%.*s\"",
+	r->Link.playpath.av_len, r->Link.playpath.av_val);
+      argv[argc++].av_len = r->Link.playpath.av_len;
+
+      if (r->Link.playpath.av_len)
+	av = r->Link.playpath;
+      else
+	{
+	  av.av_val = "file";
+	  av.av_len = 4;
+	}
+      /* strip trailing URL parameters */
+      q = memchr(av.av_val, '?', av.av_len);
+      if (q)
+	{
+	  if (q == av.av_val)
 	    {
 	      av.av_val++;
 	      av.av_len--;
 	    }
-	  file = malloc(av.av_len+5);
+	  else
+	    {
+	      av.av_len = q - av.av_val;
+	    }
+	}
+      /* strip leading slash components */
+      for (p=av.av_val+av.av_len-1; p>=av.av_val; p--)
+	if (*p == '/')
+	  {
+	    p++;
+	    av.av_len -= p - av.av_val;
+	    av.av_val = p;
+	    break;
+	  }
+      /* skip leading dot */
+      if (av.av_val[0] == '.')
+	{
+	  av.av_val++;
+	  av.av_len--;
+	}
+      file = malloc(av.av_len+5);
 
-	  memcpy(file, av.av_val, av.av_len);
-	  file[av.av_len] = '\0';
+      memcpy(file, av.av_val, av.av_len);
+      file[av.av_len] = '\0';
 
-          if (strlen(file) < 128)
-            {
-              /* Add extension if none present */
-              if (file[av.av_len - 4] != '.')
-                {
-                  av.av_len += 4;
-                }
-
-              /* Always use flv extension, regardless of original */
-              if (strcmp(file + av.av_len - 4, ".flv"))
-                {
-                  strcpy(file + av.av_len - 4, ".flv");
-                }
-
-              /* Remove invalid characters from filename */
-              file = strreplace(file, 0, ":", "_", TRUE);
-              file = strreplace(file, 0, "&", "_", TRUE);
-              file = strreplace(file, 0, "^", "_", TRUE);
-              file = strreplace(file, 0, "|", "_", TRUE);
-            }
-          else
-            {
-              /* Filename too long - generate unique name */
-              strcpy(file, "vXXXXXX");
-              mktemp(file);
-              strcat(file, ".flv");
-            }
+      if (strlen(file) < 128)
+	{
+	  /* Add extension if none present */
+	  if (av.av_len < 4 || file[av.av_len - 4] != '.')
+	    {
+	      av.av_len += 4;
+	    }
 
-          /* Add timestamp to the filename */
-          char *filename, *pfilename, timestamp[21];
-          int filename_len, timestamp_len;
-          time_t current_time;
-
-          time(&current_time);
-          timestamp_len = strftime(&timestamp[0], sizeof (timestamp), "%Y-%m-%d_%I-%M-%S_", localtime(&current_time));
-          timestamp[timestamp_len] = '\0';
-          filename_len = strlen(file);
-          filename = malloc(timestamp_len + filename_len + 1);
-          pfilename = filename;
-          memcpy(pfilename, timestamp, timestamp_len);
-          pfilename += timestamp_len;
-          memcpy(pfilename, file, filename_len);
-          pfilename += filename_len;
-          *pfilename++ = '\0';
-          file = filename;
+	  /* Always use flv extension, regardless of original */
+	  if (strcmp(file + av.av_len - 4, ".flv"))
+	    {
+	      strcpy(file + av.av_len - 4, ".flv");
+	    }
 
-	  argv[argc].av_val = ptr + 1;
-	  argv[argc++].av_len = 2;
-	  argv[argc].av_val = file;
-	  argv[argc].av_len = av.av_len;
+	  /* Remove invalid characters from filename */
+	  file = strreplace(file, 0, ":", "_", TRUE);
+	  file = strreplace(file, 0, "&", "_", TRUE);
+	  file = strreplace(file, 0, "^", "_", TRUE);
+	  file = strreplace(file, 0, "|", "_", TRUE);
+	}
+      else
+	{
+	  /* Filename too long - generate unique name */
+	  strcpy(file, "vXXXXXX");
+	  mktemp(file);
+	  strcat(file, ".flv");
+	}
+
+      /* Add timestamp to the filename */
+      char *filename, *pfilename, timestamp[21];
+      int filename_len, timestamp_len;
+      time_t current_time;
+
+      time(&current_time);
+      timestamp_len = strftime(&timestamp[0], sizeof (timestamp), "%Y-%m-%d_%I-%M-%S_", localtime(&current_time));
+      timestamp[timestamp_len] = '\0';
+      filename_len = strlen(file);
+      filename = malloc(timestamp_len + filename_len + 1);
+      pfilename = filename;
+      memcpy(pfilename, timestamp, timestamp_len);
+      pfilename += timestamp_len;
+      memcpy(pfilename, file, filename_len);
+      pfilename += filename_len;
+      *pfilename++ = '\0';
+      file = filename;
+
+      argv[argc].av_val = ptr + 1;
+      argv[argc++].av_len = 2;
+      argv[argc].av_val = file;
+      argv[argc].av_len = strlen(file);
 #ifdef VLC
-          char *vlc;
-          int didAlloc = FALSE;
+      char *vlc;
+      int didAlloc = FALSE;
 
-          if (getenv("VLC"))
-            vlc = getenv("VLC");
-          else if (getenv("ProgramFiles"))
-            {
-              vlc = malloc(512 * sizeof (char));
-              didAlloc = TRUE;
-              char *ProgramFiles = getenv("ProgramFiles");
-              sprintf(vlc, "\"%s%s", ProgramFiles, " (x86)\\VideoLAN\\VLC\\vlc.exe");
-              if (!file_exists(vlc + 1))
-                sprintf(vlc + 1, "%s%s", ProgramFiles, "\\VideoLAN\\VLC\\vlc.exe");
-              strcpy(vlc + strlen(vlc), "\" -");
-            }
-          else
-            vlc = "vlc -";
+      if (getenv("VLC"))
+	vlc = getenv("VLC");
+      else if (getenv("ProgramFiles"))
+	{
+	  vlc = malloc(512 * sizeof (char));
+	  didAlloc = TRUE;
+	  char *ProgramFiles = getenv("ProgramFiles");
+	  sprintf(vlc, "\"%s%s", ProgramFiles, " (x86)\\VideoLAN\\VLC\\vlc.exe");
+	  if (!file_exists(vlc + 1))
+	    sprintf(vlc + 1, "%s%s", ProgramFiles, "\\VideoLAN\\VLC\\vlc.exe");
+	  strcpy(vlc + strlen(vlc), "\" -");
+	}
+      else
+	vlc = "vlc -";
 
-          ptr += sprintf(ptr, " | %s", vlc);
-          if (didAlloc)
-            free(vlc);
+      ptr += sprintf(ptr, " | %s", vlc);
+      if (didAlloc)
+	free(vlc);
 #else
-          ptr += sprintf(ptr, " -o \"%s\"", file);
+      /* len has room for the name, but never write past it */
+      ptr += snprintf(ptr, cmd + len - ptr, " -o \"%.*s\"",
+		      (int) (cmd + len - ptr) - 7, file);
 #endif
-	  now = RTMP_GetTime();
-	  if (now - server->filetime < DUPTIME && AVMATCH(&argv[argc], &server->filename))
-	    {
-	      printf("Duplicate request, skipping.\n");
-	      free(file);
-	    }
-	  else
-	    {
-	      printf("\n%s\n\n", cmd);
-	      fflush(stdout);
-	      server->filetime = now;
-	      free(server->filename.av_val);
-	      server->filename = argv[argc++];
+      now = RTMP_GetTime();
+      if (now - server->filetime < DUPTIME && AVMATCH(&argv[argc], &server->filename))
+	{
+	  printf("Duplicate request, skipping.\n");
+	  free(file);
+	}
+      else
+	{
+	  printf("\n%s\n\n", cmd);
+	  fflush(stdout);
+	  server->filetime = now;
+	  free(server->filename.av_val);
+	  server->filename = argv[argc++];
 #ifdef VLC
-              FILE *vlc_cmdfile = fopen("VLC.bat", "w");
-              char *vlc_batchcmd = strreplace(cmd, 0, "%", "%%", FALSE);
-              fprintf(vlc_cmdfile, "%s\n", vlc_batchcmd);
-              fclose(vlc_cmdfile);
-              free(vlc_batchcmd);
-              spawn_dumper(argc, argv, "VLC.bat");
+	  FILE *vlc_cmdfile = fopen("VLC.bat", "w");
+	  char *vlc_batchcmd = strreplace(cmd, 0, "%", "%%", FALSE);
+	  fprintf(vlc_cmdfile, "%s\n", vlc_batchcmd);
+	  fclose(vlc_cmdfile);
+	  free(vlc_batchcmd);
+	  spawn_dumper(argc, argv, "VLC.bat");
 #else
-              spawn_dumper(argc, argv, cmd);
+	  if (poolSize)
+	    PoolAdd(argc, argv);
+	  else
+	    spawn_dumper(argc, argv, cmd);
 #endif
 
-              /* Save command to text file */
-              FILE *cmdfile = fopen("Command.txt", "a");
-              fprintf(cmdfile, "%s\n", cmd);
-              fclose(cmdfile);
-	    }
-
-	  free(cmd);
+	  /* Save command to text file */
+	  FILE *cmdfile = fopen("Command.txt", "a");
+	  fprintf(cmdfile, "%s\n", cmd);
+	  fclose(cmdfile);
 	}
-      pc.m_body = server->connect;
-      server->connect = NULL;
-      RTMPPacket_Free(&pc);
-      ret = 1;
-	  RTMP_SendCtrl(r, 0, 1, 0);
-	  SendPlayStart(r);
-	  RTMP_SendCtrl(r, 1, 1, 0);
-	  SendPlayStop(r);
+
+      free(cmd);
     }
-  AMF_Reset(&obj);
-  return ret;
+  pc.m_body = client->connect;
+  client->connect = NULL;
+  RTMPPacket_Free(&pc);
+  RTMP_SendCtrl(r, 0, 1, 0);
+  SendPlayStart(r);
+  RTMP_SendCtrl(r, 1, 1, 0);
+  SendPlayStop(r);
+  return FALSE;
 }
 
-int
-ServePacket(STREAMING_SERVER *server, RTMP *r, RTMPPacket *packet)
+/* the other commands */
+static int
+ServeInvoke(RTMPConn *c, RTMPPacket *packet, AMFObject *obj, double txn)
 {
-  int ret = 0;
+  CLIENT *client = c->ctx;
+  RTMP *r = &c->rtmp;
+  AVal method;
 
-  RTMP_Log(RTMP_LOGDEBUG, "%s, received packet type %02X, size %u bytes", __FUNCTION__,
-    packet->m_packetType, packet->m_nBodySize);
+  AMF_Dump(obj);
+  AMFProp_GetString(AMF_GetProp(obj, NULL, 0), &method);
 
-  switch (packet->m_packetType)
+  if (AVMATCH(&method, &av_getStreamLength))
     {
-    case RTMP_PACKET_TYPE_CHUNK_SIZE:
-//      HandleChangeChunkSize(r, packet);
-      break;
-
-    case RTMP_PACKET_TYPE_BYTES_READ_REPORT:
-      break;
-
-    case RTMP_PACKET_TYPE_CONTROL:
-//      HandleCtrl(r, packet);
-      break;
-
-    case RTMP_PACKET_TYPE_SERVER_BW:
-//      HandleServerBW(r, packet);
-      break;
-
-    case RTMP_PACKET_TYPE_CLIENT_BW:
- //     HandleClientBW(r, packet);
-      break;
-
-    case RTMP_PACKET_TYPE_AUDIO:
-      //RTMP_Log(RTMP_LOGDEBUG, "%s, received: audio %lu bytes", __FUNCTION__, packet.m_nBodySize);
-      break;
-
-    case RTMP_PACKET_TYPE_VIDEO:
-      //RTMP_Log(RTMP_LOGDEBUG, "%s, received: video %lu bytes", __FUNCTION__, packet.m_nBodySize);
-      break;
-
-    case RTMP_PACKET_TYPE_FLEX_STREAM_SEND:
-      break;
-
-    case RTMP_PACKET_TYPE_FLEX_SHARED_OBJECT:
-      break;
-
-    case RTMP_PACKET_TYPE_FLEX_MESSAGE:
-      {
-	RTMP_Log(RTMP_LOGDEBUG, "%s, flex message, size %u bytes, not fully supported",
-	    __FUNCTION__, packet->m_nBodySize);
-	//RTMP_LogHex(packet.m_body, packet.m_nBodySize);
-
-	// some DEBUG code
-	/*RTMP_LIB_AMFObject obj;
-	   int nRes = obj.Decode(packet.m_body+1, packet.m_nBodySize-1);
-	   if(nRes < 0) {
-	   RTMP_Log(RTMP_LOGERROR, "%s, error decoding AMF3 packet", __FUNCTION__);
-	   //return;
-	   }
-
-	   obj.Dump(); */
-
-	if (ServeInvoke(server, r, packet, 1))
-	  RTMP_Close(r);
-	break;
-      }
-    case RTMP_PACKET_TYPE_INFO:
-      break;
-
-    case RTMP_PACKET_TYPE_SHARED_OBJECT:
-      break;
-
-    case RTMP_PACKET_TYPE_INVOKE:
-      RTMP_Log(RTMP_LOGDEBUG, "%s, received: invoke %u bytes", __FUNCTION__,
-	  packet->m_nBodySize);
-      //RTMP_LogHex(packet.m_body, packet.m_nBodySize);
-
-      if (ServeInvoke(server, r, packet, 0))
-	RTMP_Close(r);
-      break;
-
-    case RTMP_PACKET_TYPE_FLASH_VIDEO:
-	break;
-    default:
-      RTMP_Log(RTMP_LOGDEBUG, "%s, unknown packet type received: 0x%02x", __FUNCTION__,
-	  packet->m_packetType);
-#ifdef _DEBUG
-      RTMP_LogHex(RTMP_LOGDEBUG, packet->m_body, packet->m_nBodySize);
-#endif
+      SendResultNumber(r, txn, 10.0);
     }
-  return ret;
-}
-
-TFTYPE
-controlServerThread(void *unused)
-{
-  char ich;
-  while (1)
+  else if (AVMATCH(&method, &av_NetStream_Authenticate_UsherToken))
     {
-      ich = getchar();
-      switch (ich)
-	{
-	case 'q':
-	  RTMP_LogPrintf("Exiting\n");
-          if (rtmpServer)
-            stopStreaming(rtmpServer);
-	  break;
-	default:
-	  RTMP_LogPrintf("Unknown command \'%c\', ignoring\n", ich);
-	}
-      sleep(1);
-      if (rtmpServer && (rtmpServer->state == STREAMING_STOPPED))
-        {
-          RTMP_Log(RTMP_LOGDEBUG, "Exiting text UI thread");
-          break;
-        }
+      AVal usherToken;
+      AMFProp_GetString(AMF_GetProp(obj, NULL, 3), &usherToken);
+      AVreplace(&usherToken, &av_dquote, &av_escdquote);
+#ifdef WIN32
+      AVreplace(&usherToken, &av_caret, &av_esccaret);
+      AVreplace(&usherToken, &av_pipe, &av_escpipe);
+#endif
+      client->arglen += 6 + usherToken.av_len;
+      client->argc += 2;
+      r->Link.usherToken = usherToken;
     }
-  TFRET();
-}
-
-
-void doServe(STREAMING_SERVER * server,	// server socket and state (our listening socket)
-  int sockfd	// client connection socket
-  )
-{
-  server->state = STREAMING_IN_PROGRESS;
-
-  RTMP *rtmp = RTMP_Alloc();		/* our session with the real client */
-  RTMPPacket packet = { 0 };
-
-  // timeout for http requests
-  fd_set fds;
-  struct timeval tv;
-
-  memset(&tv, 0, sizeof(struct timeval));
-  tv.tv_sec = 5;
-
-  FD_ZERO(&fds);
-  FD_SET(sockfd, &fds);
-
-  if (select(sockfd + 1, &fds, NULL, NULL, &tv) <= 0)
+  else if (AVMATCH(&method, &av__checkbw))
     {
-      RTMP_Log(RTMP_LOGERROR, "Request timeout/select failed, ignoring request");
-      goto quit;
+      SendCheckBWResponse(r, TRUE, FALSE);
     }
-  else
+  else if (AVMATCH(&method, &av_checkBandwidth))
     {
-      RTMP_Init(rtmp);
-      rtmp->m_sb.sb_socket = sockfd;
-      if (sslCtx && !RTMP_TLS_Accept(rtmp, sslCtx))
-        {
-	  RTMP_Log(RTMP_LOGERROR, "TLS handshake failed");
-	  goto cleanup;
-        }
-      if (!RTMP_Serve(rtmp))
-	{
-	  RTMP_Log(RTMP_LOGERROR, "Handshake failed");
-	  goto cleanup;
-	}
+      SendCheckBWResponse(r, FALSE, FALSE);
     }
-  server->arglen = 0;
-  while (RTMP_IsConnected(rtmp) && RTMP_ReadPacket(rtmp, &packet))
+  else if (AVMATCH(&method, &av_FCSubscribe))
     {
-      if (!RTMPPacket_IsReady(&packet))
-	continue;
-      ServePacket(server, rtmp, &packet);
-      RTMPPacket_Free(&packet);
+      SendOnFCSubscribe(r);
     }
+  return TRUE;
+}
 
-cleanup:
+static void
+ServeClose(RTMPConn *c)
+{
+  CLIENT *client = c->ctx;
+  RTMP *rtmp = &c->rtmp;
+  RTMPPacket pc = { 0 };
+
+  if (!client)
+    return;
   RTMP_LogPrintf("Closing connection... ");
-  RTMP_Close(rtmp);
   /* Should probably be done by RTMP_Close() ... */
   rtmp->Link.playpath.av_val = NULL;
   rtmp->Link.tcUrl.av_val = NULL;
@@ -1156,122 +1593,79 @@ cleanup:
       free(rtmp->Link.usherToken.av_val);
       rtmp->Link.usherToken.av_val = NULL;
     }
-  RTMP_Free(rtmp);
+  pc.m_body = client->connect;
+  RTMPPacket_Free(&pc);
+  free(client);
+  c->ctx = NULL;
   RTMP_LogPrintf("done!\n\n");
-
-quit:
-  if (server->state == STREAMING_IN_PROGRESS)
-    server->state = STREAMING_ACCEPTING;
-
-  return;
 }
 
 TFTYPE
-serverThread(void *arg)
+controlServerThread(void *unused)
 {
-  STREAMING_SERVER *server = arg;
-  server->state = STREAMING_ACCEPTING;
-
-  while (server->state == STREAMING_ACCEPTING)
+  char ich;
+  while (1)
     {
-      struct sockaddr_in addr;
-      socklen_t addrlen = sizeof(struct sockaddr_in);
-      int sockfd =
-	accept(server->socket, (struct sockaddr *) &addr, &addrlen);
-
-      if (sockfd > 0)
-	{
-#ifdef linux
-	  struct sockaddr_in dest;
-	  char destch[16];
-	  socklen_t destlen = sizeof(struct sockaddr_in);
-	  getsockopt(sockfd, SOL_IP, SO_ORIGINAL_DST, &dest, &destlen);
-	  strcpy(destch, inet_ntoa(dest.sin_addr));
-	  RTMP_Log(RTMP_LOGDEBUG, "%s: accepted connection from %s to %s\n", __FUNCTION__,
-	      inet_ntoa(addr.sin_addr), destch);
-#else
-	  RTMP_Log(RTMP_LOGDEBUG, "%s: accepted connection from %s\n", __FUNCTION__,
-	      inet_ntoa(addr.sin_addr));
-#endif
-	  /* Create a new thread and transfer the control to that */
-	  doServe(server, sockfd);
-	  RTMP_Log(RTMP_LOGDEBUG, "%s: processed request\n", __FUNCTION__);
-	}
-      else
+      ich = getchar();
+      switch (ich)
 	{
-	  RTMP_Log(RTMP_LOGERROR, "%s: accept failed", __FUNCTION__);
+	case 'q':
+	  RTMP_LogPrintf("Exiting\n");
+          if (rtmpServer)
+            stopStreaming(rtmpServer);
+	  break;
+	case 's':
+	  if (poolSize)
+	    PoolStatus();
+	  break;
+	default:
+	  RTMP_LogPrintf("Unknown command \'%c\', ignoring\n", ich);
 	}
+      sleep(1);
+      if (rtmpServer && (rtmpServer->state == STREAMING_STOPPED))
+        {
+          RTMP_Log(RTMP_LOGDEBUG, "Exiting text UI thread");
+          break;
+        }
     }
-  server->state = STREAMING_STOPPED;
   TFRET();
 }
 
+
 STREAMING_SERVER *
 startStreaming(const char *address, int port)
 {
-  struct sockaddr_in addr;
-  int sockfd, tmp;
   STREAMING_SERVER *server;
+  RTMPServerCB cb = { 0 };
 
-  sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (sockfd == -1)
-    {
-      RTMP_Log(RTMP_LOGERROR, "%s, couldn't create socket", __FUNCTION__);
-      return 0;
-    }
-
-  tmp = 1;
-  setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR,
-				(char *) &tmp, sizeof(tmp) );
+  cb.accept = ServeAccept;
+  cb.connect = ServeConnect;
+  cb.createStream = ServeCreateStream;
+  cb.play = ServePlay;
+  cb.invoke = ServeInvoke;
+  cb.close = ServeClose;
 
-  addr.sin_family = AF_INET;
-  addr.sin_addr.s_addr = inet_addr(address);	//htonl(INADDR_ANY);
-  addr.sin_port = htons(port);
-
-  if (bind(sockfd, (struct sockaddr *) &addr, sizeof(struct sockaddr_in)) ==
-      -1)
-    {
-      RTMP_Log(RTMP_LOGERROR, "%s, TCP bind failed for port number: %d", __FUNCTION__,
-	  port);
-      return 0;
-    }
-
-  if (listen(sockfd, 10) == -1)
+  server = (STREAMING_SERVER *) calloc(1, sizeof(STREAMING_SERVER));
+  server->rs = RTMPServer_Open(address, port, &cb, server);
+  if (!server->rs)
     {
-      RTMP_Log(RTMP_LOGERROR, "%s, listen failed", __FUNCTION__);
-      closesocket(sockfd);
+      free(server);
       return 0;
     }
-
-  server = (STREAMING_SERVER *) calloc(1, sizeof(STREAMING_SERVER));
-  server->socket = sockfd;
-
-  ThreadCreate(serverThread, server);
-
+  server->state = STREAMING_ACCEPTING;
   return server;
 }
 
+/* main() notices once RTMPServer_Run() returns */
 void
 stopStreaming(STREAMING_SERVER * server)
 {
   assert(server);
 
-  if (server->state != STREAMING_STOPPED)
+  if (server->state == STREAMING_ACCEPTING)
     {
-      if (server->state == STREAMING_IN_PROGRESS)
-	{
-	  server->state = STREAMING_STOPPING;
-
-	  // wait for streaming threads to exit
-	  while (server->state != STREAMING_STOPPED)
-	    msleep(1);
-	}
-
-      if (closesocket(server->socket))
-	RTMP_Log(RTMP_LOGERROR, "%s: Failed to close listening socket, error %d",
-	    __FUNCTION__, GetSockError());
-
-      server->state = STREAMING_STOPPED;
+      server->state = STREAMING_STOPPING;
+      RTMPServer_Stop(server->rs);
     }
 }
 
@@ -1311,6 +1705,14 @@ main(int argc, char **argv)
         cert = argv[++i];
       else if (!strcmp(argv[i], "-k") && i + 1 < argc)
         key = argv[++i];
+      else if (!strcmp(argv[i], "-w") && i + 1 < argc)
+        {
+          poolSize = atoi(argv[++i]);
+          if (poolSize < 0)
+            poolSize = 0;
+          else if (poolSize > POOL_MAXWORKERS)
+            poolSize = POOL_MAXWORKERS;
+        }
     }
 
   if (cert && key)
@@ -1339,8 +1741,21 @@ main(int argc, char **argv)
 
   InitSockets();
 
+  if (poolSize)
+    {
+      int nStarted = PoolStart(poolSize);
+      if (!nStarted)
+	{
+	  RTMP_Log(RTMP_LOGWARNING,
+	      "No download workers, spawning rtmpdump instead");
+	  PoolStop();
+	}
+      poolSize = nStarted;
+    }
+
   // start text UI
-  ThreadCreate(controlServerThread, 0);
+  if (ThreadFailed(ThreadCreate(controlServerThread, 0)))
+    RTMP_Log(RTMP_LOGWARNING, "Couldn't start the text UI, 'q' won't work");
 
   // start http streaming
   if ((rtmpServer =
@@ -1352,12 +1767,14 @@ main(int argc, char **argv)
   RTMP_LogPrintf("Streaming on rtmp://%s:%d\n", rtmpStreamingDevice,
 	    nRtmpStreamingPort);
 
-  while (rtmpServer->state != STREAMING_STOPPED)
-    {
-      sleep(1);
-    }
+  RTMPServer_Run(rtmpServer->rs);
+  RTMPServer_Close(rtmpServer->rs);
+  rtmpServer->state = STREAMING_STOPPED;
   RTMP_Log(RTMP_LOGDEBUG, "Done, exiting...");
 
+  if (poolSize)
+    PoolStop();
+
   if (sslCtx)
     RTMP_TLS_FreeServerContext(sslCtx);
 
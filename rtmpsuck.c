@@ -39,8 +39,10 @@
 
 #include "librtmp/rtmp_sys.h"
 #include "librtmp/log.h"
+#include "librtmp/server.h"
 
 #include "thread.h"
+#include "ringbuf.h"
 
 #ifdef linux
 #include <linux/netfilter_ipv4.h>
@@ -52,6 +54,9 @@
 
 #define PACKET_SIZE 1024*1024
 
+#define CAPTURE_QUEUE	(4*1024*1024)	/* capture bytes a session may have pending */
+#define CAPTURE_RESERVE	256	/* kept for closing files when it is full */
+
 #ifdef WIN32
 #define InitSockets()	{\
         WORD version;			\
@@ -87,10 +92,76 @@ typedef struct Plist
   RTMPPacket p_pkt;
 } Plist;
 
+struct SESSION;
+
+/* The capture files of a session are written by a thread of their own,
+ * so a slow disk can't hold up the streams being proxied. When the
+ * writer falls too far behind, whole media tags are dropped instead.
+ * A file that would lose what a player needs to decode the rest isn't
+ * written any further.
+ */
+typedef struct CAPTURE
+{
+  RingBuf ring;			/* of CAPREC headers, each followed by its data */
+  int bStarted;
+  unsigned long nDropped;	/* writes dropped */
+  uint64_t dropBytes;
+  uint32_t lastReport;		/* time of the last warning about them */
+  FILE *broken;			/* lost a header, left as it is until closed */
+} CAPTURE;
+
+typedef struct CAPREC
+{
+  FILE *file;
+  uint32_t len;			/* 0 to close the file */
+} CAPREC;
+
+/* what the peer knows of a chunk stream, as RELAY flags */
+#define RELAY_FIELDS	0x01	/* type, size, stream and time of the last message */
+#define RELAY_DELTA	0x02	/* and the timestamp delta, as sent to us */
+#define RELAY_DROP	0x04	/* the message being read is not passed on */
+#define RELAY_HOLD	0x08	/* or only once it is complete, as a whole */
+
+/* One direction of a session in relay mode. The bytes read are passed on
+ * as they are, the chunk headers are only parsed to find the messages the
+ * proxy has to look at. A header is rewritten when the peer can't decode
+ * it. Commands are held until they are complete, the proxy may change
+ * them, and so is every message while the two sides use different chunk
+ * sizes: it goes out whole, in chunks of the peer's size, and never in
+ * the middle of another chunk.
+ */
+typedef struct RELAY
+{
+  RTMP *from;			/* its m_chunksIn and m_inChunkSize are read */
+  RTMP *to;			/* its m_chunksOut and m_outChunkSize are sent */
+  int which;			/* 0 from the client, 1 from the server */
+  int channel;			/* of the chunk being read */
+  int chunkLeft;		/* its bytes still to come */
+  unsigned char *flags;		/* RELAY_* by chunk stream id */
+  int nFlags;
+  char *span;			/* input going out unchanged, not copied */
+  int spanLen;
+  char *out;			/* or else what goes out */
+  int outLen;
+  int outSize;
+} RELAY;
+
 typedef struct
 {
-  int socket;
+  RTMPServer *rs;		/* accepts and handshakes, NULL once it stopped */
   int state;
+  TMUTEX lock;
+  struct SESSION *sessions;	/* being proxied */
+  int nSessions;
+} STREAMING_SERVER;
+
+/* one proxied connection, a player may open several at once */
+typedef struct SESSION
+{
+  struct SESSION *next;
+  STREAMING_SERVER *server;
+  int socket;			/* of rs and rc while they are open, */
+  int rcSocket;			/* changed with the server locked */
   uint32_t stamp;
   RTMP rs;
   RTMP rc;
@@ -98,11 +169,24 @@ typedef struct
   Plist *rc_pkt[2];	/* head, tail */
   Flist *f_head, *f_tail;
   Flist *f_cur;
+  int paused;
+  CAPTURE capture;
+  RELAY relay[2];	/* from the client, from the server */
+} SESSION;
 
-} STREAMING_SERVER;
+/* pass raw chunks on instead of reassembled packets */
+static int relayMode = FALSE;
+
+/* capture file names and Command.txt are shared by all sessions */
+static TMUTEX fileLock;
 
 STREAMING_SERVER *rtmpServer = 0;	// server structure pointer
 
+/* the signal that asked to stop, TRUE for the q command; main() then
+ * stops the server
+ */
+static volatile sig_atomic_t stopRequested = 0;
+
 STREAMING_SERVER *startStreaming(const char *address, int port);
 void stopStreaming(STREAMING_SERVER * server);
 
@@ -160,9 +244,225 @@ char *strreplace(char *srcstr, int srclen, char *orig, char *repl, int didAlloc)
 AVal AVcopy(AVal src);
 AVal StripParams(AVal *src);
 
+/* Returns file, or a name made from it that no file has yet, as other
+ * sessions may be saving the same stream in the same second. Call with
+ * fileLock held until the file is created.
+ */
+static char *
+UniqueName(char *file)
+{
+  FILE *f;
+  char *name;
+  size_t len = strlen(file);
+  int i;
+
+  if (!(f = fopen(file, "rb")))
+    return file;
+  fclose(f);
+  name = malloc(len + 8);
+  for (i = 1; i < 10000; i++)
+    {
+      /* ahead of the .flv */
+      sprintf(name, "%.*s_%d%s", (int)(len - 4), file, i, file + len - 4);
+      if (!(f = fopen(name, "rb")))
+        break;
+      fclose(f);
+    }
+  free(file);
+  return name;
+}
+
+static TFTYPE
+CaptureThread(void *arg)
+{
+  CAPTURE *cap = arg;
+  FILE *failed = NULL;
+  CAPREC rec;
+
+  while (1)
+    {
+      char *ptr = (char *)&rec;
+      size_t left = sizeof(rec), n;
+      const char *data;
+
+      /* the header may wrap around the end of the ring */
+      while (left && (n = RingGet(&cap->ring, &data)) > 0)
+	{
+	  if (n > left)
+	    n = left;
+	  memcpy(ptr, data, n);
+	  RingConsume(&cap->ring, n);
+	  ptr += n;
+	  left -= n;
+	}
+      if (left)
+	break;
+
+      if (!rec.len)
+	{
+	  if (rec.file == failed)
+	    failed = NULL;
+	  fclose(rec.file);
+	  continue;
+	}
+
+      while (rec.len && (n = RingGet(&cap->ring, &data)) > 0)
+	{
+	  if (n > rec.len)
+	    n = rec.len;
+	  if (rec.file != failed && fwrite(data, 1, n, rec.file) != n)
+	    {
+	      RTMP_Log(RTMP_LOGERROR, "%s, failed writing capture, error %d",
+		  __FUNCTION__, errno);
+	      failed = rec.file;
+	    }
+	  RingConsume(&cap->ring, n);
+	  rec.len -= n;
+	}
+    }
+  RingDone(&cap->ring);
+  TFRET();
+}
+
+/* Whether a write is one the file can't do without: its FLV header,
+ * onMetaData or an AVC or AAC sequence header.
+ */
+static int
+CaptureNeeded(const char *data, uint32_t len)
+{
+  if (len >= 3 && !memcmp(data, "FLV", 3))
+    return TRUE;
+  if (len < 13)
+    return FALSE;
+  switch (data[0])
+    {
+    case RTMP_PACKET_TYPE_INFO:
+      return len >= 11 + 13 && data[11] == AMF_STRING
+	&& !memcmp(data + 14, "onMetaData", 10);
+    case RTMP_PACKET_TYPE_VIDEO:
+      return (data[11] & 0x0f) == 7 && !data[12];
+    case RTMP_PACKET_TYPE_AUDIO:
+      return ((unsigned char)data[11] >> 4) == 10 && !data[12];
+    }
+  return FALSE;
+}
+
+/* Queue a write, or the close of file if len is 0. Data goes in whole
+ * or not at all, so a full queue costs tags, never a broken one. This
+ * never waits for the writer, a header that doesn't fit ends the file
+ * instead.
+ */
+static void
+CapturePut(SESSION *sess, FILE *file, const char *data, uint32_t len)
+{
+  CAPTURE *cap = &sess->capture;
+  CAPREC rec;
+
+  if (!cap->bStarted)
+    {
+      if (RingInit(&cap->ring, CAPTURE_QUEUE))
+	{
+	  cap->bStarted = TRUE;
+	  if (ThreadFailed(ThreadCreate(CaptureThread, cap)))
+	    {
+	      RingFree(&cap->ring);
+	      cap->bStarted = FALSE;
+	    }
+	}
+      if (!cap->bStarted)
+	{
+	  RTMP_Log(RTMP_LOGWARNING, "%s, can't start a capture writer, writing directly",
+	      __FUNCTION__);
+	  cap->bStarted = -1;
+	}
+    }
+  if (cap->bStarted < 0)
+    {
+      if (!len)
+	fclose(file);
+      else if (fwrite(data, 1, len, file) != len)
+	RTMP_Log(RTMP_LOGERROR, "%s, failed writing capture, error %d",
+	    __FUNCTION__, errno);
+      return;
+    }
+
+  if (file == cap->broken)
+    {
+      if (len)
+	return;
+      cap->broken = NULL;
+    }
+
+  rec.file = file;
+  rec.len = len;
+  if (len && cap->ring.size - RingUsed(&cap->ring)
+      < sizeof(rec) + len + CAPTURE_RESERVE)
+    {
+      uint32_t now = RTMP_GetTime();
+
+      if (CaptureNeeded(data, len))
+	{
+	  RTMP_Log(RTMP_LOGERROR, "Capture can't keep up with the stream and lost a header, the file ends here");
+	  cap->broken = file;
+	  return;
+	}
+
+      cap->nDropped++;
+      cap->dropBytes += len;
+      if (!cap->lastReport || now - cap->lastReport >= 5000)
+	{
+	  RTMP_Log(RTMP_LOGWARNING, "Capture can't keep up with the stream, %lu writes (%.1f kB) dropped so far",
+	      cap->nDropped, (double) cap->dropBytes / 1024.0);
+	  cap->lastReport = now;
+	}
+      return;
+    }
+  /* nothing but the writer makes room, this can't wait long */
+  RingPut(&cap->ring, (char *)&rec, sizeof(rec), TRUE);
+  if (len)
+    RingPut(&cap->ring, data, len, TRUE);
+}
+
+/* let the writer finish what is queued, at the end of the session */
+static void
+CaptureFinish(SESSION *sess)
+{
+  CAPTURE *cap = &sess->capture;
+
+  if (cap->bStarted <= 0)
+    return;
+
+  RingClose(&cap->ring);
+  RingWaitDone(&cap->ring);
+  RTMP_Log(RTMP_LOGDEBUG, "%s, capture queue high-water %.1f kB of %.1f kB",
+      __FUNCTION__, (double) cap->ring.highWater / 1024.0,
+      (double) cap->ring.size / 1024.0);
+  if (cap->nDropped)
+    RTMP_Log(RTMP_LOGWARNING, "Capture dropped %lu writes, %.1f kB in all",
+	cap->nDropped, (double) cap->dropBytes / 1024.0);
+  RingFree(&cap->ring);
+  cap->bStarted = FALSE;
+}
+
+/* stopStreaming() shuts down the sockets the sessions have open. One is
+ * taken off the session with the server locked before it is closed, so
+ * a descriptor that was handed out again is never touched.
+ */
+static void
+SessionClose(SESSION *sess, RTMP *r)
+{
+  MutexLock(&sess->server->lock);
+  if (r == &sess->rs)
+    sess->socket = -1;
+  else
+    sess->rcSocket = -1;
+  MutexUnlock(&sess->server->lock);
+  RTMP_Close(r);
+}
+
 // Returns 0 for OK/Failed/error, 1 for 'Stop or Complete'
 int
-ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *body)
+ServeInvoke(SESSION *sess, int which, RTMPPacket *pack, const char *body)
 {
   int ret = 0, nRes;
   int nBodySize = pack->m_nBodySize;
@@ -209,12 +509,12 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
             }
           if (AVMATCH(&pname, &av_app))
             {
-              server->rc.Link.app = AVcopy(pval);
+              sess->rc.Link.app = AVcopy(pval);
               pval.av_val = NULL;
             }
           else if (AVMATCH(&pname, &av_flashVer))
             {
-              server->rc.Link.flashVer = AVcopy(pval);
+              sess->rc.Link.flashVer = AVcopy(pval);
               pval.av_val = NULL;
             }
           else if (AVMATCH(&pname, &av_swfUrl))
@@ -223,10 +523,10 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
               if (pval.av_val)
                 {
                   AVal swfUrl = StripParams(&pval);
-                  RTMP_HashSWF(swfUrl.av_val, &server->rc.Link.SWFSize, (unsigned char *) server->rc.Link.SWFHash, 30);
+                  RTMP_HashSWF(swfUrl.av_val, &sess->rc.Link.SWFSize, (unsigned char *) sess->rc.Link.SWFHash, 30);
                 }
 #endif
-              server->rc.Link.swfUrl = AVcopy(pval);
+              sess->rc.Link.swfUrl = AVcopy(pval);
               pval.av_val = NULL;
             }
           else if (AVMATCH(&pname, &av_tcUrl))
@@ -234,7 +534,7 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
               char *r1 = NULL, *r2;
               int len;
 
-              server->rc.Link.tcUrl = AVcopy(pval);
+              sess->rc.Link.tcUrl = AVcopy(pval);
               if ((pval.av_val[0] | 0x40) == 'r' &&
                   (pval.av_val[1] | 0x40) == 't' &&
                   (pval.av_val[2] | 0x40) == 'm' &&
@@ -242,12 +542,12 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
                 {
                   if (pval.av_val[4] == ':')
                     {
-                      server->rc.Link.protocol = RTMP_PROTOCOL_RTMP;
+                      sess->rc.Link.protocol = RTMP_PROTOCOL_RTMP;
                       r1 = pval.av_val+7;
                     }
                   else if ((pval.av_val[4] | 0x40) == 'e' && pval.av_val[5] == ':')
                     {
-                      server->rc.Link.protocol = RTMP_PROTOCOL_RTMPE;
+                      sess->rc.Link.protocol = RTMP_PROTOCOL_RTMPE;
                       r1 = pval.av_val+8;
                     }
                   r2 = strchr(r1, '/');
@@ -258,39 +558,39 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
                   r2 = malloc(len+1);
                   memcpy(r2, r1, len);
                   r2[len] = '\0';
-                  server->rc.Link.hostname.av_val = r2;
+                  sess->rc.Link.hostname.av_val = r2;
                   r1 = strrchr(r2, ':');
                   if (r1)
                     {
-		      server->rc.Link.hostname.av_len = r1 - r2;
+		      sess->rc.Link.hostname.av_len = r1 - r2;
                       *r1++ = '\0';
-                      server->rc.Link.port = atoi(r1);
+                      sess->rc.Link.port = atoi(r1);
                     }
                   else
                     {
-		      server->rc.Link.hostname.av_len = len;
-                      server->rc.Link.port = 1935;
+		      sess->rc.Link.hostname.av_len = len;
+                      sess->rc.Link.port = 1935;
                     }
                 }
               pval.av_val = NULL;
             }
           else if (AVMATCH(&pname, &av_pageUrl))
             {
-              server->rc.Link.pageUrl = AVcopy(pval);
+              sess->rc.Link.pageUrl = AVcopy(pval);
               pval.av_val = NULL;
             }
           else if (AVMATCH(&pname, &av_audioCodecs))
             {
-              server->rc.m_fAudioCodecs = cobj.o_props[i].p_vu.p_number;
+              sess->rc.m_fAudioCodecs = cobj.o_props[i].p_vu.p_number;
             }
           else if (AVMATCH(&pname, &av_videoCodecs))
             {
-              server->rc.m_fVideoCodecs = cobj.o_props[i].p_vu.p_number;
+              sess->rc.m_fVideoCodecs = cobj.o_props[i].p_vu.p_number;
             }
           else if (AVMATCH(&pname, &av_objectEncoding))
             {
-              server->rc.m_fEncoding = cobj.o_props[i].p_vu.p_number;
-              server->rc.m_bSendEncoding = TRUE;
+              sess->rc.m_fEncoding = cobj.o_props[i].p_vu.p_number;
+              sess->rc.m_bSendEncoding = TRUE;
             }
           /* Dup'd a string we didn't recognize? */
           if (pval.av_val)
@@ -300,37 +600,40 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
       if (obj.o_num > 3)
         {
           int i = obj.o_num - 3;
-          server->rc.Link.extras.o_num = i;
-          server->rc.Link.extras.o_props = malloc(i * sizeof (AMFObjectProperty));
-          memcpy(server->rc.Link.extras.o_props, obj.o_props + 3, i * sizeof (AMFObjectProperty));
+          sess->rc.Link.extras.o_num = i;
+          sess->rc.Link.extras.o_props = malloc(i * sizeof (AMFObjectProperty));
+          memcpy(sess->rc.Link.extras.o_props, obj.o_props + 3, i * sizeof (AMFObjectProperty));
           obj.o_num = 3;
         }
 
-      if (server->rc.Link.extras.o_num)
+      if (sess->rc.Link.extras.o_num)
         {
-          server->rc.Link.Extras.av_val = calloc(2048, sizeof (char));
-          dumpAMF(&server->rc.Link.extras, server->rc.Link.Extras.av_val);
-          server->rc.Link.Extras.av_len = strlen(server->rc.Link.Extras.av_val);
+          sess->rc.Link.Extras.av_val = calloc(2048, sizeof (char));
+          dumpAMF(&sess->rc.Link.extras, sess->rc.Link.Extras.av_val);
+          sess->rc.Link.Extras.av_len = strlen(sess->rc.Link.Extras.av_val);
         }
 
-      if (!RTMP_Connect(&server->rc, pack))
+      if (!RTMP_Connect(&sess->rc, pack))
         {
           /* failed */
           return 1;
         }
-      server->rc.m_bSendCounter = FALSE;
+      MutexLock(&sess->server->lock);
+      sess->rcSocket = sess->rc.m_sb.sb_socket;
+      MutexUnlock(&sess->server->lock);
+      sess->rc.m_bSendCounter = FALSE;
 
-      if (server->rc.Link.extras.o_props)
+      if (sess->rc.Link.extras.o_props)
         {
-          AMF_Reset(&server->rc.Link.extras);
+          AMF_Reset(&sess->rc.Link.extras);
         }
     }
   else if (AVMATCH(&method, &av_NetStream_Authenticate_UsherToken))
     {
       AVal usherToken = {0};
       AMFProp_GetString(AMF_GetProp(&obj, NULL, 3), &usherToken);
-      server->rc.Link.usherToken = AVcopy(usherToken);
-      RTMP_LogPrintf("%10s : %.*s\n", "usherToken", server->rc.Link.usherToken.av_len, server->rc.Link.usherToken.av_val);
+      sess->rc.Link.usherToken = AVcopy(usherToken);
+      RTMP_LogPrintf("%10s : %.*s\n", "usherToken", sess->rc.Link.usherToken.av_len, sess->rc.Link.usherToken.av_val);
     }
   else if (AVMATCH(&method, &av_play2))
     {
@@ -364,9 +667,9 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
        };
       int count = 0, flen;
 
-      server->rc.m_stream_id = pack->m_nInfoField2;
+      sess->rc.m_stream_id = pack->m_nInfoField2;
       AMFProp_GetString(AMF_GetProp(&obj, NULL, 3), &av);
-      server->rc.Link.playpath = av;
+      sess->rc.Link.playpath = av;
       if (!av.av_val)
         goto out;
 
@@ -374,12 +677,12 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
       AMFObjectProperty *Start = AMF_GetProp(&obj, NULL, 4);
       if (!(Start->p_type == AMF_INVALID))
         StartFlag = AMFProp_GetNumber(Start);
-      if (StartFlag == -1000 || (server->rc.Link.app.av_val && strstr(server->rc.Link.app.av_val, "live")))
+      if (StartFlag == -1000 || (sess->rc.Link.app.av_val && strstr(sess->rc.Link.app.av_val, "live")))
         StartFlag = -1000;
       RTMP_LogPrintf("%10s : %s\n", "live", (StartFlag == -1000) ? "yes" : "no");
 
       /* check for duplicates */
-      for (fl = server->f_head; fl; fl=fl->f_next)
+      for (fl = sess->f_head; fl; fl=fl->f_next)
         {
           if (AVMATCH(&av, &fl->f_path))
             count++;
@@ -471,8 +774,11 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
       *pfilename++ = '\0';
       file = filename;
 
-      RTMP_LogPrintf("%10s : %.*s\n%10s : %s\n", "Playpath", server->rc.Link.playpath.av_len,
-                     server->rc.Link.playpath.av_val, "Saving as", file);
+      MutexLock(&fileLock);
+      file = UniqueName(file);
+
+      RTMP_LogPrintf("%10s : %.*s\n%10s : %s\n", "Playpath", sess->rc.Link.playpath.av_len,
+                     sess->rc.Link.playpath.av_val, "Saving as", file);
 
       /* Save command to text file */
       char *cmd = NULL, *ptr = NULL;
@@ -480,18 +786,18 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
 
       cmd = calloc(4096, sizeof (char));
       ptr = cmd;
-      tcUrl = StripParams(&server->rc.Link.tcUrl);
-      swfUrl = StripParams(&server->rc.Link.swfUrl);
+      tcUrl = StripParams(&sess->rc.Link.tcUrl);
+      swfUrl = StripParams(&sess->rc.Link.swfUrl);
       ptr += sprintf(ptr, "rtmpdump -r \"%.*s\" -a \"%.*s\" -f \"%.*s\" -W \"%.*s\" -p \"%.*s\"",
                      tcUrl.av_len, tcUrl.av_val,
-                     server->rc.Link.app.av_len, server->rc.Link.app.av_val,
-                     server->rc.Link.flashVer.av_len, server->rc.Link.flashVer.av_val,
+                     sess->rc.Link.app.av_len, sess->rc.Link.app.av_val,
+                     sess->rc.Link.flashVer.av_len, sess->rc.Link.flashVer.av_val,
                      swfUrl.av_len, swfUrl.av_val,
-                     server->rc.Link.pageUrl.av_len, server->rc.Link.pageUrl.av_val);
+                     sess->rc.Link.pageUrl.av_len, sess->rc.Link.pageUrl.av_val);
 
-      if (server->rc.Link.usherToken.av_val)
+      if (sess->rc.Link.usherToken.av_val)
         {
-          char *usherToken = strreplace(server->rc.Link.usherToken.av_val, server->rc.Link.usherToken.av_len, "\"", "\\\"", TRUE);
+          char *usherToken = strreplace(sess->rc.Link.usherToken.av_val, sess->rc.Link.usherToken.av_len, "\"", "\\\"", TRUE);
 #ifdef WIN32
           usherToken = strreplace(usherToken, 0, "^", "^^", TRUE);
           usherToken = strreplace(usherToken, 0, "|", "^|", TRUE);
@@ -500,14 +806,14 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
           free(usherToken);
         }
 
-      if (server->rc.Link.Extras.av_len)
+      if (sess->rc.Link.Extras.av_len)
         {
-          ptr += sprintf(ptr, "%.*s", server->rc.Link.Extras.av_len, server->rc.Link.Extras.av_val);
+          ptr += sprintf(ptr, "%.*s", sess->rc.Link.Extras.av_len, sess->rc.Link.Extras.av_val);
         }
 
       if (StartFlag == -1000)
         ptr += sprintf(ptr, "%s", " --live");
-      ptr += sprintf(ptr, " -y \"%.*s\"", server->rc.Link.playpath.av_len, server->rc.Link.playpath.av_val);
+      ptr += sprintf(ptr, " -y \"%.*s\"", sess->rc.Link.playpath.av_len, sess->rc.Link.playpath.av_val);
       ptr += sprintf(ptr, " -o \"%s\"\n", file);
 
       FILE *cmdfile = fopen("Command.txt", "a");
@@ -516,13 +822,14 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
       free(cmd);
 
       out = fopen(file, "wb");
+      MutexUnlock(&fileLock);
       free(file);
       if (!out)
         ret = 1;
       else
         {
-          fwrite(flvHeader, 1, sizeof(flvHeader), out);
-          av = server->rc.Link.playpath;
+          CapturePut(sess, out, flvHeader, sizeof(flvHeader));
+          av = sess->rc.Link.playpath;
           fl = malloc(sizeof(Flist)+av.av_len+1);
           fl->f_file = out;
           fl->f_path.av_len = av.av_len;
@@ -530,11 +837,11 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
           memcpy(fl->f_path.av_val, av.av_val, av.av_len);
           fl->f_path.av_val[av.av_len] = '\0';
           fl->f_next = NULL;
-          if (server->f_tail)
-            server->f_tail->f_next = fl;
+          if (sess->f_tail)
+            sess->f_tail->f_next = fl;
           else
-            server->f_head = fl;
-          server->f_tail = fl;
+            sess->f_head = fl;
+          sess->f_tail = fl;
         }
     }
   else if (AVMATCH(&method, &av_onStatus))
@@ -557,17 +864,17 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
       if (AVMATCH(&code, &av_NetStream_Play_Start))
 	{
           /* set up the next stream */
-          if (server->f_cur)
+          if (sess->f_cur)
 		    {
-		      if (server->f_cur->f_next)
-                server->f_cur = server->f_cur->f_next;
+		      if (sess->f_cur->f_next)
+                sess->f_cur = sess->f_cur->f_next;
 			}
           else
             {
-              for (server->f_cur = server->f_head; server->f_cur &&
-                    !server->f_cur->f_file; server->f_cur = server->f_cur->f_next) ;
+              for (sess->f_cur = sess->f_head; sess->f_cur &&
+                    !sess->f_cur->f_file; sess->f_cur = sess->f_cur->f_next) ;
             }
-	  server->rc.m_bPlaying = TRUE;
+	  sess->rc.m_bPlaying = TRUE;
 	}
 
       // Return 1 if this is a Play.Complete or Play.Stop
@@ -583,7 +890,7 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
     }
   else if (AVMATCH(&method, &av_close))
     {
-      RTMP_Close(&server->rc);
+      SessionClose(sess, &sess->rc);
       ret = 1;
     }
 out:
@@ -592,7 +899,7 @@ out:
 }
 
 int
-ServePacket(STREAMING_SERVER *server, int which, RTMPPacket *packet)
+ServePacket(SESSION *sess, int which, RTMPPacket *packet)
 {
   int ret = 0;
 
@@ -646,7 +953,7 @@ ServePacket(STREAMING_SERVER *server, int which, RTMPPacket *packet)
     case RTMP_PACKET_TYPE_FLEX_MESSAGE:
       // flex message
       {
-	ret = ServeInvoke(server, which, packet, packet->m_body + 1);
+	ret = ServeInvoke(sess, which, packet, packet->m_body + 1);
 	break;
       }
     case RTMP_PACKET_TYPE_INFO:
@@ -659,7 +966,7 @@ ServePacket(STREAMING_SERVER *server, int which, RTMPPacket *packet)
 
     case RTMP_PACKET_TYPE_INVOKE:
       // invoke
-      ret = ServeInvoke(server, which, packet, packet->m_body);
+      ret = ServeInvoke(sess, which, packet, packet->m_body);
       break;
 
     case RTMP_PACKET_TYPE_FLASH_VIDEO:
@@ -859,8 +1166,7 @@ controlServerThread(void *unused)
 	{
 	case 'q':
 	  RTMP_LogPrintf("Exiting\n");
-          if (rtmpServer)
-            stopStreaming(rtmpServer);
+	  stopRequested = TRUE;
 	  break;
 	default:
 	  RTMP_LogPrintf("Unknown command \'%c\', ignoring\n", ich);
@@ -875,113 +1181,752 @@ controlServerThread(void *unused)
   TFRET();
 }
 
-TFTYPE doServe(void *arg)	// server socket and state (our listening socket)
+#define RELAY_PEEK	64	/* control messages are looked at before going out */
+
+static unsigned char *
+RelayFlags(RELAY *rl, int channel)
 {
-  STREAMING_SERVER *server = arg;
-  RTMPPacket pc = { 0 }, ps = { 0 };
-  RTMPChunk rk = { 0 };
-  char *buf = NULL;
-  unsigned int buflen = 131072;
-  int paused = FALSE;
-  int sockfd = server->socket;
+  if (channel >= rl->nFlags)
+    {
+      int n = channel < RTMP_DENSE_CHANNELS ? RTMP_DENSE_CHANNELS : channel + 1;
+      unsigned char *flags = realloc(rl->flags, n);
+
+      if (!flags)
+	return NULL;
+      memset(flags + rl->nFlags, 0, n - rl->nFlags);
+      rl->flags = flags;
+      rl->nFlags = n;
+    }
+  return &rl->flags[channel];
+}
 
-  // timeout for http requests
-  fd_set rfds;
-  struct timeval tv;
+/* The peer got a message from the proxy itself, its idea of the chunk
+ * streams can't be trusted anymore.
+ */
+static void
+RelayReset(RELAY *rl)
+{
+  int i;
+
+  for (i = 0; i < rl->nFlags; i++)
+    rl->flags[i] &= RELAY_DROP | RELAY_HOLD;
+}
+
+/* Queue n bytes for the peer. Input that goes out unchanged stays where
+ * it was read, so the usual case costs no copy at all.
+ */
+static int
+RelayEmit(RELAY *rl, char *ptr, int n, int bCopy)
+{
+  if (!bCopy && !rl->outLen
+      && (!rl->spanLen || ptr == rl->span + rl->spanLen))
+    {
+      if (!rl->spanLen)
+	rl->span = ptr;
+      rl->spanLen += n;
+      return TRUE;
+    }
+
+  if (rl->outLen + rl->spanLen + n > rl->outSize)
+    {
+      int size = rl->outSize ? rl->outSize : 4096;
+      char *out;
+
+      while (size < rl->outLen + rl->spanLen + n)
+	size *= 2;
+      out = realloc(rl->out, size);
+      if (!out)
+	return FALSE;
+      rl->out = out;
+      rl->outSize = size;
+    }
+  if (rl->spanLen)
+    {
+      memcpy(rl->out + rl->outLen, rl->span, rl->spanLen);
+      rl->outLen += rl->spanLen;
+      rl->spanLen = 0;
+    }
+  memcpy(rl->out + rl->outLen, ptr, n);
+  rl->outLen += n;
+  return TRUE;
+}
+
+static void
+RelayFlush(SESSION *sess, RELAY *rl)
+{
+  char *ptr = rl->outLen ? rl->out : rl->span;
+  int n = rl->outLen ? rl->outLen : rl->spanLen;
 
-  server->state = STREAMING_IN_PROGRESS;
+  rl->outLen = rl->spanLen = 0;
 
-  memset(&tv, 0, sizeof(struct timeval));
-  tv.tv_sec = 5;
+  /* the server may still be captured after the client left */
+  if (!RTMP_IsConnected(rl->to))
+    return;
 
-  FD_ZERO(&rfds);
-  FD_SET(sockfd, &rfds);
+  while (n > 0)
+    {
+      int wrote = RTMP_SockSend(rl->to, ptr, n);
+
+      if (wrote < 0)
+	{
+	  int sockerr = GetSockError();
+
+	  if (sockerr == EINTR && !RTMP_ctrlC)
+	    continue;
+	  RTMP_Log(RTMP_LOGERROR, "%s, %s send error %d (%d bytes)", __FUNCTION__,
+	      cst[!rl->which], sockerr, n);
+	  SessionClose(sess, rl->to);
+	  return;
+	}
+      ptr += wrote;
+      n -= wrote;
+    }
+}
 
-  if (select(sockfd + 1, &rfds, NULL, NULL, &tv) <= 0)
+static char *
+RelayBasicHeader(char *ptr, int fmt, int channel)
+{
+  if (channel < 64)
+    {
+      *ptr++ = (fmt << 6) | channel;
+    }
+  else if (channel < 320)
     {
-      RTMP_Log(RTMP_LOGERROR, "Request timeout/select failed, ignoring request");
-      goto quit;
+      *ptr++ = fmt << 6;
+      *ptr++ = channel - 64;
     }
   else
     {
-      RTMP_Init(&server->rs);
-      RTMP_Init(&server->rc);
-      server->rs.m_sb.sb_socket = sockfd;
-      if (!RTMP_Serve(&server->rs))
-        {
-          RTMP_Log(RTMP_LOGERROR, "Handshake failed");
-          goto cleanup;
-        }
+      *ptr++ = (fmt << 6) | 1;
+      *ptr++ = (channel - 64) & 0xff;
+      *ptr++ = (channel - 64) >> 8;
+    }
+  return ptr;
+}
+
+/* A type 0 chunk header, which the peer decodes whatever it knows */
+static int
+RelayFullHeader(char *hbuf, int channel, int type, uint32_t ts,
+		uint32_t bodySize, int32_t streamId)
+{
+  char *hptr, *hend = hbuf + RTMP_MAX_HEADER_SIZE;
+
+  hptr = RelayBasicHeader(hbuf, 0, channel);
+  hptr = AMF_EncodeInt24(hptr, hend, ts >= 0xffffff ? 0xffffff : ts);
+  hptr = AMF_EncodeInt24(hptr, hend, bodySize);
+  *hptr++ = type;
+  *hptr++ = streamId & 0xff;
+  *hptr++ = (streamId >> 8) & 0xff;
+  *hptr++ = (streamId >> 16) & 0xff;
+  *hptr++ = (streamId >> 24) & 0xff;
+  if (ts >= 0xffffff)
+    hptr = AMF_EncodeInt32(hptr, hend, ts);
+  return hptr - hbuf;
+}
+
+/* what RTMP_SendPacket compresses against when the proxy talks */
+static void
+RelaySent(RELAY *rl, int channel, int fmt, int type, uint32_t ts,
+	  uint32_t bodySize, int32_t streamId)
+{
+  RTMPChunkState *out = RTMP_GetChunkState(rl->to, TRUE, channel);
+
+  if (out)
+    {
+      out->headerType = fmt;
+      out->type = type;
+      out->timestamp = ts;
+      out->streamId = streamId;
+      out->bodySize = bodySize;
+      out->bUsed = TRUE;
+    }
+}
+
+/* Send a message that was held back, whole and in chunks of the size
+ * the peer expects.
+ */
+static int
+RelayMessage(RELAY *rl, RTMPPacket *packet)
+{
+  char hbuf[RTMP_MAX_HEADER_SIZE];
+  char *ptr = packet->m_body;
+  int size = rl->to->m_outChunkSize;
+  int left = packet->m_nBodySize, n;
+
+  n = RelayFullHeader(hbuf, packet->m_nChannel, packet->m_packetType,
+		      packet->m_nTimeStamp, packet->m_nBodySize,
+		      packet->m_nInfoField2);
+  if (!RelayEmit(rl, hbuf, n, TRUE))
+    return FALSE;
+  while (left > 0)
+    {
+      if (ptr != packet->m_body
+	  && !RelayEmit(rl, hbuf, RelayBasicHeader(hbuf, 3, packet->m_nChannel) - hbuf, TRUE))
+	return FALSE;
+      n = left < size ? left : size;
+      if (!RelayEmit(rl, ptr, n, TRUE))
+	return FALSE;
+      ptr += n;
+      left -= n;
+    }
+  rl->flags[packet->m_nChannel] = RELAY_FIELDS;
+  RelaySent(rl, packet->m_nChannel, 0, packet->m_packetType,
+	    packet->m_nTimeStamp, packet->m_nBodySize, packet->m_nInfoField2);
+  return TRUE;
+}
+
+/* Whether the message starting with this chunk is kept from the peer.
+ * body holds len bytes of it.
+ */
+static int
+RelayDrop(SESSION *sess, RELAY *rl, int type, uint32_t ts, char *body, int len)
+{
+  if (rl->which == 0)
+    return FALSE;
+
+  if (sess->paused)
+    {
+      if (ts <= sess->rc.m_mediaStamp)
+	return TRUE;
+      sess->paused = FALSE;
+      sess->rc.m_pausing = 0;
+    }
+
+  /* SWFverification */
+  if (type == RTMP_PACKET_TYPE_CONTROL && len >= 2
+      && AMF_DecodeInt16(body) == 0x1a)
+    {
+#ifdef CRYPTO
+      if (sess->rc.Link.SWFSize)
+	{
+	  RTMP_SendCtrl(&sess->rc, 0x1b, 0, 0);
+	  RelayReset(&sess->relay[0]);
+	  return TRUE;
+	}
+#else
+      /* The session will certainly fail right after this */
+      RTMP_Log(RTMP_LOGERROR, "%s, server requested SWF verification, need CRYPTO support! ", __FUNCTION__);
+#endif
+    }
+  return FALSE;
+}
+
+/* Parse the chunk header at ptr and pass it on, or what the peer needs
+ * instead. Returns the size of the header, 0 if it isn't all there yet,
+ * -1 on error.
+ */
+static int
+RelayStart(SESSION *sess, RELAY *rl, char *ptr, int avail)
+{
+  static const int fieldSize[] = { 11, 7, 3, 0 };
+  uint8_t *hdr = (uint8_t *)ptr;
+  int fmt = hdr[0] >> 6, channel = hdr[0] & 0x3f;
+  int hSize = 1, nSize = fieldSize[fmt], chunk;
+  int type, bAbs, start;
+  uint32_t ts, bodySize, bytesRead;
+  int32_t streamId;
+  RTMPChunkState *cs;
+  unsigned char *flags;
+
+  if (channel < 2)
+    {
+      hSize += channel + 1;
+      if (avail < hSize)
+	return 0;
+      channel = 64 + hdr[1] + (channel ? hdr[2] << 8 : 0);
+    }
+  if (avail < hSize + nSize)
+    return 0;
+
+  cs = RTMP_GetChunkState(rl->from, FALSE, channel);
+  flags = RelayFlags(rl, channel);
+  if (!cs || !flags)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, no memory for chunk stream %d",
+	  __FUNCTION__, channel);
+      return -1;
+    }
+
+  /* what the header leaves out is as in the last one, like RTMP_ReadPacket */
+  type = cs->type;
+  bAbs = fmt == 0 ? TRUE : cs->bAbsTimestamp;
+  ts = cs->timestamp;
+  streamId = cs->streamId;
+  bodySize = cs->bodySize;
+  bytesRead = cs->bytesRead;
+
+  if (nSize >= 3)
+    {
+      ts = AMF_DecodeInt24(ptr + hSize);
+      if (nSize >= 6)
+	{
+	  bodySize = AMF_DecodeInt24(ptr + hSize + 3);
+	  bytesRead = 0;
+	  if (nSize > 6)
+	    {
+	      type = hdr[hSize + 6];
+	      if (nSize == 11)
+		streamId = hdr[hSize + 7] | (hdr[hSize + 8] << 8)
+		  | (hdr[hSize + 9] << 16) | (hdr[hSize + 10] << 24);
+	    }
+	}
+      if (ts == 0xffffff)
+	{
+	  if (avail < hSize + nSize + 4)
+	    return 0;
+	  ts = AMF_DecodeInt32(ptr + hSize + nSize);
+	  nSize += 4;
+	}
+    }
+  hSize += nSize;
+
+  if (bytesRead > bodySize)
+    bytesRead = bodySize;
+  chunk = bodySize - bytesRead;
+  if (chunk > rl->from->m_inChunkSize)
+    chunk = rl->from->m_inChunkSize;
+
+  /* have all of a small control message before deciding on it */
+  if (type == RTMP_PACKET_TYPE_CONTROL && chunk <= RELAY_PEEK
+      && avail < hSize + chunk)
+    return 0;
+
+  start = bytesRead == 0;
+  if (start && cs->body)
+    {
+      /* a new message in the middle of one, drop what we had */
+      free(cs->body - RTMP_MAX_HEADER_SIZE);
+      cs->body = NULL;
+    }
+
+  cs->headerType = start ? fmt : cs->headerType;
+  cs->type = type;
+  cs->bAbsTimestamp = bAbs;
+  cs->timestamp = ts;
+  cs->streamId = streamId;
+  cs->bodySize = bodySize;
+  cs->bytesRead = bytesRead;
+  cs->bUsed = TRUE;
+
+  if (start)
+    {
+      uint32_t abs = bAbs ? ts : cs->absTime + ts;
+      int bWant;
+
+      if (RelayDrop(sess, rl, type, abs, ptr + hSize, avail - hSize < chunk ? avail - hSize : chunk))
+	{
+	  *flags = RELAY_DROP;
+	}
+      else if (type == RTMP_PACKET_TYPE_FLEX_MESSAGE
+	       || type == RTMP_PACKET_TYPE_INVOKE
+	       || rl->from->m_inChunkSize != rl->to->m_outChunkSize)
+	{
+	  /* RelayDone() sends it */
+	  *flags |= RELAY_HOLD;
+	}
+      else
+	{
+	  /* the header goes as it is if the peer can decode it */
+	  if (fmt == 0 || (fmt < 3 && (*flags & RELAY_FIELDS))
+	      || (*flags & RELAY_DELTA))
+	    {
+	      if (!RelayEmit(rl, ptr, hSize, FALSE))
+		return -1;
+	      *flags = RELAY_FIELDS | RELAY_DELTA;
+	      RelaySent(rl, channel, fmt, type, abs, bodySize, streamId);
+	    }
+	  else
+	    {
+	      char hbuf[RTMP_MAX_HEADER_SIZE];
+
+	      if (!RelayEmit(rl, hbuf, RelayFullHeader(hbuf, channel, type, abs,
+		    bodySize, streamId), TRUE))
+		return -1;
+	      *flags = RELAY_FIELDS;
+	      RelaySent(rl, channel, 0, type, abs, bodySize, streamId);
+	    }
+	}
+
+      /* reassemble only what the proxy looks at */
+      switch (type)
+	{
+	case RTMP_PACKET_TYPE_CHUNK_SIZE:
+	case RTMP_PACKET_TYPE_FLEX_MESSAGE:
+	case RTMP_PACKET_TYPE_INVOKE:
+	  bWant = TRUE;
+	  break;
+	case RTMP_PACKET_TYPE_AUDIO:
+	case RTMP_PACKET_TYPE_VIDEO:
+	case RTMP_PACKET_TYPE_INFO:
+	case RTMP_PACKET_TYPE_FLASH_VIDEO:
+	  bWant = rl->which == 1 && sess->f_cur;
+	  break;
+	default:
+	  bWant = FALSE;
+	}
+      if ((bWant || (*flags & RELAY_HOLD)) && !(*flags & RELAY_DROP)
+	  && bodySize)
+	{
+	  RTMPPacket packet = { 0 };
+
+	  if (!RTMPPacket_Alloc(&packet, bodySize))
+	    {
+	      RTMP_Log(RTMP_LOGERROR, "%s, failed to allocate packet", __FUNCTION__);
+	      return -1;
+	    }
+	  cs->body = packet.m_body;
+	}
+
+      /* UpdateBufferMS, rewritten in place */
+      if (rl->which == 0 && type == RTMP_PACKET_TYPE_CONTROL
+	  && chunk >= 10 && chunk <= RELAY_PEEK
+	  && AMF_DecodeInt16(ptr + hSize) == 0x03)
+	{
+	  char *body = ptr + hSize + 2;
+	  int id;
+	  int len;
+	  id = AMF_DecodeInt32(body);
+	  /* Assume the interesting media is on a non-zero stream */
+	  if (id)
+	    {
+	      len = AMF_DecodeInt32(body + 4);
+	      /* request a big buffer */
+	      if (len < BUFFERTIME)
+		{
+		  AMF_EncodeInt32(body + 4, body + 8, BUFFERTIME);
+		}
+	      RTMP_Log(RTMP_LOGDEBUG, "%s, client: BufferTime change in stream %d to %d", __FUNCTION__,
+		  id, len);
+	    }
+	}
+    }
+  /* a message that passes through keeps its chunks */
+  else if (!(*flags & (RELAY_DROP | RELAY_HOLD)))
+    {
+      if (!RelayEmit(rl, ptr, hSize, FALSE))
+	return -1;
+    }
+
+  rl->channel = channel;
+  rl->chunkLeft = chunk;
+  return hSize;
+}
+
+/* A whole message has been read, act on it like the packet loop does */
+static int
+RelayDone(SESSION *sess, RELAY *rl, char **buf, unsigned int *buflen)
+{
+  RTMPChunkState *cs = RTMP_GetChunkState(rl->from, FALSE, rl->channel);
+  RTMPPacket packet = { 0 };
+  int flags = rl->flags[rl->channel];
+
+  packet.m_headerType = cs->headerType;
+  packet.m_packetType = cs->type;
+  packet.m_hasAbsTimestamp = cs->bAbsTimestamp;
+  packet.m_nChannel = rl->channel;
+  packet.m_nTimeStamp = cs->bAbsTimestamp ? cs->timestamp
+    : cs->absTime + cs->timestamp;
+  packet.m_nInfoField2 = cs->streamId;
+  packet.m_nBodySize = cs->bodySize;
+  packet.m_nBytesRead = cs->bytesRead;
+  packet.m_body = cs->body;
+
+  cs->absTime = packet.m_nTimeStamp;
+  cs->body = NULL;
+  cs->bytesRead = 0;
+  cs->bAbsTimestamp = FALSE;
+  rl->flags[rl->channel] &= ~(RELAY_DROP | RELAY_HOLD);
+
+  /* the proxy acts on a command before it goes out, it may change it */
+  if (packet.m_body && (packet.m_packetType == RTMP_PACKET_TYPE_FLEX_MESSAGE
+			|| packet.m_packetType == RTMP_PACKET_TYPE_INVOKE))
+    {
+      if (ServePacket(sess, rl->which, &packet) && sess->f_cur)
+	{
+	  CapturePut(sess, sess->f_cur->f_file, NULL, 0);
+	  sess->f_cur->f_file = NULL;
+	  sess->f_cur = NULL;
+	}
+    }
+  if ((flags & (RELAY_HOLD | RELAY_DROP)) == RELAY_HOLD
+      && !RelayMessage(rl, &packet))
+    {
+      RTMPPacket_Free(&packet);
+      return FALSE;
+    }
+
+  if (!packet.m_body)
+    return TRUE;
+
+  if (packet.m_packetType == RTMP_PACKET_TYPE_CHUNK_SIZE)
+    {
+      if (packet.m_nBodySize >= 4)
+	{
+	  rl->from->m_inChunkSize = AMF_DecodeInt32(packet.m_body);
+	  RTMP_Log(RTMP_LOGDEBUG, "%s, %s: chunk size change to %d", __FUNCTION__,
+	      cst[rl->which], rl->from->m_inChunkSize);
+	  rl->to->m_outChunkSize = rl->from->m_inChunkSize;
+	}
+    }
+  else if (packet.m_packetType != RTMP_PACKET_TYPE_FLEX_MESSAGE
+	   && packet.m_packetType != RTMP_PACKET_TYPE_INVOKE
+	   && sess->f_cur && RTMP_ClientPacket(&sess->rc, &packet))
+    {
+      int len = WriteStream(buf, buflen, &sess->stamp, &packet);
+      if (len > 0)
+	CapturePut(sess, sess->f_cur->f_file, *buf, len);
+    }
+  RTMPPacket_Free(&packet);
+  return TRUE;
+}
+
+/* Pass on what has been read from one side. Returns FALSE if the session
+ * has to end.
+ */
+static int
+RelayChunks(SESSION *sess, RELAY *rl, char **buf, unsigned int *buflen)
+{
+  RTMPSockBuf *sb = &rl->from->m_sb;
+  char *ptr = sb->sb_start, *end = ptr + sb->sb_size;
+  int ret = TRUE;
+
+  while (ptr < end && ret)
+    {
+      RTMPChunkState *cs;
+      int n;
+
+      if (!rl->chunkLeft)
+	{
+	  n = RelayStart(sess, rl, ptr, end - ptr);
+	  if (n <= 0)
+	    {
+	      ret = n == 0;
+	      break;
+	    }
+	  ptr += n;
+	  cs = RTMP_GetChunkState(rl->from, FALSE, rl->channel);
+	  if (!rl->chunkLeft && cs->bytesRead >= cs->bodySize)
+	    ret = RelayDone(sess, rl, buf, buflen);
+	  continue;
+	}
+
+      cs = RTMP_GetChunkState(rl->from, FALSE, rl->channel);
+      n = rl->chunkLeft;
+      if (n > end - ptr)
+	n = end - ptr;
+      if (cs->body)
+	memcpy(cs->body + cs->bytesRead, ptr, n);
+      if (!(rl->flags[rl->channel] & (RELAY_DROP | RELAY_HOLD))
+	  && !RelayEmit(rl, ptr, n, FALSE))
+	ret = FALSE;
+      cs->bytesRead += n;
+      rl->chunkLeft -= n;
+      ptr += n;
+      if (!rl->chunkLeft && cs->bytesRead >= cs->bodySize && ret)
+	ret = RelayDone(sess, rl, buf, buflen);
+    }
+
+  /* the input must go out before the buffer is filled again */
+  RelayFlush(sess, rl);
+  sb->sb_start = ptr;
+  sb->sb_size = end - ptr;
+  return ret;
+}
+
+/* raw bytes can only be passed on unencrypted and outside of HTTP */
+static int
+RelayUsable(SESSION *sess)
+{
+  if (!RTMP_IsConnected(&sess->rc)
+      || (sess->rc.Link.protocol & RTMP_FEATURE_HTTP))
+    return FALSE;
+#ifdef CRYPTO
+  if (sess->rs.Link.rc4keyIn || sess->rc.Link.rc4keyIn)
+    return FALSE;
+#endif
+  return TRUE;
+}
+
+/* Relay mode: pass the bytes each side sends on as they arrive, until
+ * both sides are done. Returns FALSE on errors.
+ */
+static int
+RelayServe(SESSION *sess, char **buf, unsigned int *buflen)
+{
+  STREAMING_SERVER *server = sess->server;
+  int i;
+
+  sess->relay[0].from = &sess->rs;
+  sess->relay[0].to = &sess->rc;
+  sess->relay[0].which = 0;
+  sess->relay[1].from = &sess->rc;
+  sess->relay[1].to = &sess->rs;
+  sess->relay[1].which = 1;
+  for (i = 0; i < 2; i++)
+    if (sess->relay[i].from->m_inChunkSize != sess->relay[i].to->m_outChunkSize)
+      RTMP_Log(RTMP_LOGDEBUG, "%s, %s chunks of %d bytes go out as %d", __FUNCTION__,
+	  cst[i], sess->relay[i].from->m_inChunkSize, sess->relay[i].to->m_outChunkSize);
+
+  /* what came in along with the connect request */
+  for (i = 0; i < 2; i++)
+    if (sess->relay[i].from->m_sb.sb_size
+	&& !RelayChunks(sess, &sess->relay[i], buf, buflen))
+      return FALSE;
+
+  while ((RTMP_IsConnected(&sess->rs) || RTMP_IsConnected(&sess->rc))
+	 && server->state == STREAMING_ACCEPTING)
+    {
+      fd_set rfds;
+      struct timeval tv;
+      int n = 0;
+
+      FD_ZERO(&rfds);
+      for (i = 0; i < 2; i++)
+	if (RTMP_IsConnected(sess->relay[i].from))
+	  {
+	    int fd = sess->relay[i].from->m_sb.sb_socket;
+	    FD_SET(fd, &rfds);
+	    if (fd > n)
+	      n = fd;
+	  }
+
+      /* give more time to start up if we're not playing yet */
+      tv.tv_sec = sess->f_cur ? 30 : 60;
+      tv.tv_usec = 0;
+
+      if (select(n + 1, &rfds, NULL, NULL, &tv) <= 0)
+	{
+	  if (sess->f_cur && sess->rc.m_mediaChannel && !sess->paused)
+	    {
+	      sess->rc.m_pauseStamp = RTMP_GetChannelTime(&sess->rc, sess->rc.m_mediaChannel);
+	      if (RTMP_ToggleStream(&sess->rc))
+		{
+		  RelayReset(&sess->relay[0]);
+		  sess->paused = TRUE;
+		  continue;
+		}
+	    }
+	  RTMP_Log(RTMP_LOGERROR, "Request timeout/select failed, ignoring request");
+	  return FALSE;
+	}
+
+      for (i = 0; i < 2; i++)
+	{
+	  RELAY *rl = &sess->relay[i];
+
+	  if (!RTMP_IsConnected(rl->from)
+	      || !FD_ISSET(rl->from->m_sb.sb_socket, &rfds))
+	    continue;
+	  if (RTMP_SockFill(rl->from) <= 0)
+	    {
+	      RTMP_Log(RTMP_LOGDEBUG, "%s, %s closed the connection", __FUNCTION__,
+		  cst[i]);
+	      SessionClose(sess, rl->from);
+	      continue;
+	    }
+	  if (!RelayChunks(sess, rl, buf, buflen))
+	    return FALSE;
+	}
+
+      if (!RTMP_IsConnected(&sess->rs) && RTMP_IsConnected(&sess->rc)
+	  && !sess->f_cur)
+	SessionClose(sess, &sess->rc);
     }
+  return TRUE;
+}
+
+TFTYPE doServe(void *arg)	// the session of an accepted connection
+{
+  SESSION *sess = arg;
+  STREAMING_SERVER *server = sess->server;
+  SESSION **prev;
+  RTMPPacket pc = { 0 }, ps = { 0 };
+  RTMPChunk rk = { 0 };
+  char *buf = NULL;
+  unsigned int buflen = 131072;
+  int sockfd = sess->socket;
+  fd_set rfds;
+  struct timeval tv;
+
+  /* the client's handshake is done already, see ServeReady() */
+  RTMP_Init(&sess->rc);
 
   buf = malloc(buflen);
 
   /* Just process the Connect request */
-  while (RTMP_IsConnected(&server->rs) && RTMP_ReadPacket(&server->rs, &ps))
+  while (RTMP_IsConnected(&sess->rs) && RTMP_ReadPacket(&sess->rs, &ps))
     {
       if (!RTMPPacket_IsReady(&ps))
         continue;
-      ServePacket(server, 0, &ps);
+      ServePacket(sess, 0, &ps);
       RTMPPacket_Free(&ps);
-      if (RTMP_IsConnected(&server->rc))
+      if (RTMP_IsConnected(&sess->rc))
         break;
     }
 
   pc.m_chunk = &rk;
 
   /* We have our own timeout in select() */
-  server->rc.Link.timeout = 10;
-  server->rs.Link.timeout = 10;
-  while (RTMP_IsConnected(&server->rs) || RTMP_IsConnected(&server->rc))
+  sess->rc.Link.timeout = 10;
+  sess->rs.Link.timeout = 10;
+
+  if (relayMode && RelayUsable(sess))
+    {
+      RelayServe(sess, &buf, &buflen);
+      goto cleanup;
+    }
+
+  while ((RTMP_IsConnected(&sess->rs) || RTMP_IsConnected(&sess->rc))
+	 && server->state == STREAMING_ACCEPTING)
     {
       int n;
       int sr, cr;
 
-      cr = server->rc.m_sb.sb_size;
-      sr = server->rs.m_sb.sb_size;
+      cr = sess->rc.m_sb.sb_size;
+      sr = sess->rs.m_sb.sb_size;
 
       if (cr || sr)
         {
         }
       else
         {
-          n = server->rs.m_sb.sb_socket;
-	  if (server->rc.m_sb.sb_socket > n)
-	    n = server->rc.m_sb.sb_socket;
+          n = sess->rs.m_sb.sb_socket;
+	  if (sess->rc.m_sb.sb_socket > n)
+	    n = sess->rc.m_sb.sb_socket;
 	  FD_ZERO(&rfds);
-	  if (RTMP_IsConnected(&server->rs))
+	  if (RTMP_IsConnected(&sess->rs))
 	    FD_SET(sockfd, &rfds);
-	  if (RTMP_IsConnected(&server->rc))
-	    FD_SET(server->rc.m_sb.sb_socket, &rfds);
+	  if (RTMP_IsConnected(&sess->rc))
+	    FD_SET(sess->rc.m_sb.sb_socket, &rfds);
 
           /* give more time to start up if we're not playing yet */
-	  tv.tv_sec = server->f_cur ? 30 : 60;
+	  tv.tv_sec = sess->f_cur ? 30 : 60;
 	  tv.tv_usec = 0;
 
 	  if (select(n + 1, &rfds, NULL, NULL, &tv) <= 0)
 	    {
-              if (server->f_cur && server->rc.m_mediaChannel && !paused)
+              if (sess->f_cur && sess->rc.m_mediaChannel && !sess->paused)
                 {
-                  server->rc.m_pauseStamp = server->rc.m_channelTimestamp[server->rc.m_mediaChannel];
-                  if (RTMP_ToggleStream(&server->rc))
+                  sess->rc.m_pauseStamp = RTMP_GetChannelTime(&sess->rc, sess->rc.m_mediaChannel);
+                  if (RTMP_ToggleStream(&sess->rc))
                     {
-                      paused = TRUE;
+                      sess->paused = TRUE;
                       continue;
                     }
                 }
 	      RTMP_Log(RTMP_LOGERROR, "Request timeout/select failed, ignoring request");
 	      goto cleanup;
 	    }
-          if (server->rs.m_sb.sb_socket > 0 &&
-	    FD_ISSET(server->rs.m_sb.sb_socket, &rfds))
+          if (sess->rs.m_sb.sb_socket > 0 &&
+	    FD_ISSET(sess->rs.m_sb.sb_socket, &rfds))
             sr = 1;
-          if (server->rc.m_sb.sb_socket > 0 &&
-	    FD_ISSET(server->rc.m_sb.sb_socket, &rfds))
+          if (sess->rc.m_sb.sb_socket > 0 &&
+	    FD_ISSET(sess->rc.m_sb.sb_socket, &rfds))
             cr = 1;
         }
       if (sr)
         {
-          while (RTMP_ReadPacket(&server->rs, &ps))
+          while (RTMP_ReadPacket(&sess->rs, &ps))
             if (RTMPPacket_IsReady(&ps))
               {
                 /* change chunk size */
@@ -989,10 +1934,10 @@ TFTYPE doServe(void *arg)	// server socket and state (our listening socket)
                   {
                     if (ps.m_nBodySize >= 4)
                       {
-                        server->rs.m_inChunkSize = AMF_DecodeInt32(ps.m_body);
+                        sess->rs.m_inChunkSize = AMF_DecodeInt32(ps.m_body);
                         RTMP_Log(RTMP_LOGDEBUG, "%s, client: chunk size change to %d", __FUNCTION__,
-                            server->rs.m_inChunkSize);
-                        server->rc.m_outChunkSize = server->rs.m_inChunkSize;
+                            sess->rs.m_inChunkSize);
+                        sess->rc.m_outChunkSize = sess->rs.m_inChunkSize;
                       }
                   }
                 /* bytes received */
@@ -1035,41 +1980,41 @@ TFTYPE doServe(void *arg)	// server socket and state (our listening socket)
                 else if (ps.m_packetType == RTMP_PACKET_TYPE_FLEX_MESSAGE
                          || ps.m_packetType == RTMP_PACKET_TYPE_INVOKE)
                   {
-                    if (ServePacket(server, 0, &ps) && server->f_cur)
+                    if (ServePacket(sess, 0, &ps) && sess->f_cur)
                       {
-                        fclose(server->f_cur->f_file);
-                        server->f_cur->f_file = NULL;
-                        server->f_cur = NULL;
+                        CapturePut(sess, sess->f_cur->f_file, NULL, 0);
+                        sess->f_cur->f_file = NULL;
+                        sess->f_cur = NULL;
                       }
                   }
-                RTMP_SendPacket(&server->rc, &ps, FALSE);
+                RTMP_SendPacket(&sess->rc, &ps, FALSE);
                 RTMPPacket_Free(&ps);
                 break;
               }
         }
       if (cr)
         {
-          while (RTMP_ReadPacket(&server->rc, &pc))
+          while (RTMP_ReadPacket(&sess->rc, &pc))
             {
               int sendit = 1;
               if (RTMPPacket_IsReady(&pc))
                 {
-                  if (paused)
+                  if (sess->paused)
                     {
-                      if (pc.m_nTimeStamp <= server->rc.m_mediaStamp)
+                      if (pc.m_nTimeStamp <= sess->rc.m_mediaStamp)
                         continue;
-                      paused = 0;
-                      server->rc.m_pausing = 0;
+                      sess->paused = 0;
+                      sess->rc.m_pausing = 0;
                     }
                   /* change chunk size */
                   if (pc.m_packetType == RTMP_PACKET_TYPE_CHUNK_SIZE)
                     {
                       if (pc.m_nBodySize >= 4)
                         {
-                          server->rc.m_inChunkSize = AMF_DecodeInt32(pc.m_body);
+                          sess->rc.m_inChunkSize = AMF_DecodeInt32(pc.m_body);
                           RTMP_Log(RTMP_LOGDEBUG, "%s, server: chunk size change to %d", __FUNCTION__,
-                              server->rc.m_inChunkSize);
-                          server->rs.m_outChunkSize = server->rc.m_inChunkSize;
+                              sess->rc.m_inChunkSize);
+                          sess->rs.m_outChunkSize = sess->rc.m_inChunkSize;
                         }
                     }
                   else if (pc.m_packetType == RTMP_PACKET_TYPE_CONTROL)
@@ -1078,9 +2023,9 @@ TFTYPE doServe(void *arg)	// server socket and state (our listening socket)
                       /* SWFverification */
                       if (nType == 0x1a)
 #ifdef CRYPTO
-                        if (server->rc.Link.SWFSize)
+                        if (sess->rc.Link.SWFSize)
                         {
-                          RTMP_SendCtrl(&server->rc, 0x1b, 0, 0);
+                          RTMP_SendCtrl(&sess->rc, 0x1b, 0, 0);
                           sendit = 0;
                         }
 #else
@@ -1088,154 +2033,164 @@ TFTYPE doServe(void *arg)	// server socket and state (our listening socket)
                         RTMP_Log(RTMP_LOGERROR, "%s, server requested SWF verification, need CRYPTO support! ", __FUNCTION__);
 #endif
                     }
-                  else if (server->f_cur && (
+                  else if (sess->f_cur && (
                        pc.m_packetType == RTMP_PACKET_TYPE_AUDIO ||
                        pc.m_packetType == RTMP_PACKET_TYPE_VIDEO ||
                        pc.m_packetType == RTMP_PACKET_TYPE_INFO ||
                        pc.m_packetType == RTMP_PACKET_TYPE_FLASH_VIDEO) &&
-                       RTMP_ClientPacket(&server->rc, &pc))
+                       RTMP_ClientPacket(&sess->rc, &pc))
                     {
-                      int len = WriteStream(&buf, &buflen, &server->stamp, &pc);
-                      if (len > 0 && fwrite(buf, 1, len, server->f_cur->f_file) != len)
-                        goto cleanup;
+                      int len = WriteStream(&buf, &buflen, &sess->stamp, &pc);
+                      if (len > 0)
+                        CapturePut(sess, sess->f_cur->f_file, buf, len);
                     }
                   else if (pc.m_packetType == RTMP_PACKET_TYPE_FLEX_MESSAGE ||
                            pc.m_packetType == RTMP_PACKET_TYPE_INVOKE)
                     {
-                      if (ServePacket(server, 1, &pc) && server->f_cur)
+                      if (ServePacket(sess, 1, &pc) && sess->f_cur)
                         {
-                          fclose(server->f_cur->f_file);
-                          server->f_cur->f_file = NULL;
-                          server->f_cur = NULL;
+                          CapturePut(sess, sess->f_cur->f_file, NULL, 0);
+                          sess->f_cur->f_file = NULL;
+                          sess->f_cur = NULL;
                         }
                     }
                 }
-              if (sendit && RTMP_IsConnected(&server->rs))
-                RTMP_SendChunk(&server->rs, &rk);
+              if (sendit && RTMP_IsConnected(&sess->rs))
+                RTMP_SendChunk(&sess->rs, &rk);
               if (RTMPPacket_IsReady(&pc))
                   RTMPPacket_Free(&pc);
               break;
             }
         }
-      if (!RTMP_IsConnected(&server->rs) && RTMP_IsConnected(&server->rc)
-        && !server->f_cur)
-        RTMP_Close(&server->rc);
+      if (!RTMP_IsConnected(&sess->rs) && RTMP_IsConnected(&sess->rc)
+        && !sess->f_cur)
+        SessionClose(sess, &sess->rc);
     }
 
 cleanup:
   RTMP_LogPrintf("Closing connection... ");
-  RTMP_Close(&server->rs);
-  RTMP_Close(&server->rc);
-  while (server->f_head)
+  SessionClose(sess, &sess->rs);
+  SessionClose(sess, &sess->rc);
+  while (sess->f_head)
     {
-      Flist *fl = server->f_head;
-      server->f_head = fl->f_next;
+      Flist *fl = sess->f_head;
+      sess->f_head = fl->f_next;
       if (fl->f_file)
-        fclose(fl->f_file);
+        CapturePut(sess, fl->f_file, NULL, 0);
       free(fl);
     }
-  server->f_tail = NULL;
-  server->f_cur = NULL;
+  CaptureFinish(sess);
+  sess->f_tail = NULL;
+  sess->f_cur = NULL;
   free(buf);
+  free(sess->relay[0].flags);
+  free(sess->relay[0].out);
+  free(sess->relay[1].flags);
+  free(sess->relay[1].out);
   /* Should probably be done by RTMP_Close() ... */
-  server->rc.Link.hostname.av_val = NULL;
-  server->rc.Link.tcUrl.av_val = NULL;
-  server->rc.Link.swfUrl.av_val = NULL;
-  server->rc.Link.pageUrl.av_val = NULL;
-  server->rc.Link.app.av_val = NULL;
-  server->rc.Link.auth.av_val = NULL;
-  server->rc.Link.flashVer.av_val = NULL;
+  free(sess->rc.Link.tcUrl.av_val);
+  free(sess->rc.Link.swfUrl.av_val);
+  free(sess->rc.Link.pageUrl.av_val);
+  free(sess->rc.Link.app.av_val);
+  free(sess->rc.Link.flashVer.av_val);
+  free(sess->rc.Link.usherToken.av_val);
+  free(sess->rc.Link.Extras.av_val);
   RTMP_LogPrintf("done!\n\n");
 
-quit:
-  if (server->state == STREAMING_IN_PROGRESS)
-    server->state = STREAMING_ACCEPTING;
+  MutexLock(&server->lock);
+  for (prev = &server->sessions; *prev; prev = &(*prev)->next)
+    if (*prev == sess)
+      {
+	*prev = sess->next;
+	break;
+      }
+  server->nSessions--;
+  MutexUnlock(&server->lock);
+  free(sess);
 
   TFRET();
 }
 
+static int
+ServeAccept(RTMPConn *c)
+{
+#ifdef linux
+  struct sockaddr_in dest;
+  socklen_t destlen = sizeof(struct sockaddr_in);
+  if (getsockopt(c->rtmp.m_sb.sb_socket, SOL_IP, SO_ORIGINAL_DST, &dest, &destlen) == 0)
+    RTMP_Log(RTMP_LOGDEBUG, "%s: accepted connection from %s to %s\n", __FUNCTION__,
+	c->peer, inet_ntoa(dest.sin_addr));
+  else
+#endif
+  RTMP_Log(RTMP_LOGDEBUG, "%s: accepted connection from %s\n", __FUNCTION__,
+      c->peer);
+  return TRUE;
+}
+
+/* The handshake is done by the server loop, the proxying itself still
+ * gets a thread of its own.
+ */
+static int
+ServeReady(RTMPConn *c)
+{
+  STREAMING_SERVER *server = RTMPServer_Context(c->server);
+  SESSION *sess;
+
+  if (server->state != STREAMING_ACCEPTING)
+    return FALSE;
+  sess = calloc(1, sizeof(SESSION));
+  if (!sess)
+    return FALSE;
+  if (!RTMPConn_Detach(c, &sess->rs))
+    {
+      free(sess);
+      return FALSE;
+    }
+  sess->server = server;
+  sess->rcSocket = -1;
+  MutexLock(&server->lock);
+  sess->socket = sess->rs.m_sb.sb_socket;
+  sess->next = server->sessions;
+  server->sessions = sess;
+  server->nSessions++;
+  MutexUnlock(&server->lock);
+  /* Create a new thread and transfer the control to that */
+  ThreadCreate(doServe, sess);
+  RTMP_Log(RTMP_LOGDEBUG, "%s: processed request\n", __FUNCTION__);
+  return TRUE;
+}
+
 TFTYPE
 serverThread(void *arg)
 {
   STREAMING_SERVER *server = arg;
-  server->state = STREAMING_ACCEPTING;
 
-  while (server->state == STREAMING_ACCEPTING)
-    {
-      struct sockaddr_in addr;
-      socklen_t addrlen = sizeof(struct sockaddr_in);
-      STREAMING_SERVER *srv2 = malloc(sizeof(STREAMING_SERVER));
-      int sockfd =
-	accept(server->socket, (struct sockaddr *) &addr, &addrlen);
-
-      if (sockfd > 0)
-	{
-#ifdef linux
-          struct sockaddr_in dest;
-	  char destch[16];
-          socklen_t destlen = sizeof(struct sockaddr_in);
-	  getsockopt(sockfd, SOL_IP, SO_ORIGINAL_DST, &dest, &destlen);
-          strcpy(destch, inet_ntoa(dest.sin_addr));
-	  RTMP_Log(RTMP_LOGDEBUG, "%s: accepted connection from %s to %s\n", __FUNCTION__,
-	      inet_ntoa(addr.sin_addr), destch);
-#else
-	  RTMP_Log(RTMP_LOGDEBUG, "%s: accepted connection from %s\n", __FUNCTION__,
-	      inet_ntoa(addr.sin_addr));
-#endif
-	  *srv2 = *server;
-	  srv2->socket = sockfd;
-	  /* Create a new thread and transfer the control to that */
-	  ThreadCreate(doServe, srv2);
-	  RTMP_Log(RTMP_LOGDEBUG, "%s: processed request\n", __FUNCTION__);
-	}
-      else
-	{
-	  RTMP_Log(RTMP_LOGERROR, "%s: accept failed", __FUNCTION__);
-	}
-    }
-  server->state = STREAMING_STOPPED;
+  RTMPServer_Run(server->rs);
+  MutexLock(&server->lock);
+  RTMPServer_Close(server->rs);
+  server->rs = NULL;
+  MutexUnlock(&server->lock);
   TFRET();
 }
 
 STREAMING_SERVER *
 startStreaming(const char *address, int port)
 {
-  struct sockaddr_in addr;
-  int sockfd, tmp;
   STREAMING_SERVER *server;
+  RTMPServerCB cb = { 0 };
 
-  sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (sockfd == -1)
-    {
-      RTMP_Log(RTMP_LOGERROR, "%s, couldn't create socket", __FUNCTION__);
-      return 0;
-    }
-
-  tmp = 1;
-  setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR,
-				(char *) &tmp, sizeof(tmp) );
-
-  addr.sin_family = AF_INET;
-  addr.sin_addr.s_addr = inet_addr(address);	//htonl(INADDR_ANY);
-  addr.sin_port = htons(port);
-
-  if (bind(sockfd, (struct sockaddr *) &addr, sizeof(struct sockaddr_in)) ==
-      -1)
-    {
-      RTMP_Log(RTMP_LOGERROR, "%s, TCP bind failed for port number: %d", __FUNCTION__,
-	  port);
-      return 0;
-    }
+  cb.accept = ServeAccept;
+  cb.ready = ServeReady;
 
-  if (listen(sockfd, 10) == -1)
+  server = (STREAMING_SERVER *) calloc(1, sizeof(STREAMING_SERVER));
+  server->rs = RTMPServer_Open(address, port, &cb, server);
+  if (!server->rs)
     {
-      RTMP_Log(RTMP_LOGERROR, "%s, listen failed", __FUNCTION__);
-      closesocket(sockfd);
+      free(server);
       return 0;
     }
-
-  server = (STREAMING_SERVER *) calloc(1, sizeof(STREAMING_SERVER));
-  server->socket = sockfd;
+  MutexInit(&server->lock);
+  server->state = STREAMING_ACCEPTING;
 
   ThreadCreate(serverThread, server);
 
@@ -1249,32 +2204,47 @@ stopStreaming(STREAMING_SERVER * server)
 
   if (server->state != STREAMING_STOPPED)
     {
-      int fd = server->socket;
-      server->socket = 0;
-      if (server->state == STREAMING_IN_PROGRESS)
+      SESSION *sess;
+      int n;
+      server->state = STREAMING_STOPPING;
+      RTMPServer_Stop(server->rs);
+
+      /* wake the sessions up from their selects, they close their
+       * connections themselves
+       */
+      MutexLock(&server->lock);
+      for (sess = server->sessions; sess; sess = sess->next)
 	{
-	  server->state = STREAMING_STOPPING;
+	  if (sess->socket >= 0)
+	    shutdown(sess->socket, 2);
+	  if (sess->rcSocket >= 0)
+	    shutdown(sess->rcSocket, 2);
+	}
+      MutexUnlock(&server->lock);
 
-	  // wait for streaming threads to exit
-	  while (server->state != STREAMING_STOPPED)
+      // wait for streaming threads to exit
+      do
+	{
+	  MutexLock(&server->lock);
+	  n = server->nSessions + (server->rs != NULL);
+	  MutexUnlock(&server->lock);
+	  if (n)
 	    msleep(1);
 	}
-
-      if (fd && closesocket(fd))
-	RTMP_Log(RTMP_LOGERROR, "%s: Failed to close listening socket, error %d",
-	    __FUNCTION__, GetSockError());
+      while (n);
 
       server->state = STREAMING_STOPPED;
     }
 }
 
+/* Only flags the stop, the locks stopStreaming() takes may be held by
+ * the very thread the signal interrupted.
+ */
 void
 sigIntHandler(int sig)
 {
   RTMP_ctrlC = TRUE;
-  RTMP_LogPrintf("Caught signal: %d, cleaning up, just a second...\n", sig);
-  if (rtmpServer)
-    stopStreaming(rtmpServer);
+  stopRequested = sig;
   signal(SIGINT, SIG_DFL);
 }
 
@@ -1282,6 +2252,7 @@ int
 main(int argc, char **argv)
 {
   int nStatus = RD_SUCCESS;
+  int i;
 
   // rtmp streaming server
   char DEFAULT_RTMP_STREAMING_DEVICE[] = "0.0.0.0";	// 0.0.0.0 is any device
@@ -1294,8 +2265,13 @@ main(int argc, char **argv)
 
   RTMP_debuglevel = RTMP_LOGINFO;
 
-  if (argc > 1 && !strcmp(argv[1], "-z"))
-    RTMP_debuglevel = RTMP_LOGALL;
+  for (i = 1; i < argc; i++)
+    {
+      if (!strcmp(argv[i], "-z"))
+        RTMP_debuglevel = RTMP_LOGALL;
+      else if (!strcmp(argv[i], "-r"))
+        relayMode = TRUE;
+    }
 
   signal(SIGINT, sigIntHandler);
 #ifndef WIN32
@@ -1308,6 +2284,7 @@ main(int argc, char **argv)
 #endif
 
   InitSockets();
+  MutexInit(&fileLock);
 
   // start text UI
   ThreadCreate(controlServerThread, 0);
@@ -1324,7 +2301,15 @@ main(int argc, char **argv)
 
   while (rtmpServer->state != STREAMING_STOPPED)
     {
-      sleep(1);
+      if (stopRequested)
+	{
+	  if (stopRequested != TRUE)
+	    RTMP_LogPrintf("Caught signal: %d, cleaning up, just a second...\n",
+		stopRequested);
+	  stopStreaming(rtmpServer);
+	}
+      else
+	sleep(1);	/* a signal cuts it short */
     }
   RTMP_Log(RTMP_LOGDEBUG, "Done, exiting...");
 
@@ -51,7 +51,10 @@ ThreadCreate(thrfunc *routine, void *args)
   ret =
     pthread_create(&id, &attributes, routine, args);
   if (ret != 0)
-    RTMP_LogPrintf("%s, pthread_create failed with %d\n", __FUNCTION__, ret);
+    {
+      RTMP_LogPrintf("%s, pthread_create failed with %d\n", __FUNCTION__, ret);
+      id = 0;
+    }
 
   return id;
 }
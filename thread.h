@@ -28,11 +28,35 @@
 #define TFTYPE	void
 #define TFRET()
 #define THANDLE	HANDLE
+#define ThreadFailed(t)	((t) == INVALID_HANDLE_VALUE)
+#define TMUTEX	CRITICAL_SECTION
+#define TCOND	CONDITION_VARIABLE
+#define MutexInit(m)	InitializeCriticalSection(m)
+#define MutexDestroy(m)	DeleteCriticalSection(m)
+#define MutexLock(m)	EnterCriticalSection(m)
+#define MutexUnlock(m)	LeaveCriticalSection(m)
+#define CondInit(c)	InitializeConditionVariable(c)
+#define CondDestroy(c)
+#define CondWait(c,m)	SleepConditionVariableCS(c,m,INFINITE)
+#define CondSignal(c)	WakeConditionVariable(c)
+#define CondBroadcast(c)	WakeAllConditionVariable(c)
 #else
 #include <pthread.h>
 #define TFTYPE	void *
 #define TFRET()	return 0
 #define THANDLE pthread_t
+#define ThreadFailed(t)	((t) == 0)
+#define TMUTEX	pthread_mutex_t
+#define TCOND	pthread_cond_t
+#define MutexInit(m)	pthread_mutex_init(m,NULL)
+#define MutexDestroy(m)	pthread_mutex_destroy(m)
+#define MutexLock(m)	pthread_mutex_lock(m)
+#define MutexUnlock(m)	pthread_mutex_unlock(m)
+#define CondInit(c)	pthread_cond_init(c,NULL)
+#define CondDestroy(c)	pthread_cond_destroy(c)
+#define CondWait(c,m)	pthread_cond_wait(c,m)
+#define CondSignal(c)	pthread_cond_signal(c)
+#define CondBroadcast(c)	pthread_cond_broadcast(c)
 #endif
 typedef TFTYPE (thrfunc)(void *arg);
 